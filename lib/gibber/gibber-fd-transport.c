@@ -42,6 +42,9 @@ static gboolean _channel_io_out (GIOChannel *source,
 static gboolean gibber_fd_transport_send (GibberTransport *transport,
     const guint8 *data, gsize size, GError **error);
 
+static gboolean gibber_fd_transport_send_bytes (GibberTransport *transport,
+    GBytes *bytes, GError **error);
+
 static void gibber_fd_transport_disconnect (GibberTransport *transport);
 
 static gboolean gibber_fd_transport_get_peeraddr (GibberTransport *transport,
@@ -82,10 +85,36 @@ struct _GibberFdTransportPrivate
   guint watch_in;
   guint watch_out;
   guint watch_err;
-  GString *output_buffer;
+  /* GBytes waiting to be written out, oldest first. The first
+   * output_offset bytes of the head have already been written; we never move
+   * data around, we just drop each chunk once it's been completely sent. */
+  GQueue output_queue;
+  gsize output_offset;
+  /* total number of bytes in output_queue still to be written */
+  gsize output_size;
   gboolean receiving_blocked;
+
+  /* Reads go into read_buffer, which holds read_size bytes (plus a NUL).
+   * read_size doubles, up to max_read_size, while the fd keeps filling it,
+   * and halves when reads are mostly empty, so bulk transfers get few large
+   * reads and chatty connections don't pin down a big buffer. */
+  guint8 *read_buffer;
+  gsize read_size;
+  guint max_read_size;
+};
+
+/* properties */
+enum {
+  PROP_MAX_READ_SIZE = 1,
+  LAST_PROPERTY
 };
 
+#define MIN_READ_SIZE 1024
+#define DEFAULT_MAX_READ_SIZE (256 * 1024)
+
+/* Maximum number of chunks we hand to writev() in one go */
+#define MAX_IOV 16
+
 #define GIBBER_FD_TRANSPORT_GET_PRIVATE(o)  \
   (G_TYPE_INSTANCE_GET_PRIVATE ((o), GIBBER_TYPE_FD_TRANSPORT, \
    GibberFdTransportPrivate))
@@ -97,10 +126,56 @@ gibber_fd_transport_init (GibberFdTransport *self)
   GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
   self->fd = -1;
   priv->channel = NULL;
-  priv->output_buffer = NULL;
+  g_queue_init (&priv->output_queue);
+  priv->output_offset = 0;
+  priv->output_size = 0;
   priv->watch_in = 0;
   priv->watch_out = 0;
   priv->watch_err = 0;
+  priv->read_buffer = NULL;
+  priv->read_size = MIN_READ_SIZE;
+  priv->max_read_size = DEFAULT_MAX_READ_SIZE;
+}
+
+static void
+gibber_fd_transport_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (object);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  switch (property_id)
+    {
+      case PROP_MAX_READ_SIZE:
+        g_value_set_uint (value, priv->max_read_size);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+gibber_fd_transport_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (object);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  switch (property_id)
+    {
+      case PROP_MAX_READ_SIZE:
+        priv->max_read_size = g_value_get_uint (value);
+        /* the buffer will be shrunk on the next read if needed */
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
 }
 
 static void gibber_fd_transport_dispose (GObject *object);
@@ -116,14 +191,18 @@ gibber_fd_transport_class_init (
   GObjectClass *object_class = G_OBJECT_CLASS (gibber_fd_transport_class);
   GibberTransportClass *transport_class =
     GIBBER_TRANSPORT_CLASS (gibber_fd_transport_class);
+  GParamSpec *param_spec;
 
   g_type_class_add_private (gibber_fd_transport_class,
                             sizeof (GibberFdTransportPrivate));
 
+  object_class->get_property = gibber_fd_transport_get_property;
+  object_class->set_property = gibber_fd_transport_set_property;
   object_class->dispose = gibber_fd_transport_dispose;
   object_class->finalize = gibber_fd_transport_finalize;
 
   transport_class->send = gibber_fd_transport_send;
+  transport_class->send_bytes = gibber_fd_transport_send_bytes;
   transport_class->disconnect = gibber_fd_transport_disconnect;
   transport_class->get_peeraddr = gibber_fd_transport_get_peeraddr;
   transport_class->get_sockaddr = gibber_fd_transport_get_sockaddr;
@@ -132,6 +211,13 @@ gibber_fd_transport_class_init (
 
   gibber_fd_transport_class->read = gibber_fd_transport_read;
   gibber_fd_transport_class->write = gibber_fd_transport_write;
+
+  param_spec = g_param_spec_uint ("max-read-size", "Maximum read size",
+      "The largest number of bytes passed to the handler at once",
+      MIN_READ_SIZE, G_MAXINT, DEFAULT_MAX_READ_SIZE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_READ_SIZE,
+      param_spec);
 }
 
 void
@@ -154,6 +240,11 @@ gibber_fd_transport_dispose (GObject *object)
 void
 gibber_fd_transport_finalize (GObject *object)
 {
+  GibberFdTransport *self = GIBBER_FD_TRANSPORT (object);
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  g_free (priv->read_buffer);
+
   G_OBJECT_CLASS (gibber_fd_transport_parent_class)->finalize (object);
 }
 
@@ -190,11 +281,10 @@ _do_disconnect (GibberFdTransport *self)
     }
   self->fd = -1;
 
-  if (priv->output_buffer)
-    {
-      g_string_free (priv->output_buffer, TRUE);
-      priv->output_buffer = NULL;
-    }
+  g_queue_foreach (&priv->output_queue, (GFunc) g_bytes_unref, NULL);
+  g_queue_clear (&priv->output_queue);
+  priv->output_offset = 0;
+  priv->output_size = 0;
 
   if (!priv->dispose_has_run)
     /* If we are disposing we don't care about the state anymore */
@@ -233,15 +323,140 @@ _try_write (GibberFdTransport *self, const guint8 *data, int len,
     return TRUE;
 }
 
+#ifdef HAVE_SYS_UIO_H
+/* Writes as much of the output queue as possible with a single writev() */
+static gboolean
+_try_writev (GibberFdTransport *self, gsize *written, GError **err)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+  struct iovec iov[MAX_IOV];
+  GList *l;
+  int n = 0;
+  ssize_t ret;
+  GError *error;
+
+  for (l = priv->output_queue.head; l != NULL && n < MAX_IOV; l = l->next)
+    {
+      gsize size;
+      const guint8 *data = g_bytes_get_data (l->data, &size);
+
+      if (n == 0)
+        {
+          data += priv->output_offset;
+          size -= priv->output_offset;
+        }
+
+      iov[n].iov_base = (void *) data;
+      iov[n].iov_len = size;
+      n++;
+    }
+
+  ret = writev (self->fd, iov, n);
+
+  if (ret >= 0)
+    {
+      *written = ret;
+      return TRUE;
+    }
+
+  *written = 0;
+
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    return TRUE;
+
+  error = g_error_new_literal (G_IO_CHANNEL_ERROR,
+      g_io_channel_error_from_errno (errno), g_strerror (errno));
+  gibber_transport_emit_error (GIBBER_TRANSPORT (self), error);
+
+  DEBUG ("Writing data failed, closing the transport");
+  _do_disconnect (self);
+
+  g_propagate_error (err, error);
+  return FALSE;
+}
+#endif
+
+/* Drops @written bytes from the head of the output queue */
+static void
+_consume_output (GibberFdTransport *self, gsize written)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+
+  priv->output_size -= written;
+
+  while (written > 0)
+    {
+      GBytes *head = g_queue_peek_head (&priv->output_queue);
+      gsize left = g_bytes_get_size (head) - priv->output_offset;
+
+      if (written < left)
+        {
+          priv->output_offset += written;
+          return;
+        }
+
+      written -= left;
+      g_bytes_unref (g_queue_pop_head (&priv->output_queue));
+      priv->output_offset = 0;
+    }
+}
+
+/* Writes out as much of the output queue as the fd will take. Returns FALSE
+ * if the transport got disconnected. */
+static gboolean
+_flush_output (GibberFdTransport *self, GError **error)
+{
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
+#ifdef HAVE_SYS_UIO_H
+  GibberFdTransportClass *cls = GIBBER_FD_TRANSPORT_GET_CLASS (self);
+#endif
+
+  while (!g_queue_is_empty (&priv->output_queue))
+    {
+      gsize written = 0;
+
+#ifdef HAVE_SYS_UIO_H
+      /* Subclasses overriding write() must see every byte */
+      if (cls->write == gibber_fd_transport_write)
+        {
+          if (!_try_writev (self, &written, error))
+            return FALSE;
+        }
+      else
+#endif
+        {
+          gsize size;
+          const guint8 *data = g_bytes_get_data (
+              g_queue_peek_head (&priv->output_queue), &size);
+
+          if (!_try_write (self, data + priv->output_offset,
+                  size - priv->output_offset, &written, error))
+            return FALSE;
+        }
+
+      if (written == 0)
+        /* The fd is full; we'll try again when it's writable */
+        break;
+
+      _consume_output (self, written);
+    }
+
+  return TRUE;
+}
+
+/* Sends @len bytes at @data. If @bytes is not %NULL, @data points into it,
+ * and we keep a reference to it rather than copying whatever we can't
+ * write straight away. */
 static gboolean
 _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
-    GError **error)
+    GBytes *bytes, GError **error)
 {
   GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
   gsize written = 0;
+  GBytes *rest;
 
   DEBUG ("Writing out %" G_GSIZE_FORMAT " bytes", len);
-  if (priv->output_buffer == NULL || priv->output_buffer->len == 0)
+  if (g_queue_is_empty (&priv->output_queue))
     {
       /* We've got nothing buffer yet so try to write out directly */
       if (!_try_write (self, data, len, &written, error))
@@ -256,16 +471,15 @@ _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
       return TRUE;
     }
 
-  if (priv->output_buffer)
-    {
-      g_string_append_len (priv->output_buffer, (gchar *) data + written,
-        len - written);
-    }
+  if (bytes == NULL)
+    rest = g_bytes_new (data + written, len - written);
+  else if (written == 0)
+    rest = g_bytes_ref (bytes);
   else
-    {
-      priv->output_buffer = g_string_new_len ((gchar *) data + written,
-          len - written);
-    }
+    rest = g_bytes_new_from_bytes (bytes, written, len - written);
+
+  g_queue_push_tail (&priv->output_queue, rest);
+  priv->output_size += len - written;
 
   if (!priv->watch_out)
     {
@@ -273,6 +487,9 @@ _writeout (GibberFdTransport *self, const guint8 *data, gsize len,
         g_io_add_watch (priv->channel, G_IO_OUT, _channel_io_out, self);
     }
 
+  gibber_transport_set_buffered_size (GIBBER_TRANSPORT (self),
+      priv->output_size);
+
   return TRUE;
 }
 
@@ -311,27 +528,27 @@ _channel_io_out (GIOChannel *source, GIOCondition condition, gpointer data)
   GibberFdTransport *self = GIBBER_FD_TRANSPORT (data);
   GibberFdTransportPrivate *priv =
      GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
-  gsize written;
 
-  g_assert (priv->output_buffer);
-  if (!_try_write (self, (guint8 *) priv->output_buffer->str,
-                   priv->output_buffer->len, &written, NULL))
+  g_assert (!g_queue_is_empty (&priv->output_queue));
+  if (!_flush_output (self, NULL))
     {
       return FALSE;
     }
 
-  if (written > 0 )
-    {
-      priv->output_buffer = g_string_erase (priv->output_buffer, 0, written);
-    }
-
-  if (priv->output_buffer->len == 0)
+  if (g_queue_is_empty (&priv->output_queue))
     {
       priv->watch_out = 0;
-      gibber_transport_emit_buffer_empty (GIBBER_TRANSPORT (self));
+      gibber_transport_set_buffered_size (GIBBER_TRANSPORT (self), 0);
+
+      /* buffer-low handlers may have sent more data already */
+      if (g_queue_is_empty (&priv->output_queue))
+        gibber_transport_emit_buffer_empty (GIBBER_TRANSPORT (self));
+
       return FALSE;
     }
 
+  gibber_transport_set_buffered_size (GIBBER_TRANSPORT (self),
+      priv->output_size);
   return TRUE;
 }
 
@@ -411,26 +628,63 @@ gibber_fd_transport_write (GibberFdTransport *fd_transport,
     g_assert_not_reached ();
 }
 
-#define BUFSIZE 1024
+/* Picks the size of the next read based on how full the last one was */
+static void
+_adapt_read_size (GibberFdTransportPrivate *priv, gsize bytes_read)
+{
+  gsize new_size = priv->read_size;
+
+  if (bytes_read == priv->read_size)
+    new_size = MIN (priv->read_size * 2, priv->max_read_size);
+  else if (bytes_read < priv->read_size / 4)
+    new_size = priv->read_size / 2;
+
+  new_size = MAX (new_size, MIN_READ_SIZE);
+
+  if (new_size != priv->read_size)
+    {
+      priv->read_size = new_size;
+      /* reallocated before the next read */
+      g_free (priv->read_buffer);
+      priv->read_buffer = NULL;
+    }
+}
 
 GibberFdIOResult
 gibber_fd_transport_read (GibberFdTransport *transport,
     GIOChannel *channel, GError **error)
 {
-  guint8  buf[BUFSIZE + 1];
+  GibberFdTransportPrivate *priv = GIBBER_FD_TRANSPORT_GET_PRIVATE (
+      transport);
   GIOStatus status;
   gsize bytes_read;
 
-  status = g_io_channel_read_chars (channel, (gchar *) buf, BUFSIZE,
-    &bytes_read, error);
+  if (priv->read_size > priv->max_read_size)
+    {
+      priv->read_size = MAX (priv->max_read_size, MIN_READ_SIZE);
+      g_free (priv->read_buffer);
+      priv->read_buffer = NULL;
+    }
+
+  if (priv->read_buffer == NULL)
+    priv->read_buffer = g_malloc (priv->read_size + 1);
+
+  status = g_io_channel_read_chars (channel, (gchar *) priv->read_buffer,
+    priv->read_size, &bytes_read, error);
 
   switch (status)
     {
       case G_IO_STATUS_NORMAL:
-        buf[bytes_read] = '\0';
+        priv->read_buffer[bytes_read] = '\0';
         DEBUG ("Received %" G_GSIZE_FORMAT " bytes", bytes_read);
+
+        /* The handler may drop the last reference to us, but
+         * priv->read_buffer must stay around until it returns */
+        g_object_ref (transport);
         gibber_transport_received_data (GIBBER_TRANSPORT (transport),
-            buf, bytes_read);
+            priv->read_buffer, bytes_read);
+        _adapt_read_size (priv, bytes_read);
+        g_object_unref (transport);
         return GIBBER_FD_IO_RESULT_SUCCESS;
       case G_IO_STATUS_ERROR:
         return GIBBER_FD_IO_RESULT_ERROR;
@@ -502,7 +756,19 @@ gboolean
 gibber_fd_transport_send (GibberTransport *transport,
     const guint8 *data, gsize size, GError **error)
 {
-  return _writeout (GIBBER_FD_TRANSPORT (transport), data, size, error);
+  return _writeout (GIBBER_FD_TRANSPORT (transport), data, size, NULL, error);
+}
+
+static gboolean
+gibber_fd_transport_send_bytes (GibberTransport *transport,
+    GBytes *bytes, GError **error)
+{
+  gconstpointer data;
+  gsize size;
+
+  data = g_bytes_get_data (bytes, &size);
+  return _writeout (GIBBER_FD_TRANSPORT (transport), data, size, bytes,
+      error);
 }
 
 void
@@ -554,7 +820,7 @@ gibber_fd_transport_buffer_is_empty (GibberTransport *transport)
   GibberFdTransportPrivate *priv =
      GIBBER_FD_TRANSPORT_GET_PRIVATE (self);
 
-  return (priv->output_buffer == NULL || priv->output_buffer->len == 0);
+  return g_queue_is_empty (&priv->output_queue);
 }
 
 static void
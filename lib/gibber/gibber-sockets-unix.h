@@ -53,6 +53,9 @@
 #ifdef HAVE_SYS_IOCTL_H
 #   include <sys/ioctl.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#   include <sys/uio.h>
+#endif
 #ifdef HAVE_SYS_UN_H
 #   include <sys/un.h>
 #endif
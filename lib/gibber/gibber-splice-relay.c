@@ -0,0 +1,555 @@
+/*
+ * gibber-splice-relay.c - Source for GibberSpliceRelay
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* A GibberSpliceRelay copies everything received on one GibberFdTransport to
+ * another, and vice versa, without the data ever reaching userspace: each
+ * direction has a pipe, and bytes are moved socket -> pipe -> socket with
+ * splice(2). While the relay is running, both transports have receiving
+ * blocked and must not be written to.
+ *
+ * When one side reaches EOF, everything it sent is delivered and then the
+ * other side's socket is shut down for writing, while data keeps flowing the
+ * other way. If a side fails, whatever has already been read from it is
+ * still delivered, but nothing more is. Once both directions are over, the
+ * relay disconnects both transports and stops, so whoever owns them sees the
+ * same "disconnected" signal they would have seen without the relay.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_SPLICE
+# include <fcntl.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "gibber-splice-relay.h"
+#include "gibber-sockets.h"
+
+#define DEBUG_FLAG DEBUG_NET
+#include "gibber-debug.h"
+
+G_DEFINE_TYPE (GibberSpliceRelay, gibber_splice_relay, G_TYPE_OBJECT)
+
+/* The most we ask splice() to move in one go; this is also the default
+ * capacity of a pipe on Linux. */
+#define CHUNK_SIZE (64 * 1024)
+
+/* How many chunks we move in one direction before returning to the main
+ * loop, so a fast sender can't starve everything else. */
+#define MAX_CHUNKS_PER_WAKEUP 16
+
+typedef struct {
+  GibberSpliceRelay *self;
+  GibberFdTransport *src;
+  GibberFdTransport *dst;
+  GIOChannel *src_channel;
+  GIOChannel *dst_channel;
+  /* { read end, write end } */
+  int pipe[2];
+  /* bytes sitting in the pipe, waiting for dst to be writable */
+  gsize pending;
+  gboolean eof;
+  /* nothing more will be relayed this way */
+  gboolean done;
+  guint watch_in;
+  guint watch_out;
+} Direction;
+
+struct _GibberSpliceRelayPrivate
+{
+  GibberFdTransport *a;
+  GibberFdTransport *b;
+  GIOChannel *channel_a;
+  GIOChannel *channel_b;
+
+  /* a -> b, and b -> a */
+  Direction directions[2];
+
+  gboolean running;
+};
+
+#define GIBBER_SPLICE_RELAY_GET_PRIVATE(obj) ((obj)->priv)
+
+static void
+gibber_splice_relay_init (GibberSpliceRelay *self)
+{
+  GibberSpliceRelayPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      GIBBER_TYPE_SPLICE_RELAY, GibberSpliceRelayPrivate);
+  guint i;
+
+  self->priv = priv;
+
+  for (i = 0; i < G_N_ELEMENTS (priv->directions); i++)
+    {
+      priv->directions[i].self = self;
+      priv->directions[i].pipe[0] = -1;
+      priv->directions[i].pipe[1] = -1;
+    }
+}
+
+static void
+gibber_splice_relay_dispose (GObject *object)
+{
+  GibberSpliceRelay *self = GIBBER_SPLICE_RELAY (object);
+  GibberSpliceRelayPrivate *priv = GIBBER_SPLICE_RELAY_GET_PRIVATE (self);
+
+  gibber_splice_relay_stop (self);
+
+  if (priv->a != NULL)
+    {
+      g_signal_handlers_disconnect_matched (priv->a, G_SIGNAL_MATCH_DATA,
+          0, 0, NULL, NULL, self);
+      g_object_unref (priv->a);
+      priv->a = NULL;
+    }
+
+  if (priv->b != NULL)
+    {
+      g_signal_handlers_disconnect_matched (priv->b, G_SIGNAL_MATCH_DATA,
+          0, 0, NULL, NULL, self);
+      g_object_unref (priv->b);
+      priv->b = NULL;
+    }
+
+  G_OBJECT_CLASS (gibber_splice_relay_parent_class)->dispose (object);
+}
+
+static void
+gibber_splice_relay_class_init (GibberSpliceRelayClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (GibberSpliceRelayPrivate));
+
+  object_class->dispose = gibber_splice_relay_dispose;
+}
+
+/**
+ * gibber_splice_relay_is_available:
+ *
+ * Returns: %TRUE if relays can be created on this system. Setting
+ *  GIBBER_DISABLE_SPLICE in the environment makes this return %FALSE, which
+ *  is handy when debugging.
+ */
+gboolean
+gibber_splice_relay_is_available (void)
+{
+#ifdef HAVE_SPLICE
+  return g_getenv ("GIBBER_DISABLE_SPLICE") == NULL;
+#else
+  return FALSE;
+#endif
+}
+
+#ifdef HAVE_SPLICE
+
+static void direction_pump (Direction *d);
+static gboolean direction_readable_cb (GIOChannel *source,
+    GIOCondition condition, gpointer user_data);
+static gboolean direction_writable_cb (GIOChannel *source,
+    GIOCondition condition, gpointer user_data);
+
+static void
+direction_set_watches (Direction *d,
+    gboolean want_in,
+    gboolean want_out)
+{
+  if (want_in && d->watch_in == 0)
+    d->watch_in = g_io_add_watch (d->src_channel, G_IO_IN | G_IO_HUP,
+        direction_readable_cb, d);
+  else if (!want_in && d->watch_in != 0)
+    {
+      g_source_remove (d->watch_in);
+      d->watch_in = 0;
+    }
+
+  if (want_out && d->watch_out == 0)
+    d->watch_out = g_io_add_watch (d->dst_channel, G_IO_OUT,
+        direction_writable_cb, d);
+  else if (!want_out && d->watch_out != 0)
+    {
+      g_source_remove (d->watch_out);
+      d->watch_out = 0;
+    }
+}
+
+static GibberFdIOResult
+direction_flush (Direction *d)
+{
+  while (d->pending > 0)
+    {
+      ssize_t n = splice (d->pipe[0], NULL, d->dst->fd, NULL, d->pending,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          if (errno == EAGAIN)
+            return GIBBER_FD_IO_RESULT_AGAIN;
+
+          DEBUG ("writing to fd %d failed: %s", d->dst->fd,
+              g_strerror (errno));
+          return GIBBER_FD_IO_RESULT_ERROR;
+        }
+
+      d->pending -= n;
+    }
+
+  return GIBBER_FD_IO_RESULT_SUCCESS;
+}
+
+static GibberFdIOResult
+direction_fill (Direction *d)
+{
+  ssize_t n;
+
+  do
+    {
+      n = splice (d->src->fd, NULL, d->pipe[1], NULL, CHUNK_SIZE,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    {
+      if (errno == EAGAIN)
+        return GIBBER_FD_IO_RESULT_AGAIN;
+
+      DEBUG ("reading from fd %d failed: %s", d->src->fd, g_strerror (errno));
+      return GIBBER_FD_IO_RESULT_ERROR;
+    }
+
+  if (n == 0)
+    return GIBBER_FD_IO_RESULT_EOF;
+
+  d->pending += n;
+  return GIBBER_FD_IO_RESULT_SUCCESS;
+}
+
+static Direction *
+direction_other (Direction *d)
+{
+  GibberSpliceRelayPrivate *priv = GIBBER_SPLICE_RELAY_GET_PRIVATE (d->self);
+
+  if (d == &priv->directions[0])
+    return &priv->directions[1];
+
+  return &priv->directions[0];
+}
+
+static void
+direction_finish (Direction *d)
+{
+  GibberSpliceRelay *self = d->self;
+  GibberSpliceRelayPrivate *priv = GIBBER_SPLICE_RELAY_GET_PRIVATE (self);
+  GibberTransport *a, *b;
+
+  d->done = TRUE;
+  direction_set_watches (d, FALSE, FALSE);
+
+  if (!direction_other (d)->done)
+    return;
+
+  /* Stop first, so nothing touches the fds once the transports have closed
+   * them. Disconnecting the transports makes them emit "disconnected", and
+   * whoever owns them takes it from there, possibly dropping the relay. */
+  a = g_object_ref (priv->a);
+  b = g_object_ref (priv->b);
+
+  gibber_splice_relay_stop (self);
+  gibber_transport_disconnect (a);
+  gibber_transport_disconnect (b);
+
+  g_object_unref (a);
+  g_object_unref (b);
+}
+
+static void
+direction_fail (Direction *d)
+{
+  Direction *other = direction_other (d);
+
+  if (d->pending > 0)
+    DEBUG ("dropping %" G_GSIZE_FORMAT " bytes for fd %d", d->pending,
+        d->dst->fd);
+
+  d->pending = 0;
+  direction_finish (d);
+
+  if (other->done)
+    return;
+
+  /* Deliver what the other direction has already read, but no more */
+  other->eof = TRUE;
+  direction_pump (other);
+}
+
+static void
+direction_pump (Direction *d)
+{
+  guint chunks;
+
+  for (chunks = 0; chunks < MAX_CHUNKS_PER_WAKEUP; chunks++)
+    {
+      switch (direction_flush (d))
+        {
+          case GIBBER_FD_IO_RESULT_SUCCESS:
+          case GIBBER_FD_IO_RESULT_EOF:
+            break;
+          case GIBBER_FD_IO_RESULT_AGAIN:
+            /* The receiver is slow; stop reading until it catches up */
+            direction_set_watches (d, FALSE, TRUE);
+            return;
+          case GIBBER_FD_IO_RESULT_ERROR:
+            direction_fail (d);
+            return;
+        }
+
+      if (d->eof)
+        {
+          DEBUG ("fd %d reached EOF and everything has been relayed; "
+              "shutting down fd %d for writing", d->src->fd, d->dst->fd);
+          shutdown (d->dst->fd, SHUT_WR);
+          direction_finish (d);
+          return;
+        }
+
+      switch (direction_fill (d))
+        {
+          case GIBBER_FD_IO_RESULT_SUCCESS:
+            break;
+          case GIBBER_FD_IO_RESULT_AGAIN:
+            direction_set_watches (d, TRUE, FALSE);
+            return;
+          case GIBBER_FD_IO_RESULT_EOF:
+            d->eof = TRUE;
+            break;
+          case GIBBER_FD_IO_RESULT_ERROR:
+            direction_fail (d);
+            return;
+        }
+    }
+
+  /* Come back for more on the next main loop iteration */
+  direction_set_watches (d, d->pending == 0, d->pending > 0);
+}
+
+static gboolean
+direction_readable_cb (GIOChannel *source,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  Direction *d = user_data;
+  GibberSpliceRelay *self = g_object_ref (d->self);
+
+  direction_pump (d);
+  g_object_unref (self);
+
+  /* direction_pump() removes this watch if it's no longer wanted */
+  return TRUE;
+}
+
+static gboolean
+direction_writable_cb (GIOChannel *source,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  Direction *d = user_data;
+  GibberSpliceRelay *self = g_object_ref (d->self);
+
+  direction_pump (d);
+  g_object_unref (self);
+
+  return TRUE;
+}
+
+static gboolean
+make_pipe (int fds[2])
+{
+  guint i;
+
+  if (pipe (fds) != 0)
+    {
+      DEBUG ("pipe() failed: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      fcntl (fds[i], F_SETFL, O_NONBLOCK);
+      fcntl (fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+  return TRUE;
+}
+
+static void
+transport_disconnected_cb (GibberTransport *transport,
+    GibberSpliceRelay *self)
+{
+  DEBUG ("transport disconnected; stopping the relay");
+  gibber_splice_relay_stop (self);
+}
+
+#endif /* HAVE_SPLICE */
+
+/**
+ * gibber_splice_relay_new:
+ * @a: a connected transport whose output buffer is empty
+ * @b: another connected transport whose output buffer is empty
+ *
+ * Starts relaying data between @a and @b. Receiving is blocked on both
+ * transports while the relay is running.
+ *
+ * Returns: a new relay, or %NULL if relaying with splice() isn't possible,
+ *  in which case the caller should relay the data itself.
+ */
+GibberSpliceRelay *
+gibber_splice_relay_new (GibberFdTransport *a,
+    GibberFdTransport *b)
+{
+#ifdef HAVE_SPLICE
+  GibberSpliceRelay *self;
+  GibberSpliceRelayPrivate *priv;
+  guint i;
+
+  g_return_val_if_fail (GIBBER_IS_FD_TRANSPORT (a), NULL);
+  g_return_val_if_fail (GIBBER_IS_FD_TRANSPORT (b), NULL);
+
+  if (!gibber_splice_relay_is_available () || a->fd < 0 || b->fd < 0 ||
+      !gibber_transport_buffer_is_empty (GIBBER_TRANSPORT (a)) ||
+      !gibber_transport_buffer_is_empty (GIBBER_TRANSPORT (b)))
+    return NULL;
+
+  self = g_object_new (GIBBER_TYPE_SPLICE_RELAY, NULL);
+  priv = GIBBER_SPLICE_RELAY_GET_PRIVATE (self);
+
+  for (i = 0; i < G_N_ELEMENTS (priv->directions); i++)
+    {
+      if (!make_pipe (priv->directions[i].pipe))
+        {
+          g_object_unref (self);
+          return NULL;
+        }
+    }
+
+  priv->a = g_object_ref (a);
+  priv->b = g_object_ref (b);
+
+  /* Our own channels, which don't own the fds: the transports close them */
+  priv->channel_a = g_io_channel_unix_new (a->fd);
+  priv->channel_b = g_io_channel_unix_new (b->fd);
+
+  priv->directions[0].src = a;
+  priv->directions[0].src_channel = priv->channel_a;
+  priv->directions[0].dst = b;
+  priv->directions[0].dst_channel = priv->channel_b;
+
+  priv->directions[1].src = b;
+  priv->directions[1].src_channel = priv->channel_b;
+  priv->directions[1].dst = a;
+  priv->directions[1].dst_channel = priv->channel_a;
+
+  g_signal_connect (a, "disconnected",
+      G_CALLBACK (transport_disconnected_cb), self);
+  g_signal_connect (b, "disconnected",
+      G_CALLBACK (transport_disconnected_cb), self);
+
+  gibber_transport_block_receiving (GIBBER_TRANSPORT (a), TRUE);
+  gibber_transport_block_receiving (GIBBER_TRANSPORT (b), TRUE);
+
+  DEBUG ("relaying between fds %d and %d", a->fd, b->fd);
+  priv->running = TRUE;
+
+  for (i = 0; i < G_N_ELEMENTS (priv->directions); i++)
+    direction_set_watches (&priv->directions[i], TRUE, FALSE);
+
+  return self;
+#else
+  return NULL;
+#endif
+}
+
+/**
+ * gibber_splice_relay_stop:
+ * @relay: a relay
+ *
+ * Stops relaying data. Anything read from one transport but not yet written
+ * to the other is lost, and receiving stays blocked on both transports, so
+ * this is only meant to be used when tearing them down.
+ */
+void
+gibber_splice_relay_stop (GibberSpliceRelay *self)
+{
+  GibberSpliceRelayPrivate *priv = GIBBER_SPLICE_RELAY_GET_PRIVATE (self);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (priv->directions); i++)
+    {
+      Direction *d = &priv->directions[i];
+
+      if (d->watch_in != 0)
+        {
+          g_source_remove (d->watch_in);
+          d->watch_in = 0;
+        }
+
+      if (d->watch_out != 0)
+        {
+          g_source_remove (d->watch_out);
+          d->watch_out = 0;
+        }
+
+#ifdef HAVE_SPLICE
+      if (d->pipe[0] >= 0)
+        {
+          close (d->pipe[0]);
+          close (d->pipe[1]);
+          d->pipe[0] = -1;
+          d->pipe[1] = -1;
+        }
+#endif
+    }
+
+  if (priv->channel_a != NULL)
+    {
+      g_io_channel_unref (priv->channel_a);
+      priv->channel_a = NULL;
+    }
+
+  if (priv->channel_b != NULL)
+    {
+      g_io_channel_unref (priv->channel_b);
+      priv->channel_b = NULL;
+    }
+
+  if (priv->running)
+    {
+      DEBUG ("relay stopped");
+      priv->running = FALSE;
+    }
+}
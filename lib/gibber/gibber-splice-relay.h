@@ -0,0 +1,71 @@
+/*
+ * gibber-splice-relay.h - Header for GibberSpliceRelay
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GIBBER_SPLICE_RELAY_H__
+#define __GIBBER_SPLICE_RELAY_H__
+
+#include <glib-object.h>
+
+#include "gibber-fd-transport.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GibberSpliceRelay GibberSpliceRelay;
+typedef struct _GibberSpliceRelayClass GibberSpliceRelayClass;
+typedef struct _GibberSpliceRelayPrivate GibberSpliceRelayPrivate;
+
+struct _GibberSpliceRelayClass {
+    GObjectClass parent_class;
+};
+
+struct _GibberSpliceRelay {
+    GObject parent;
+
+    GibberSpliceRelayPrivate *priv;
+};
+
+GType gibber_splice_relay_get_type (void);
+
+/* TYPE MACROS */
+#define GIBBER_TYPE_SPLICE_RELAY \
+  (gibber_splice_relay_get_type ())
+#define GIBBER_SPLICE_RELAY(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), GIBBER_TYPE_SPLICE_RELAY, \
+   GibberSpliceRelay))
+#define GIBBER_SPLICE_RELAY_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass), GIBBER_TYPE_SPLICE_RELAY, \
+   GibberSpliceRelayClass))
+#define GIBBER_IS_SPLICE_RELAY(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), GIBBER_TYPE_SPLICE_RELAY))
+#define GIBBER_IS_SPLICE_RELAY_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), GIBBER_TYPE_SPLICE_RELAY))
+#define GIBBER_SPLICE_RELAY_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), GIBBER_TYPE_SPLICE_RELAY, \
+   GibberSpliceRelayClass))
+
+gboolean gibber_splice_relay_is_available (void);
+
+GibberSpliceRelay *gibber_splice_relay_new (GibberFdTransport *a,
+    GibberFdTransport *b);
+
+void gibber_splice_relay_stop (GibberSpliceRelay *relay);
+
+G_END_DECLS
+
+#endif /* #ifndef __GIBBER_SPLICE_RELAY_H__ */
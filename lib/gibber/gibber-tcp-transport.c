@@ -43,15 +43,30 @@
 G_DEFINE_TYPE(GibberTCPTransport, gibber_tcp_transport,
               GIBBER_TYPE_FD_TRANSPORT)
 
+/* How long we wait for a connection attempt to succeed before starting the
+ * next one in parallel, as recommended by RFC 8305 */
+#define CONNECTION_ATTEMPT_DELAY 250
+
+typedef struct {
+  GibberTCPTransport *self;
+  GInetAddress *address;
+  GIOChannel *channel;
+  guint watch;
+} ConnectAttempt;
+
 /* private structure */
 typedef struct _GibberTCPTransportPrivate GibberTCPTransportPrivate;
 
 struct _GibberTCPTransportPrivate
 {
-  GIOChannel *channel;
+  GCancellable *cancellable;
+  /* (GInetAddress *) we haven't tried yet, in the order we'll try them */
   GList *addresses;
   guint16 port;
-  guint watch_in;
+  /* (ConnectAttempt *) in progress */
+  GSList *attempts;
+  /* starts the next attempt if the current ones are taking too long */
+  guint attempt_timer;
 
   gboolean dispose_has_run;
 };
@@ -71,37 +86,38 @@ gibber_tcp_transport_init (GibberTCPTransport *obj)
 
 static void gibber_tcp_transport_dispose (GObject *object);
 static void gibber_tcp_transport_finalize (GObject *object);
+static void gibber_tcp_transport_disconnect (GibberTransport *transport);
 
 static void
 gibber_tcp_transport_class_init (
   GibberTCPTransportClass *gibber_tcp_transport_class)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (gibber_tcp_transport_class);
+  GibberTransportClass *transport_class =
+    GIBBER_TRANSPORT_CLASS (gibber_tcp_transport_class);
 
   g_type_class_add_private (gibber_tcp_transport_class,
     sizeof (GibberTCPTransportPrivate));
 
   object_class->dispose = gibber_tcp_transport_dispose;
   object_class->finalize = gibber_tcp_transport_finalize;
+
+  transport_class->disconnect = gibber_tcp_transport_disconnect;
 }
 
 static void
-clean_connect_attempt (GibberTCPTransport *self)
+connect_attempt_free (ConnectAttempt *attempt)
 {
-  GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
-      self);
+  if (attempt->watch != 0)
+    g_source_remove (attempt->watch);
 
-  if (priv->watch_in != 0)
-    {
-      g_source_remove (priv->watch_in);
-      priv->watch_in = 0;
-    }
+  /* this closes the socket too, unless we've handed it over to the
+   * GibberFdTransport */
+  if (attempt->channel != NULL)
+    g_io_channel_unref (attempt->channel);
 
-  if (priv->channel != NULL)
-    {
-      g_io_channel_unref (priv->channel);
-      priv->channel = NULL;
-    }
+  g_object_unref (attempt->address);
+  g_slice_free (ConnectAttempt, attempt);
 }
 
 static void
@@ -110,7 +126,22 @@ clean_all_connect_attempts (GibberTCPTransport *self)
   GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
       self);
 
-  clean_connect_attempt (self);
+  if (priv->cancellable != NULL)
+    {
+      g_cancellable_cancel (priv->cancellable);
+      g_object_unref (priv->cancellable);
+      priv->cancellable = NULL;
+    }
+
+  if (priv->attempt_timer != 0)
+    {
+      g_source_remove (priv->attempt_timer);
+      priv->attempt_timer = 0;
+    }
+
+  g_slist_foreach (priv->attempts, (GFunc) connect_attempt_free, NULL);
+  g_slist_free (priv->attempts);
+  priv->attempts = NULL;
 
   g_resolver_free_addresses (priv->addresses);
   priv->addresses = NULL;
@@ -147,6 +178,17 @@ gibber_tcp_transport_finalize (GObject *object)
   G_OBJECT_CLASS (gibber_tcp_transport_parent_class)->finalize (object);
 }
 
+static void
+gibber_tcp_transport_disconnect (GibberTransport *transport)
+{
+  /* Abandon the address lookup and any connection attempts, so we don't
+   * come back to life after being disconnected */
+  clean_all_connect_attempts (GIBBER_TCP_TRANSPORT (transport));
+
+  GIBBER_TRANSPORT_CLASS (gibber_tcp_transport_parent_class)->disconnect (
+      transport);
+}
+
 GibberTCPTransport *
 gibber_tcp_transport_new ()
 {
@@ -155,9 +197,39 @@ gibber_tcp_transport_new ()
 
 static void new_connect_attempt (GibberTCPTransport *self);
 
+static void
+connect_failed (GibberTCPTransport *self)
+{
+  DEBUG ("connection failed");
+  clean_all_connect_attempts (self);
+
+  gibber_transport_set_state (GIBBER_TRANSPORT (self),
+      GIBBER_TRANSPORT_DISCONNECTED);
+}
+
+static void
+connect_attempt_failed (ConnectAttempt *attempt)
+{
+  GibberTCPTransport *self = attempt->self;
+  GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
+      self);
+
+  priv->attempts = g_slist_remove (priv->attempts, attempt);
+  connect_attempt_free (attempt);
+
+  /* Don't wait for the timer: this attempt is over, so start the next one
+   * straight away. */
+  if (priv->addresses != NULL)
+    new_connect_attempt (self);
+  else if (priv->attempts == NULL)
+    connect_failed (self);
+}
+
+/* Returns TRUE if the attempt is still in progress */
 static gboolean
-try_to_connect (GibberTCPTransport *self)
+try_to_connect (ConnectAttempt *attempt)
 {
+  GibberTCPTransport *self = attempt->self;
   GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
       self);
   GSocketAddress *gaddr;
@@ -168,12 +240,11 @@ try_to_connect (GibberTCPTransport *self)
   int err;
   gboolean connected = FALSE;
 
-  g_assert (priv->channel != NULL);
+  g_assert (attempt->channel != NULL);
 
-  fd = g_io_channel_unix_get_fd (priv->channel);
+  fd = g_io_channel_unix_get_fd (attempt->channel);
 
-  gaddr = g_inet_socket_address_new (G_INET_ADDRESS (priv->addresses->data),
-    priv->port);
+  gaddr = g_inet_socket_address_new (attempt->address, priv->port);
 
   native_size = g_socket_address_get_native_size (gaddr);
   /* _get_native_size() really shouldn't fail... */
@@ -196,8 +267,14 @@ try_to_connect (GibberTCPTransport *self)
 
   if (connected)
     {
-      DEBUG ("connect succeeded");
+      gchar *tmpstr = g_inet_address_to_string (attempt->address);
+
+      DEBUG ("connect to %s succeeded", tmpstr);
+      g_free (tmpstr);
 
+      /* The socket is the transport's now; don't let clean_all_connect_
+       * attempts() close it along with the attempts that lost the race. */
+      g_io_channel_set_close_on_unref (attempt->channel, FALSE);
       clean_all_connect_attempts (self);
       gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (self), fd, TRUE);
       return FALSE;
@@ -209,10 +286,8 @@ try_to_connect (GibberTCPTransport *self)
       return TRUE;
     }
 
-  clean_connect_attempt (self);
-  g_object_unref (priv->addresses->data);
-  priv->addresses = g_list_remove_link (priv->addresses, priv->addresses);
-  new_connect_attempt (self);
+  /* This removes the attempt's watch, even if we're being called from it */
+  connect_attempt_failed (attempt);
 
   return FALSE;
 }
@@ -221,10 +296,24 @@ static gboolean
 _channel_io (GIOChannel *source,
              GIOCondition condition,
              gpointer data)
+{
+  ConnectAttempt *attempt = data;
+
+  return try_to_connect (attempt);
+}
+
+static gboolean
+attempt_timer_cb (gpointer data)
 {
   GibberTCPTransport *self = GIBBER_TCP_TRANSPORT (data);
+  GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
+      self);
+
+  priv->attempt_timer = 0;
+  DEBUG ("no connection yet; trying the next address in parallel");
+  new_connect_attempt (self);
 
-  return try_to_connect (self);
+  return FALSE;
 }
 
 static void
@@ -232,23 +321,36 @@ new_connect_attempt (GibberTCPTransport *self)
 {
   GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
       self);
+  ConnectAttempt *attempt;
   int fd;
   GSocketAddress *gaddr;
   gchar *tmpstr;
 
+  if (priv->attempt_timer != 0)
+    {
+      g_source_remove (priv->attempt_timer);
+      priv->attempt_timer = 0;
+    }
+
   if (priv->addresses == NULL)
     {
-      /* no more candidate to try */
-      DEBUG ("connection failed");
-      goto failed;
+      /* no more candidate to try; wait for the ones in progress */
+      if (priv->attempts == NULL)
+        connect_failed (self);
+
+      return;
     }
 
-  tmpstr = g_inet_address_to_string (G_INET_ADDRESS (priv->addresses->data));
+  attempt = g_slice_new0 (ConnectAttempt);
+  attempt->self = self;
+  attempt->address = priv->addresses->data;
+  priv->addresses = g_list_delete_link (priv->addresses, priv->addresses);
+
+  tmpstr = g_inet_address_to_string (attempt->address);
   DEBUG ("Trying %s port %d...", tmpstr, priv->port);
   g_free (tmpstr);
 
-  gaddr = g_inet_socket_address_new (G_INET_ADDRESS (priv->addresses->data),
-    priv->port);
+  gaddr = g_inet_socket_address_new (attempt->address, priv->port);
   fd = socket (g_socket_address_get_family (gaddr), SOCK_STREAM, IPPROTO_TCP);
   g_object_unref (gaddr);
 
@@ -256,28 +358,140 @@ new_connect_attempt (GibberTCPTransport *self)
     {
       DEBUG("socket failed: #%d %s", gibber_socket_errno (),
           gibber_socket_strerror ());
-      goto failed;
+      priv->attempts = g_slist_prepend (priv->attempts, attempt);
+      connect_attempt_failed (attempt);
+      return;
     }
 
   gibber_socket_set_nonblocking (fd);
-  priv->channel = gibber_io_channel_new_from_socket (fd);
-  g_io_channel_set_close_on_unref (priv->channel, FALSE);
-  g_io_channel_set_encoding (priv->channel, NULL, NULL);
-  g_io_channel_set_buffered (priv->channel, FALSE);
+  attempt->channel = gibber_io_channel_new_from_socket (fd);
+  g_io_channel_set_close_on_unref (attempt->channel, TRUE);
+  g_io_channel_set_encoding (attempt->channel, NULL, NULL);
+  g_io_channel_set_buffered (attempt->channel, FALSE);
 
-  priv->watch_in = g_io_add_watch (priv->channel, G_IO_IN | G_IO_PRI | G_IO_OUT,
-      _channel_io, self);
+  attempt->watch = g_io_add_watch (attempt->channel,
+      G_IO_IN | G_IO_PRI | G_IO_OUT, _channel_io, attempt);
 
-  try_to_connect (self);
-  return;
+  priv->attempts = g_slist_prepend (priv->attempts, attempt);
 
-failed:
-  clean_all_connect_attempts (self);
+  if (!try_to_connect (attempt))
+    /* it either succeeded or failed straight away */
+    return;
 
-  gibber_transport_set_state (GIBBER_TRANSPORT (self),
-      GIBBER_TRANSPORT_DISCONNECTED);
+  if (priv->addresses != NULL)
+    priv->attempt_timer = g_timeout_add (CONNECTION_ATTEMPT_DELAY,
+        attempt_timer_cb, self);
+}
+
+/* Reorder @addresses so that address families alternate, starting with the
+ * family of the first address (RFC 8305 section 4). The resolver has
+ * already sorted them by preference, so we keep the order within each
+ * family. This means a broken IPv6 route delays connecting over IPv4 by at
+ * most CONNECTION_ATTEMPT_DELAY, rather than by a TCP timeout per address. */
+static GList *
+interleave_address_families (GList *addresses)
+{
+  GList *first_family = NULL, *other_families = NULL, *l;
+  GList *result = NULL;
+  GSocketFamily family;
+
+  if (addresses == NULL)
+    return NULL;
+
+  family = g_inet_address_get_family (addresses->data);
+
+  for (l = addresses; l != NULL; l = l->next)
+    {
+      if (g_inet_address_get_family (l->data) == family)
+        first_family = g_list_prepend (first_family, l->data);
+      else
+        other_families = g_list_prepend (other_families, l->data);
+    }
+
+  g_list_free (addresses);
+  first_family = g_list_reverse (first_family);
+  other_families = g_list_reverse (other_families);
+
+  while (first_family != NULL || other_families != NULL)
+    {
+      if (first_family != NULL)
+        {
+          result = g_list_prepend (result, first_family->data);
+          first_family = g_list_delete_link (first_family, first_family);
+        }
+
+      if (other_families != NULL)
+        {
+          result = g_list_prepend (result, other_families->data);
+          other_families = g_list_delete_link (other_families,
+              other_families);
+        }
+    }
+
+  return g_list_reverse (result);
+}
+
+static void
+lookup_by_name_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GibberTCPTransport *self = GIBBER_TCP_TRANSPORT (user_data);
+  GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
+      self);
+  GList *addresses;
+  GError *error = NULL;
+
+  addresses = g_resolver_lookup_by_name_finish (G_RESOLVER (source), result,
+      &error);
+
+  if (addresses == NULL)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          DEBUG ("Address lookup cancelled");
+        }
+      else
+        {
+          DEBUG ("Address lookup failed: %s", error->message);
+          connect_failed (self);
+        }
+
+      g_error_free (error);
+      goto out;
+    }
+
+  if (GIBBER_TRANSPORT (self)->state != GIBBER_TRANSPORT_CONNECTING)
+    {
+      DEBUG ("Transport was disconnected during the address lookup");
+      g_resolver_free_addresses (addresses);
+      goto out;
+    }
+
+  g_assert (priv->addresses == NULL);
+  g_assert (priv->attempts == NULL);
+
+  g_object_unref (priv->cancellable);
+  priv->cancellable = NULL;
+  priv->addresses = interleave_address_families (addresses);
+  new_connect_attempt (self);
+
+out:
+  g_object_unref (self);
 }
 
+/**
+ * gibber_tcp_transport_connect:
+ * @tcp_transport: a transport
+ * @host: the host name or IP address to connect to
+ * @port: the port to connect to
+ *
+ * Starts connecting. @host is resolved asynchronously, and if it has
+ * several addresses, a new attempt is started every
+ * CONNECTION_ATTEMPT_DELAY milliseconds until one of them succeeds,
+ * alternating between IPv6 and IPv4. The transport becomes connected as soon
+ * as one attempt succeeds, or disconnected once they have all failed.
+ */
 void
 gibber_tcp_transport_connect (GibberTCPTransport *tcp_transport,
     const gchar *host, guint16 port)
@@ -285,7 +499,6 @@ gibber_tcp_transport_connect (GibberTCPTransport *tcp_transport,
   GibberTCPTransportPrivate *priv = GIBBER_TCP_TRANSPORT_GET_PRIVATE (
       tcp_transport);
   GResolver *resolver = g_resolver_get_default ();
-  GError *error = NULL;
 
   gibber_transport_set_state (GIBBER_TRANSPORT (tcp_transport),
                              GIBBER_TRANSPORT_CONNECTING);
@@ -293,23 +506,14 @@ gibber_tcp_transport_connect (GibberTCPTransport *tcp_transport,
   priv->port = port;
 
   g_assert (priv->addresses == NULL);
-  g_assert (priv->channel == NULL);
+  g_assert (priv->attempts == NULL);
+  g_assert (priv->cancellable == NULL);
 
-  priv->addresses = g_resolver_lookup_by_name (resolver, host, NULL, &error);
-
-  if (priv->addresses == NULL)
-    {
-      DEBUG("Address lookup failed: %s", error->message);
+  priv->cancellable = g_cancellable_new ();
 
-      gibber_transport_set_state (GIBBER_TRANSPORT (tcp_transport),
-          GIBBER_TRANSPORT_DISCONNECTED);
+  /* The lookup keeps a ref on the transport until it completes */
+  g_resolver_lookup_by_name_async (resolver, host, priv->cancellable,
+      lookup_by_name_cb, g_object_ref (tcp_transport));
 
-      g_error_free (error);
-      goto out;
-    }
-
-  new_connect_attempt (tcp_transport);
-
-out:
   g_object_unref (resolver);
 }
@@ -40,6 +40,8 @@ enum
   DISCONNECTING,
   ERROR,
   BUFFER_EMPTY,
+  BUFFER_LOW,
+  BUFFER_HIGH,
   LAST_SIGNAL
 };
 
@@ -51,15 +53,29 @@ typedef struct _GibberTransportPrivate GibberTransportPrivate;
 struct _GibberTransportPrivate
 {
   gboolean dispose_has_run;
+
+  /* Once more than high_watermark bytes are waiting to be sent, we emit
+   * buffer-high; once that's back down to low_watermark, buffer-low. */
+  gsize low_watermark;
+  gsize high_watermark;
+  gboolean buffer_high;
 };
 
+#define DEFAULT_LOW_WATERMARK (64 * 1024)
+#define DEFAULT_HIGH_WATERMARK (256 * 1024)
+
 #define GIBBER_TRANSPORT_GET_PRIVATE(o)     (G_TYPE_INSTANCE_GET_PRIVATE ((o), GIBBER_TYPE_TRANSPORT, GibberTransportPrivate))
 
 static void
 gibber_transport_init (GibberTransport *obj)
 {
+  GibberTransportPrivate *priv = GIBBER_TRANSPORT_GET_PRIVATE (obj);
+
   obj->state = GIBBER_TRANSPORT_DISCONNECTED;
   obj->handler = NULL;
+
+  priv->low_watermark = DEFAULT_LOW_WATERMARK;
+  priv->high_watermark = DEFAULT_HIGH_WATERMARK;
 }
 
 static void gibber_transport_dispose (GObject *object);
@@ -84,6 +100,24 @@ gibber_transport_class_init (GibberTransportClass *gibber_transport_class)
                   g_cclosure_marshal_VOID__VOID,
                   G_TYPE_NONE, 0);
 
+  signals[BUFFER_LOW] =
+    g_signal_new ("buffer-low",
+                  G_OBJECT_CLASS_TYPE (gibber_transport_class),
+                  G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                  0,
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+
+  signals[BUFFER_HIGH] =
+    g_signal_new ("buffer-high",
+                  G_OBJECT_CLASS_TYPE (gibber_transport_class),
+                  G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                  0,
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+
   signals[CONNECTED] =
     g_signal_new ("connected",
                   G_OBJECT_CLASS_TYPE (gibber_transport_class),
@@ -186,6 +220,10 @@ gibber_transport_set_state (GibberTransport *transport,
     {
       transport->state = state;
 
+      /* Whatever was buffered has gone with the connection */
+      if (state == GIBBER_TRANSPORT_DISCONNECTED)
+        GIBBER_TRANSPORT_GET_PRIVATE (transport)->buffer_high = FALSE;
+
       switch (state)
         {
           case GIBBER_TRANSPORT_DISCONNECTED:
@@ -229,6 +267,26 @@ gibber_transport_send (GibberTransport *transport, const guint8 *data,
   return cls->send (transport, data, size, error);
 }
 
+/* Like gibber_transport_send(), but the transport may hold on to @bytes
+ * instead of copying whatever it can't write out straight away */
+gboolean
+gibber_transport_send_bytes (GibberTransport *transport,
+    GBytes *bytes,
+    GError **error)
+{
+  GibberTransportClass *cls = GIBBER_TRANSPORT_GET_CLASS (transport);
+  gconstpointer data;
+  gsize size;
+
+  g_assert (transport->state == GIBBER_TRANSPORT_CONNECTED);
+
+  if (cls->send_bytes != NULL)
+    return cls->send_bytes (transport, bytes, error);
+
+  data = g_bytes_get_data (bytes, &size);
+  return cls->send (transport, data, size, error);
+}
+
 void
 gibber_transport_disconnect (GibberTransport *transport)
 {
@@ -285,6 +343,56 @@ gibber_transport_emit_buffer_empty (GibberTransport *transport)
   g_signal_emit (transport, signals[BUFFER_EMPTY], 0);
 }
 
+/* For subclasses: tells the transport how many bytes are waiting to be
+ * sent, so it can emit buffer-high and buffer-low as needed */
+void
+gibber_transport_set_buffered_size (GibberTransport *transport,
+    gsize size)
+{
+  GibberTransportPrivate *priv = GIBBER_TRANSPORT_GET_PRIVATE (transport);
+
+  if (!priv->buffer_high && size > priv->high_watermark)
+    {
+      DEBUG ("%" G_GSIZE_FORMAT " bytes buffered; above the high watermark",
+          size);
+      priv->buffer_high = TRUE;
+      g_signal_emit (transport, signals[BUFFER_HIGH], 0);
+    }
+  else if (priv->buffer_high && size <= priv->low_watermark)
+    {
+      DEBUG ("%" G_GSIZE_FORMAT " bytes buffered; back to the low watermark",
+          size);
+      priv->buffer_high = FALSE;
+      g_signal_emit (transport, signals[BUFFER_LOW], 0);
+    }
+}
+
+/* Sets the thresholds for buffer-high and buffer-low. Callers should stop
+ * feeding the transport when buffer-high is emitted, and resume on
+ * buffer-low: the gap between the two keeps data flowing while the
+ * transport drains. */
+void
+gibber_transport_set_watermarks (GibberTransport *transport,
+    gsize low,
+    gsize high)
+{
+  GibberTransportPrivate *priv = GIBBER_TRANSPORT_GET_PRIVATE (transport);
+
+  g_return_if_fail (low <= high);
+
+  priv->low_watermark = low;
+  priv->high_watermark = high;
+}
+
+/* Returns TRUE between buffer-high and the following buffer-low */
+gboolean
+gibber_transport_buffer_is_high (GibberTransport *transport)
+{
+  GibberTransportPrivate *priv = GIBBER_TRANSPORT_GET_PRIVATE (transport);
+
+  return priv->buffer_high;
+}
+
 void
 gibber_transport_block_receiving (GibberTransport *transport,
                                   gboolean block)
@@ -58,6 +58,10 @@ struct _GibberTransportClass {
         struct sockaddr_storage *addr, socklen_t *len);
     gboolean (*buffer_is_empty) (GibberTransport *transport);
     void (*block_receiving) (GibberTransport *transport, gboolean block);
+    /* Optional; transports which queue data can keep a reference to @bytes
+     * rather than copying it */
+    gboolean (*send_bytes) (GibberTransport *transport, GBytes *bytes,
+        GError **error);
 };
 
 struct _GibberTransport {
@@ -101,12 +105,18 @@ void gibber_transport_set_state (GibberTransport *transport,
 
 void gibber_transport_emit_error (GibberTransport *transport, GError *error);
 
+void gibber_transport_set_buffered_size (GibberTransport *transport,
+    gsize size);
+
 /* Public api */
 GibberTransportState gibber_transport_get_state (GibberTransport *transport);
 
 gboolean gibber_transport_send (GibberTransport *transport, const guint8 *data,
     gsize size, GError **error);
 
+gboolean gibber_transport_send_bytes (GibberTransport *transport,
+    GBytes *bytes, GError **error);
+
 void gibber_transport_disconnect (GibberTransport *transport);
 
 void gibber_transport_set_handler (GibberTransport *transport,
@@ -123,6 +133,11 @@ gboolean gibber_transport_buffer_is_empty (GibberTransport *transport);
 
 void gibber_transport_emit_buffer_empty (GibberTransport *transport);
 
+void gibber_transport_set_watermarks (GibberTransport *transport,
+    gsize low, gsize high);
+
+gboolean gibber_transport_buffer_is_high (GibberTransport *transport);
+
 void gibber_transport_block_receiving (GibberTransport *transport,
     gboolean block);
 
@@ -67,6 +67,9 @@ struct _GibberUnixTransportPrivate
   GibberUnixTransportRecvCredentialsCb recv_creds_cb;
   gpointer recv_creds_data;
 
+  GibberUnixTransportRecvFdCb recv_fd_cb;
+  gpointer recv_fd_data;
+
   gboolean dispose_has_run;
 };
 
@@ -120,6 +123,8 @@ gibber_unix_transport_dispose (GObject *object)
 
   priv->recv_creds_cb = NULL;
   priv->recv_creds_data = NULL;
+  priv->recv_fd_cb = NULL;
+  priv->recv_fd_data = NULL;
 
   if (G_OBJECT_CLASS (gibber_unix_transport_parent_class)->dispose)
     G_OBJECT_CLASS (gibber_unix_transport_parent_class)->dispose (object);
@@ -199,6 +204,150 @@ gibber_unix_transport_new_from_fd (int fd)
   return transport;
 }
 
+#define BUFSIZE 1024
+
+/* File descriptor passing is plain POSIX, unlike credentials */
+
+gboolean
+gibber_unix_transport_send_fd (GibberUnixTransport *transport,
+    const guint8 *data,
+    gsize size,
+    int fd_to_send)
+{
+  int fd, ret;
+  struct msghdr msg;
+  struct cmsghdr *ch;
+  struct iovec iov;
+  char buffer[CMSG_SPACE (sizeof (int))];
+
+  g_return_val_if_fail (size > 0, FALSE);
+
+  DEBUG ("send fd %d", fd_to_send);
+  fd = GIBBER_FD_TRANSPORT (transport)->fd;
+
+  /* At least one byte of payload has to go along with the fd */
+  memset (&iov, 0, sizeof (iov));
+  iov.iov_base = (void *) data;
+  iov.iov_len = size;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buffer;
+  msg.msg_controllen = sizeof (buffer);
+  memset (buffer, 0, sizeof (buffer));
+
+  ch = CMSG_FIRSTHDR (&msg);
+  ch->cmsg_len = CMSG_LEN (sizeof (int));
+  ch->cmsg_level = SOL_SOCKET;
+  ch->cmsg_type = SCM_RIGHTS;
+  memcpy (CMSG_DATA (ch), &fd_to_send, sizeof (int));
+
+  ret = sendmsg (fd, &msg, 0);
+  if (ret == -1)
+    {
+      DEBUG ("sendmsg failed: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static GibberFdIOResult
+_read_with_fd (GibberUnixTransport *self,
+    GError **error)
+{
+  GibberUnixTransportPrivate *priv = GIBBER_UNIX_TRANSPORT_GET_PRIVATE (self);
+  GibberUnixTransportRecvFdCb callback = priv->recv_fd_cb;
+  gpointer user_data = priv->recv_fd_data;
+  guint8 buffer[BUFSIZE];
+  ssize_t bytes_read;
+  GibberBuffer buf;
+  struct iovec iov;
+  struct msghdr msg;
+  char control[CMSG_SPACE (sizeof (int))];
+  struct cmsghdr *ch;
+  int received_fd = -1;
+
+  memset (&iov, 0, sizeof (iov));
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof (buffer);
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  bytes_read = recvmsg (GIBBER_FD_TRANSPORT (self)->fd, &msg, 0);
+
+  if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR))
+    return GIBBER_FD_IO_RESULT_AGAIN;
+
+  priv->recv_fd_cb = NULL;
+  priv->recv_fd_data = NULL;
+
+  if (bytes_read == -1)
+    {
+      GError *err = NULL;
+
+      g_set_error_literal (&err, G_IO_CHANNEL_ERROR,
+          g_io_channel_error_from_errno (errno), "recvmsg failed");
+
+      callback (self, NULL, -1, err, user_data);
+      g_propagate_error (error, err);
+      return GIBBER_FD_IO_RESULT_ERROR;
+    }
+
+  if (bytes_read == 0)
+    return GIBBER_FD_IO_RESULT_EOF;
+
+  for (ch = CMSG_FIRSTHDR (&msg); ch != NULL; ch = CMSG_NXTHDR (&msg, ch))
+    {
+      if (ch->cmsg_level == SOL_SOCKET && ch->cmsg_type == SCM_RIGHTS &&
+          ch->cmsg_len >= CMSG_LEN (sizeof (int)))
+        {
+          memcpy (&received_fd, CMSG_DATA (ch), sizeof (int));
+          fcntl (received_fd, F_SETFD, FD_CLOEXEC);
+          break;
+        }
+    }
+
+  if (msg.msg_flags & MSG_CTRUNC)
+    DEBUG ("more than one fd was sent; ignoring the others");
+
+  buf.data = buffer;
+  buf.length = bytes_read;
+
+  callback (self, &buf, received_fd, NULL, user_data);
+  return GIBBER_FD_IO_RESULT_SUCCESS;
+}
+
+/**
+ * gibber_unix_transport_recv_fd:
+ *
+ * Arranges for the next read from @self to accept a file descriptor sent
+ * along with the data. @callback is called with the data and the fd, which
+ * it then owns, or -1 if the peer sent plain data.
+ */
+gboolean
+gibber_unix_transport_recv_fd (GibberUnixTransport *self,
+    GibberUnixTransportRecvFdCb callback,
+    gpointer user_data)
+{
+  GibberUnixTransportPrivate *priv = GIBBER_UNIX_TRANSPORT_GET_PRIVATE (self);
+
+  if (priv->recv_fd_cb != NULL || priv->recv_creds_cb != NULL)
+    {
+      DEBUG ("already waiting for an fd or credentials");
+      return FALSE;
+    }
+
+  priv->recv_fd_cb = callback;
+  priv->recv_fd_data = user_data;
+  return TRUE;
+}
+
 /* Patches that reimplement these functions for non-Linux would be welcome
  * (please file a bug) */
 
@@ -258,8 +407,6 @@ gibber_unix_transport_send_credentials (GibberUnixTransport *transport,
   return TRUE;
 }
 
-#define BUFSIZE 1024
-
 static GibberFdIOResult
 gibber_unix_transport_read (GibberFdTransport *transport,
     GIOChannel *channel,
@@ -278,6 +425,9 @@ gibber_unix_transport_read (GibberFdTransport *transport,
   struct ucred *cred;
   int opt;
 
+  if (priv->recv_fd_cb != NULL)
+    return _read_with_fd (self, error);
+
   if (priv->recv_creds_cb == NULL)
     return gibber_fd_transport_read (transport, channel, error);
 
@@ -363,9 +513,9 @@ gibber_unix_transport_recv_credentials (GibberUnixTransport *self,
 {
   GibberUnixTransportPrivate *priv = GIBBER_UNIX_TRANSPORT_GET_PRIVATE (self);
 
-  if (priv->recv_creds_cb != NULL)
+  if (priv->recv_creds_cb != NULL || priv->recv_fd_cb != NULL)
     {
-      DEBUG ("already waiting for credentials");
+      DEBUG ("already waiting for credentials or an fd");
       return FALSE;
     }
 
@@ -405,6 +555,11 @@ gibber_unix_transport_read (GibberFdTransport *transport,
     GIOChannel *channel,
     GError **error)
 {
+  GibberUnixTransport *self = GIBBER_UNIX_TRANSPORT (transport);
+
+  if (GIBBER_UNIX_TRANSPORT_GET_PRIVATE (self)->recv_fd_cb != NULL)
+    return _read_with_fd (self, error);
+
   return gibber_fd_transport_read (transport, channel, error);
 }
 
@@ -110,6 +110,20 @@ gboolean gibber_unix_transport_recv_credentials (GibberUnixTransport *transport,
     GibberUnixTransportRecvCredentialsCb callback,
     gpointer user_data);
 
+gboolean gibber_unix_transport_send_fd (GibberUnixTransport *transport,
+    const guint8 *data, gsize size, int fd_to_send);
+
+typedef void (*GibberUnixTransportRecvFdCb) (
+    GibberUnixTransport *transport,
+    GibberBuffer *buffer,
+    int fd,
+    GError *error,
+    gpointer user_data);
+
+gboolean gibber_unix_transport_recv_fd (GibberUnixTransport *transport,
+    GibberUnixTransportRecvFdCb callback,
+    gpointer user_data);
+
 G_END_DECLS
 
 #endif /* G_OS_UNIX */
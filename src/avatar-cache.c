@@ -0,0 +1,459 @@
+/*
+ * avatar-cache.c - Source for GabbleAvatarCache
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* The avatar cache is a content-addressed store of avatar images, keyed by
+ * the lower-case hex SHA-1 of the image data, which is also the avatar token
+ * we hand out over D-Bus. Since the key is derived from the content, an entry
+ * never needs to be invalidated: a contact changing their avatar just means
+ * they now have a different token.
+ *
+ * Each entry lives in <dir>/<first two hex digits>/<remaining 38 digits>,
+ * and consists of the MIME type, a newline, and then the raw image bytes.
+ * Entries are written atomically with g_file_set_contents(), so readers never
+ * see a partially-written file.
+ *
+ * The store is kept below GabbleAvatarCache:max-size bytes by deleting the
+ * least recently used entries; looking an entry up touches its mtime.
+ */
+
+#include "config.h"
+#include "avatar-cache.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
+
+#include "util.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_VCARD
+#include "debug.h"
+
+/* Default GabbleAvatarCache:max-size, in bytes */
+#define DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+
+G_DEFINE_TYPE (GabbleAvatarCache, gabble_avatar_cache, G_TYPE_OBJECT)
+
+static gpointer shared_cache = NULL;
+
+struct _GabbleAvatarCachePrivate
+{
+  /* NULL if the cache is disabled */
+  gchar *path;
+  guint max_size;
+  /* total size of the entries on disk, or -1 if we haven't looked yet */
+  gint64 size;
+};
+
+enum
+{
+  PROP_PATH = 1,
+  PROP_MAX_SIZE,
+};
+
+static void
+gabble_avatar_cache_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  GabbleAvatarCache *self = GABBLE_AVATAR_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, self->priv->path);
+      break;
+    case PROP_MAX_SIZE:
+      g_value_set_uint (value, self->priv->max_size);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+gabble_avatar_cache_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  GabbleAvatarCache *self = GABBLE_AVATAR_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_free (self->priv->path);
+      self->priv->path = g_value_dup_string (value);
+      break;
+    case PROP_MAX_SIZE:
+      self->priv->max_size = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+gabble_avatar_cache_finalize (GObject *object)
+{
+  GabbleAvatarCache *self = GABBLE_AVATAR_CACHE (object);
+
+  g_free (self->priv->path);
+
+  G_OBJECT_CLASS (gabble_avatar_cache_parent_class)->finalize (object);
+}
+
+static void
+gabble_avatar_cache_class_init (GabbleAvatarCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (GabbleAvatarCachePrivate));
+
+  object_class->get_property = gabble_avatar_cache_get_property;
+  object_class->set_property = gabble_avatar_cache_set_property;
+  object_class->finalize = gabble_avatar_cache_finalize;
+
+  /**
+   * GabbleAvatarCache:path:
+   *
+   * The directory in which avatars are stored, or %NULL if the cache is
+   * disabled.
+   */
+  g_object_class_install_property (object_class, PROP_PATH,
+      g_param_spec_string ("path", "Path", "The path to the cache directory",
+          NULL,
+          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE |
+          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GabbleAvatarCache:max-size:
+   *
+   * The most bytes the cache may take up on disk. Once it grows beyond this,
+   * the least recently used avatars are removed.
+   */
+  g_object_class_install_property (object_class, PROP_MAX_SIZE,
+      g_param_spec_uint ("max-size", "Maximum size",
+          "The largest the cache may grow, in bytes",
+          0, G_MAXUINT, DEFAULT_MAX_SIZE,
+          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE |
+          G_PARAM_STATIC_STRINGS));
+}
+
+static void
+gabble_avatar_cache_init (GabbleAvatarCache *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, GABBLE_TYPE_AVATAR_CACHE,
+      GabbleAvatarCachePrivate);
+  self->priv->size = -1;
+}
+
+/**
+ * gabble_avatar_cache_dup_shared:
+ *
+ * Returns a reference to the #GabbleAvatarCache shared by all connections,
+ * creating it if necessary. Setting GABBLE_AVATAR_CACHE_DIR to the empty
+ * string disables the cache altogether.
+ *
+ * Returns: a new, or cached, #GabbleAvatarCache.
+ */
+GabbleAvatarCache *
+gabble_avatar_cache_dup_shared (void)
+{
+  return gabble_cache_dup_shared (&shared_cache, GABBLE_TYPE_AVATAR_CACHE,
+      "GABBLE_AVATAR_CACHE_DIR", "avatars");
+}
+
+/**
+ * gabble_avatar_cache_free_shared:
+ *
+ * Drops the reference to the shared #GabbleAvatarCache taken by
+ * gabble_avatar_cache_dup_shared(), or does nothing if it was never created.
+ */
+void
+gabble_avatar_cache_free_shared (void)
+{
+  gabble_cache_free_shared (&shared_cache);
+}
+
+/* Tokens may come from the network (XEP-0084 item ids), so check that they
+ * really are SHA-1s before using them to build a path. */
+static gboolean
+is_valid_sha1 (const gchar *sha1)
+{
+  guint i;
+
+  if (sha1 == NULL)
+    return FALSE;
+
+  for (i = 0; i < SHA1_HASH_SIZE * 2; i++)
+    {
+      if (!g_ascii_isxdigit (sha1[i]) || g_ascii_isupper (sha1[i]))
+        return FALSE;
+    }
+
+  return sha1[SHA1_HASH_SIZE * 2] == '\0';
+}
+
+static gchar *
+entry_path (GabbleAvatarCache *self,
+    const gchar *sha1)
+{
+  gchar prefix[3] = { sha1[0], sha1[1], '\0' };
+
+  return g_build_filename (self->priv->path, prefix, sha1 + 2, NULL);
+}
+
+typedef struct
+{
+  gchar *path;
+  goffset size;
+  time_t mtime;
+} Entry;
+
+static void
+entry_free (Entry *entry)
+{
+  g_free (entry->path);
+  g_slice_free (Entry, entry);
+}
+
+static gint
+entry_compare_mtime (gconstpointer a,
+    gconstpointer b)
+{
+  const Entry *entry_a = *(Entry * const *) a;
+  const Entry *entry_b = *(Entry * const *) b;
+
+  if (entry_a->mtime < entry_b->mtime)
+    return -1;
+
+  return entry_a->mtime > entry_b->mtime;
+}
+
+/* Adds every entry in the store to @entries, if it's not NULL, and returns
+ * their total size */
+static gint64
+scan (GabbleAvatarCache *self,
+    GPtrArray *entries)
+{
+  GDir *dir, *subdir;
+  const gchar *prefix, *name;
+  gint64 total = 0;
+
+  dir = g_dir_open (self->priv->path, 0, NULL);
+
+  if (dir == NULL)
+    return 0;
+
+  while ((prefix = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *subdir_path = g_build_filename (self->priv->path, prefix, NULL);
+
+      subdir = g_dir_open (subdir_path, 0, NULL);
+
+      while (subdir != NULL && (name = g_dir_read_name (subdir)) != NULL)
+        {
+          gchar *path = g_build_filename (subdir_path, name, NULL);
+          GStatBuf buf;
+
+          if (g_stat (path, &buf) == 0 && S_ISREG (buf.st_mode))
+            {
+              total += buf.st_size;
+
+              if (entries != NULL)
+                {
+                  Entry *entry = g_slice_new (Entry);
+
+                  entry->path = path;
+                  entry->size = buf.st_size;
+                  entry->mtime = buf.st_mtime;
+                  g_ptr_array_add (entries, entry);
+                  continue;
+                }
+            }
+
+          g_free (path);
+        }
+
+      if (subdir != NULL)
+        g_dir_close (subdir);
+
+      g_free (subdir_path);
+    }
+
+  g_dir_close (dir);
+  return total;
+}
+
+/* Removes the least recently used entries until the store is comfortably
+ * below its maximum size, so we don't have to do this on every store */
+static void
+trim (GabbleAvatarCache *self)
+{
+  GPtrArray *entries = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) entry_free);
+  gint64 target = self->priv->max_size / 4 * 3;
+  guint i;
+
+  self->priv->size = scan (self, entries);
+  g_ptr_array_sort (entries, entry_compare_mtime);
+
+  for (i = 0; i < entries->len && self->priv->size > target; i++)
+    {
+      Entry *entry = g_ptr_array_index (entries, i);
+
+      if (g_unlink (entry->path) == 0)
+        self->priv->size -= entry->size;
+    }
+
+  DEBUG ("removed %u old avatars; %" G_GINT64_FORMAT " bytes left", i,
+      self->priv->size);
+  g_ptr_array_unref (entries);
+}
+
+/**
+ * gabble_avatar_cache_store:
+ * @self: the cache
+ * @sha1: the lower-case hex SHA-1 of @data
+ * @data: the avatar image
+ * @len: the length of @data
+ * @mime_type: the MIME type of @data, or %NULL if unknown
+ *
+ * Stores an avatar, unless an entry for @sha1 already exists.
+ *
+ * Returns: %TRUE if the avatar is now in the cache
+ */
+gboolean
+gabble_avatar_cache_store (GabbleAvatarCache *self,
+    const gchar *sha1,
+    const gchar *data,
+    gsize len,
+    const gchar *mime_type)
+{
+  gchar *path;
+  GString *contents;
+  GError *error = NULL;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (GABBLE_IS_AVATAR_CACHE (self), FALSE);
+
+  if (self->priv->path == NULL || !is_valid_sha1 (sha1))
+    return FALSE;
+
+  if (mime_type == NULL || strchr (mime_type, '\n') != NULL)
+    mime_type = "";
+
+  path = entry_path (self, sha1);
+
+  if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+    {
+      g_free (path);
+      return TRUE;
+    }
+
+  contents = g_string_sized_new (strlen (mime_type) + 1 + len);
+  g_string_append (contents, mime_type);
+  g_string_append_c (contents, '\n');
+  g_string_append_len (contents, data, len);
+
+  if (gabble_cache_set_contents (path, contents->str, contents->len, &error))
+    {
+      DEBUG ("stored %" G_GSIZE_FORMAT " byte avatar %s", len, sha1);
+      ret = TRUE;
+
+      if (self->priv->size < 0)
+        self->priv->size = scan (self, NULL);
+      else
+        self->priv->size += contents->len;
+
+      if (self->priv->size > self->priv->max_size)
+        trim (self);
+    }
+  else
+    {
+      DEBUG ("failed to store avatar %s: %s", sha1, error->message);
+      g_clear_error (&error);
+    }
+
+  g_string_free (contents, TRUE);
+  g_free (path);
+  return ret;
+}
+
+/**
+ * gabble_avatar_cache_lookup:
+ * @self: the cache
+ * @sha1: the avatar token to look up
+ * @mime_type: (out): used to return the avatar's MIME type
+ *
+ * Returns: (transfer full): a newly-allocated array holding the avatar
+ *  whose SHA-1 is @sha1, or %NULL if it's not in the cache.
+ */
+GArray *
+gabble_avatar_cache_lookup (GabbleAvatarCache *self,
+    const gchar *sha1,
+    gchar **mime_type)
+{
+  GMappedFile *file;
+  const gchar *contents, *newline;
+  gsize len;
+  gchar *path;
+  GArray *ret = NULL;
+
+  g_return_val_if_fail (GABBLE_IS_AVATAR_CACHE (self), NULL);
+  g_return_val_if_fail (mime_type != NULL, NULL);
+
+  if (self->priv->path == NULL || !is_valid_sha1 (sha1))
+    return NULL;
+
+  path = entry_path (self, sha1);
+  file = g_mapped_file_new (path, FALSE, NULL);
+
+  if (file == NULL)
+    goto out;
+
+  contents = g_mapped_file_get_contents (file);
+  len = g_mapped_file_get_length (file);
+  newline = (len > 0) ? memchr (contents, '\n', len) : NULL;
+
+  if (newline == NULL)
+    {
+      DEBUG ("%s is corrupt; removing it", path);
+      g_unlink (path);
+      goto out;
+    }
+
+  *mime_type = g_strndup (contents, newline - contents);
+  len -= newline + 1 - contents;
+
+  ret = g_array_sized_new (FALSE, FALSE, sizeof (gchar), len);
+  g_array_append_vals (ret, newline + 1, len);
+
+  /* Keep recently used avatars when trimming the cache */
+  g_utime (path, NULL);
+
+out:
+  if (file != NULL)
+    g_mapped_file_unref (file);
+
+  g_free (path);
+  return ret;
+}
@@ -0,0 +1,76 @@
+/*
+ * avatar-cache.h - Header for GabbleAvatarCache
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_AVATAR_CACHE_H__
+#define __GABBLE_AVATAR_CACHE_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleAvatarCache GabbleAvatarCache;
+typedef struct _GabbleAvatarCacheClass GabbleAvatarCacheClass;
+typedef struct _GabbleAvatarCachePrivate GabbleAvatarCachePrivate;
+
+struct _GabbleAvatarCache
+{
+  GObject parent;
+  GabbleAvatarCachePrivate *priv;
+};
+
+struct _GabbleAvatarCacheClass
+{
+  GObjectClass parent_class;
+};
+
+GType gabble_avatar_cache_get_type (void);
+
+/* TYPE MACROS */
+#define GABBLE_TYPE_AVATAR_CACHE \
+  (gabble_avatar_cache_get_type ())
+#define GABBLE_AVATAR_CACHE(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), GABBLE_TYPE_AVATAR_CACHE, \
+                               GabbleAvatarCache))
+#define GABBLE_AVATAR_CACHE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), GABBLE_TYPE_AVATAR_CACHE, \
+                            GabbleAvatarCacheClass))
+#define GABBLE_IS_AVATAR_CACHE(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GABBLE_TYPE_AVATAR_CACHE))
+#define GABBLE_IS_AVATAR_CACHE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), GABBLE_TYPE_AVATAR_CACHE))
+#define GABBLE_AVATAR_CACHE_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), GABBLE_TYPE_AVATAR_CACHE, \
+                              GabbleAvatarCacheClass))
+
+GabbleAvatarCache *gabble_avatar_cache_dup_shared (void);
+void gabble_avatar_cache_free_shared (void);
+
+gboolean gabble_avatar_cache_store (GabbleAvatarCache *self,
+    const gchar *sha1,
+    const gchar *data,
+    gsize len,
+    const gchar *mime_type);
+
+GArray *gabble_avatar_cache_lookup (GabbleAvatarCache *self,
+    const gchar *sha1,
+    gchar **mime_type);
+
+G_END_DECLS
+
+#endif /* __GABBLE_AVATAR_CACHE_H__ */
@@ -0,0 +1,430 @@
+/*
+ * base64.c - Gabble's base64 codec
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Unlike g_base64_encode() and g_base64_decode(), these functions can work
+ * on caller-supplied buffers, which lets the bytestreams avoid allocating
+ * (and copying) a fresh buffer for every stanza. The bulk of the work is done
+ * by a "block" kernel which handles whole quanta; on x86 CPUs with SSSE3 we
+ * use a vectorised one which handles 12 bytes (16 characters) at a time.
+ *
+ * Decoding is as forgiving as g_base64_decode(): characters outside the
+ * base64 alphabet, such as the line breaks found in vCard BINVALs, and
+ * padding are skipped.
+ */
+
+#include "config.h"
+#include "base64.h"
+
+#include <string.h>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define HAVE_SSSE3_KERNELS 1
+#include <tmmintrin.h>
+#endif
+
+static const gchar encode_table[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define INVALID 0xff
+static guchar decode_table[256];
+
+/* Encodes as many whole 3-byte groups of @data as it likes, returning the
+ * number of bytes consumed; the output is 4/3 of that. */
+typedef gsize (*EncodeBlockFunc) (const guchar *data, gsize len, gchar *out);
+
+/* Decodes whole 4-character quanta of @text for as long as they contain
+ * nothing but base64 alphabet characters, returning the number of characters
+ * consumed; the output is 3/4 of that. */
+typedef gsize (*DecodeBlockFunc) (const guchar *text, gsize len, guchar *out);
+
+static EncodeBlockFunc encode_block = NULL;
+static DecodeBlockFunc decode_block = NULL;
+
+static gsize
+encode_block_scalar (const guchar *data,
+    gsize len,
+    gchar *out)
+{
+  const guchar *in = data;
+  const guchar *end = data + (len - len % 3);
+
+  while (in < end)
+    {
+      guint32 triple = (in[0] << 16) | (in[1] << 8) | in[2];
+
+      out[0] = encode_table[(triple >> 18) & 0x3f];
+      out[1] = encode_table[(triple >> 12) & 0x3f];
+      out[2] = encode_table[(triple >> 6) & 0x3f];
+      out[3] = encode_table[triple & 0x3f];
+
+      in += 3;
+      out += 4;
+    }
+
+  return in - data;
+}
+
+static gsize
+decode_block_scalar (const guchar *text,
+    gsize len,
+    guchar *out)
+{
+  const guchar *in = text;
+  const guchar *end = text + (len - len % 4);
+
+  while (in < end)
+    {
+      guint32 a = decode_table[in[0]];
+      guint32 b = decode_table[in[1]];
+      guint32 c = decode_table[in[2]];
+      guint32 d = decode_table[in[3]];
+      guint32 quad;
+
+      /* INVALID has the top bits set too */
+      if (((a | b | c | d) & 0xc0) != 0)
+        break;
+
+      quad = (a << 18) | (b << 12) | (c << 6) | d;
+      out[0] = quad >> 16;
+      out[1] = quad >> 8;
+      out[2] = quad;
+
+      in += 4;
+      out += 3;
+    }
+
+  return in - text;
+}
+
+#ifdef HAVE_SSSE3_KERNELS
+
+/* The vectorised kernels follow Wojciech Muła's SSE base64 algorithms. */
+
+__attribute__ ((target ("ssse3")))
+static gsize
+encode_block_ssse3 (const guchar *data,
+    gsize len,
+    gchar *out)
+{
+  const __m128i shuffle = _mm_setr_epi8 (1, 0, 2, 1, 4, 3, 5, 4,
+      7, 6, 8, 7, 10, 9, 11, 10);
+  const __m128i shift_lut = _mm_setr_epi8 ('a' - 26, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  gsize done = 0;
+
+  /* Each iteration loads 16 bytes but only consumes 12. */
+  while (len - done >= 16)
+    {
+      __m128i in, t0, t1, t2, t3, indices, result, less;
+
+      in = _mm_loadu_si128 ((const __m128i *) (data + done));
+
+      /* Split each 3-byte group into four 6-bit indices, one per byte */
+      in = _mm_shuffle_epi8 (in, shuffle);
+      t0 = _mm_and_si128 (in, _mm_set1_epi32 (0x0fc0fc00));
+      t1 = _mm_mulhi_epu16 (t0, _mm_set1_epi32 (0x04000040));
+      t2 = _mm_and_si128 (in, _mm_set1_epi32 (0x003f03f0));
+      t3 = _mm_mullo_epi16 (t2, _mm_set1_epi32 (0x01000010));
+      indices = _mm_or_si128 (t1, t3);
+
+      /* Map each index to the offset of its range in the alphabet */
+      result = _mm_subs_epu8 (indices, _mm_set1_epi8 (51));
+      less = _mm_cmpgt_epi8 (_mm_set1_epi8 (26), indices);
+      result = _mm_or_si128 (result,
+          _mm_and_si128 (less, _mm_set1_epi8 (13)));
+      result = _mm_shuffle_epi8 (shift_lut, result);
+      result = _mm_add_epi8 (result, indices);
+
+      _mm_storeu_si128 ((__m128i *) (out + done / 3 * 4), result);
+      done += 12;
+    }
+
+  return done + encode_block_scalar (data + done, len - done,
+      out + done / 3 * 4);
+}
+
+__attribute__ ((target ("ssse3")))
+static gsize
+decode_block_ssse3 (const guchar *text,
+    gsize len,
+    guchar *out)
+{
+  /* Every byte of lut_lo has 0x10 set, as does every byte of lut_hi for a
+   * high nibble which never starts an alphabet character; lut_lo's other
+   * bits, indexed by low nibble, are the high nibbles for which that low
+   * nibble is valid. So (lo & hi) is zero exactly for alphabet characters. */
+  const __m128i lut_lo = _mm_setr_epi8 (0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8 (0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+      0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  /* What to add to a character to get its value, indexed by its high
+   * nibble; '/' shares its high nibble with '+', so gets index 1 instead */
+  const __m128i lut_roll = _mm_setr_epi8 (0, 16, 19, 4, -65, -65, -71, -71,
+      0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8 (0x2f);
+  const __m128i pack = _mm_setr_epi8 (2, 1, 0, 6, 5, 4, 10, 9, 8,
+      14, 13, 12, -1, -1, -1, -1);
+  gsize done = 0;
+
+  /* Each iteration stores 16 bytes but only produces 12, so stop while
+   * there's still enough input left for the slack to be inside the output
+   * buffer. */
+  while (len - done >= 24)
+    {
+      __m128i in, hi_nibbles, lo_nibbles, lo, hi, eq_2f, roll, values;
+
+      in = _mm_loadu_si128 ((const __m128i *) (text + done));
+
+      hi_nibbles = _mm_and_si128 (_mm_srli_epi32 (in, 4), mask_2f);
+      lo_nibbles = _mm_and_si128 (in, mask_2f);
+      lo = _mm_shuffle_epi8 (lut_lo, lo_nibbles);
+      hi = _mm_shuffle_epi8 (lut_hi, hi_nibbles);
+
+      /* Anything else (whitespace, padding, junk) is left to the scalar
+       * code */
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (lo, hi),
+              _mm_setzero_si128 ())) != 0xffff)
+        break;
+
+      eq_2f = _mm_cmpeq_epi8 (in, mask_2f);
+      roll = _mm_shuffle_epi8 (lut_roll, _mm_add_epi8 (eq_2f, hi_nibbles));
+      values = _mm_add_epi8 (in, roll);
+
+      /* Merge four 6-bit values into each 24-bit group, then squeeze the
+       * groups together in big-endian order */
+      values = _mm_maddubs_epi16 (values, _mm_set1_epi32 (0x01400140));
+      values = _mm_madd_epi16 (values, _mm_set1_epi32 (0x00011000));
+      values = _mm_shuffle_epi8 (values, pack);
+
+      _mm_storeu_si128 ((__m128i *) (out + done / 4 * 3), values);
+      done += 16;
+    }
+
+  return done + decode_block_scalar (text + done, len - done,
+      out + done / 4 * 3);
+}
+
+#endif /* HAVE_SSSE3_KERNELS */
+
+static void
+init_kernels (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      guint i;
+
+      memset (decode_table, INVALID, sizeof (decode_table));
+
+      for (i = 0; i < 64; i++)
+        decode_table[(guchar) encode_table[i]] = i;
+
+      encode_block = encode_block_scalar;
+      decode_block = decode_block_scalar;
+
+#ifdef HAVE_SSSE3_KERNELS
+      __builtin_cpu_init ();
+
+      if (__builtin_cpu_supports ("ssse3"))
+        {
+          encode_block = encode_block_ssse3;
+          decode_block = decode_block_ssse3;
+        }
+#endif
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/**
+ * gabble_base64_force_scalar:
+ * @scalar: whether to stop using vectorised kernels
+ *
+ * Selects the portable implementation even if the CPU supports a faster one.
+ * Only intended for tests and benchmarks.
+ */
+void
+gabble_base64_force_scalar (gboolean scalar)
+{
+  init_kernels ();
+
+  encode_block = encode_block_scalar;
+  decode_block = decode_block_scalar;
+
+#ifdef HAVE_SSSE3_KERNELS
+  if (!scalar && __builtin_cpu_supports ("ssse3"))
+    {
+      encode_block = encode_block_ssse3;
+      decode_block = decode_block_ssse3;
+    }
+#endif
+}
+
+/**
+ * gabble_base64_encode_to:
+ * @data: the bytes to encode
+ * @len: the length of @data
+ * @out: a buffer of at least GABBLE_BASE64_ENCODED_LEN (@len) + 1 bytes
+ *
+ * Encodes @data into @out, without line breaks, and NUL-terminates it.
+ *
+ * Returns: the number of characters written, not counting the NUL
+ */
+gsize
+gabble_base64_encode_to (const guchar *data,
+    gsize len,
+    gchar *out)
+{
+  gsize done;
+  gchar *o;
+
+  init_kernels ();
+
+  done = encode_block (data, len, out);
+  o = out + done / 3 * 4;
+
+  /* Encode and pad whatever's left */
+  while (done < len)
+    {
+      guint32 triple = data[done] << 16;
+
+      if (done + 1 < len)
+        triple |= data[done + 1] << 8;
+
+      if (done + 2 < len)
+        triple |= data[done + 2];
+
+      o[0] = encode_table[(triple >> 18) & 0x3f];
+      o[1] = encode_table[(triple >> 12) & 0x3f];
+      o[2] = (done + 1 < len) ? encode_table[(triple >> 6) & 0x3f] : '=';
+      o[3] = (done + 2 < len) ? encode_table[triple & 0x3f] : '=';
+
+      done += 3;
+      o += 4;
+    }
+
+  *o = '\0';
+  return o - out;
+}
+
+/**
+ * gabble_base64_encode:
+ * @data: the bytes to encode
+ * @len: the length of @data
+ *
+ * Returns: a newly-allocated string holding @data in base64
+ */
+gchar *
+gabble_base64_encode (const guchar *data,
+    gsize len)
+{
+  gchar *out = g_malloc (GABBLE_BASE64_ENCODED_LEN (len) + 1);
+
+  gabble_base64_encode_to (data, len, out);
+  return out;
+}
+
+/**
+ * gabble_base64_decode_to:
+ * @text: base64-encoded text
+ * @len: the length of @text
+ * @out: a buffer of at least GABBLE_BASE64_DECODED_MAX_LEN (@len) bytes
+ *
+ * Decodes @text into @out.
+ *
+ * Returns: the number of bytes written to @out
+ */
+gsize
+gabble_base64_decode_to (const gchar *text,
+    gsize len,
+    guchar *out)
+{
+  const guchar *in = (const guchar *) text;
+  const guchar *end = in + len;
+  guchar *o = out;
+  guint32 acc = 0;
+  guint n = 0;
+
+  init_kernels ();
+
+  while (in < end)
+    {
+      guint32 v;
+
+      if (n == 0)
+        {
+          gsize done = decode_block (in, end - in, o);
+
+          in += done;
+          o += done / 4 * 3;
+
+          if (in == end)
+            break;
+        }
+
+      v = decode_table[*in++];
+
+      if (v == INVALID)
+        continue;
+
+      acc = (acc << 6) | v;
+
+      if (++n == 4)
+        {
+          o[0] = acc >> 16;
+          o[1] = acc >> 8;
+          o[2] = acc;
+          o += 3;
+          acc = 0;
+          n = 0;
+        }
+    }
+
+  /* A trailing partial quantum holds one or two more bytes */
+  if (n == 2)
+    {
+      *o++ = acc >> 4;
+    }
+  else if (n == 3)
+    {
+      *o++ = acc >> 10;
+      *o++ = acc >> 2;
+    }
+
+  return o - out;
+}
+
+/**
+ * gabble_base64_decode_to_string:
+ * @text: NUL-terminated base64-encoded text
+ *
+ * Returns: a newly-allocated #GString holding the decoded bytes
+ */
+GString *
+gabble_base64_decode_to_string (const gchar *text)
+{
+  gsize len = strlen (text);
+  GString *str = g_string_sized_new (GABBLE_BASE64_DECODED_MAX_LEN (len));
+
+  str->len = gabble_base64_decode_to (text, len, (guchar *) str->str);
+  str->str[str->len] = '\0';
+  return str;
+}
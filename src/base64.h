@@ -0,0 +1,44 @@
+/*
+ * base64.h - Header for Gabble's base64 codec
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_BASE64_H__
+#define __GABBLE_BASE64_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Number of characters needed to encode @len bytes, not counting the
+ * trailing NUL */
+#define GABBLE_BASE64_ENCODED_LEN(len) ((((len) + 2) / 3) * 4)
+
+/* Upper bound on the number of bytes @len characters can decode to */
+#define GABBLE_BASE64_DECODED_MAX_LEN(len) (((len) / 4) * 3 + 3)
+
+gsize gabble_base64_encode_to (const guchar *data, gsize len, gchar *out);
+gchar *gabble_base64_encode (const guchar *data, gsize len);
+
+gsize gabble_base64_decode_to (const gchar *text, gsize len, guchar *out);
+GString *gabble_base64_decode_to_string (const gchar *text);
+
+void gabble_base64_force_scalar (gboolean scalar);
+
+G_END_DECLS
+
+#endif /* __GABBLE_BASE64_H__ */
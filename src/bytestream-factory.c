@@ -43,6 +43,7 @@
 #include "namespaces.h"
 #include "presence-cache.h"
 #include "private-tubes-factory.h"
+#include "proxy-stats.h"
 #include "util.h"
 
 G_DEFINE_TYPE (GabbleBytestreamFactory, gabble_bytestream_factory,
@@ -181,6 +182,9 @@ struct _GabbleBytestreamFactoryPrivate
   /* Time stamp of the proxies list received from TELEPATHY_PROXIES_SERVICE */
   GTimeVal proxies_list_stamp;
 
+  /* How well each proxy worked for us in the past, used to rank them */
+  GabbleProxyStats *proxy_stats;
+
   gboolean dispose_has_run;
 };
 
@@ -209,7 +213,8 @@ static gboolean handle_socks5_query_iq (
 static void query_proxies (GabbleBytestreamFactory *self,
     guint nb_proxies_needed);
 
-static GSList * randomize_g_slist (GSList *list);
+static GSList * rank_potential_proxies (GabbleBytestreamFactory *self,
+    GSList *list);
 
 static void
 gabble_bytestream_factory_init (GabbleBytestreamFactory *self)
@@ -232,6 +237,8 @@ gabble_bytestream_factory_init (GabbleBytestreamFactory *self)
       bytestream_id_equal, bytestream_id_free, g_object_unref);
 
   memset (&priv->proxies_list_stamp, 0, sizeof (GTimeVal));
+
+  priv->proxy_stats = gabble_proxy_stats_dup_shared ();
 }
 
 static gint
@@ -359,6 +366,8 @@ fail:
       found = g_slist_find_custom (priv->socks5_potential_proxies,
           from, (GCompareFunc) strcmp);
 
+      gabble_proxy_stats_add_result (priv->proxy_stats, from, FALSE);
+
       if (found != NULL)
         {
           DEBUG ("remove proxy %s", from);
@@ -478,8 +487,8 @@ proxies_disco_cb (GabbleDisco *disco,
   g_slist_foreach (priv->socks5_potential_proxies, (GFunc) g_free, NULL);
   g_slist_free (priv->socks5_potential_proxies);
 
-  /* randomize the list to not always use the same proxies */
-  priv->socks5_potential_proxies = randomize_g_slist (new_list);
+  /* query the ones which worked best in the past first */
+  priv->socks5_potential_proxies = rank_potential_proxies (self, new_list);
   priv->next_query = priv->socks5_potential_proxies;
 
   gabble_bytestream_factory_query_socks5_proxies (self);
@@ -542,32 +551,68 @@ gabble_bytestream_factory_query_socks5_proxies (GabbleBytestreamFactory *self)
   query_proxies (self, nb_proxies_needed);
 }
 
-static GSList *
-randomize_g_slist (GSList *list)
+/* Shuffles the data of the @n elements of a list starting at @first */
+static void
+shuffle_g_slist_run (GSList *first,
+    guint n)
 {
-  guint len;
+  gpointer *items = g_new (gpointer, n);
+  GSList *l;
   guint i;
-  GSList *new_head, *new_tail;
 
-  len = g_slist_length (list);
-  if (len <= 1)
-    return list;
+  for (i = 0, l = first; i < n; i++, l = l->next)
+    items[i] = l->data;
 
-  i = g_random_int_range (0, len);
-  if (i == 0)
-    return list;
+  for (i = n - 1; i > 0; i--)
+    {
+      guint j = g_random_int_range (0, i + 1);
+      gpointer tmp = items[i];
 
-  /* Cut the list at the i th position and make it the new head of the
-   * list */
-  new_tail = g_slist_nth (list, i - 1);
-  g_assert (new_tail != NULL);
+      items[i] = items[j];
+      items[j] = tmp;
+    }
 
-  new_head = new_tail->next;
-  g_assert (new_head != NULL);
+  for (i = 0, l = first; i < n; i++, l = l->next)
+    l->data = items[i];
 
-  new_tail->next = NULL;
+  g_free (items);
+}
 
-  return g_slist_concat (new_head, list);
+static gint
+cmp_potential_proxy_cost (gconstpointer a,
+    gconstpointer b,
+    gpointer user_data)
+{
+  return gabble_proxy_stats_compare (user_data, a, b);
+}
+
+/* Sorts a list of proxy JIDs so the cheapest come first. Proxies which cost
+ * the same, such as all those we know nothing about, are shuffled so that we
+ * don't always use the same ones. */
+static GSList *
+rank_potential_proxies (GabbleBytestreamFactory *self,
+    GSList *list)
+{
+  GabbleProxyStats *stats = self->priv->proxy_stats;
+  GSList *l, *end;
+  guint n;
+
+  list = g_slist_sort_with_data (list, cmp_potential_proxy_cost, stats);
+
+  for (l = list; l != NULL; l = end)
+    {
+      n = 1;
+
+      for (end = l->next;
+           end != NULL &&
+           gabble_proxy_stats_compare (stats, l->data, end->data) == 0;
+           end = end->next)
+        n++;
+
+      shuffle_g_slist_run (l, n);
+    }
+
+  return list;
 }
 
 static void
@@ -632,9 +677,9 @@ conn_status_changed_cb (GabbleConnection *conn,
               priv->socks5_potential_proxies, g_strdup (jids[i]));
         }
 
-      /* randomize the list to not always use the same proxies */
-      priv->socks5_potential_proxies = randomize_g_slist (
-              priv->socks5_potential_proxies);
+      /* query the ones which worked best in the past first */
+      priv->socks5_potential_proxies = rank_potential_proxies (self,
+          priv->socks5_potential_proxies);
 
       priv->next_query = priv->socks5_potential_proxies;
 
@@ -723,6 +768,12 @@ gabble_bytestream_factory_dispose (GObject *object)
   g_slist_free (priv->socks5_potential_proxies);
   priv->socks5_potential_proxies = NULL;
 
+  if (priv->proxy_stats != NULL)
+    {
+      g_object_unref (priv->proxy_stats);
+      priv->proxy_stats = NULL;
+    }
+
   if (G_OBJECT_CLASS (gabble_bytestream_factory_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_bytestream_factory_parent_class)->dispose (object);
 }
@@ -2253,12 +2304,63 @@ gabble_bytestream_factory_make_multi_accept_iq (const gchar *full_jid,
   return msg;
 }
 
+static gint
+cmp_proxy_cost (gconstpointer a,
+    gconstpointer b,
+    gpointer user_data)
+{
+  const GabbleSocks5Proxy *proxy_a = a;
+  const GabbleSocks5Proxy *proxy_b = b;
+
+  return gabble_proxy_stats_compare (user_data, proxy_a->jid, proxy_b->jid);
+}
+
+/* Returns the known proxies, best first */
 GSList *
 gabble_bytestream_factory_get_socks5_proxies (GabbleBytestreamFactory *self)
 {
   GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
       self);
+  GSList *proxies;
 
-  return g_slist_concat (g_slist_copy (priv->socks5_proxies),
+  proxies = g_slist_concat (g_slist_copy (priv->socks5_proxies),
       g_slist_copy (priv->socks5_fallback_proxies));
+
+  /* Discovered proxies stay ahead of fallback ones with the same cost */
+  return g_slist_sort_with_data (proxies, cmp_proxy_cost, priv->proxy_stats);
+}
+
+static gboolean
+proxy_list_contains (GSList *list,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port)
+{
+  GSList *l;
+
+  for (l = list; l != NULL; l = g_slist_next (l))
+    {
+      GabbleSocks5Proxy *proxy = l->data;
+
+      if (!tp_strdiff (proxy->jid, jid) && !tp_strdiff (proxy->host, host) &&
+          proxy->port == port)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Whether @jid at @host:@port is one of the proxies we found ourselves,
+ * rather than one a peer has told us about */
+gboolean
+gabble_bytestream_factory_is_socks5_proxy (GabbleBytestreamFactory *self,
+    const gchar *jid,
+    const gchar *host,
+    guint16 port)
+{
+  GabbleBytestreamFactoryPrivate *priv = GABBLE_BYTESTREAM_FACTORY_GET_PRIVATE (
+      self);
+
+  return proxy_list_contains (priv->socks5_proxies, jid, host, port) ||
+      proxy_list_contains (priv->socks5_fallback_proxies, jid, host, port);
 }
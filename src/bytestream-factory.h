@@ -107,6 +107,10 @@ gchar *gabble_bytestream_factory_generate_stream_id (void);
 GSList *gabble_bytestream_factory_get_socks5_proxies (
     GabbleBytestreamFactory *self);
 
+gboolean gabble_bytestream_factory_is_socks5_proxy (
+    GabbleBytestreamFactory *self, const gchar *jid, const gchar *host,
+    guint16 port);
+
 void gabble_bytestream_factory_query_socks5_proxies (
     GabbleBytestreamFactory *self);
 
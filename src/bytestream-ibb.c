@@ -29,6 +29,7 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_BYTESTREAM
 
+#include "base64.h"
 #include "bytestream-factory.h"
 #include "bytestream-iface.h"
 #include "connection.h"
@@ -59,14 +60,38 @@ enum
   PROP_STATE,
   PROP_PROTOCOL,
   PROP_BLOCK_SIZE,
+  PROP_WINDOW_SIZE,
+  PROP_THROUGHPUT,
   LAST_PROPERTY
 };
 
 #define READ_BUFFER_MAX_SIZE (512 * 1024)
 
-/* the number of not acked stanzas allowed. Once this number reached, we stop
- * sending and wait for acks. */
-#define WINDOW_SIZE 10
+/* The block size we propose when initiating a stream. If the peer replies
+ * with <resource-constraint/>, we retry with FALLBACK_BLOCK_SIZE, which is
+ * what we always used to propose. XEP-0047 caps block sizes at 65535. */
+#define DEFAULT_BLOCK_SIZE (16 * 1024)
+#define FALLBACK_BLOCK_SIZE 4096
+
+/* The number of not acked stanzas allowed. Once this number is reached, we
+ * stop sending and wait for acks. The window starts at INITIAL_WINDOW_SIZE
+ * and adapts to how promptly acks arrive: it grows while acks keep coming
+ * back within SLOW_ACK_FACTOR times the fastest round-trip we've seen, and
+ * halves (at most once per round-trip) when they don't, which is what
+ * happens once the server starts queueing our stanzas. */
+#define INITIAL_WINDOW_SIZE 10
+#define MIN_WINDOW_SIZE 2
+#define MAX_WINDOW_SIZE 64
+#define SLOW_ACK_FACTOR 2
+
+/* How often, in microseconds, we update the throughput estimate */
+#define THROUGHPUT_INTERVAL G_USEC_PER_SEC
+
+typedef struct {
+  /* when we queued the stanza, until the porter starts writing it */
+  gint64 sent_at;
+  guint len;
+} SentStanza;
 
 struct _GabbleBytestreamIBBPrivate
 {
@@ -90,12 +115,34 @@ struct _GabbleBytestreamIBBPrivate
   /* list of reffed (WockyStanza *) */
   GSList *received_stanzas_not_acked;
 
-  /* (WockyStanza *) -> TRUE
+  /* (WockyStanza *) -> owned (SentStanza *)
    * We don't keep a ref on the WockyStanza as we just use this table to track
    * stanzas waiting for reply. The stanza is never used (and so deferenced). */
   GHashTable *sent_stanzas_not_acked;
+  /* reffed, once we've sent data; we watch it to see when our stanzas are
+   * actually written */
+  WockyPorter *porter;
+  gulong sending_id;
+
+  /* congestion control; see INITIAL_WINDOW_SIZE */
+  guint window_size;
+  guint slow_start_threshold;
+  guint acks_since_growth;
+  gint64 min_rtt;
+  gint64 srtt;
+  gint64 last_backoff;
+
+  /* bytes acked since throughput_since, and the resulting estimate in
+   * bytes per second */
+  guint64 acked_bytes;
+  gint64 throughput_since;
+  guint throughput;
+
   GString *write_buffer;
   gboolean write_blocked;
+  /* scratch space for the base64 payload of outgoing stanzas */
+  gchar *encode_buffer;
+  gsize encode_buffer_size;
 
   gboolean dispose_has_run;
 };
@@ -113,10 +160,14 @@ gabble_bytestream_ibb_init (GabbleBytestreamIBB *self)
   priv->read_buffer = NULL;
   priv->received_stanzas_not_acked = NULL;
 
-  priv->sent_stanzas_not_acked = g_hash_table_new (g_direct_hash,
-      g_direct_equal);
+  priv->sent_stanzas_not_acked = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, g_free);
   priv->write_buffer = NULL;
   priv->write_blocked = FALSE;
+
+  priv->window_size = INITIAL_WINDOW_SIZE;
+  priv->slow_start_threshold = MAX_WINDOW_SIZE;
+  priv->min_rtt = G_MAXINT64;
 }
 
 static void
@@ -142,6 +193,12 @@ gabble_bytestream_ibb_dispose (GObject *object)
       priv->close_iq_to_ack = NULL;
     }
 
+  if (priv->porter != NULL)
+    {
+      g_signal_handler_disconnect (priv->porter, priv->sending_id);
+      tp_clear_object (&priv->porter);
+    }
+
   G_OBJECT_CLASS (gabble_bytestream_ibb_parent_class)->dispose (object);
 }
 
@@ -162,6 +219,8 @@ gabble_bytestream_ibb_finalize (GObject *object)
   if (priv->write_buffer != NULL)
     g_string_free (priv->write_buffer, TRUE);
 
+  g_free (priv->encode_buffer);
+
   g_hash_table_unref (priv->sent_stanzas_not_acked);
 
   G_OBJECT_CLASS (gabble_bytestream_ibb_parent_class)->finalize (object);
@@ -208,6 +267,12 @@ gabble_bytestream_ibb_get_property (GObject *object,
       case PROP_BLOCK_SIZE:
         g_value_set_uint (value, priv->block_size);
         break;
+      case PROP_WINDOW_SIZE:
+        g_value_set_uint (value, priv->window_size);
+        break;
+      case PROP_THROUGHPUT:
+        g_value_set_uint (value, priv->throughput);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -345,10 +410,29 @@ gabble_bytestream_ibb_class_init (
       "block-size",
       "block size",
       "Maximum data sent using one stanza as described in XEP-0047",
-      0, G_MAXUINT32, 4096,
+      0, G_MAXUINT32, DEFAULT_BLOCK_SIZE,
       G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_BLOCK_SIZE,
       param_spec);
+
+  param_spec = g_param_spec_uint (
+      "window-size",
+      "window size",
+      "The number of data stanzas we currently allow to be waiting for an "
+      "ack",
+      0, G_MAXUINT32, INITIAL_WINDOW_SIZE,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_WINDOW_SIZE,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "throughput",
+      "throughput",
+      "Recently achieved sending throughput, in bytes per second",
+      0, G_MAXUINT32, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_THROUGHPUT,
+      param_spec);
 }
 
 static void
@@ -399,6 +483,67 @@ send_close_stanza (GabbleBytestreamIBB *self)
 static guint
 send_data (GabbleBytestreamIBB *self, const gchar *str, guint len);
 
+static void
+update_window (GabbleBytestreamIBB *self,
+    const SentStanza *stanza)
+{
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  gint64 now = g_get_monotonic_time ();
+  gint64 rtt = now - stanza->sent_at;
+  guint old_window_size = priv->window_size;
+
+  priv->min_rtt = MIN (priv->min_rtt, rtt);
+  priv->srtt = (priv->srtt == 0) ? rtt : (7 * priv->srtt + rtt) / 8;
+
+  if (rtt > SLOW_ACK_FACTOR * priv->min_rtt)
+    {
+      /* Acks are slowing down, so the server is probably queueing our
+       * stanzas; back off, but only once per round-trip as the rest of the
+       * stanzas in flight will have been delayed too. */
+      if (now - priv->last_backoff > priv->srtt)
+        {
+          priv->window_size = MAX (priv->window_size / 2, MIN_WINDOW_SIZE);
+          priv->slow_start_threshold = priv->window_size;
+          priv->acks_since_growth = 0;
+          priv->last_backoff = now;
+        }
+    }
+  else if (priv->window_size < priv->slow_start_threshold)
+    {
+      priv->window_size++;
+    }
+  else if (++priv->acks_since_growth >= priv->window_size)
+    {
+      priv->window_size++;
+      priv->acks_since_growth = 0;
+    }
+
+  priv->window_size = MIN (priv->window_size, MAX_WINDOW_SIZE);
+
+  if (priv->window_size != old_window_size)
+    {
+      DEBUG ("window size %u -> %u (rtt %" G_GINT64_FORMAT " ms, min %"
+          G_GINT64_FORMAT " ms)", old_window_size, priv->window_size,
+          rtt / 1000, priv->min_rtt / 1000);
+      g_object_notify (G_OBJECT (self), "window-size");
+    }
+
+  priv->acked_bytes += stanza->len;
+
+  if (priv->throughput_since == 0)
+    {
+      priv->throughput_since = stanza->sent_at;
+    }
+  else if (now - priv->throughput_since >= THROUGHPUT_INTERVAL)
+    {
+      priv->throughput = priv->acked_bytes * G_USEC_PER_SEC /
+          (now - priv->throughput_since);
+      priv->acked_bytes = 0;
+      priv->throughput_since = now;
+      g_object_notify (G_OBJECT (self), "throughput");
+    }
+}
+
 static void
 iq_reply_cb (
     GObject *source,
@@ -412,6 +557,7 @@ iq_reply_cb (
   gpointer sent_msg = tp_weak_ref_get_user_data (weak_ref);
   GabbleBytestreamIBBPrivate *priv;
   GError *error = NULL;
+  gboolean acked;
 
   tp_weak_ref_destroy (weak_ref);
 
@@ -420,10 +566,24 @@ iq_reply_cb (
     return;
 
   priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  acked = conn_util_send_iq_finish (GABBLE_CONNECTION (source), result, NULL,
+      &error);
+
+  if (acked)
+    {
+      SentStanza *sent_stanza = g_hash_table_lookup (
+          priv->sent_stanzas_not_acked, sent_msg);
+
+      if (sent_stanza != NULL)
+        update_window (self, sent_stanza);
+    }
+
   g_hash_table_remove (priv->sent_stanzas_not_acked, sent_msg);
 
-  if (!conn_util_send_iq_finish (GABBLE_CONNECTION (source), result, NULL, &error))
+  if (!acked)
     {
+      /* IBB has no way to retransmit a single stanza, so whatever the error
+       * was, the stream is now broken. */
       DEBUG ("error sending IBB stanza: %s #%u '%s'. Closing the bytestream",
           g_quark_to_string (error->domain), error->code, error->message);
       g_clear_error (&error);
@@ -466,6 +626,28 @@ iq_reply_cb (
   g_object_unref (self);
 }
 
+/* Our stanzas may wait in the porter's queue behind each other (or anything
+ * else the connection is sending), which says nothing about the network, so
+ * round-trips are timed from when the porter starts writing each one. */
+static void
+porter_sending_cb (WockyPorter *porter,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  GabbleBytestreamIBB *self = user_data;
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
+  SentStanza *sent_stanza;
+
+  /* NULL means whitespace keepalive */
+  if (stanza == NULL)
+    return;
+
+  sent_stanza = g_hash_table_lookup (priv->sent_stanzas_not_acked, stanza);
+
+  if (sent_stanza != NULL)
+    sent_stanza->sent_at = g_get_monotonic_time ();
+}
+
 static guint
 send_data (GabbleBytestreamIBB *self,
            const gchar *str,
@@ -474,19 +656,28 @@ send_data (GabbleBytestreamIBB *self,
   GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
   guint sent, stanza_count;
 
+  if (priv->porter == NULL)
+    {
+      priv->porter = g_object_ref (
+          wocky_session_get_porter (priv->conn->session));
+      priv->sending_id = g_signal_connect (priv->porter, "sending",
+          G_CALLBACK (porter_sending_cb), self);
+    }
+
   sent = 0;
   stanza_count = 0;
   while (sent < len)
     {
       WockyStanza *iq;
       guint send_now, remaining;
-      gchar *seq, *encoded;
+      gchar *seq;
       guint nb_stanzas_waiting;
+      SentStanza *sent_stanza;
 
       remaining = (len - sent);
 
       nb_stanzas_waiting = g_hash_table_size (priv->sent_stanzas_not_acked);
-      if (nb_stanzas_waiting >= WINDOW_SIZE)
+      if (nb_stanzas_waiting >= priv->window_size)
         {
           DEBUG ("Window is full (%u). Stop sending stanzas",
               nb_stanzas_waiting);
@@ -505,28 +696,40 @@ send_data (GabbleBytestreamIBB *self,
           send_now = remaining;
         }
 
-      encoded = g_base64_encode ((const guchar *) str + sent, send_now);
+      if (priv->encode_buffer_size < GABBLE_BASE64_ENCODED_LEN (send_now) + 1)
+        {
+          priv->encode_buffer_size =
+              GABBLE_BASE64_ENCODED_LEN (priv->block_size) + 1;
+          priv->encode_buffer = g_realloc (priv->encode_buffer,
+              priv->encode_buffer_size);
+        }
+
+      gabble_base64_encode_to ((const guchar *) str + sent, send_now,
+          priv->encode_buffer);
       seq = g_strdup_printf ("%u", priv->seq++);
 
       iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_SET,
           NULL, priv->peer_jid,
           '(', "data",
-            '$', encoded,
+            '$', priv->encode_buffer,
             ':', NS_IBB,
             '@', "sid", priv->stream_id,
             '@', "seq", seq,
           ')', NULL);
 
+      /* The porter may start writing the stanza straight away, so this has
+       * to be in place first */
+      sent_stanza = g_new (SentStanza, 1);
+      sent_stanza->sent_at = g_get_monotonic_time ();
+      sent_stanza->len = send_now;
+      g_hash_table_insert (priv->sent_stanzas_not_acked, iq, sent_stanza);
+
       conn_util_send_iq_async (priv->conn, iq, NULL,
           iq_reply_cb, tp_weak_ref_new (self, iq, NULL));
 
-      g_free (encoded);
       g_free (seq);
       g_object_unref (iq);
 
-      g_hash_table_insert (priv->sent_stanzas_not_acked, iq,
-          GUINT_TO_POINTER (TRUE));
-
       DEBUG ("send %d bytes (window size: %u)", send_now,
           nb_stanzas_waiting + 1);
 
@@ -599,6 +802,16 @@ gabble_bytestream_ibb_send (GabbleBytestreamIface *iface,
   return TRUE;
 }
 
+static void
+emit_data_received (GabbleBytestreamIBB *self,
+                    TpHandle sender,
+                    GString *str)
+{
+  GibberBuffer received = { (const guint8 *) str->str, str->len };
+
+  g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, &received);
+}
+
 void
 gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
                                WockyStanza *msg,
@@ -607,8 +820,6 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
   GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
   WockyNode *data;
   GString *str;
-  guchar *st;
-  gsize outlen;
   TpHandle sender;
 
   /* caller must have checked for this in order to know which bytestream to
@@ -634,12 +845,9 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
 
   /* FIXME: check sequence number */
 
-  st = g_base64_decode (data->content, &outlen);
-  str = g_string_new_len ((gchar *) st, outlen);
-  g_free (st);
-  if (str == NULL)
+  if (data->content == NULL)
     {
-      DEBUG ("base64 decoding failed");
+      DEBUG ("data stanza has no payload");
       if (is_iq)
         wocky_porter_send_iq_error (
             wocky_session_get_porter (priv->conn->session), msg,
@@ -647,6 +855,8 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
       return;
     }
 
+  str = gabble_base64_decode_to_string (data->content);
+
   if (priv->read_blocked)
     {
       gsize current_buffer_len = 0;
@@ -688,7 +898,7 @@ gabble_bytestream_ibb_receive (GabbleBytestreamIBB *self,
       return;
     }
 
-  g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, str);
+  emit_data_received (self, sender, str);
   g_string_free (str, TRUE);
 
   if (is_iq)
@@ -821,6 +1031,8 @@ gabble_bytestream_ibb_close (GabbleBytestreamIface *iface,
     }
 }
 
+static gboolean gabble_bytestream_ibb_initiate (GabbleBytestreamIface *iface);
+
 static void
 ibb_init_reply_cb (GabbleConnection *conn,
                    WockyStanza *sent_msg,
@@ -829,6 +1041,7 @@ ibb_init_reply_cb (GabbleConnection *conn,
                    gpointer user_data)
 {
   GabbleBytestreamIBB *self = GABBLE_BYTESTREAM_IBB (obj);
+  GabbleBytestreamIBBPrivate *priv = GABBLE_BYTESTREAM_IBB_GET_PRIVATE (self);
   GError *error = NULL;
 
   if (!wocky_stanza_extract_errors (reply_msg, NULL, &error, NULL, NULL))
@@ -837,6 +1050,19 @@ ibb_init_reply_cb (GabbleConnection *conn,
       DEBUG ("IBB stream initiated");
       g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
     }
+  else if (g_error_matches (error, WOCKY_XMPP_ERROR,
+          WOCKY_XMPP_ERROR_RESOURCE_CONSTRAINT) &&
+      priv->block_size > FALLBACK_BLOCK_SIZE)
+    {
+      /* XEP-0047 says this means the peer wants smaller chunks */
+      DEBUG ("peer rejected block size %u; retrying with %u",
+          priv->block_size, FALLBACK_BLOCK_SIZE);
+      g_clear_error (&error);
+      priv->block_size = FALLBACK_BLOCK_SIZE;
+
+      if (!gabble_bytestream_ibb_initiate (GABBLE_BYTESTREAM_IFACE (self)))
+        g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_CLOSED, NULL);
+    }
   else
     {
       DEBUG ("error during IBB initiation: %s", error->message);
@@ -910,8 +1136,7 @@ gabble_bytestream_ibb_block_reading (GabbleBytestreamIface *iface,
 
       DEBUG ("Bytestream unblocked, flushing the buffer");
 
-      g_signal_emit_by_name (G_OBJECT (self), "data-received",
-          priv->peer_handle, priv->read_buffer);
+      emit_data_received (self, priv->peer_handle, priv->read_buffer);
 
       g_string_free (priv->read_buffer, TRUE);
       priv->read_buffer = NULL;
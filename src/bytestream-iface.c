@@ -133,6 +133,8 @@ gabble_bytestream_iface_base_init (gpointer klass)
           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
       g_object_interface_install_property (klass, param_spec);
 
+      /* The data is a const GibberBuffer * which is only valid for the
+       * duration of the emission; handlers which keep it must copy it. */
       g_signal_new ("data-received",
           G_TYPE_FROM_INTERFACE (klass),
           G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
@@ -180,6 +182,25 @@ gabble_bytestream_iface_block_reading (GabbleBytestreamIface *self,
   /* else: do nothing. Some bytestreams like IBB can't implement read_block. */
 }
 
+/*
+ * gabble_bytestream_iface_get_raw_transport:
+ *
+ * Returns: (transfer none): the transport over which the bytestream's data
+ *  currently flows unframed, so that it may be relayed directly to or from
+ *  another socket, or %NULL if there is no such transport.
+ */
+GibberFdTransport *
+gabble_bytestream_iface_get_raw_transport (GabbleBytestreamIface *self)
+{
+  GibberFdTransport * (*virtual_method)(GabbleBytestreamIface *) =
+    GABBLE_BYTESTREAM_IFACE_GET_CLASS (self)->get_raw_transport;
+
+  if (virtual_method == NULL)
+    return NULL;
+
+  return virtual_method (self);
+}
+
 GType
 gabble_bytestream_iface_get_type (void)
 {
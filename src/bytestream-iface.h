@@ -23,6 +23,8 @@
 #include <glib-object.h>
 #include <wocky/wocky.h>
 
+#include <gibber/gibber-fd-transport.h>
+
 G_BEGIN_DECLS
 
 typedef enum
@@ -58,6 +60,8 @@ struct _GabbleBytestreamIfaceClass {
   void (*accept) (GabbleBytestreamIface *bytestream,
       GabbleBytestreamAugmentSiAcceptReply func, gpointer user_data);
   void (*block_reading) (GabbleBytestreamIface *bytestream, gboolean block);
+  GibberFdTransport * (*get_raw_transport) (
+      GabbleBytestreamIface *bytestream);
 };
 
 GType gabble_bytestream_iface_get_type (void);
@@ -88,6 +92,9 @@ void gabble_bytestream_iface_accept (GabbleBytestreamIface *bytestream,
 void gabble_bytestream_iface_block_reading (GabbleBytestreamIface *bytestream,
     gboolean block);
 
+GibberFdTransport *gabble_bytestream_iface_get_raw_transport (
+    GabbleBytestreamIface *bytestream);
+
 G_END_DECLS
 
 #endif /* #ifndef __GABBLE_BYTESTREAM_IFACE_H__ */
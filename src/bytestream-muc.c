@@ -29,6 +29,7 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_BYTESTREAM
 
+#include "base64.h"
 #include "bytestream-factory.h"
 #include "bytestream-iface.h"
 #include "connection.h"
@@ -38,8 +39,13 @@
 #include "util.h"
 
 /* 45k gives us 60k after base64 encoding, allowing 4k of header before we hit
- * ejabberd's default 64k maximum stanza size */
-#define MAX_BLOCK_SIZE (1024 * 45)
+ * ejabberd's default 64k maximum stanza size. We use that unless the server
+ * tells us its actual limit is lower: the other occupants' servers see the
+ * same stanzas, so a higher limit on ours doesn't mean they'd accept them. */
+#define DEFAULT_BLOCK_SIZE (1024 * 45)
+#define STANZA_HEADER_SIZE (1024 * 4)
+/* The smallest block we'll send, however low the server's limit */
+#define MIN_BLOCK_SIZE 1024
 
 static void
 bytestream_iface_init (gpointer g_iface, gpointer iface_data);
@@ -70,7 +76,8 @@ struct _GabbleBytestreamMucPrivate
   gchar *stream_id;
   GabbleBytestreamState state;
   const gchar *peer_jid;
-  /* (gchar *): sender's muc-JID -> (GString *): accumulated message data */
+  /* (gchar *): sender's muc-JID -> (GString *): accumulated message data,
+   * into which each fragment is decoded in turn */
   GHashTable *buffers;
 
   gboolean dispose_has_run;
@@ -270,6 +277,25 @@ enum
   FRAG_LAST
 };
 
+/* The largest block we can send in one stanza without going over the
+ * server's stanza size limit once it's base64-encoded, if that's smaller than
+ * the default */
+static guint
+get_block_size (GabbleBytestreamMuc *self)
+{
+  GabbleBytestreamMucPrivate *priv = GABBLE_BYTESTREAM_MUC_GET_PRIVATE (self);
+  guint max_stanza_size = priv->conn->max_stanza_size;
+
+  if (max_stanza_size == 0)
+    return DEFAULT_BLOCK_SIZE;
+
+  if (max_stanza_size <= STANZA_HEADER_SIZE)
+    return MIN_BLOCK_SIZE;
+
+  return MAX (MIN_BLOCK_SIZE,
+      MIN (DEFAULT_BLOCK_SIZE, (max_stanza_size - STANZA_HEADER_SIZE) / 4 * 3));
+}
+
 static gboolean
 send_data_to (GabbleBytestreamMuc *self,
               const gchar *to,
@@ -280,6 +306,8 @@ send_data_to (GabbleBytestreamMuc *self,
   GabbleBytestreamMucPrivate *priv = GABBLE_BYTESTREAM_MUC_GET_PRIVATE (self);
   guint sent, stanza_count;
   guint frag;
+  guint block_size;
+  gchar *encoded;
 
   if (priv->state != GABBLE_BYTESTREAM_STATE_OPEN)
     {
@@ -290,11 +318,13 @@ send_data_to (GabbleBytestreamMuc *self,
 
   sent = 0;
   stanza_count = 0;
+  block_size = get_block_size (self);
+  /* reused for every fragment */
+  encoded = g_malloc (GABBLE_BASE64_ENCODED_LEN (MIN (len, block_size)) + 1);
 
   while (sent < len)
     {
       gboolean ret;
-      gchar *encoded;
       guint send_now;
       GError *error = NULL;
       WockyStanza *msg;
@@ -318,10 +348,10 @@ send_data_to (GabbleBytestreamMuc *self,
               "type", "groupchat");
         }
 
-      if ((len - sent) > MAX_BLOCK_SIZE)
+      if ((len - sent) > block_size)
         {
           /* We can't send all the remaining data in one stanza */
-          send_now = MAX_BLOCK_SIZE;
+          send_now = block_size;
 
           if (stanza_count == 0)
             frag = FRAG_FIRST;
@@ -339,7 +369,8 @@ send_data_to (GabbleBytestreamMuc *self,
             frag = FRAG_LAST;
         }
 
-      encoded = g_base64_encode ((const guchar *) str + sent, send_now);
+      gabble_base64_encode_to ((const guchar *) str + sent, send_now,
+          encoded);
       wocky_node_set_content (data, encoded);
 
       switch (frag)
@@ -358,13 +389,12 @@ send_data_to (GabbleBytestreamMuc *self,
       DEBUG ("send %d bytes", send_now);
       ret = _gabble_connection_send (priv->conn, msg, &error);
 
-      g_free (encoded);
-
       if (!ret)
         {
           DEBUG ("error sending pseusdo IBB Muc stanza: %s", error->message);
           g_error_free (error);
           g_object_unref (msg);
+          g_free (encoded);
           return FALSE;
         }
 
@@ -374,6 +404,8 @@ send_data_to (GabbleBytestreamMuc *self,
       g_object_unref (msg);
     }
 
+  g_free (encoded);
+
   DEBUG ("finished to send %d bytes (%d stanzas needed)", len, stanza_count);
 
   return TRUE;
@@ -395,6 +427,21 @@ gabble_bytestream_muc_send (GabbleBytestreamIface *iface,
   return send_data_to (self, priv->peer_jid, TRUE, len, str);
 }
 
+/* Decodes @text onto the end of @buffer */
+static void
+append_decoded (GString *buffer,
+    const gchar *text)
+{
+  gsize len = strlen (text);
+  gsize old_len = buffer->len;
+  gsize decoded;
+
+  g_string_set_size (buffer, old_len + GABBLE_BASE64_DECODED_MAX_LEN (len));
+  decoded = gabble_base64_decode_to (text, len,
+      (guchar *) buffer->str + old_len);
+  g_string_truncate (buffer, old_len + decoded);
+}
+
 void
 gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
                                WockyStanza *msg)
@@ -404,9 +451,7 @@ gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
       (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
   const gchar *from;
   WockyNode *data;
-  GString *str;
-  guchar *st;
-  gsize outlen;
+  GString *str = NULL;
   TpHandle sender;
   GString *buffer;
   const gchar *frag_val;
@@ -455,12 +500,9 @@ gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
       return;
     }
 
-  st = g_base64_decode (data->content, &outlen);
-  str = g_string_new_len ((const gchar *) st, outlen);
-  g_free (st);
-  if (str == NULL)
+  if (data->content == NULL)
     {
-      DEBUG ("base64 decoding failed");
+      DEBUG ("data stanza has no payload");
       return;
     }
 
@@ -475,11 +517,14 @@ gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
           g_hash_table_remove (priv->buffers, from);
         }
 
+      str = gabble_base64_decode_to_string (data->content);
       fully_received = TRUE;
     }
 
   else if (frag == FRAG_FIRST)
     {
+      gsize len = strlen (data->content);
+
       if (buffer != NULL)
         {
           DEBUG ("Drop incomplete buffer of %s. "
@@ -491,46 +536,49 @@ gabble_bytestream_muc_receive (GabbleBytestreamMuc *self,
           DEBUG ("New buffer for %s", from);
         }
 
-      g_hash_table_insert (priv->buffers, g_strdup (from), str);
+      /* There's at least one more fragment of the same size to come; the
+       * buffer will grow geometrically if there are more. */
+      buffer = g_string_sized_new (2 * GABBLE_BASE64_DECODED_MAX_LEN (len));
+      append_decoded (buffer, data->content);
+      g_hash_table_insert (priv->buffers, g_strdup (from), buffer);
     }
 
-  else if (frag == FRAG_MIDDLE)
+  else if (buffer == NULL)
     {
-      if (buffer == NULL)
-        {
-          DEBUG ("Drop middle part stanza from %s, first parts not buffered",
-              from);
-        }
-      else
-        {
-          DEBUG ("Append data to buffer of %s (%" G_GSIZE_FORMAT " bytes)", from, str->len);
-          g_string_append_len (buffer, str->str, str->len);
-        }
+      DEBUG ("Drop %s part stanza from %s, first parts not buffered",
+          frag == FRAG_MIDDLE ? "middle" : "last", from);
+    }
 
-      g_string_free (str, TRUE);
+  else if (frag == FRAG_MIDDLE)
+    {
+      append_decoded (buffer, data->content);
+      DEBUG ("Appended data to buffer of %s (now %" G_GSIZE_FORMAT " bytes)",
+          from, buffer->len);
     }
 
   else if (frag == FRAG_LAST)
     {
-      if (buffer == NULL)
-          {
-            DEBUG ("Drop last part stanza from %s, first parts not buffered",
-                from);
-            g_string_free (str, TRUE);
-          }
-      else
-        {
-          DEBUG ("Received last part from %s, buffer flushed", from);
-          g_string_prepend_len (str, buffer->str, buffer->len);
-          g_hash_table_remove (priv->buffers, from);
-          fully_received = TRUE;
-        }
+      gpointer key;
+
+      append_decoded (buffer, data->content);
+      DEBUG ("Received last part from %s, buffer flushed", from);
+
+      /* Take the buffer out of the table without freeing it */
+      g_hash_table_lookup_extended (priv->buffers, from, &key, NULL);
+      g_hash_table_steal (priv->buffers, from);
+      g_free (key);
+
+      str = buffer;
+      fully_received = TRUE;
     }
 
   if (fully_received)
     {
+      GibberBuffer received = { (const guint8 *) str->str, str->len };
+
       DEBUG ("fully received %" G_GSIZE_FORMAT " bytes of data", str->len);
-      g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, str);
+      g_signal_emit_by_name (G_OBJECT (self), "data-received", sender,
+          &received);
       g_string_free (str, TRUE);
     }
 }
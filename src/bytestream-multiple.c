@@ -485,13 +485,13 @@ gabble_bytestream_multiple_initiate (GabbleBytestreamIface *iface)
 static void
 bytestream_data_received_cb (GabbleBytestreamIface *bytestream,
                              TpHandle sender,
-                             GString *str,
+                             const GibberBuffer *data,
                              gpointer user_data)
 {
   GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (user_data);
 
   /* Just forward the data */
-  g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, str);
+  g_signal_emit_by_name (G_OBJECT (self), "data-received", sender, data);
 }
 
 static void
@@ -651,6 +651,19 @@ gabble_bytestream_multiple_block_reading (GabbleBytestreamIface *iface,
   gabble_bytestream_iface_block_reading (priv->active_bytestream, block);
 }
 
+static GibberFdTransport *
+gabble_bytestream_multiple_get_raw_transport (GabbleBytestreamIface *iface)
+{
+  GabbleBytestreamMultiple *self = GABBLE_BYTESTREAM_MULTIPLE (iface);
+  GabbleBytestreamMultiplePrivate *priv =
+    GABBLE_BYTESTREAM_MULTIPLE_GET_PRIVATE (self);
+
+  if (priv->active_bytestream == NULL)
+    return NULL;
+
+  return gabble_bytestream_iface_get_raw_transport (priv->active_bytestream);
+}
+
 static void
 bytestream_iface_init (gpointer g_iface,
                        gpointer iface_data)
@@ -662,4 +675,5 @@ bytestream_iface_init (gpointer g_iface,
   klass->close = gabble_bytestream_multiple_close;
   klass->accept = gabble_bytestream_multiple_accept;
   klass->block_reading = gabble_bytestream_multiple_block_reading;
+  klass->get_raw_transport = gabble_bytestream_multiple_get_raw_transport;
 }
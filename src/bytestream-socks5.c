@@ -48,6 +48,7 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include <gibber/gibber-fd-transport.h>
 #include <gibber/gibber-transport.h>
 #include <gibber/gibber-tcp-transport.h>
 #include <gibber/gibber-listener.h>
@@ -62,6 +63,7 @@
 #include "disco.h"
 #include "gabble-signals-marshal.h"
 #include "namespaces.h"
+#include "proxy-stats.h"
 #include "util.h"
 
 static void
@@ -123,6 +125,11 @@ typedef enum _Socks5State Socks5State;
 #define CONNECT_REPLY_TIMEOUT 30
 #define CONNECT_TIMEOUT 10
 
+/* As a target, we don't wait for one streamhost to fail before trying the
+ * next: a new attempt is started every STREAMHOST_ATTEMPT_DELAY ms, and we
+ * use whichever completes the SOCKS5 handshake first. */
+#define STREAMHOST_ATTEMPT_DELAY 500
+
 struct _Streamhost
 {
   gchar *jid;
@@ -161,6 +168,50 @@ streamhost_free (Streamhost *streamhost)
   g_slice_free (Streamhost, streamhost);
 }
 
+/* Tell the shared proxy statistics how long it took to connect to @jid */
+static void
+record_proxy_connect_time (const gchar *jid,
+                           gint64 started)
+{
+  GabbleProxyStats *stats = gabble_proxy_stats_dup_shared ();
+
+  gabble_proxy_stats_add_connect_time (stats, jid,
+      (guint) ((g_get_monotonic_time () - started) / 1000));
+  g_object_unref (stats);
+}
+
+/* Tell the shared proxy statistics whether using @jid worked */
+static void
+record_proxy_result (const gchar *jid,
+                     gboolean success)
+{
+  GabbleProxyStats *stats = gabble_proxy_stats_dup_shared ();
+
+  gabble_proxy_stats_add_result (stats, jid, success);
+  g_object_unref (stats);
+}
+
+/* A SOCKS5 connection which the bytestream may or may not end up using. As
+ * a target, it's an attempt to connect to one of the streamhosts offered to
+ * us; as the initiator, it's a connection the target made to our own
+ * streamhost, and streamhost is NULL. Several of these can be in progress
+ * at once. */
+typedef struct
+{
+  GabbleBytestreamSocks5 *self;
+  /* borrowed from priv->streamhosts */
+  Streamhost *streamhost;
+  GibberTransport *transport;
+  /* one of the SOCKS5_STATE_TARGET_* states as a target; as the initiator,
+   * one of the SOCKS5_STATE_INITIATOR_AWAITING_* states, then
+   * SOCKS5_STATE_CONNECTED once we've answered the CONNECT command */
+  Socks5State state;
+  GString *read_buffer;
+  guint timer_id;
+  /* monotonic time at which we started connecting */
+  gint64 started;
+} Candidate;
+
 struct _GabbleBytestreamSocks5Private
 {
   GabbleConnection *conn;
@@ -177,6 +228,13 @@ struct _GabbleBytestreamSocks5Private
 
   /* List of Streamhost */
   GSList *streamhosts;
+  /* As a target, the first streamhost in priv->streamhosts we haven't
+   * tried yet. The (Candidate *) connections currently in progress; as a
+   * target, only the one we sent the CONNECT command on is left once we
+   * have. */
+  GSList *next_streamhost;
+  GSList *candidates;
+  guint next_candidate_timer;
 
   /* Connections to streamhosts are async, so we keep the IQ set message
    * around */
@@ -188,8 +246,18 @@ struct _GabbleBytestreamSocks5Private
   gboolean read_blocked;
   GibberListener *listener;
   guint timer_id;
-
+  /* As an initiator, the monotonic time at which we started connecting to
+   * priv->proxy_jid */
+  gint64 connect_started;
+
+  /* Data received from the transport which hasn't been processed yet. The
+   * first read_offset bytes have already been used; rather than memmoving
+   * the rest down after each handshake message, we just truncate the buffer
+   * once it's been entirely consumed. Once the stream is connected and this
+   * is empty, reads are passed to data-received straight from the
+   * transport without being copied here. */
   GString *read_buffer;
+  gsize read_offset;
 
   gboolean dispose_has_run;
 };
@@ -197,6 +265,7 @@ struct _GabbleBytestreamSocks5Private
 #define GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE(obj) ((obj)->priv)
 
 static void socks5_connect (GabbleBytestreamSocks5 *self);
+static void cancel_candidates (GabbleBytestreamSocks5 *self);
 
 static void gabble_bytestream_socks5_close (GabbleBytestreamIface *iface,
     GError *error);
@@ -241,6 +310,7 @@ gabble_bytestream_socks5_dispose (GObject *object)
   priv->dispose_has_run = TRUE;
 
   stop_timer (self);
+  cancel_candidates (self);
 
   if (priv->bytestream_state != GABBLE_BYTESTREAM_STATE_CLOSED)
     {
@@ -472,6 +542,9 @@ gabble_bytestream_socks5_class_init (
       param_spec);
 }
 
+/* The only authentication method we support is SOCKS5_AUTH_NONE */
+static const guint8 auth_request[] = { SOCKS5_VERSION, 1, SOCKS5_AUTH_NONE };
+
 static gboolean
 write_to_transport (GabbleBytestreamSocks5 *self,
                     const gchar *data,
@@ -499,25 +572,17 @@ transport_connected_cb (GibberTransport *transport,
 
   stop_timer (self);
 
-  if (priv->socks5_state == SOCKS5_STATE_TARGET_TRYING_CONNECT ||
-      priv->socks5_state == SOCKS5_STATE_INITIATOR_TRYING_CONNECT)
+  /* As a target, we only get here once a candidate has completed the
+   * handshake, so this is the initiator connecting to a proxy */
+  if (priv->socks5_state == SOCKS5_STATE_INITIATOR_TRYING_CONNECT)
     {
-      gchar msg[3];
-
       DEBUG ("transport is connected. Sending auth request");
 
-      msg[0] = SOCKS5_VERSION;
-      /* Number of auth methods we are offering, we support just
-       * SOCKS5_AUTH_NONE */
-      msg[1] = 1;
-      msg[2] = SOCKS5_AUTH_NONE;
-
-      write_to_transport (self, msg, 3, NULL);
+      record_proxy_connect_time (priv->proxy_jid, priv->connect_started);
 
-      if (priv->socks5_state == SOCKS5_STATE_TARGET_TRYING_CONNECT)
-        priv->socks5_state = SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT;
-      else
-        priv->socks5_state = SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT;
+      gibber_transport_send (transport, auth_request, sizeof (auth_request),
+          NULL);
+      priv->socks5_state = SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT;
     }
 }
 
@@ -550,10 +615,13 @@ socks5_close_transport (GabbleBytestreamSocks5 *self)
   GabbleBytestreamSocks5Private *priv =
     GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
 
+  cancel_candidates (self);
+
   if (priv->read_buffer != NULL)
     {
       g_string_free (priv->read_buffer, TRUE);
       priv->read_buffer = NULL;
+      priv->read_offset = 0;
     }
 
   if (priv->transport == NULL)
@@ -584,10 +652,13 @@ transport_buffer_empty_cb (GibberTransport *transport,
       DEBUG ("buffer is now empty. Bytestream can be closed");
       bytestream_closed (self);
     }
-  else if (priv->write_blocked)
-    {
-      change_write_blocked_state (self, FALSE);
-    }
+}
+
+static void
+transport_buffer_low_cb (GibberTransport *transport,
+                         GabbleBytestreamSocks5 *self)
+{
+  change_write_blocked_state (self, FALSE);
 }
 
 static void
@@ -601,6 +672,7 @@ set_transport (GabbleBytestreamSocks5 *self,
 
   g_assert (priv->read_buffer == NULL);
   priv->read_buffer = g_string_sized_new (4096);
+  priv->read_offset = 0;
 
   gibber_transport_set_handler (transport, transport_handler, self);
 
@@ -608,6 +680,8 @@ set_transport (GabbleBytestreamSocks5 *self,
       G_CALLBACK (transport_connected_cb), self);
   g_signal_connect (transport, "disconnected",
       G_CALLBACK (transport_disconnected_cb), self);
+  g_signal_connect (priv->transport, "buffer-low",
+      G_CALLBACK (transport_buffer_low_cb), self);
   g_signal_connect (priv->transport, "buffer-empty",
       G_CALLBACK (transport_buffer_empty_cb), self);
 }
@@ -625,30 +699,22 @@ socks5_error (GabbleBytestreamSocks5 *self)
   previous_state = priv->socks5_state;
   priv->socks5_state = SOCKS5_STATE_ERROR;
 
+  if (previous_state == SOCKS5_STATE_INITIATOR_TRYING_CONNECT ||
+      previous_state == SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT ||
+      previous_state == SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED)
+    {
+      /* We failed to use the proxy we picked */
+      record_proxy_result (priv->proxy_jid, FALSE);
+    }
+
   switch (previous_state)
     {
       case SOCKS5_STATE_TARGET_TRYING_CONNECT:
       case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
       case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
-        /* The attempt for connect to the streamhost failed */
+        /* Every attempt to connect to a streamhost failed */
         socks5_close_transport (self);
 
-        if (priv->streamhosts != NULL)
-          {
-            /* Remove the failed streamhost */
-            streamhost_free (priv->streamhosts->data);
-            priv->streamhosts = g_slist_delete_link (priv->streamhosts,
-                priv->streamhosts);
-          }
-
-        if (priv->streamhosts != NULL)
-          {
-            DEBUG ("connection to streamhost failed, trying the next one");
-
-            socks5_connect (self);
-            return;
-          }
-
         DEBUG ("no more streamhosts to try");
 
         g_signal_emit_by_name (self, "connection-error");
@@ -663,12 +729,6 @@ socks5_error (GabbleBytestreamSocks5 *self)
         priv->msg_for_acknowledge_connection = NULL;
         break;
 
-      case SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST:
-      case SOCKS5_STATE_INITIATOR_AWAITING_COMMAND:
-        DEBUG ("Something goes wrong during SOCKS5 negotiation. Don't close "
-            "the bytestream yet as the target can still try other streamhosts");
-        break;
-
       default:
         DEBUG ("error, closing the connection\n");
         gabble_bytestream_socks5_close (GABBLE_BYTESTREAM_IFACE (self), NULL);
@@ -704,6 +764,90 @@ check_domain (const gchar *domain,
   return TRUE;
 }
 
+/* Fills @msg with a CONNECT command for @domain */
+static void
+make_connect_request (gchar *msg,
+    const gchar *domain)
+{
+  msg[0] = SOCKS5_VERSION;
+  msg[1] = SOCKS5_CMD_CONNECT;
+  msg[2] = SOCKS5_RESERVED;
+  msg[3] = SOCKS5_ATYP_DOMAIN;
+  /* Length of a hex SHA1 */
+  msg[4] = 40;
+  /* Domain name: SHA-1(sid + initiator + target) */
+  memcpy (&msg[5], domain, 40);
+  /* Port: 0 */
+  msg[45] = 0x00;
+  msg[46] = 0x00;
+}
+
+/* Parses the reply to a CONNECT command for @domain. Returns the number of
+ * bytes used, 0 if we need more data, or -1 if the connection was refused. */
+static gssize
+parse_connect_reply (const gchar *data,
+    gsize len,
+    const gchar *domain)
+{
+  /* the length of the BND.ADDR field */
+  guint8 addr_len;
+
+  if (len < SOCKS5_MIN_LENGTH)
+    return 0;
+
+  if (data[0] != SOCKS5_VERSION ||
+      data[1] != SOCKS5_STATUS_OK ||
+      data[2] != SOCKS5_RESERVED)
+    {
+      DEBUG ("Connection refused");
+      return -1;
+    }
+
+  if (data[3] == SOCKS5_ATYP_DOMAIN)
+    {
+      /* correct domain. The first byte of the domain contains its
+       * length */
+      addr_len = (guint8) data[4];
+      addr_len += 1;
+    }
+  else if (data[3] == 0x00)
+    {
+      DEBUG ("Got 0x00 as domain. Pretend it's ok to be able to interop "
+          "with ejabberd < 2.0.2");
+      addr_len = 0;
+    }
+  else
+    {
+      DEBUG ("Wrong domain");
+      return -1;
+    }
+
+  if ((guint8) len < SOCKS5_MIN_LENGTH + addr_len)
+    /* We didn't receive the full packet yet */
+    return 0;
+
+  if (
+      /* first half of the port number */
+      data[4 + addr_len] != 0 ||
+      /* second half of the port number */
+      data[5 + addr_len] != 0)
+    {
+      DEBUG ("Connection refused");
+      return -1;
+    }
+
+  if (addr_len > 0)
+    {
+      if (!check_domain (&data[5], addr_len - 1, domain))
+        {
+          /* Thanks Pidgin... */
+          DEBUG ("Ignoring to interop with buggy implementations");
+        }
+    }
+
+  return SOCKS5_MIN_LENGTH + addr_len;
+}
+
 static gboolean
 socks5_timer_cb (gpointer data)
 {
@@ -728,12 +872,12 @@ start_timer (GabbleBytestreamSocks5 *self,
 }
 
 static void
-target_got_connect_reply (GabbleBytestreamSocks5 *self)
+target_got_connect_reply (GabbleBytestreamSocks5 *self,
+                          Streamhost *current_streamhost)
 {
   GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
       self);
   WockyPorter *porter = wocky_session_get_porter (priv->conn->session);
-  Streamhost *current_streamhost;
 
   DEBUG ("Received CONNECT reply. Socks5 stream connected. "
       "Bytestream is now open");
@@ -741,7 +885,6 @@ target_got_connect_reply (GabbleBytestreamSocks5 *self)
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
 
   /* Acknowledge the connection */
-  current_streamhost = priv->streamhosts->data;
   wocky_porter_acknowledge_iq (porter, priv->msg_for_acknowledge_connection,
       '(', "query", ':', NS_BYTESTREAMS,
         /* streamhost-used informs the other end of the streamhost we
@@ -780,6 +923,7 @@ socks5_activation_reply_cb (
   if (!conn_util_send_iq_finish (GABBLE_CONNECTION (source), result, &reply_msg, NULL))
     {
       DEBUG ("Activation failed");
+      record_proxy_result (priv->proxy_jid, FALSE);
       goto activation_failed;
     }
 
@@ -791,6 +935,7 @@ socks5_activation_reply_cb (
     }
 
   DEBUG ("Proxy activated the bytestream. It's now open");
+  record_proxy_result (priv->proxy_jid, TRUE);
 
   priv->socks5_state = SOCKS5_STATE_CONNECTED;
   g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
@@ -835,33 +980,29 @@ initiator_got_connect_reply (GabbleBytestreamSocks5 *self)
   g_object_unref (iq);
 }
 
-/* Process the received data and returns the number of bytes that have been
- * used */
+/* Process the @len bytes of handshake data at @data and returns the number of
+ * bytes that have been used */
 static gssize
 socks5_handle_received_data (GabbleBytestreamSocks5 *self,
-                             GString *string)
+                             const gchar *data,
+                             gsize len)
 {
   GabbleBytestreamSocks5Private *priv =
       GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
   gchar msg[SOCKS5_CONNECT_LENGTH];
-  guint auth_len;
-  guint i;
   gchar *domain;
-  /* the length of the BND.ADDR field */
-  guint8 addr_len;
-  gsize len;
+  gssize used;
 
   switch (priv->socks5_state)
     {
-      case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
       case SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT:
         /* We sent an authorization request and we are awaiting for a
          * response, the response is 2 bytes-long */
-        if (string->len < 2)
+        if (len < 2)
           return 0;
 
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_STATUS_OK)
+        if (data[0] != SOCKS5_VERSION ||
+            data[1] != SOCKS5_STATUS_OK)
           {
             DEBUG ("Authentication failed");
 
@@ -873,39 +1014,14 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
 
         DEBUG ("Received auth reply. Sending CONNECT command");
 
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
-          {
-            domain = compute_domain (priv->stream_id, priv->peer_jid,
-                priv->self_full_jid);
-          }
-        else
-          {
-            /* SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT */
-            domain = compute_domain (priv->stream_id, priv->self_full_jid,
-                priv->peer_jid);
-          }
-
-        msg[0] = SOCKS5_VERSION;
-        msg[1] = SOCKS5_CMD_CONNECT;
-        msg[2] = SOCKS5_RESERVED;
-        msg[3] = SOCKS5_ATYP_DOMAIN;
-        /* Length of a hex SHA1 */
-        msg[4] = 40;
-        /* Domain name: SHA-1(sid + initiator + target) */
-        memcpy (&msg[5], domain, 40);
-        /* Port: 0 */
-        msg[45] = 0x00;
-        msg[46] = 0x00;
-
+        domain = compute_domain (priv->stream_id, priv->self_full_jid,
+            priv->peer_jid);
+        make_connect_request (msg, domain);
         g_free (domain);
 
         write_to_transport (self, msg, SOCKS5_CONNECT_LENGTH, NULL);
 
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
-          priv->socks5_state = SOCKS5_STATE_TARGET_CONNECT_REQUESTED;
-        else
-          /* SOCKS5_STATE_INITIATOR_AUTH_REQUEST_SENT */
-          priv->socks5_state = SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED;
+        priv->socks5_state = SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED;
 
         /* Older version of Gabble (pre 0.7.22) are bugged and just send 2
          * bytes as CONNECT reply. We set a timer to not wait the full reply
@@ -916,229 +1032,46 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
 
         return 2;
 
-      case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
       case SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED:
         /* We sent a CONNECT request and are awaiting for the response */
-        if (string->len < SOCKS5_MIN_LENGTH)
-          return 0;
-
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_STATUS_OK ||
-            string->str[2] != SOCKS5_RESERVED)
-          {
-            DEBUG ("Connection refused");
-
-            socks5_error (self);
-            return -1;
-          }
-
-        if (string->str[3] == SOCKS5_ATYP_DOMAIN)
-          {
-            /* correct domain. The first byte of the domain contains its
-             * length */
-            addr_len = (guint8) string->str[4];
-            addr_len += 1;
-          }
-        else if (string->str[3] == 0x00)
-          {
-            DEBUG ("Got 0x00 as domain. Pretend it's ok to be able to interop "
-                "with ejabberd < 2.0.2");
-            addr_len = 0;
-          }
-        else
-          {
-            DEBUG ("Wrong domain");
-
-            socks5_error (self);
-            return -1;
-          }
-
-        if ((guint8) string->len < SOCKS5_MIN_LENGTH + addr_len)
-          /* We didn't receive the full packet yet */
-          return 0;
-
-        stop_timer (self);
-
-        if (
-            /* first half of the port number */
-            string->str[4 + addr_len] != 0 ||
-            /* second half of the port number */
-            string->str[5 + addr_len] != 0)
-          {
-            DEBUG ("Connection refused");
-
-            socks5_error (self);
-            return -1;
-          }
-
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
-          {
-            domain = compute_domain (priv->stream_id, priv->peer_jid,
-                priv->self_full_jid);
-          }
-        else
-          {
-            /* SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED */
-            domain = compute_domain (priv->stream_id, priv->self_full_jid,
-                priv->peer_jid);
-          }
-
-        if (addr_len > 0)
-          {
-            if (!check_domain (&string->str[5], addr_len - 1, domain))
-              {
-                /* Thanks Pidgin... */
-                DEBUG ("Ignoring to interop with buggy implementations");
-              }
-          }
-
+        domain = compute_domain (priv->stream_id, priv->self_full_jid,
+            priv->peer_jid);
+        used = parse_connect_reply (data, len, domain);
         g_free (domain);
 
-        if (priv->socks5_state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
-          target_got_connect_reply (self);
-        else
-          /* SOCKS5_STATE_INITIATOR_CONNECT_REQUESTED */
-          initiator_got_connect_reply (self);
-
-        return SOCKS5_MIN_LENGTH + addr_len;
-
-      case SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST:
-        /* A client connected to us and we are awaiting for the authorization
-         * request (at least 2 bytes) */
-        if (string->len < 2)
-          return 0;
-
-        if (string->str[0] != SOCKS5_VERSION)
-          {
-            DEBUG ("Authentication failed");
-
-            socks5_error (self);
-            return -1;
-          }
-
-        /* The auth request string is SOCKS5_VERSION + # of methods + methods */
-        auth_len = string->str[1] + 2;
-        if (string->len < auth_len)
-          /* We are still receiving some auth method */
-          return 0;
-
-        for (i = 2; i < auth_len; i++)
-          {
-            if (string->str[i] == SOCKS5_AUTH_NONE)
-              {
-                /* Authorize the connection */
-                msg[0] = SOCKS5_VERSION;
-                msg[1] = SOCKS5_AUTH_NONE;
-
-                DEBUG ("Received auth request. Sending auth reply");
-                write_to_transport (self, msg, 2, NULL);
-
-                priv->socks5_state = SOCKS5_STATE_INITIATOR_AWAITING_COMMAND;
-
-                return auth_len;
-              }
-          }
-
-        DEBUG ("Unauthenticated access is not supported by the streamhost");
-
-        socks5_error (self);
-
-        return -1;
-
-      case SOCKS5_STATE_INITIATOR_AWAITING_COMMAND:
-        /* The client has been authorized and we are waiting for a command,
-         * the only one supported by the SOCKS5 bytestreams XEP is
-         * CONNECT with:
-         *  - ATYP = DOMAIN
-         *  - PORT = 0
-         *  - DOMAIN = SHA1(sid + initiator + target)
-         */
-        if (string->len < SOCKS5_MIN_LENGTH)
+        if (used == 0)
           return 0;
 
-        addr_len = (guint8) string->str[4];
-        /* the first byte is the length */
-        addr_len += 1;
-
-        if ((guint8) string->len < SOCKS5_MIN_LENGTH + addr_len)
-          /* We didn't receive the full packet yet */
-          return 0;
-
-        if (string->str[0] != SOCKS5_VERSION ||
-            string->str[1] != SOCKS5_CMD_CONNECT ||
-            string->str[2] != SOCKS5_RESERVED ||
-            string->str[3] != SOCKS5_ATYP_DOMAIN ||
-            /* first half of the port number */
-            string->str[4 + addr_len] != 0 ||
-            /* second half of the port number */
-            string->str[5 + addr_len] != 0)
-          {
-            DEBUG ("Invalid SOCKS5 connect message");
-
-            socks5_error (self);
-            return -1;
-          }
-
-        domain = compute_domain (priv->stream_id, priv->self_full_jid,
-            priv->peer_jid);
+        stop_timer (self);
 
-        if (!check_domain (&string->str[5], addr_len - 1, domain))
+        if (used < 0)
           {
-            DEBUG ("Reject connection to prevent spoofing");
-            socks5_close_transport (self);
             socks5_error (self);
-            g_free (domain);
             return -1;
           }
 
-        msg[0] = SOCKS5_VERSION;
-        msg[1] = SOCKS5_STATUS_OK;
-        msg[2] = SOCKS5_RESERVED;
-        msg[3] = SOCKS5_ATYP_DOMAIN;
-        msg[4] = SHA1_LENGTH;
-        /* Domain name: SHA-1(sid + initiator + target) */
-        memcpy (&msg[5], domain, 40);
-        /* Port: 0 */
-        msg[45] = 0x00;
-        msg[46] = 0x00;
-
-        g_free (domain);
-
-        DEBUG ("Received CONNECT cmd. Sending CONNECT reply");
-        write_to_transport (self, msg, 47, NULL);
+        initiator_got_connect_reply (self);
 
-        priv->socks5_state = SOCKS5_STATE_CONNECTED;
-
-        /* Sock5 is connected but the bytestream is not open yet as we need
-         * to wait for the IQ reply. Stop reading until the bytestream
-         * is open to avoid data loss. */
-        gibber_transport_block_receiving (priv->transport, TRUE);
-
-        DEBUG ("sock5 stream connected. Stop to listen for connections");
-        g_assert (priv->listener != NULL);
-        tp_clear_object (&priv->listener);
-
-        return SOCKS5_MIN_LENGTH + addr_len;
+        return used;
 
       case SOCKS5_STATE_CONNECTED:
-        /* We are connected, everything we receive now is data */
-
-        /* store the buffer len because if something went wront in the
-         * data-received callback, the bytestream could be freed and so the
-         * priv->read_buffer */
-        len = string->len;
-        g_signal_emit_by_name (G_OBJECT (self), "data-received",
-            priv->peer_handle, string);
-
-        return len;
+        DEBUG ("Data is passed to data-received by transport_handler()");
+        break;
 
       case SOCKS5_STATE_ERROR:
         /* An error occurred and the channel will be closed in an idle
          * callback, so let's just throw away the data we receive */
         DEBUG ("An error occurred, throwing away received data");
-        return string->len;
+        return len;
 
       case SOCKS5_STATE_TARGET_TRYING_CONNECT:
+      case SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT:
+      case SOCKS5_STATE_TARGET_CONNECT_REQUESTED:
+      case SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST:
+      case SOCKS5_STATE_INITIATOR_AWAITING_COMMAND:
+        DEBUG ("Handshakes with streamhosts are handled by each Candidate");
+        break;
+
       case SOCKS5_STATE_INITIATOR_TRYING_CONNECT:
         DEBUG ("Impossible to receive data when not yet connected to the "
             "socket");
@@ -1158,7 +1091,7 @@ socks5_handle_received_data (GabbleBytestreamSocks5 *self,
     }
 
   g_assert_not_reached ();
-  return string->len;
+  return len;
 }
 
 static void
@@ -1173,69 +1106,643 @@ transport_handler (GibberTransport *transport,
   gssize used_bytes;
 
   g_assert (priv->read_buffer != NULL);
-  g_string_append_len (priv->read_buffer, (const gchar *) data->data,
-      data->length);
+
+  if (priv->socks5_state == SOCKS5_STATE_CONNECTED &&
+      priv->read_buffer->len == 0)
+    {
+      /* Everything we receive now is data, and there's nothing left over
+       * from the handshake to go before it, so the transport's buffer can be
+       * handed on as it is. */
+      g_signal_emit_by_name (G_OBJECT (self), "data-received",
+          priv->peer_handle, data);
+      return;
+    }
 
   /* If something goes wrong in socks5_handle_received_data, the bytestream
    * could be closed and disposed. Ref it to artificially keep this bytestream
    * object alive while we are in this function. */
   g_object_ref (self);
 
-  do
+  g_string_append_len (priv->read_buffer, (const gchar *) data->data,
+      data->length);
+
+  while (priv->socks5_state != SOCKS5_STATE_CONNECTED &&
+      priv->read_offset < priv->read_buffer->len)
     {
       /* socks5_handle_received_data() processes the data and returns the
        * number of bytes that have been used. 0 means that there is not enough
        * data to do anything, so we just wait for more data from the socket */
-      used_bytes = socks5_handle_received_data (self, priv->read_buffer);
+      used_bytes = socks5_handle_received_data (self,
+          priv->read_buffer->str + priv->read_offset,
+          priv->read_buffer->len - priv->read_offset);
 
       if (priv->read_buffer == NULL)
         /* If something did wrong in socks5_handle_received_data, the
          * bytestream can be closed and so destroyed. */
+        goto out;
+
+      if (used_bytes == 0)
         break;
 
-      g_string_erase (priv->read_buffer, 0, used_bytes);
+      if (used_bytes < 0)
+        /* an error occurred; throw away everything we have */
+        priv->read_offset = priv->read_buffer->len;
+      else
+        priv->read_offset += used_bytes;
+    }
+
+  if (priv->socks5_state == SOCKS5_STATE_CONNECTED &&
+      priv->read_offset < priv->read_buffer->len)
+    {
+      /* The handshake has just finished, and whatever came in the same read
+       * after it is data */
+      GibberBuffer leftover = {
+          (const guint8 *) priv->read_buffer->str + priv->read_offset,
+          priv->read_buffer->len - priv->read_offset };
+
+      g_signal_emit_by_name (G_OBJECT (self), "data-received",
+          priv->peer_handle, &leftover);
+
+      if (priv->read_buffer == NULL)
+        /* the data-received handlers closed the bytestream */
+        goto out;
+
+      priv->read_offset = priv->read_buffer->len;
+    }
+
+  if (priv->read_offset >= priv->read_buffer->len)
+    {
+      g_string_truncate (priv->read_buffer, 0);
+      priv->read_offset = 0;
     }
-  while (used_bytes > 0 && priv->read_buffer->len > 0);
 
+out:
   g_object_unref (self);
 }
 
+/* Whether @streamhost is one of our own proxies. The initiator can offer
+ * us whatever it likes, so only those are worth keeping statistics for. */
+static gboolean
+streamhost_is_our_proxy (GabbleBytestreamSocks5 *self,
+                         Streamhost *streamhost)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  return gabble_bytestream_factory_is_socks5_proxy (
+      priv->conn->bytestream_factory, streamhost->jid, streamhost->host,
+      streamhost->port);
+}
+
 static void
-socks5_connect (GabbleBytestreamSocks5 *self)
+candidate_free (Candidate *candidate)
+{
+  if (candidate->timer_id != 0)
+    g_source_remove (candidate->timer_id);
+
+  if (candidate->transport != NULL)
+    {
+      g_signal_handlers_disconnect_matched (candidate->transport,
+          G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, candidate);
+      gibber_transport_set_handler (candidate->transport, NULL, NULL);
+      gibber_transport_disconnect (candidate->transport);
+      g_object_unref (candidate->transport);
+    }
+
+  if (candidate->read_buffer != NULL)
+    g_string_free (candidate->read_buffer, TRUE);
+
+  g_slice_free (Candidate, candidate);
+}
+
+static void
+cancel_candidates (GabbleBytestreamSocks5 *self)
 {
   GabbleBytestreamSocks5Private *priv =
       GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
-  Streamhost* streamhost;
-  GibberTCPTransport *transport;
 
-  priv->socks5_state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
+  if (priv->next_candidate_timer != 0)
+    {
+      g_source_remove (priv->next_candidate_timer);
+      priv->next_candidate_timer = 0;
+    }
+
+  g_slist_foreach (priv->candidates, (GFunc) candidate_free, NULL);
+  g_slist_free (priv->candidates);
+  priv->candidates = NULL;
+  priv->next_streamhost = NULL;
+}
+
+static void start_next_candidate (GabbleBytestreamSocks5 *self);
+
+static void
+candidate_failed (Candidate *candidate,
+                  const gchar *reason)
+{
+  GabbleBytestreamSocks5 *self = candidate->self;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  Streamhost *streamhost = candidate->streamhost;
+  gboolean was_chosen;
 
-  if (priv->streamhosts != NULL)
+  if (streamhost == NULL)
     {
-      streamhost = priv->streamhosts->data;
+      /* The target may be racing several connections to us, and drops all
+       * but the first to be authenticated; this only matters if it's the
+       * one it picks, in which case we'll find out when it tells us. */
+      DEBUG ("connection from the target failed: %s", reason);
+      priv->candidates = g_slist_remove (priv->candidates, candidate);
+      candidate_free (candidate);
+      return;
     }
-  else
+
+  DEBUG ("connection to streamhost %s (%s:%d) failed: %s", streamhost->jid,
+      streamhost->host, streamhost->port, reason);
+
+  if (streamhost_is_our_proxy (self, streamhost))
+    record_proxy_result (streamhost->jid, FALSE);
+
+  was_chosen = (candidate->state == SOCKS5_STATE_TARGET_CONNECT_REQUESTED);
+  priv->candidates = g_slist_remove (priv->candidates, candidate);
+  candidate_free (candidate);
+
+  /* Remove the failed streamhost */
+  priv->streamhosts = g_slist_remove (priv->streamhosts, streamhost);
+  streamhost_free (streamhost);
+
+  if (was_chosen)
     {
-      DEBUG ("No more streamhosts to try, closing");
+      /* We gave up on all the others when this one won the race, so race
+       * whichever streamhosts are left again */
+      g_assert (priv->candidates == NULL);
+      priv->next_streamhost = priv->streamhosts;
+    }
 
+  if (priv->next_streamhost != NULL)
+    {
+      /* No point waiting for the next attempt to be due */
+      DEBUG ("trying the next one");
+      start_next_candidate (self);
+    }
+  else if (priv->candidates == NULL)
+    {
       socks5_error (self);
+    }
+}
+
+/* @candidate is the first of the connections to the streamhosts to have
+ * been authenticated, so it's the one we'll send the CONNECT command on; and
+ * the initiator must only see one CONNECT command, so close all the others
+ * now. */
+static void
+candidate_won_race (Candidate *candidate)
+{
+  GabbleBytestreamSocks5 *self = candidate->self;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  priv->candidates = g_slist_remove (priv->candidates, candidate);
+  cancel_candidates (self);
+  priv->candidates = g_slist_prepend (priv->candidates, candidate);
+}
+
+/* Takes @candidate's transport, and any data received after the SOCKS5
+ * handshake, for the bytestream's own use; then gives up on all the other
+ * candidates. Returns the data, which the caller must pass to
+ * deliver_leftover() once the bytestream is ready for it. */
+static GString *
+candidate_take_transport (Candidate *candidate)
+{
+  GabbleBytestreamSocks5 *self = candidate->self;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GibberTransport *transport = candidate->transport;
+  GString *leftover = candidate->read_buffer;
+
+  g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, candidate);
+  gibber_transport_set_handler (transport, NULL, NULL);
+  candidate->transport = NULL;
+  candidate->read_buffer = NULL;
+
+  priv->candidates = g_slist_remove (priv->candidates, candidate);
+  candidate_free (candidate);
+  cancel_candidates (self);
+
+  set_transport (self, transport);
+  g_object_unref (transport);
+
+  return leftover;
+}
+
+static void
+deliver_leftover (GabbleBytestreamSocks5 *self,
+                  GString *leftover)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  if (leftover->len > 0 && priv->transport != NULL)
+    {
+      GibberBuffer buffer;
+
+      buffer.data = (const guint8 *) leftover->str;
+      buffer.length = leftover->len;
+      transport_handler (priv->transport, &buffer, self);
+    }
+
+  g_string_free (leftover, TRUE);
+}
+
+static void
+candidate_succeeded (Candidate *candidate)
+{
+  GabbleBytestreamSocks5 *self = candidate->self;
+  Streamhost *streamhost = candidate->streamhost;
+  GString *leftover;
+
+  DEBUG ("streamhost %s accepted our CONNECT command", streamhost->jid);
+
+  if (streamhost_is_our_proxy (self, streamhost))
+    record_proxy_result (streamhost->jid, TRUE);
+
+  g_object_ref (self);
+
+  leftover = candidate_take_transport (candidate);
+  target_got_connect_reply (self, streamhost);
+  deliver_leftover (self, leftover);
+
+  g_object_unref (self);
+}
+
+static gboolean
+candidate_timer_cb (gpointer data)
+{
+  Candidate *candidate = data;
+
+  candidate->timer_id = 0;
+  candidate_failed (candidate, "timed out");
+  return FALSE;
+}
+
+static void
+candidate_start_timer (Candidate *candidate,
+                       guint seconds)
+{
+  if (candidate->timer_id != 0)
+    g_source_remove (candidate->timer_id);
+
+  candidate->timer_id = g_timeout_add_seconds (seconds, candidate_timer_cb,
+      candidate);
+}
+
+static void
+candidate_connected_cb (GibberTransport *transport,
+                        Candidate *candidate)
+{
+  DEBUG ("connected to streamhost %s. Sending auth request",
+      candidate->streamhost->jid);
+
+  /* The TCP connection is up, so CONNECT_TIMEOUT no longer applies */
+  if (candidate->timer_id != 0)
+    {
+      g_source_remove (candidate->timer_id);
+      candidate->timer_id = 0;
+    }
+
+  if (streamhost_is_our_proxy (candidate->self, candidate->streamhost))
+    record_proxy_connect_time (candidate->streamhost->jid,
+        candidate->started);
+
+  gibber_transport_send (transport, auth_request, sizeof (auth_request),
+      NULL);
+  candidate->state = SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT;
+}
+
+static void
+candidate_disconnected_cb (GibberTransport *transport,
+                           Candidate *candidate)
+{
+  candidate_failed (candidate, "transport disconnected");
+}
+
+static void
+candidate_handler (GibberTransport *transport,
+                   GibberBuffer *data,
+                   gpointer user_data)
+{
+  Candidate *candidate = user_data;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (candidate->self);
+  GString *string = candidate->read_buffer;
+  gchar msg[SOCKS5_CONNECT_LENGTH];
+  gchar *domain;
+  gssize used;
+
+  g_string_append_len (string, (const gchar *) data->data, data->length);
+
+  if (candidate->state == SOCKS5_STATE_TARGET_AUTH_REQUEST_SENT)
+    {
+      /* The auth reply is 2 bytes-long */
+      if (string->len < 2)
+        return;
+
+      if (string->str[0] != SOCKS5_VERSION ||
+          string->str[1] != SOCKS5_STATUS_OK)
+        {
+          candidate_failed (candidate, "authentication failed");
+          return;
+        }
+
+      g_string_erase (string, 0, 2);
+
+      DEBUG ("Received auth reply from %s first. Sending CONNECT command",
+          candidate->streamhost->jid);
+
+      candidate_won_race (candidate);
+
+      domain = compute_domain (priv->stream_id, priv->peer_jid,
+          priv->self_full_jid);
+      make_connect_request (msg, domain);
+      g_free (domain);
+
+      gibber_transport_send (transport, (const guint8 *) msg,
+          SOCKS5_CONNECT_LENGTH, NULL);
+      candidate->state = SOCKS5_STATE_TARGET_CONNECT_REQUESTED;
+
+      /* See the comment in socks5_handle_received_data() about older Gabbles
+       * which don't send a full CONNECT reply */
+      candidate_start_timer (candidate, CONNECT_REPLY_TIMEOUT);
+    }
+
+  if (candidate->state != SOCKS5_STATE_TARGET_CONNECT_REQUESTED)
+    return;
+
+  domain = compute_domain (priv->stream_id, priv->peer_jid,
+      priv->self_full_jid);
+  used = parse_connect_reply (string->str, string->len, domain);
+  g_free (domain);
+
+  if (used == 0)
+    return;
+
+  if (used < 0)
+    {
+      candidate_failed (candidate, "CONNECT refused");
       return;
     }
 
+  g_string_erase (string, 0, used);
+  candidate_succeeded (candidate);
+}
+
+/* Runs our side of the SOCKS5 handshake, as the initiator, on a connection
+ * the target made to our own streamhost */
+static void
+incoming_candidate_handler (GibberTransport *transport,
+                            GibberBuffer *data,
+                            gpointer user_data)
+{
+  Candidate *candidate = user_data;
+  GabbleBytestreamSocks5 *self = candidate->self;
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GString *string = candidate->read_buffer;
+  gchar msg[SOCKS5_CONNECT_LENGTH];
+  guint auth_len;
+  guint i;
+  gchar *domain;
+  /* the length of the BND.ADDR field */
+  guint8 addr_len;
+
+  g_string_append_len (string, (const gchar *) data->data, data->length);
+
+  if (candidate->state == SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST)
+    {
+      /* We are awaiting for the authorization request (at least 2 bytes) */
+      if (string->len < 2)
+        return;
+
+      if (string->str[0] != SOCKS5_VERSION)
+        {
+          candidate_failed (candidate, "authentication failed");
+          return;
+        }
+
+      /* The auth request string is SOCKS5_VERSION + # of methods +
+       * methods */
+      auth_len = (guint8) string->str[1] + 2;
+      if (string->len < auth_len)
+        /* We are still receiving some auth method */
+        return;
+
+      for (i = 2; i < auth_len; i++)
+        {
+          if (string->str[i] == SOCKS5_AUTH_NONE)
+            break;
+        }
+
+      if (i == auth_len)
+        {
+          candidate_failed (candidate,
+              "unauthenticated access is not supported by the target");
+          return;
+        }
+
+      /* Authorize the connection */
+      msg[0] = SOCKS5_VERSION;
+      msg[1] = SOCKS5_AUTH_NONE;
+
+      DEBUG ("Received auth request. Sending auth reply");
+      gibber_transport_send (transport, (const guint8 *) msg, 2, NULL);
+
+      g_string_erase (string, 0, auth_len);
+      candidate->state = SOCKS5_STATE_INITIATOR_AWAITING_COMMAND;
+    }
+
+  if (candidate->state != SOCKS5_STATE_INITIATOR_AWAITING_COMMAND)
+    return;
+
+  /* The target has been authorized and we are waiting for a command, the
+   * only one supported by the SOCKS5 bytestreams XEP is CONNECT with:
+   *  - ATYP = DOMAIN
+   *  - PORT = 0
+   *  - DOMAIN = SHA1(sid + initiator + target)
+   */
+  if (string->len < SOCKS5_MIN_LENGTH)
+    return;
+
+  addr_len = (guint8) string->str[4];
+  /* the first byte is the length */
+  addr_len += 1;
+
+  if (string->len < (gsize) SOCKS5_MIN_LENGTH + addr_len)
+    /* We didn't receive the full packet yet */
+    return;
+
+  if (string->str[0] != SOCKS5_VERSION ||
+      string->str[1] != SOCKS5_CMD_CONNECT ||
+      string->str[2] != SOCKS5_RESERVED ||
+      string->str[3] != SOCKS5_ATYP_DOMAIN ||
+      /* first half of the port number */
+      string->str[4 + addr_len] != 0 ||
+      /* second half of the port number */
+      string->str[5 + addr_len] != 0)
+    {
+      candidate_failed (candidate, "invalid SOCKS5 connect message");
+      return;
+    }
+
+  domain = compute_domain (priv->stream_id, priv->self_full_jid,
+      priv->peer_jid);
+
+  if (!check_domain (&string->str[5], addr_len - 1, domain))
+    {
+      g_free (domain);
+      candidate_failed (candidate, "rejected to prevent spoofing");
+      return;
+    }
+
+  msg[0] = SOCKS5_VERSION;
+  msg[1] = SOCKS5_STATUS_OK;
+  msg[2] = SOCKS5_RESERVED;
+  msg[3] = SOCKS5_ATYP_DOMAIN;
+  msg[4] = SHA1_LENGTH;
+  /* Domain name: SHA-1(sid + initiator + target) */
+  memcpy (&msg[5], domain, 40);
+  /* Port: 0 */
+  msg[45] = 0x00;
+  msg[46] = 0x00;
+
+  g_free (domain);
+
+  DEBUG ("Received CONNECT cmd. Sending CONNECT reply");
+  gibber_transport_send (transport, (const guint8 *) msg, 47, NULL);
+
+  g_string_erase (string, 0, SOCKS5_MIN_LENGTH + addr_len);
+  candidate->state = SOCKS5_STATE_CONNECTED;
+
+  /* The target only sends the CONNECT command on the connection it'll use
+   * if it uses our streamhost at all, but it may yet pick a proxy instead;
+   * it only tells us in its reply to our offer. Stop reading until then to
+   * avoid data loss. */
+  gibber_transport_block_receiving (transport, TRUE);
+}
+
+/* The target says it's using our own streamhost, so use the connection it
+ * sent the CONNECT command on, and stop listening for any more. Returns the
+ * data received after the handshake (see candidate_take_transport()), or
+ * %NULL if no connection is ready. */
+static GString *
+initiator_take_candidate (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  GSList *l;
+
+  for (l = priv->candidates; l != NULL; l = g_slist_next (l))
+    {
+      Candidate *candidate = l->data;
+
+      if (candidate->state == SOCKS5_STATE_CONNECTED)
+        {
+          DEBUG ("sock5 stream connected. Stop to listen for connections");
+          tp_clear_object (&priv->listener);
+
+          priv->socks5_state = SOCKS5_STATE_CONNECTED;
+          return candidate_take_transport (candidate);
+        }
+    }
+
+  return NULL;
+}
+
+static gboolean
+next_candidate_timer_cb (gpointer data)
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (data);
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  priv->next_candidate_timer = 0;
+  start_next_candidate (self);
+  return FALSE;
+}
+
+static void
+start_next_candidate (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  Streamhost *streamhost;
+  Candidate *candidate;
+  GibberTCPTransport *transport;
+
+  if (priv->next_candidate_timer != 0)
+    {
+      g_source_remove (priv->next_candidate_timer);
+      priv->next_candidate_timer = 0;
+    }
+
+  if (priv->next_streamhost == NULL)
+    return;
+
+  streamhost = priv->next_streamhost->data;
+  priv->next_streamhost = priv->next_streamhost->next;
+
   DEBUG ("Trying streamhost %s on port %d", streamhost->host,
       streamhost->port);
 
   transport = gibber_tcp_transport_new ();
-  set_transport (self, GIBBER_TRANSPORT (transport));
-  g_object_unref (transport);
 
-  /* We don't wait to wait for the TCP timeout is the host is unreachable */
-  start_timer (self, CONNECT_TIMEOUT);
+  candidate = g_slice_new0 (Candidate);
+  candidate->self = self;
+  candidate->streamhost = streamhost;
+  candidate->transport = GIBBER_TRANSPORT (transport);
+  candidate->state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
+  candidate->read_buffer = g_string_sized_new (SOCKS5_CONNECT_LENGTH);
+  candidate->started = g_get_monotonic_time ();
+  priv->candidates = g_slist_prepend (priv->candidates, candidate);
+
+  gibber_transport_set_handler (candidate->transport, candidate_handler,
+      candidate);
+  g_signal_connect (transport, "connected",
+      G_CALLBACK (candidate_connected_cb), candidate);
+  g_signal_connect (transport, "disconnected",
+      G_CALLBACK (candidate_disconnected_cb), candidate);
+
+  /* We don't want to wait for the TCP timeout if the host is unreachable */
+  candidate_start_timer (candidate, CONNECT_TIMEOUT);
+
+  /* Don't wait for this one to fail before trying the next */
+  if (priv->next_streamhost != NULL)
+    priv->next_candidate_timer = g_timeout_add (STREAMHOST_ATTEMPT_DELAY,
+        next_candidate_timer_cb, self);
 
+  /* We'll send the auth request once the transport is connected. This may
+   * fail synchronously, so @candidate must not be used afterwards. */
   gibber_tcp_transport_connect (transport, streamhost->host,
       streamhost->port);
+}
+
+static void
+socks5_connect (GabbleBytestreamSocks5 *self)
+{
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  priv->socks5_state = SOCKS5_STATE_TARGET_TRYING_CONNECT;
 
-  /* We'll send the auth request once the transport is connected */
+  if (priv->streamhosts == NULL)
+    {
+      DEBUG ("No streamhosts to try, closing");
+
+      socks5_error (self);
+      return;
+    }
+
+  priv->next_streamhost = priv->streamhosts;
+  start_next_candidate (self);
 }
 
 /**
@@ -1374,9 +1881,9 @@ gabble_bytestream_socks5_send (GabbleBytestreamIface *iface,
   /* At this point we know that the bytestream has not been closed */
   g_object_unref (self);
 
-  if (!gibber_transport_buffer_is_empty (priv->transport))
+  if (gibber_transport_buffer_is_high (priv->transport))
     {
-      /* We >don't want to send more data while the buffer isn't empty */
+      /* We don't want to send more data until the peer catches up */
       change_write_blocked_state (self, TRUE);
     }
 
@@ -1536,6 +2043,7 @@ initiator_connected_to_proxy (GabbleBytestreamSocks5 *self)
   set_transport (self, GIBBER_TRANSPORT (transport));
   g_object_unref (transport);
 
+  priv->connect_started = g_get_monotonic_time ();
   gibber_tcp_transport_connect (transport, proxy->host,
       proxy->port);
 }
@@ -1560,6 +2068,7 @@ socks5_init_reply_cb (
     {
       WockyNode *query, *streamhost = NULL;
       const gchar *jid;
+      GString *leftover;
 
       query = wocky_node_get_child_ns (
         wocky_stanza_get_top_node (reply_msg), "query", NS_BYTESTREAMS);
@@ -1591,6 +2100,10 @@ socks5_init_reply_cb (
               goto socks5_init_error;
             }
 
+          /* The target won't use any of its connections to us */
+          cancel_candidates (self);
+          tp_clear_object (&priv->listener);
+
           priv->proxy_jid = g_strdup (jid);
           initiator_connected_to_proxy (self);
           goto out;
@@ -1599,11 +2112,20 @@ socks5_init_reply_cb (
       /* No proxy used */
       DEBUG ("Target is connected to us");
 
-      if (priv->socks5_state != SOCKS5_STATE_CONNECTED)
+      if (priv->socks5_state != SOCKS5_STATE_INITIATOR_OFFER_SENT)
         {
-          DEBUG ("Target claims that the bytestream is open but SOCKS5 is not "
-              "connected (state: %u). Closing the bytestream",
-              priv->socks5_state);
+          DEBUG ("We are already in the negotiation process (state: %u). "
+              "Closing the bytestream", priv->socks5_state);
+          goto socks5_init_error;
+        }
+
+      leftover = initiator_take_candidate (self);
+
+      if (leftover == NULL)
+        {
+          DEBUG ("Target claims that the bytestream is open but none of its "
+              "connections completed the SOCKS5 handshake. Closing the "
+              "bytestream");
           goto socks5_init_error;
         }
 
@@ -1611,7 +2133,10 @@ socks5_init_reply_cb (
       DEBUG ("Socks5 stream initiated using stream: %s", jid);
       g_object_set (self, "state", GABBLE_BYTESTREAM_STATE_OPEN, NULL);
       /* We can read data from the sock5 socket now */
-      gibber_transport_block_receiving (priv->transport, FALSE);
+      if (priv->transport != NULL)
+        gibber_transport_block_receiving (priv->transport, FALSE);
+
+      deliver_leftover (self, leftover);
       goto out;
     }
 
@@ -1865,11 +2390,24 @@ new_connection_cb (GibberListener *listener,
   GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (user_data);
   GabbleBytestreamSocks5Private *priv =
     GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+  Candidate *candidate;
 
+  /* The target may be racing several connections to our streamhosts. Each
+   * gets its own handshake, and we only pick one once the target tells us
+   * which it's using. */
   DEBUG ("New connection...");
 
-  priv->socks5_state = SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST;
-  set_transport (self, transport);
+  candidate = g_slice_new0 (Candidate);
+  candidate->self = self;
+  candidate->transport = g_object_ref (transport);
+  candidate->state = SOCKS5_STATE_INITIATOR_AWAITING_AUTH_REQUEST;
+  candidate->read_buffer = g_string_sized_new (SOCKS5_CONNECT_LENGTH);
+  priv->candidates = g_slist_prepend (priv->candidates, candidate);
+
+  gibber_transport_set_handler (transport, incoming_candidate_handler,
+      candidate);
+  g_signal_connect (transport, "disconnected",
+      G_CALLBACK (candidate_disconnected_cb), candidate);
 }
 
 /*
@@ -2016,6 +2554,25 @@ gabble_bytestream_socks5_block_reading (GabbleBytestreamIface *iface,
     gibber_transport_block_receiving (priv->transport, block);
 }
 
+static GibberFdTransport *
+gabble_bytestream_socks5_get_raw_transport (GabbleBytestreamIface *iface)
+{
+  GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (iface);
+  GabbleBytestreamSocks5Private *priv =
+      GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (self);
+
+  /* Once the SOCKS5 handshake is over, the socket carries nothing but the
+   * bytestream's data; but anything left over from the handshake has to go
+   * through data-received first. */
+  if (priv->bytestream_state != GABBLE_BYTESTREAM_STATE_OPEN ||
+      priv->socks5_state != SOCKS5_STATE_CONNECTED ||
+      priv->read_buffer == NULL || priv->read_buffer->len > 0 ||
+      !GIBBER_IS_FD_TRANSPORT (priv->transport))
+    return NULL;
+
+  return GIBBER_FD_TRANSPORT (priv->transport);
+}
+
 static void
 bytestream_iface_init (gpointer g_iface,
                        gpointer iface_data)
@@ -2027,4 +2584,5 @@ bytestream_iface_init (gpointer g_iface,
   klass->close = gabble_bytestream_socks5_close;
   klass->accept = gabble_bytestream_socks5_accept;
   klass->block_reading = gabble_bytestream_socks5_block_reading;
+  klass->get_raw_transport = gabble_bytestream_socks5_get_raw_transport;
 }
@@ -62,6 +62,8 @@ static const Feature self_advertised_features[] =
   { FEATURE_FIXED, NS_SI },
   { FEATURE_FIXED, NS_IBB },
   { FEATURE_FIXED, NS_TUBES },
+  { FEATURE_FIXED, NS_TUBES_MUX },
+  { FEATURE_FIXED, NS_TUBES_POOL },
   { FEATURE_FIXED, NS_BYTESTREAMS },
   { FEATURE_FIXED, NS_VERSION },
   { FEATURE_FIXED, NS_LAST },
@@ -27,6 +27,8 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include "avatar-cache.h"
+#include "base64.h"
 #include "presence.h"
 #include "presence-cache.h"
 #include "conn-presence.h"
@@ -413,6 +415,52 @@ gabble_connection_get_known_avatar_tokens (TpSvcConnectionInterfaceAvatars *ifac
 
 
 
+/* Returns the avatar token we currently believe @handle to have, or NULL if
+ * we don't know it (or know that they have no avatar). */
+static const gchar *
+get_known_avatar_token (GabbleConnection *conn,
+    TpHandle handle)
+{
+  TpBaseConnection *base = (TpBaseConnection *) conn;
+  GabblePresence *presence;
+
+  if (handle == tp_base_connection_get_self_handle (base))
+    presence = conn->self_presence;
+  else
+    presence = gabble_presence_cache_get (conn->presence_cache, handle);
+
+  if (presence != NULL && !tp_str_empty (presence->avatar_sha1))
+    return presence->avatar_sha1;
+
+  return g_hash_table_lookup (conn->pep_avatar_hashes,
+      GUINT_TO_POINTER (handle));
+}
+
+/* If we already have @handle's current avatar on disk, emits
+ * AvatarRetrieved for it and returns TRUE. */
+static gboolean
+emit_avatar_retrieved_from_cache (GabbleConnection *conn,
+    TpHandle handle)
+{
+  const gchar *sha1 = get_known_avatar_token (conn, handle);
+  gchar *mime_type = NULL;
+  GArray *arr;
+
+  if (sha1 == NULL)
+    return FALSE;
+
+  arr = gabble_avatar_cache_lookup (conn->avatar_cache, sha1, &mime_type);
+
+  if (arr == NULL)
+    return FALSE;
+
+  tp_svc_connection_interface_avatars_emit_avatar_retrieved (conn, handle,
+      sha1, arr, mime_type);
+  g_array_unref (arr);
+  g_free (mime_type);
+  return TRUE;
+}
+
 static gboolean
 parse_avatar (WockyNode *vcard,
               const gchar **mime_type,
@@ -423,8 +471,6 @@ parse_avatar (WockyNode *vcard,
   WockyNode *type_node;
   WockyNode *binval_node;
   const gchar *binval_value;
-  guchar *st;
-  gsize outlen;
 
   photo_node = wocky_node_get_child (vcard, "PHOTO");
 
@@ -464,16 +510,7 @@ parse_avatar (WockyNode *vcard,
       return FALSE;
     }
 
-  st = g_base64_decode (binval_value, &outlen);
-  *avatar = g_string_new_len ((gchar *) st, outlen);
-  g_free (st);
-
-  if (NULL == *avatar)
-    {
-      g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
-        "failed to decode avatar from base64");
-      return FALSE;
-    }
+  *avatar = gabble_base64_decode_to_string (binval_value);
 
   return TRUE;
 }
@@ -571,6 +608,8 @@ _request_avatar_cb (GabbleVCardManager *self,
           goto out;
         }
 
+      gabble_avatar_cache_store (conn->avatar_cache, sha1, avatar->str,
+          avatar->len, mime_type);
       g_free (sha1);
     }
 
@@ -608,6 +647,7 @@ gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
       TP_HANDLE_TYPE_CONTACT);
   GError *err = NULL;
   WockyNode *vcard_node;
+  const gchar *sha1;
 
   TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
 
@@ -618,6 +658,24 @@ gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
       return;
     }
 
+  sha1 = get_known_avatar_token (self, contact);
+
+  if (sha1 != NULL)
+    {
+      gchar *mime_type = NULL;
+      GArray *arr = gabble_avatar_cache_lookup (self->avatar_cache, sha1,
+          &mime_type);
+
+      if (arr != NULL)
+        {
+          tp_svc_connection_interface_avatars_return_from_request_avatar (
+              context, arr, mime_type);
+          g_array_unref (arr);
+          g_free (mime_type);
+          return;
+        }
+    }
+
   if (gabble_vcard_manager_get_cached (self->vcard_manager,
       contact, &vcard_node))
     {
@@ -636,6 +694,7 @@ emit_avatar_retrieved (TpSvcConnectionInterfaceAvatars *iface,
                        TpHandle contact,
                        WockyNode *vcard_node)
 {
+  GabbleConnection *conn = GABBLE_CONNECTION (iface);
   const gchar *mime_type;
   GString *avatar_str;
   gchar *sha1;
@@ -645,6 +704,8 @@ emit_avatar_retrieved (TpSvcConnectionInterfaceAvatars *iface,
     return;
 
   sha1 = sha1_hex (avatar_str->str, avatar_str->len);
+  gabble_avatar_cache_store (conn->avatar_cache, sha1, avatar_str->str,
+      avatar_str->len, mime_type);
   arr = g_array_new (FALSE, FALSE, sizeof (gchar));
   g_array_append_vals (arr, avatar_str->str, avatar_str->len);
   tp_svc_connection_interface_avatars_emit_avatar_retrieved (iface, contact,
@@ -709,6 +770,9 @@ gabble_connection_request_avatars (TpSvcConnectionInterfaceAvatars *iface,
       WockyNode *vcard_node;
       TpHandle contact = g_array_index (contacts, TpHandle, i);
 
+      if (emit_avatar_retrieved_from_cache (self, contact))
+        continue;
+
       if (gabble_vcard_manager_get_cached (self->vcard_manager,
             contact, &vcard_node))
         {
@@ -752,6 +816,7 @@ struct _set_avatar_ctx {
   GabbleConnection *conn;
   DBusGMethodInvocation *invocation;
   GString *avatar;
+  gchar *mime_type;
 };
 
 
@@ -760,6 +825,7 @@ _set_avatar_ctx_free (struct _set_avatar_ctx *ctx)
 {
   if (ctx->avatar)
       g_string_free (ctx->avatar, TRUE);
+  g_free (ctx->mime_type);
   g_free (ctx);
 }
 
@@ -800,6 +866,9 @@ _set_avatar_cb2 (GabbleVCardManager *manager,
         {
           presence->avatar_sha1 = sha1_hex (ctx->avatar->str,
                                             ctx->avatar->len);
+          gabble_avatar_cache_store (ctx->conn->avatar_cache,
+              presence->avatar_sha1, ctx->avatar->str, ctx->avatar->len,
+              ctx->mime_type);
         }
       else
         {
@@ -862,6 +931,7 @@ gabble_connection_set_avatar (TpSvcConnectionInterfaceAvatars *iface,
           base64_data_size + (base64_data_size / 72) + 1;
 
       ctx->avatar = g_string_new_len (avatar->data, avatar->len);
+      ctx->mime_type = g_strdup (mime_type);
       base64 = g_malloc (base64_line_wrapped_data_size);
       outlen = g_base64_encode_step ((const guchar *) avatar->data,
           avatar->len, TRUE, base64, &state, &save);
@@ -961,8 +1031,7 @@ pep_avatar_request_data_cb (
   gchar *sha1;
   // we only request avatars of type png, so this is fixed for now
   const gchar *mime_type = "image/png";
-  gchar *bindata;
-  gsize outlen;
+  GString *bindata;
   GArray *arr;
 
   g_slice_free (pep_request_ctx, ctx);
@@ -1022,25 +1091,21 @@ pep_avatar_request_data_cb (
       return;
     }
 
-  bindata = (gchar *) g_base64_decode (binval_value, &outlen);
+  bindata = gabble_base64_decode_to_string (binval_value);
 
-  if (bindata == NULL)
-    {
-      g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
-        "failed to decode avatar from base64");
-      return;
-    }
-
-  sha1 = sha1_hex (bindata, outlen);
+  sha1 = sha1_hex (bindata->str, bindata->len);
+  gabble_avatar_cache_store (conn->avatar_cache, sha1, bindata->str,
+      bindata->len, mime_type);
   arr = g_array_new (FALSE, FALSE, sizeof (gchar));
-  g_array_append_vals (arr, bindata, outlen);
+  g_array_append_vals (arr, bindata->str, bindata->len);
   tp_svc_connection_interface_avatars_emit_avatar_retrieved (conn, handle,
       sha1, arr, mime_type);
 
   g_array_unref (arr);
-  g_free (bindata);
 
-  DEBUG ("retrieved avatar from %d with size=%zd, sha1='%s'", handle, outlen, sha1);
+  DEBUG ("retrieved avatar from %d with size=%zd, sha1='%s'", handle,
+      bindata->len, sha1);
+  g_string_free (bindata, TRUE);
 
   // is this really needed?
   if (sha1)
@@ -1171,6 +1236,8 @@ conn_avatars_init (GabbleConnection *conn)
 {
   g_assert (conn->vcard_manager != NULL);
 
+  conn->avatar_cache = gabble_avatar_cache_dup_shared ();
+
   g_signal_connect (conn->vcard_manager, "got-self-initial-avatar", G_CALLBACK
       (connection_got_self_initial_avatar_cb), conn);
   g_signal_connect (conn->presence_cache, "avatar-update", G_CALLBACK
@@ -31,8 +31,11 @@
 
 #include <wocky/wocky.h>
 
+#include "avatar-cache.h"
 #include "connection.h"
 #include "debug.h"
+#include "muc-history.h"
+#include "proxy-stats.h"
 
 #include "extensions/extensions.h"
 
@@ -72,6 +75,9 @@ gabble_connection_manager_finalize (GObject *object)
 {
   wocky_caps_cache_free_shared ();
   roster_cache_free_shared ();
+  gabble_avatar_cache_free_shared ();
+  gabble_proxy_stats_free_shared ();
+  gabble_muc_history_free_shared ();
   gabble_debug_free ();
 
   G_OBJECT_CLASS (gabble_connection_manager_parent_class)->finalize (object);
@@ -174,6 +174,11 @@ enum
     PROP_SEND_CHAT_MARKERS,
     PROP_FORCE_CHAT_MARKERS,
     PROP_FORCE_RECEIPTS,
+    PROP_DBUS_TUBE_BATCH_MS,
+    PROP_STREAM_TUBE_POOL_SIZE,
+    PROP_MUC_REJOIN_HISTORY,
+    PROP_MUC_PRESENCE_INTERVAL_MS,
+    PROP_ROOM_LIST_SKIP_INFO,
 
     LAST_PROPERTY
 };
@@ -232,6 +237,22 @@ struct _GabbleConnectionPrivate
   gboolean force_chat_markers;
   gboolean force_receipts;
 
+  /* how long outgoing messages on 1-1 D-Bus tubes may wait to be sent
+   * together, in ms */
+  guint dbus_tube_batch_ms;
+  /* how many bytestreams we keep negotiated ahead of time for each 1-1
+   * stream tube we've accepted */
+  guint stream_tube_pool_size;
+  /* whether rejoining a room asks for the messages we missed while we were
+   * out of it, rather than none at all */
+  gboolean muc_rejoin_history;
+  /* how long to wait between sending our new presence to one room and the
+   * next, in ms */
+  guint muc_presence_interval_ms;
+  /* whether room lists take the names rooms are given in the list on trust,
+   * rather than asking each room for its details */
+  gboolean room_list_skip_info;
+
   /* authentication properties */
   gchar *stream_server;
   gchar *username;
@@ -697,6 +718,26 @@ gabble_connection_get_property (GObject    *object,
       g_value_set_boolean (value, priv->force_receipts);
       break;
 
+    case PROP_DBUS_TUBE_BATCH_MS:
+      g_value_set_uint (value, priv->dbus_tube_batch_ms);
+      break;
+
+    case PROP_STREAM_TUBE_POOL_SIZE:
+      g_value_set_uint (value, priv->stream_tube_pool_size);
+      break;
+
+    case PROP_MUC_REJOIN_HISTORY:
+      g_value_set_boolean (value, priv->muc_rejoin_history);
+      break;
+
+    case PROP_MUC_PRESENCE_INTERVAL_MS:
+      g_value_set_uint (value, priv->muc_presence_interval_ms);
+      break;
+
+    case PROP_ROOM_LIST_SKIP_INFO:
+      g_value_set_boolean (value, priv->room_list_skip_info);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -860,6 +901,26 @@ gabble_connection_set_property (GObject      *object,
       priv->force_receipts = g_value_get_boolean (value);
       break;
 
+    case PROP_DBUS_TUBE_BATCH_MS:
+      priv->dbus_tube_batch_ms = g_value_get_uint (value);
+      break;
+
+    case PROP_STREAM_TUBE_POOL_SIZE:
+      priv->stream_tube_pool_size = g_value_get_uint (value);
+      break;
+
+    case PROP_MUC_REJOIN_HISTORY:
+      priv->muc_rejoin_history = g_value_get_boolean (value);
+      break;
+
+    case PROP_MUC_PRESENCE_INTERVAL_MS:
+      priv->muc_presence_interval_ms = g_value_get_uint (value);
+      break;
+
+    case PROP_ROOM_LIST_SKIP_INFO:
+      priv->room_list_skip_info = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -1297,6 +1358,51 @@ gabble_connection_class_init (GabbleConnectionClass *gabble_connection_class)
           FALSE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (
+      object_class, PROP_DBUS_TUBE_BATCH_MS,
+      g_param_spec_uint (
+          "dbus-tube-batch-ms", "D-Bus tube batching delay",
+          "Milliseconds outgoing messages on 1-1 D-Bus tubes may wait to be "
+          "sent together, or 0 to send each one straight away",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_STREAM_TUBE_POOL_SIZE,
+      g_param_spec_uint (
+          "stream-tube-pool-size", "Stream tube pool size",
+          "How many bytestreams to keep negotiated ahead of time for each "
+          "accepted 1-1 stream tube, or 0 to negotiate one per connection",
+          0, G_MAXUINT, 2,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_MUC_REJOIN_HISTORY,
+      g_param_spec_boolean (
+          "muc-rejoin-history", "Ask for missed MUC history?",
+          "Whether rejoining a room asks for the messages sent since we last "
+          "saw one there, or for no history at all",
+          TRUE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_MUC_PRESENCE_INTERVAL_MS,
+      g_param_spec_uint (
+          "muc-presence-interval-ms", "MUC presence interval",
+          "Milliseconds to wait between sending our new presence to one room "
+          "and the next, or 0 to send it to every room at once",
+          0, G_MAXUINT, 100,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_ROOM_LIST_SKIP_INFO,
+      g_param_spec_boolean (
+          "room-list-skip-info", "Skip room info in room lists?",
+          "Whether room lists report rooms with the names the server lists "
+          "them under, without asking each one for its details",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   gabble_connection_class->properties_class.interfaces = prop_interfaces;
   tp_dbus_properties_mixin_class_init (object_class,
       G_STRUCT_OFFSET (GabbleConnectionClass, properties_class));
@@ -1352,6 +1458,7 @@ gabble_connection_dispose (GObject *object)
 
   g_hash_table_unref (self->avatar_requests);
   g_hash_table_unref (self->vcard_requests);
+  tp_clear_object (&self->avatar_cache);
 
   conn_presence_dispose (self);
 
@@ -1965,7 +2072,7 @@ connector_connected (GabbleConnection *self,
       TP_HANDLE_TYPE_CONTACT);
 
   GObject *fobj = NULL;
-  WockyNode *feat;
+  WockyNode *feat, *limits;
 
   /* cleanup the cancellable */
   tp_clear_object (&priv->cancellable);
@@ -2000,6 +2107,16 @@ connector_connected (GabbleConnection *self,
           self->features |= GABBLE_CONNECTION_FEATURES_SM;
       else if (wocky_node_get_child_ns (feat, "sm", NS_SM2))
           self->features |= GABBLE_CONNECTION_FEATURES_SM;
+
+      limits = wocky_node_get_child_ns (feat, "limits", NS_STREAM_LIMITS);
+      if (limits != NULL)
+        {
+          WockyNode *max_bytes = wocky_node_get_child (limits, "max-bytes");
+
+          if (max_bytes != NULL && max_bytes->content != NULL)
+            self->max_stanza_size = MIN (G_MAXUINT,
+                g_ascii_strtoull (max_bytes->content, NULL, 10));
+        }
     }
   if (fobj != NULL)
     g_object_unref (fobj);
@@ -31,6 +31,8 @@
 #include <wocky/wocky.h>
 
 #include "gabble/capabilities.h"
+
+#include "avatar-cache.h"
 #ifdef ENABLE_FILE_TRANSFER
 #include "ft-manager.h"
 #endif
@@ -196,6 +198,9 @@ struct _GabbleConnection {
 
     /* connection feature flags */
     GabbleConnectionFeatures features;
+    /* largest stanza the server accepts, in bytes, as advertised in its
+     * stream features; 0 if it didn't say */
+    guint max_stanza_size;
 
     /* presence */
     GabblePresenceCache *presence_cache;
@@ -221,6 +226,9 @@ struct _GabbleConnection {
     /* outstanding avatar requests */
     GHashTable *avatar_requests;
 
+    /* on-disk avatar store, shared between connections */
+    GabbleAvatarCache *avatar_cache;
+
     /* outstanding vcard requests */
     GHashTable *vcard_requests;
 
@@ -0,0 +1,223 @@
+/*
+ * dbus-reassembler.c - Source for GabbleDBusReassembler
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Splits a byte stream back into the D-Bus messages that were written to it.
+ *
+ * Complete messages are handed out straight from the data that was passed
+ * in. Only a message that is cut short by the end of the data is copied, and
+ * the buffer it goes into never holds more than that one message, so nothing
+ * ever has to be moved along it. */
+
+#include "config.h"
+#include "dbus-reassembler.h"
+
+#include <string.h>
+
+#include <dbus/dbus.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_TUBES
+#include "debug.h"
+
+/* Each D-Bus message has a 16-byte fixed header, in which
+ *
+ * * byte 0 is 'l' (ell) or 'B' for endianness
+ * * bytes 4-7 are body length "n" in bytes in that endianness
+ * * bytes 12-15 are length "m" of param array in bytes in that
+ *   endianness
+ *
+ * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
+ */
+#define HEADER_SIZE 16
+
+struct _GabbleDBusReassembler {
+    /* the start of a message that the data so far ended in the middle of */
+    GString *partial;
+    /* size of the message in partial, or 0 if we don't have its header yet */
+    guint32 needed;
+};
+
+static guint32
+collect_le32 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+      ((guint32) bytes[3] << 24);
+}
+
+static guint32
+collect_be32 (const gchar *str)
+{
+  const guchar *bytes = (const guchar *) str;
+
+  return ((guint32) bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) |
+      bytes[3];
+}
+
+/* Returns the size of the message starting with @header, or 0 if it can't
+ * be a valid message */
+static guint32
+message_size (const gchar *header)
+{
+  guint32 body_length, params_length, m;
+
+  if (header[0] == DBUS_BIG_ENDIAN)
+    {
+      body_length = collect_be32 (header + 4);
+      m = collect_be32 (header + 12);
+    }
+  else if (header[0] == DBUS_LITTLE_ENDIAN)
+    {
+      body_length = collect_le32 (header + 4);
+      m = collect_le32 (header + 12);
+    }
+  else
+    {
+      DEBUG ("D-Bus message has unknown endianness byte 0x%x",
+          (guint) (guchar) header[0]);
+      return 0;
+    }
+
+  /* n.b.: the first and second tests are sufficient to ensure that the
+   * additions below don't overflow on 32-bit platforms */
+  if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
+      m > DBUS_MAXIMUM_ARRAY_LENGTH)
+    {
+      DEBUG ("D-Bus message is too large to be valid");
+      return 0;
+    }
+
+  /* pad to 8-byte boundary */
+  params_length = m + ((8 - (m % 8)) % 8);
+
+  if (params_length + body_length + HEADER_SIZE >
+      DBUS_MAXIMUM_MESSAGE_LENGTH)
+    {
+      DEBUG ("D-Bus message is too large to be valid");
+      return 0;
+    }
+
+  return params_length + body_length + HEADER_SIZE;
+}
+
+GabbleDBusReassembler *
+gabble_dbus_reassembler_new (void)
+{
+  GabbleDBusReassembler *self = g_slice_new0 (GabbleDBusReassembler);
+
+  self->partial = g_string_new ("");
+  return self;
+}
+
+/* Copies as much of @data into the partial message as it needs to have
+ * @wanted bytes, and returns how much was taken. */
+static gsize
+fill_partial (GabbleDBusReassembler *self,
+    const gchar *data,
+    gsize len,
+    gsize wanted)
+{
+  gsize taken = MIN (wanted - self->partial->len, len);
+
+  g_string_append_len (self->partial, data, taken);
+  return taken;
+}
+
+/*
+ * gabble_dbus_reassembler_feed:
+ *
+ * Calls @callback for each message completed by @data, which is the next part
+ * of the stream. The data passed to @callback is only valid until it returns.
+ *
+ * Returns: %FALSE if the stream can't be D-Bus messages, in which case
+ *  nothing more should be fed to @self.
+ */
+gboolean
+gabble_dbus_reassembler_feed (GabbleDBusReassembler *self,
+    const gchar *data,
+    gsize len,
+    GabbleDBusReassemblerMessageCb callback,
+    gpointer user_data)
+{
+  gsize offset = 0;
+
+  /* First finish off the message that the previous data ended in */
+  if (self->partial->len > 0)
+    {
+      if (self->needed == 0)
+        {
+          offset += fill_partial (self, data, len, HEADER_SIZE);
+
+          if (self->partial->len < HEADER_SIZE)
+            return TRUE;
+
+          self->needed = message_size (self->partial->str);
+
+          if (self->needed == 0)
+            return FALSE;
+        }
+
+      offset += fill_partial (self, data + offset, len - offset,
+          self->needed);
+
+      if (self->partial->len < self->needed)
+        return TRUE;
+
+      callback (self->partial->str, self->needed, user_data);
+      g_string_truncate (self->partial, 0);
+      self->needed = 0;
+    }
+
+  /* Then hand out whole messages without copying them */
+  while (len - offset >= HEADER_SIZE)
+    {
+      guint32 size = message_size (data + offset);
+
+      if (size == 0)
+        return FALSE;
+
+      if (len - offset < size)
+        {
+          self->needed = size;
+          break;
+        }
+
+      callback (data + offset, size, user_data);
+      offset += size;
+    }
+
+  /* and keep whatever is left over for next time */
+  g_string_append_len (self->partial, data + offset, len - offset);
+
+  return TRUE;
+}
+
+/* Returns the number of bytes held back waiting for the rest of a message */
+gsize
+gabble_dbus_reassembler_get_pending (GabbleDBusReassembler *self)
+{
+  return self->partial->len;
+}
+
+void
+gabble_dbus_reassembler_free (GabbleDBusReassembler *self)
+{
+  g_string_free (self->partial, TRUE);
+  g_slice_free (GabbleDBusReassembler, self);
+}
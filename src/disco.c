@@ -41,6 +41,9 @@
 
 #define DEFAULT_REQUEST_TIMEOUT 20
 #define DISCO_PIPELINE_SIZE 10
+/* How many items a pipeline asks for at a time, from servers which support
+ * XEP-0059 Result Set Management; others just send them all */
+#define DISCO_ITEMS_PAGE_SIZE 100
 
 /* signals */
 enum
@@ -279,6 +282,10 @@ gabble_disco_new (GabbleConnection *conn)
 
 
 static void notify_delete_request (gpointer data, GObject *obj);
+static GabbleDiscoRequest *disco_request_page (GabbleDisco *self,
+    GabbleDiscoType type, const gchar *jid, const char *node, guint timeout,
+    guint page_size, const gchar *after, GabbleDiscoCb callback,
+    gpointer user_data, GObject *object, GError **error);
 
 static void
 delete_request (GabbleDiscoRequest *request)
@@ -475,6 +482,20 @@ gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
                                    guint timeout, GabbleDiscoCb callback,
                                    gpointer user_data, GObject *object,
                                    GError **error)
+{
+  return disco_request_page (self, type, jid, node, timeout, 0, NULL,
+      callback, user_data, object, error);
+}
+
+/* As gabble_disco_request_with_timeout(), but if @page_size isn't 0, asks
+ * for at most that many results, after the page ending with @after (or
+ * from the start if it's NULL) */
+static GabbleDiscoRequest *
+disco_request_page (GabbleDisco *self, GabbleDiscoType type,
+                    const gchar *jid, const char *node,
+                    guint timeout, guint page_size, const gchar *after,
+                    GabbleDiscoCb callback, gpointer user_data,
+                    GObject *object, GError **error)
 {
   GabbleDiscoPrivate *priv = self->priv;
   GabbleDiscoRequest *request;
@@ -509,6 +530,18 @@ gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
       wocky_node_set_attribute (lm_node, "node", node);
     }
 
+  if (page_size > 0)
+    {
+      WockyNode *set = wocky_node_add_child_ns (lm_node, "set", NS_RSM);
+      gchar *max = g_strdup_printf ("%u", page_size);
+
+      wocky_node_add_child_with_content (set, "max", max);
+      g_free (max);
+
+      if (after != NULL)
+        wocky_node_add_child_with_content (set, "after", after);
+    }
+
   if (! _gabble_connection_send_with_reply (priv->connection, msg,
         request_reply_cb, G_OBJECT(self), request, error))
     {
@@ -552,11 +585,41 @@ struct _GabbleDiscoPipeline {
     GPtrArray *disco_pipeline;
     GHashTable *remaining_items;
     GabbleDiscoRequest *list_request;
+    gchar *server;
+    /* the last item of the page we asked for, and of the one we were given
+     * if there are more */
+    gchar *page_after;
+    gchar *next_page;
+    gboolean trust_item_names;
     gboolean running;
+    /* while an item is being reported, set by gabble_disco_pipeline_destroy()
+     * if the callback destroys the pipeline */
+    gboolean *destroyed;
 };
 
 static void
 gabble_disco_fill_pipeline (GabbleDisco *disco, GabbleDiscoPipeline *pipeline);
+static void request_page (GabbleDiscoPipeline *pipeline);
+static void disco_items_cb (GabbleDisco *disco, GabbleDiscoRequest *request,
+    const gchar *jid, const gchar *node, WockyNode *result, GError *error,
+    gpointer user_data);
+
+/* Returns FALSE if the callback destroyed the pipeline */
+static gboolean
+report_item (GabbleDiscoPipeline *pipeline,
+    GabbleDiscoItem *item)
+{
+  gboolean destroyed = FALSE;
+
+  pipeline->destroyed = &destroyed;
+  pipeline->callback (pipeline, item, pipeline->user_data);
+
+  if (destroyed)
+    return FALSE;
+
+  pipeline->destroyed = NULL;
+  return TRUE;
+}
 
 static void
 item_info_cb (GabbleDisco *disco,
@@ -647,7 +710,12 @@ item_info_cb (GabbleDisco *disco,
   item.type = type;
   item.features = keys;
 
-  pipeline->callback (pipeline, &item, pipeline->user_data);
+  if (!report_item (pipeline, &item))
+    {
+      g_hash_table_unref (keys);
+      return;
+    }
+
   g_hash_table_unref (keys);
 
 done:
@@ -694,7 +762,14 @@ gabble_disco_fill_pipeline (GabbleDisco *disco, GabbleDiscoPipeline *pipeline)
           g_hash_table_remove (pipeline->remaining_items, jid);
         }
 
-      if (0 == pipeline->disco_pipeline->len)
+      /* Only ask for the next page once this one's items are all being
+       * looked at, so we never hold more than one page of them */
+      if (pipeline->next_page != NULL && pipeline->list_request == NULL &&
+          0 == g_hash_table_size (pipeline->remaining_items))
+        request_page (pipeline);
+
+      if (0 == pipeline->disco_pipeline->len &&
+          pipeline->list_request == NULL)
         {
           /* signal that the pipeline has finished */
           pipeline->running = FALSE;
@@ -704,6 +779,19 @@ gabble_disco_fill_pipeline (GabbleDisco *disco, GabbleDiscoPipeline *pipeline)
 }
 
 
+static void
+request_page (GabbleDiscoPipeline *pipeline)
+{
+  g_free (pipeline->page_after);
+  pipeline->page_after = pipeline->next_page;
+  pipeline->next_page = NULL;
+
+  pipeline->list_request = disco_request_page (pipeline->disco,
+      GABBLE_DISCO_TYPE_ITEMS, pipeline->server, NULL,
+      DEFAULT_REQUEST_TIMEOUT, DISCO_ITEMS_PAGE_SIZE, pipeline->page_after,
+      disco_items_cb, pipeline, G_OBJECT (pipeline->disco), NULL);
+}
+
 static void
 disco_items_cb (GabbleDisco *disco,
           GabbleDiscoRequest *request,
@@ -713,11 +801,13 @@ disco_items_cb (GabbleDisco *disco,
           GError *error,
           gpointer user_data)
 {
-  const char *item_jid;
+  const char *item_jid, *item_name, *last;
   gpointer key, value;
   GabbleDiscoPipeline *pipeline = (GabbleDiscoPipeline *) user_data;
   WockyNodeIter i;
-  WockyNode *item;
+  WockyNode *item, *set;
+  GPtrArray *named = NULL;
+  guint n_items = 0;
 
   pipeline->list_request = NULL;
 
@@ -727,14 +817,26 @@ disco_items_cb (GabbleDisco *disco,
       goto out;
     }
 
+  named = g_ptr_array_new ();
+
   wocky_node_iter_init (&i, result, "item", NULL);
   while (wocky_node_iter_next (&i, &item))
     {
+      n_items++;
       item_jid = wocky_node_get_attribute (item, "jid");
+      item_name = wocky_node_get_attribute (item, "name");
 
-      if (NULL != item_jid &&
-          !g_hash_table_lookup_extended (pipeline->remaining_items, item_jid,
-            &key, &value))
+      if (NULL == item_jid)
+        continue;
+
+      if (pipeline->trust_item_names && NULL != item_name)
+        {
+          DEBUG ("discovered service item %s, not asking for its info",
+              item_jid);
+          g_ptr_array_add (named, item);
+        }
+      else if (!g_hash_table_lookup_extended (pipeline->remaining_items,
+            item_jid, &key, &value))
         {
           gchar *tmp = g_strdup (item_jid);
           DEBUG ("discovered service item: %s", tmp);
@@ -742,6 +844,47 @@ disco_items_cb (GabbleDisco *disco,
         }
     }
 
+  /* XEP-0059: if the server paged its reply, carry on after the last item,
+   * unless it's stopped making progress */
+  set = wocky_node_get_child_ns (result, "set", NS_RSM);
+  last = set == NULL ? NULL : wocky_node_get_content_from_child (set, "last");
+
+  if (n_items > 0 && last != NULL && tp_strdiff (last, pipeline->page_after))
+    {
+      DEBUG ("more items on %s after %s", jid, last);
+      pipeline->next_page = g_strdup (last);
+    }
+
+  /* Items we take the server's word for are reported once we're done with
+   * the reply, as the callback may destroy the pipeline */
+  if (named->len > 0)
+    {
+      GHashTable *no_features = g_hash_table_new (g_str_hash, g_str_equal);
+      gboolean alive = TRUE;
+      guint j;
+
+      for (j = 0; alive && j < named->len; j++)
+        {
+          WockyNode *named_item = g_ptr_array_index (named, j);
+          GabbleDiscoItem bare_item = { NULL, NULL, NULL, NULL, NULL };
+
+          bare_item.jid = wocky_node_get_attribute (named_item, "jid");
+          bare_item.name = wocky_node_get_attribute (named_item, "name");
+          bare_item.features = no_features;
+          alive = report_item (pipeline, &bare_item);
+        }
+
+      g_hash_table_unref (no_features);
+
+      if (!alive)
+        {
+          g_ptr_array_unref (named);
+          return;
+        }
+    }
+
+  g_ptr_array_unref (named);
+
 out:
   gabble_disco_fill_pipeline (disco, pipeline);
 }
@@ -769,21 +912,47 @@ gpointer gabble_disco_pipeline_init (GabbleDisco *disco,
   pipeline->disco_pipeline = g_ptr_array_sized_new (DISCO_PIPELINE_SIZE);
   pipeline->remaining_items = g_hash_table_new_full (g_str_hash, g_str_equal,
       g_free, NULL);
+  pipeline->list_request = NULL;
+  pipeline->server = NULL;
+  pipeline->page_after = NULL;
+  pipeline->next_page = NULL;
+  pipeline->trust_item_names = FALSE;
   pipeline->running = TRUE;
+  pipeline->destroyed = NULL;
   pipeline->disco = disco;
 
   return pipeline;
 }
 
+/**
+ * gabble_disco_pipeline_set_trust_item_names:
+ * @self: reference to the pipeline structure
+ * @trust: whether to believe the names the server gives items
+ *
+ * If @trust is %TRUE, items which have a name in the ITEMS reply are passed
+ * to the callback straight away, with %NULL category and type and no
+ * features, rather than being queried for INFO.
+ */
+void
+gabble_disco_pipeline_set_trust_item_names (gpointer self,
+                                            gboolean trust)
+{
+  GabbleDiscoPipeline *pipeline = (GabbleDiscoPipeline *) self;
+
+  pipeline->trust_item_names = trust;
+}
+
 /**
  * gabble_disco_pipeline_run:
  * @self: reference to the pipeline structure
  * @server: server to query
  *
  * Makes ITEMS request on the server, and afterwards queries for INFO
- * on each item. INFO queries are pipelined. The item properties are stored
- * in hash table parameter to the callback function. The user is responsible
- * for destroying the hash table after it's done with.
+ * on each item. If the server pages the ITEMS reply, each page is requested
+ * once the previous one's items have been queried. INFO queries are
+ * pipelined. The item properties are stored in hash table parameter to the
+ * callback function. The user is responsible for destroying the hash table
+ * after it's done with.
  *
  * Upon returning all the results, the end_callback is called with
  * reference to the pipeline.
@@ -795,9 +964,11 @@ gabble_disco_pipeline_run (gpointer self, const char *server)
 
   pipeline->running = TRUE;
 
-  pipeline->list_request = gabble_disco_request (pipeline->disco,
-      GABBLE_DISCO_TYPE_ITEMS, server, NULL, disco_items_cb, pipeline,
-      G_OBJECT (pipeline->disco), NULL);
+  g_free (pipeline->server);
+  pipeline->server = g_strdup (server);
+  tp_clear_pointer (&pipeline->page_after, g_free);
+  tp_clear_pointer (&pipeline->next_page, g_free);
+  request_page (pipeline);
 }
 
 
@@ -815,6 +986,9 @@ gabble_disco_pipeline_destroy (gpointer self)
 
   pipeline->running = FALSE;
 
+  if (pipeline->destroyed != NULL)
+    *pipeline->destroyed = TRUE;
+
   if (pipeline->list_request != NULL)
     {
       gabble_disco_cancel_request (pipeline->disco, pipeline->list_request);
@@ -832,6 +1006,9 @@ gabble_disco_pipeline_destroy (gpointer self)
 
   g_hash_table_unref (pipeline->remaining_items);
   g_ptr_array_unref (pipeline->disco_pipeline);
+  g_free (pipeline->server);
+  g_free (pipeline->page_after);
+  g_free (pipeline->next_page);
   g_free (pipeline);
 }
 
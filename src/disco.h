@@ -123,6 +123,8 @@ gpointer gabble_disco_pipeline_init (GabbleDisco *disco,
                                      GabbleDiscoEndCb end_callback,
                                      gpointer user_data);
 
+void gabble_disco_pipeline_set_trust_item_names (gpointer self,
+    gboolean trust);
 void gabble_disco_pipeline_run (gpointer self, const char *server);
 void gabble_disco_pipeline_destroy (gpointer self);
 
@@ -34,15 +34,21 @@
 # include <unistd.h>
 #endif
 
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+# include <sys/sendfile.h>
+# define USE_SENDFILE 1
+#endif
+
 #define DEBUG_FLAG GABBLE_DEBUG_FT
 #include "debug.h"
 
 #include <gibber/gibber-listener.h>
 #include <gibber/gibber-transport.h>
-#include <gibber/gibber-unix-transport.h>       /* just for the feature-test */
+#include <gibber/gibber-unix-transport.h>
 
 #include "connection.h"
 #include "ft-channel.h"
+#include "ft-hasher.h"
 #include "gabble-signals-marshal.h"
 #include "namespaces.h"
 #include "presence-cache.h"
@@ -121,6 +127,18 @@ struct _GabbleFileTransferChannelPrivate {
   GibberListener *listener;
   GibberTransport *transport;
 
+  /* If the client passed us the file itself rather than writing its
+   * contents to the local socket, we read it from file_fd with
+   * file_source, unless the bytestream is write-blocked. */
+  int file_fd;
+  guint file_source;
+  gboolean file_blocked;
+
+  /* Hashes incoming data to check it against content_hash. If its thread
+   * falls behind, we stop reading until it catches up. */
+  GabbleFtHasher *hasher;
+  gboolean hasher_behind;
+
   /* properties */
   TpFileTransferState state;
   gchar *content_type;
@@ -169,6 +187,7 @@ gabble_file_transfer_channel_init (GabbleFileTransferChannel *obj)
 {
   obj->priv = G_TYPE_INSTANCE_GET_PRIVATE (obj,
       GABBLE_TYPE_FILE_TRANSFER_CHANNEL, GabbleFileTransferChannelPrivate);
+  obj->priv->file_fd = -1;
 }
 
 static void
@@ -868,12 +887,37 @@ gabble_file_transfer_channel_finalize (GObject *object)
   G_OBJECT_CLASS (gabble_file_transfer_channel_parent_class)->finalize (object);
 }
 
+static void
+stop_sending_file (GabbleFileTransferChannel *self)
+{
+  if (self->priv->file_source != 0)
+    {
+      g_source_remove (self->priv->file_source);
+      self->priv->file_source = 0;
+    }
+
+  if (self->priv->file_fd != -1)
+    {
+      close (self->priv->file_fd);
+      self->priv->file_fd = -1;
+    }
+}
+
 static void
 close_session_and_transport (GabbleFileTransferChannel *self)
 {
 
   DEBUG ("Closing session and transport");
 
+  stop_sending_file (self);
+
+  if (self->priv->hasher != NULL)
+    {
+      gabble_ft_hasher_free (self->priv->hasher);
+      self->priv->hasher = NULL;
+      self->priv->hasher_behind = FALSE;
+    }
+
 #ifdef ENABLE_JINGLE_FILE_TRANSFER
   if (self->priv->gtalk_file_collection != NULL)
     gtalk_file_collection_terminate (self->priv->gtalk_file_collection, self);
@@ -982,6 +1026,11 @@ channel_open (GabbleFileTransferChannel *self)
 static void
 bytestream_closed (GabbleFileTransferChannel *self)
 {
+  if (self->priv->hasher != NULL &&
+      gabble_ft_hasher_is_finishing (self->priv->hasher))
+    /* We've got all the data; whether it was correct is still to be seen */
+    return;
+
   if (self->priv->state != TP_FILE_TRANSFER_STATE_COMPLETED &&
       self->priv->state != TP_FILE_TRANSFER_STATE_CANCELLED)
     {
@@ -1559,6 +1608,87 @@ transferred_chunk (GabbleFileTransferChannel *self,
        emit_progress_update_cb, self);
 }
 
+static void
+block_incoming_data (GabbleFileTransferChannel *self,
+    gboolean block)
+{
+  if (self->priv->bytestream != NULL)
+    gabble_bytestream_iface_block_reading (self->priv->bytestream, block);
+#ifdef ENABLE_JINGLE_FILE_TRANSFER
+  else if (self->priv->gtalk_file_collection != NULL)
+    gtalk_file_collection_block_reading (self->priv->gtalk_file_collection,
+        self, block);
+#endif
+}
+
+static void
+receive_completed (GabbleFileTransferChannel *self)
+{
+  gabble_file_transfer_channel_set_state (
+      TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
+      TP_FILE_TRANSFER_STATE_COMPLETED,
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
+
+  if (gibber_transport_buffer_is_empty (self->priv->transport))
+    gibber_transport_disconnect (self->priv->transport);
+}
+
+/* Resumes reading from the bytestream, unless the client or the hasher still
+ * has to catch up, or we've got the whole file and are checking its hash */
+static void
+unblock_incoming_data (GabbleFileTransferChannel *self)
+{
+  if (self->priv->hasher_behind)
+    return;
+
+  if (self->priv->hasher != NULL &&
+      gabble_ft_hasher_is_finishing (self->priv->hasher))
+    return;
+
+  if (self->priv->transport != NULL &&
+      gibber_transport_buffer_is_high (self->priv->transport))
+    return;
+
+  block_incoming_data (self, FALSE);
+}
+
+static void
+hasher_caught_up_cb (GabbleFtHasher *hasher,
+    gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+
+  self->priv->hasher_behind = FALSE;
+  unblock_incoming_data (self);
+}
+
+static void
+hash_checked_cb (GabbleFtHasher *hasher,
+    const gchar *digest,
+    gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+
+  gabble_ft_hasher_free (self->priv->hasher);
+  self->priv->hasher = NULL;
+  self->priv->hasher_behind = FALSE;
+
+  if (g_ascii_strcasecmp (digest, self->priv->content_hash) != 0)
+    {
+      DEBUG ("Received file doesn't match its hash: expected %s, got %s",
+          self->priv->content_hash, digest);
+      gabble_file_transfer_channel_set_state (
+          TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
+          TP_FILE_TRANSFER_STATE_CANCELLED,
+          TP_FILE_TRANSFER_STATE_CHANGE_REASON_REMOTE_ERROR);
+      close_session_and_transport (self);
+      return;
+    }
+
+  DEBUG ("Received file matches its hash. Transfer is complete");
+  receive_completed (self);
+}
+
 static void
 data_received_cb (GabbleFileTransferChannel *self, const guint8 *data, guint len)
 {
@@ -1578,35 +1708,41 @@ data_received_cb (GabbleFileTransferChannel *self, const guint8 *data, guint len
       return;
     }
 
+  if (self->priv->hasher != NULL &&
+      !gabble_ft_hasher_update (self->priv->hasher, data, len) &&
+      !self->priv->hasher_behind)
+    {
+      DEBUG ("hashing has fallen behind; waiting for it to catch up");
+      self->priv->hasher_behind = TRUE;
+      gabble_ft_hasher_wait (self->priv->hasher, hasher_caught_up_cb, self);
+    }
+
   transferred_chunk (self, (guint64) len);
 
   if (self->priv->bytestream != NULL &&
       self->priv->transferred_bytes + self->priv->initial_offset >=
       self->priv->size)
     {
-      DEBUG ("Received all the file. Transfer is complete");
-      gabble_file_transfer_channel_set_state (
-          TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
-          TP_FILE_TRANSFER_STATE_COMPLETED,
-          TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
-
-      if (gibber_transport_buffer_is_empty (self->priv->transport))
-        gibber_transport_disconnect (self->priv->transport);
+      if (self->priv->hasher != NULL)
+        {
+          DEBUG ("Received all the file. Checking its hash");
+          block_incoming_data (self, TRUE);
+          gabble_ft_hasher_finish (self->priv->hasher, hash_checked_cb, self);
+          return;
+        }
 
+      DEBUG ("Received all the file. Transfer is complete");
+      receive_completed (self);
       return;
     }
 
-  if (!gibber_transport_buffer_is_empty (self->priv->transport))
-    {
-      /* We don't want to send more data while the buffer isn't empty */
-      if (self->priv->bytestream != NULL)
-        gabble_bytestream_iface_block_reading (self->priv->bytestream, TRUE);
-#ifdef ENABLE_JINGLE_FILE_TRANSFER
-      else if (self->priv->gtalk_file_collection != NULL)
-        gtalk_file_collection_block_reading (self->priv->gtalk_file_collection,
-            self, TRUE);
-#endif
-    }
+  /* Keep reading until the client or the hasher falls behind by more than
+   * their high watermark; we'll resume once both have caught up
+   * (buffer-low, hasher_caught_up_cb()). Blocking as soon as anything is
+   * buffered would stall the bytestream on every short write. */
+  if (self->priv->hasher_behind ||
+      gibber_transport_buffer_is_high (self->priv->transport))
+    block_incoming_data (self, TRUE);
 }
 
 #ifdef ENABLE_JINGLE_FILE_TRANSFER
@@ -1621,11 +1757,11 @@ gabble_file_transfer_channel_gtalk_file_collection_data_received (
 static void
 bytestream_data_received_cb (GabbleBytestreamIface *stream,
                   TpHandle sender,
-                  GString *data,
+                  const GibberBuffer *data,
                   gpointer user_data)
 {
   GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
-  data_received_cb (self, (const guint8 *) data->str, data->len);
+  data_received_cb (self, data->data, data->length);
 }
 
 static void
@@ -1880,70 +2016,290 @@ get_local_unix_socket_path (GabbleFileTransferChannel *self)
 }
 #endif
 
-/*
- * Data is available from the channel so we can send it.
- */
+static gboolean
+all_data_sent (GabbleFileTransferChannel *self)
+{
+  return self->priv->transferred_bytes + self->priv->initial_offset >=
+      self->priv->size;
+}
+
 static void
-transport_handler (GibberTransport *transport,
-                   GibberBuffer *data,
-                   gpointer user_data)
+file_sent (GabbleFileTransferChannel *self)
 {
-  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+  stop_sending_file (self);
 
   if (self->priv->bytestream != NULL)
     {
-      if (!gabble_bytestream_iface_send (self->priv->bytestream, data->length,
-              (const gchar *) data->data))
+      DEBUG ("All the file has been sent. Closing the bytestream");
+      gabble_file_transfer_channel_set_state (
+          TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
+          TP_FILE_TRANSFER_STATE_COMPLETED,
+          TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
+      gabble_bytestream_iface_close (self->priv->bytestream, NULL);
+    }
+#ifdef ENABLE_JINGLE_FILE_TRANSFER
+  else if (self->priv->gtalk_file_collection != NULL)
+    {
+      DEBUG ("All the file has been sent.");
+      gtalk_file_collection_completed (self->priv->gtalk_file_collection,
+          self);
+    }
+#endif
+}
+
+/* Returns FALSE if the session has been closed */
+static gboolean
+send_file_data (GabbleFileTransferChannel *self,
+    const guint8 *data,
+    gsize len)
+{
+  if (self->priv->bytestream != NULL)
+    {
+      if (!gabble_bytestream_iface_send (self->priv->bytestream, len,
+              (const gchar *) data))
         {
           DEBUG ("Sending failed. Closing the bytestream");
           close_session_and_transport (self);
-          return;
+          return FALSE;
         }
     }
 #ifdef ENABLE_JINGLE_FILE_TRANSFER
   else if (self->priv->gtalk_file_collection != NULL)
     {
       if (!gtalk_file_collection_send_data (self->priv->gtalk_file_collection,
-              self, (const gchar *) data->data, data->length))
+              self, (const gchar *) data, len))
         {
           DEBUG ("Sending failed. Closing the jingle session");
           close_session_and_transport (self);
-          return;
+          return FALSE;
         }
     }
 #endif
 
-  transferred_chunk (self, (guint64) data->length);
+  transferred_chunk (self, (guint64) len);
 
-  if (self->priv->transferred_bytes + self->priv->initial_offset >=
-      self->priv->size)
+  if (all_data_sent (self))
+    file_sent (self);
+
+  return TRUE;
+}
+
+/*
+ * Data is available from the channel so we can send it.
+ */
+static void
+transport_handler (GibberTransport *transport,
+                   GibberBuffer *data,
+                   gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+
+  send_file_data (self, data->data, data->length);
+}
+
+/* Read at most this much from a file passed by the client before going back
+ * to the main loop */
+#define FILE_READ_SIZE (64 * 1024)
+#define FILE_SEND_BUDGET (1024 * 1024)
+
+static void
+file_send_failed (GabbleFileTransferChannel *self,
+    const gchar *what)
+{
+  DEBUG ("%s; cancelling the transfer", what);
+
+  gabble_file_transfer_channel_set_state (
+      TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
+      TP_FILE_TRANSFER_STATE_CANCELLED,
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_ERROR);
+  close_session_and_transport (self);
+}
+
+static gboolean
+read_file_cb (gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+  guint8 buffer[FILE_READ_SIZE];
+  guint64 offset = self->priv->initial_offset + self->priv->transferred_bytes;
+  ssize_t len;
+
+  len = pread (self->priv->file_fd, buffer,
+      MIN (sizeof (buffer), self->priv->size - offset), (off_t) offset);
+
+  if (len < 0 && errno == EINTR)
+    return TRUE;
+
+  self->priv->file_source = 0;
+
+  if (len < 0)
+    {
+      file_send_failed (self, g_strerror (errno));
+      return FALSE;
+    }
+
+  if (len == 0)
+    {
+      file_send_failed (self, "file is shorter than announced");
+      return FALSE;
+    }
+
+  if (!send_file_data (self, buffer, len) || all_data_sent (self) ||
+      self->priv->file_blocked)
+    return FALSE;
+
+  self->priv->file_source = g_idle_add (read_file_cb, self);
+  return FALSE;
+}
+
+#ifdef USE_SENDFILE
+static gboolean
+sendfile_cb (GIOChannel *source,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+  GibberFdTransport *raw = NULL;
+  gsize budget = FILE_SEND_BUDGET;
+
+  if (self->priv->bytestream != NULL)
+    raw = gabble_bytestream_iface_get_raw_transport (self->priv->bytestream);
+
+  if (raw == NULL)
+    {
+      /* The bytestream is closing; it'll tell us what happened */
+      self->priv->file_source = 0;
+      return FALSE;
+    }
+
+  while (budget > 0)
     {
-      if (self->priv->bytestream != NULL)
+      off_t offset = self->priv->initial_offset +
+          self->priv->transferred_bytes;
+      ssize_t len;
+
+      len = sendfile (raw->fd, self->priv->file_fd, &offset,
+          MIN (budget, self->priv->size - (guint64) offset));
+
+      if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return TRUE;
+
+      if (len <= 0)
         {
-          DEBUG ("All the file has been sent. Closing the bytestream");
-          gabble_file_transfer_channel_set_state (
-              TP_SVC_CHANNEL_TYPE_FILE_TRANSFER (self),
-              TP_FILE_TRANSFER_STATE_COMPLETED,
-              TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
-          gabble_bytestream_iface_close (self->priv->bytestream, NULL);
+          self->priv->file_source = 0;
+          file_send_failed (self,
+              len < 0 ? g_strerror (errno) : "file is shorter than announced");
+          return FALSE;
         }
-#ifdef ENABLE_JINGLE_FILE_TRANSFER
-      else if (self->priv->gtalk_file_collection != NULL)
+
+      budget -= len;
+      transferred_chunk (self, (guint64) len);
+
+      if (all_data_sent (self))
         {
-          DEBUG ("All the file has been sent.");
-          gtalk_file_collection_completed (self->priv->gtalk_file_collection,
-              self);
+          self->priv->file_source = 0;
+          file_sent (self);
+          return FALSE;
         }
+    }
+
+  return TRUE;
+}
 #endif
+
+static void
+send_from_file (GabbleFileTransferChannel *self)
+{
+#ifdef USE_SENDFILE
+  GibberFdTransport *raw = NULL;
+#endif
+
+  if (self->priv->file_fd == -1 || self->priv->file_source != 0 ||
+      self->priv->file_blocked)
+    return;
+
+#ifdef USE_SENDFILE
+  if (self->priv->bytestream != NULL)
+    raw = gabble_bytestream_iface_get_raw_transport (self->priv->bytestream);
+
+  /* The SOCKS5 socket carries nothing but the file, so we can have the
+   * kernel copy the file straight into it */
+  if (raw != NULL && gibber_transport_buffer_is_empty (GIBBER_TRANSPORT (raw)))
+    {
+      GIOChannel *channel = g_io_channel_unix_new (raw->fd);
+
+      DEBUG ("sending the file with sendfile()");
+      self->priv->file_source = g_io_add_watch (channel, G_IO_OUT,
+          sendfile_cb, self);
+      g_io_channel_unref (channel);
+      return;
     }
+#endif
+
+  self->priv->file_source = g_idle_add (read_file_cb, self);
 }
 
+static void
+block_file (GabbleFileTransferChannel *self,
+    gboolean blocked)
+{
+  self->priv->file_blocked = blocked;
+
+  if (blocked)
+    {
+      if (self->priv->file_source != 0)
+        {
+          g_source_remove (self->priv->file_source);
+          self->priv->file_source = 0;
+        }
+    }
+  else
+    {
+      send_from_file (self);
+    }
+}
+
+#ifdef GIBBER_TYPE_UNIX_TRANSPORT
+/* The client may send us the file's descriptor along with its first message
+ * instead of writing the file's contents to the socket; the rest of the
+ * message is ignored in that case. */
+static void
+file_fd_received_cb (GibberUnixTransport *transport,
+    GibberBuffer *buffer,
+    int fd,
+    GError *error,
+    gpointer user_data)
+{
+  GabbleFileTransferChannel *self = GABBLE_FILE_TRANSFER_CHANNEL (user_data);
+
+  if (error != NULL)
+    /* transport_disconnected_cb() will cancel the transfer */
+    return;
+
+  if (fd == -1)
+    {
+      /* Good old data */
+      transport_handler (GIBBER_TRANSPORT (transport), buffer, self);
+      return;
+    }
+
+  DEBUG ("client passed fd %d; sending the file from it", fd);
+  self->priv->file_fd = fd;
+
+  /* We don't expect anything more from the client */
+  gibber_transport_block_receiving (self->priv->transport, TRUE);
+
+  send_from_file (self);
+}
+#endif
+
 static void
 bytestream_write_blocked_cb (GabbleBytestreamIface *bytestream,
                              gboolean blocked,
                              GabbleFileTransferChannel *self)
 {
-  if (self->priv->transport != NULL)
+  if (self->priv->file_fd != -1)
+    block_file (self, blocked);
+  else if (self->priv->transport != NULL)
     gibber_transport_block_receiving (self->priv->transport, blocked);
 }
 
@@ -1952,7 +2308,9 @@ void
 gabble_file_transfer_channel_gtalk_file_collection_write_blocked (
     GabbleFileTransferChannel *self, gboolean blocked)
 {
-  if (self->priv->transport != NULL)
+  if (self->priv->file_fd != -1)
+    block_file (self, blocked);
+  else if (self->priv->transport != NULL)
     gibber_transport_block_receiving (self->priv->transport, blocked);
 }
 #endif
@@ -1969,11 +2327,30 @@ file_transfer_send (GabbleFileTransferChannel *self)
 
   gibber_transport_set_handler (self->priv->transport, transport_handler,
       self);
+
+#ifdef GIBBER_TYPE_UNIX_TRANSPORT
+  if (GIBBER_IS_UNIX_TRANSPORT (self->priv->transport))
+    gibber_unix_transport_recv_fd (
+        GIBBER_UNIX_TRANSPORT (self->priv->transport), file_fd_received_cb,
+        self);
+#endif
 }
 
 static void
 file_transfer_receive (GabbleFileTransferChannel *self)
 {
+  /* We can only check the hash if we see the whole file go past, which
+   * isn't the case when resuming. */
+  if (self->priv->bytestream != NULL && self->priv->hasher == NULL &&
+      self->priv->content_hash != NULL &&
+      gabble_ft_hasher_supports (self->priv->content_hash_type) &&
+      self->priv->initial_offset == 0)
+    {
+      DEBUG ("will check the file against its hash");
+      self->priv->hasher = gabble_ft_hasher_new (
+          self->priv->content_hash_type);
+    }
+
   /* Client is connected, we can now receive data. Unblock the bytestream */
   if (self->priv->bytestream != NULL)
     gabble_bytestream_iface_block_reading (self->priv->bytestream, FALSE);
@@ -1993,6 +2370,10 @@ transport_disconnected_cb (GibberTransport *transport,
 
   DEBUG ("transport to local socket has been disconnected");
 
+  if (self->priv->file_fd != -1)
+    /* The client gave us the file; we don't need it any more */
+    return;
+
   /* If we are sending the file, we can expect the transport to be closed as
      soon as we received all the data. Otherwise, it should only get closed once
      the channel has gone to state COMPLETED.
@@ -2014,20 +2395,19 @@ transport_disconnected_cb (GibberTransport *transport,
     }
 }
 
+static void
+transport_buffer_low_cb (GibberTransport *transport,
+                         GabbleFileTransferChannel *self)
+{
+  /* The client has caught up so we can unblock the bytestream if it was
+   * blocked */
+  unblock_incoming_data (self);
+}
+
 static void
 transport_buffer_empty_cb (GibberTransport *transport,
                            GabbleFileTransferChannel *self)
 {
-  /* Buffer is empty so we can unblock the buffer if it was blocked */
-  if (self->priv->bytestream != NULL)
-    gabble_bytestream_iface_block_reading (self->priv->bytestream, FALSE);
-
-#ifdef ENABLE_JINGLE_FILE_TRANSFER
-  if (self->priv->gtalk_file_collection != NULL)
-    gtalk_file_collection_block_reading (self->priv->gtalk_file_collection,
-        self, FALSE);
-#endif
-
   if (self->priv->state > TP_FILE_TRANSFER_STATE_OPEN)
     gibber_transport_disconnect (transport);
 }
@@ -2050,6 +2430,8 @@ new_connection_cb (GibberListener *listener,
   self->priv->transport = g_object_ref (transport);
   gabble_signal_connect_weak (transport, "disconnected",
     G_CALLBACK (transport_disconnected_cb), G_OBJECT (self));
+  gabble_signal_connect_weak (transport, "buffer-low",
+    G_CALLBACK (transport_buffer_low_cb), G_OBJECT (self));
   gabble_signal_connect_weak (transport, "buffer-empty",
     G_CALLBACK (transport_buffer_empty_cb), G_OBJECT (self));
 
@@ -0,0 +1,311 @@
+/*
+ * ft-hasher.c - Source for GabbleFtHasher
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Hashes a file transfer's data as it goes past, so that it can be checked
+ * against the hash given in the offer once the transfer is complete. The
+ * hashing happens in a thread of its own, so the main loop only has to copy
+ * each chunk onto a queue. If the thread falls behind a fast bytestream, the
+ * caller is told to stop reading until it has caught up, so the queue
+ * doesn't grow without bound. */
+
+#include "config.h"
+#include "ft-hasher.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_FT
+#include "debug.h"
+
+/* Once this many bytes are waiting to be hashed, the thread is behind */
+#define HIGH_WATERMARK (4 * 1024 * 1024)
+/* and it has caught up again once no more than this many are */
+#define LOW_WATERMARK (1024 * 1024)
+
+struct _GabbleFtHasher {
+    GThread *thread;
+    /* GBytes, then &finish_marker or &stop_marker */
+    GAsyncQueue *queue;
+    GChecksum *checksum;
+
+    GMainContext *context;
+    GabbleFtHasherDoneCb callback;
+    gpointer user_data;
+
+    /* protects the fields below, which the thread uses to hand the digest
+     * back to the main loop, and to say when it has caught up */
+    GMutex lock;
+    gboolean cancelled;
+    GSource *done_source;
+    gchar *digest;
+    /* bytes on the queue which haven't been hashed yet */
+    gsize pending;
+    GabbleFtHasherCaughtUpCb caught_up_callback;
+    gpointer caught_up_data;
+    GSource *caught_up_source;
+};
+
+static gchar finish_marker;
+static gchar stop_marker;
+
+static GChecksumType
+checksum_type (TpFileHashType hash_type)
+{
+  switch (hash_type)
+    {
+      case TP_FILE_HASH_TYPE_MD5:
+        return G_CHECKSUM_MD5;
+      case TP_FILE_HASH_TYPE_SHA1:
+        return G_CHECKSUM_SHA1;
+      case TP_FILE_HASH_TYPE_SHA256:
+        return G_CHECKSUM_SHA256;
+      default:
+        return (GChecksumType) -1;
+    }
+}
+
+gboolean
+gabble_ft_hasher_supports (TpFileHashType hash_type)
+{
+  return checksum_type (hash_type) != (GChecksumType) -1;
+}
+
+static gboolean
+hasher_done_cb (gpointer user_data)
+{
+  GabbleFtHasher *self = user_data;
+  gchar *digest;
+
+  g_mutex_lock (&self->lock);
+  g_source_unref (self->done_source);
+  self->done_source = NULL;
+  digest = self->digest;
+  self->digest = NULL;
+  g_mutex_unlock (&self->lock);
+
+  DEBUG ("digest: %s", digest);
+
+  self->callback (self, digest, self->user_data);
+  g_free (digest);
+  return FALSE;
+}
+
+static gboolean
+hasher_caught_up_cb (gpointer user_data)
+{
+  GabbleFtHasher *self = user_data;
+  GabbleFtHasherCaughtUpCb callback;
+  gpointer callback_data;
+
+  g_mutex_lock (&self->lock);
+  g_source_unref (self->caught_up_source);
+  self->caught_up_source = NULL;
+  callback = self->caught_up_callback;
+  callback_data = self->caught_up_data;
+  self->caught_up_callback = NULL;
+  self->caught_up_data = NULL;
+  g_mutex_unlock (&self->lock);
+
+  DEBUG ("caught up");
+
+  callback (self, callback_data);
+  return FALSE;
+}
+
+/* Must be called with the lock held */
+static void
+check_caught_up (GabbleFtHasher *self)
+{
+  if (self->caught_up_callback == NULL || self->caught_up_source != NULL ||
+      self->cancelled || self->pending > LOW_WATERMARK)
+    return;
+
+  self->caught_up_source = g_idle_source_new ();
+  g_source_set_callback (self->caught_up_source, hasher_caught_up_cb, self,
+      NULL);
+  g_source_attach (self->caught_up_source, self->context);
+}
+
+static gpointer
+hasher_thread (gpointer user_data)
+{
+  GabbleFtHasher *self = user_data;
+  gpointer item;
+
+  while ((item = g_async_queue_pop (self->queue)) != &stop_marker)
+    {
+      if (item == &finish_marker)
+        {
+          g_mutex_lock (&self->lock);
+
+          if (!self->cancelled)
+            {
+              self->digest = g_strdup (g_checksum_get_string (self->checksum));
+              self->done_source = g_idle_source_new ();
+              g_source_set_callback (self->done_source, hasher_done_cb, self,
+                  NULL);
+              g_source_attach (self->done_source, self->context);
+            }
+
+          g_mutex_unlock (&self->lock);
+        }
+      else
+        {
+          GBytes *bytes = item;
+          gsize len;
+          const guchar *data = g_bytes_get_data (bytes, &len);
+
+          if (!g_atomic_int_get (&self->cancelled))
+            g_checksum_update (self->checksum, data, len);
+
+          g_bytes_unref (bytes);
+
+          g_mutex_lock (&self->lock);
+          self->pending -= len;
+          check_caught_up (self);
+          g_mutex_unlock (&self->lock);
+        }
+    }
+
+  return NULL;
+}
+
+GabbleFtHasher *
+gabble_ft_hasher_new (TpFileHashType hash_type)
+{
+  GabbleFtHasher *self;
+
+  g_return_val_if_fail (gabble_ft_hasher_supports (hash_type), NULL);
+
+  self = g_slice_new0 (GabbleFtHasher);
+  self->checksum = g_checksum_new (checksum_type (hash_type));
+  self->queue = g_async_queue_new ();
+  self->context = g_main_context_ref_thread_default ();
+  g_mutex_init (&self->lock);
+  self->thread = g_thread_new ("ft-hasher", hasher_thread, self);
+
+  return self;
+}
+
+/*
+ * gabble_ft_hasher_update:
+ *
+ * Queues @data to be hashed.
+ *
+ * Returns: %FALSE if the thread has fallen too far behind, in which case the
+ *  caller should stop reading until gabble_ft_hasher_wait() says it has
+ *  caught up.
+ */
+gboolean
+gabble_ft_hasher_update (GabbleFtHasher *self,
+    const guint8 *data,
+    gsize len)
+{
+  gboolean behind;
+
+  g_return_val_if_fail (self->callback == NULL, FALSE);
+
+  g_mutex_lock (&self->lock);
+  self->pending += len;
+  behind = (self->pending > HIGH_WATERMARK);
+  g_mutex_unlock (&self->lock);
+
+  g_async_queue_push (self->queue, g_bytes_new (data, len));
+  return !behind;
+}
+
+/*
+ * gabble_ft_hasher_wait:
+ *
+ * Calls @callback from the main loop once the thread has caught up after
+ * gabble_ft_hasher_update() said it was behind, or straight away (but still
+ * from the main loop) if it already has.
+ */
+void
+gabble_ft_hasher_wait (GabbleFtHasher *self,
+    GabbleFtHasherCaughtUpCb callback,
+    gpointer user_data)
+{
+  g_return_if_fail (callback != NULL);
+  g_return_if_fail (self->caught_up_callback == NULL);
+
+  g_mutex_lock (&self->lock);
+  self->caught_up_callback = callback;
+  self->caught_up_data = user_data;
+  check_caught_up (self);
+  g_mutex_unlock (&self->lock);
+}
+
+/*
+ * gabble_ft_hasher_finish:
+ *
+ * Calls @callback from the main loop with the hex digest of everything
+ * passed to gabble_ft_hasher_update(), once the thread has caught up.
+ */
+void
+gabble_ft_hasher_finish (GabbleFtHasher *self,
+    GabbleFtHasherDoneCb callback,
+    gpointer user_data)
+{
+  g_return_if_fail (self->callback == NULL);
+  g_return_if_fail (callback != NULL);
+
+  self->callback = callback;
+  self->user_data = user_data;
+  g_async_queue_push (self->queue, &finish_marker);
+}
+
+gboolean
+gabble_ft_hasher_is_finishing (GabbleFtHasher *self)
+{
+  return self->callback != NULL;
+}
+
+/* Stops the thread, dropping whatever it hadn't hashed yet. The callbacks
+ * passed to gabble_ft_hasher_finish() and gabble_ft_hasher_wait() won't be
+ * called after this. */
+void
+gabble_ft_hasher_free (GabbleFtHasher *self)
+{
+  g_mutex_lock (&self->lock);
+  g_atomic_int_set (&self->cancelled, TRUE);
+
+  if (self->done_source != NULL)
+    {
+      g_source_destroy (self->done_source);
+      g_source_unref (self->done_source);
+      self->done_source = NULL;
+    }
+
+  if (self->caught_up_source != NULL)
+    {
+      g_source_destroy (self->caught_up_source);
+      g_source_unref (self->caught_up_source);
+      self->caught_up_source = NULL;
+    }
+
+  g_mutex_unlock (&self->lock);
+
+  g_async_queue_push (self->queue, &stop_marker);
+  g_thread_join (self->thread);
+
+  g_free (self->digest);
+  g_mutex_clear (&self->lock);
+  g_main_context_unref (self->context);
+  g_async_queue_unref (self->queue);
+  g_checksum_free (self->checksum);
+  g_slice_free (GabbleFtHasher, self);
+}
@@ -0,0 +1,59 @@
+/*
+ * ft-hasher.h - Header for GabbleFtHasher
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_FT_HASHER_H__
+#define __GABBLE_FT_HASHER_H__
+
+#include <glib.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleFtHasher GabbleFtHasher;
+
+typedef void (*GabbleFtHasherDoneCb) (GabbleFtHasher *hasher,
+    const gchar *digest,
+    gpointer user_data);
+
+typedef void (*GabbleFtHasherCaughtUpCb) (GabbleFtHasher *hasher,
+    gpointer user_data);
+
+gboolean gabble_ft_hasher_supports (TpFileHashType hash_type);
+
+GabbleFtHasher *gabble_ft_hasher_new (TpFileHashType hash_type);
+
+gboolean gabble_ft_hasher_update (GabbleFtHasher *self,
+    const guint8 *data,
+    gsize len);
+
+void gabble_ft_hasher_wait (GabbleFtHasher *self,
+    GabbleFtHasherCaughtUpCb callback,
+    gpointer user_data);
+
+void gabble_ft_hasher_finish (GabbleFtHasher *self,
+    GabbleFtHasherDoneCb callback,
+    gpointer user_data);
+
+gboolean gabble_ft_hasher_is_finishing (GabbleFtHasher *self);
+
+void gabble_ft_hasher_free (GabbleFtHasher *self);
+
+G_END_DECLS
+
+#endif /* __GABBLE_FT_HASHER_H__ */
@@ -39,6 +39,8 @@
 #include "disco.h"
 #include "error.h"
 #include "message-util.h"
+#include "muc-factory.h"
+#include "muc-history.h"
 #include "room-config.h"
 #include "namespaces.h"
 #include "presence.h"
@@ -55,9 +57,26 @@
 #define DEFAULT_LEAVE_TIMEOUT 180
 #define MAX_NICK_RETRIES 3
 
+/* Polling for room properties is only a fallback for rooms that don't tell
+ * us when their configuration changes. Rather than each room having a timer
+ * of its own, the MUC factory polls its rooms in turn; see
+ * gabble_muc_channel_poll_properties(). */
 #define PROPS_POLL_INTERVAL_LOW  60 * 5
 #define PROPS_POLL_INTERVAL_HIGH 60
 
+/* The longest we let other occupants' joins and leaves pile up, in
+ * milliseconds, if the main loop is too busy to get round to them */
+#define MEMBERS_BATCH_LATENCY 100
+
+/* How long, in milliseconds, we spend on the roster of a room we've joined
+ * before giving the main loop a turn */
+#define ROSTER_BATCH_BUDGET 10
+
+/* How many seconds before the last message we passed on the history we ask
+ * for when rejoining starts, to cover the time that message took to reach
+ * us */
+#define HISTORY_SLACK 5
+
 static void password_iface_init (gpointer, gpointer);
 static void subject_iface_init (gpointer, gpointer);
 #ifdef ENABLE_VOIP
@@ -156,9 +175,19 @@ struct _GabbleMucChannelPrivate
   gboolean initially_register;
 
   guint join_timer_id;
-  guint poll_timer_id;
   guint leave_timer_id;
 
+  /* TRUE if we've joined, and so are in the MUC factory's poll queue */
+  gboolean polling;
+  /* in seconds */
+  guint poll_interval;
+  /* when we last got the room properties, in monotonic time */
+  gint64 props_fetched;
+  /* how many requests for them have yet to be answered */
+  guint props_requests;
+  /* when we can next poll for them after a failed request, or 0 */
+  gint64 props_retry_at;
+
   gboolean must_provide_password;
   DBusGMethodInvocation *password_ctx;
 
@@ -216,6 +245,50 @@ struct _GabbleMucChannelPrivate
   char **initial_ids;
 
   gboolean have_received_error_type_wait;
+
+  /* Other occupants' joins and leaves, applied to the group mixin together
+   * once the main loop is idle, so that a flood of presences (after a
+   * netsplit, say) doesn't become a flood of MembersChanged signals. */
+  TpIntset *pending_added;
+  /* TpHandle => TpHandle owner (or 0) */
+  GHashTable *pending_owners;
+  TpIntset *pending_removed;
+  /* why the pending_removed members left; they all left for the same one */
+  gchar *pending_removed_message;
+  TpHandle pending_removed_actor;
+  TpChannelGroupChangeReason pending_removed_reason;
+  guint members_flush_id;
+  gint64 members_batch_started;
+
+  /* The occupants we found on joining, as owned keys into
+   * wocky_muc_members(): those not added to the members yet, and those
+   * whose presence (caps, tubes and so on) hasn't been looked at yet. A big
+   * room's roster is worked through a batch at a time, members first. */
+  GQueue *roster_to_add;
+  GQueue *roster_to_parse;
+  guint roster_idle_id;
+  /* our own handle in the room, while we wait for everyone else to be added
+   * before we join the members ourselves; 0 otherwise */
+  TpHandle roster_self;
+
+  /* When we last passed on a message from this room to clients, by our
+   * clock, which we ask the room for the history since when we join it
+   * again */
+  GabbleMucHistory *history;
+  /* our bare JID */
+  gchar *account;
+  /* the cursor as it was when we sent our join request, or 0 and NULL */
+  gint64 history_since;
+  gchar *history_since_id;
+  /* TRUE while wocky is building our join request */
+  gboolean sending_join;
+  /* our join request, if it asks for history, until the porter sends it */
+  WockyStanza *join_presence;
+  WockyPorter *join_porter;
+  gulong join_sending_id;
+
+  /* when we last sent a message to the room, in monotonic time, or 0 */
+  gint64 last_sent;
 };
 
 typedef struct {
@@ -256,11 +329,21 @@ gabble_muc_channel_init (GabbleMucChannel *self)
 
   priv->tubes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) g_object_unref);
+
+  priv->pending_added = tp_intset_new ();
+  priv->pending_owners = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->pending_removed = tp_intset_new ();
+
+  priv->roster_to_add = g_queue_new ();
+  priv->roster_to_parse = g_queue_new ();
 }
 
 static TpHandle create_room_identity (GabbleMucChannel *)
   G_GNUC_WARN_UNUSED_RESULT;
 
+static void flush_member_changes (GabbleMucChannel *self);
+static void clear_roster (GabbleMucChannel *self);
+
 /*  signatures for presence handlers */
 
 static void handle_fill_presence (WockyMuc *muc,
@@ -429,6 +512,9 @@ gabble_muc_channel_constructed (GObject *obj)
     priv->wmuc = wmuc;
 
     g_free (user_jid);
+    priv->account = g_strdup (tp_handle_inspect (contact_handles,
+          tp_base_connection_get_self_handle (base_conn)));
+    priv->history = gabble_muc_history_dup_shared ();
     g_object_unref (porter);
   }
 
@@ -665,12 +751,29 @@ properties_disco_cb (GabbleDisco *disco,
 
   g_assert (GABBLE_IS_MUC_CHANNEL (chan));
 
+  priv->props_requests--;
+
+  /* That doesn't count as a refresh, so the room stays where it is in the
+   * poll queue; but it isn't polled again for a while */
   if (error)
     {
       DEBUG ("got error %s", error->message);
+      priv->props_retry_at = g_get_monotonic_time () +
+          priv->poll_interval * G_TIME_SPAN_SECOND;
       return;
     }
 
+  priv->props_fetched = g_get_monotonic_time ();
+  priv->props_retry_at = 0;
+
+  if (priv->polling)
+    {
+      GabbleConnection *conn = GABBLE_CONNECTION (
+          tp_base_channel_get_connection (TP_BASE_CHANNEL (chan)));
+
+      gabble_muc_factory_poll_room (conn->muc_factory, chan);
+    }
+
   /*
    * Update room definition.
    */
@@ -723,6 +826,71 @@ properties_disco_cb (GabbleDisco *disco,
   tp_base_room_config_set_retrieved (priv->room_config);
 }
 
+static void room_properties_update (GabbleMucChannel *chan);
+
+/**
+ * gabble_muc_channel_poll_properties:
+ * @chan: a room in the MUC factory's poll queue
+ *
+ * Asks for @chan's properties if it's been at least its poll interval since
+ * we last got them. The factory calls this every so often for the room at
+ * the head of its queue, whose properties are the stalest; the room moves
+ * to the back once they've been fetched.
+ *
+ * Returns: %TRUE if @chan is due to be polled but is still waiting for a
+ *  reply, or to retry after a failure, so the next room should be tried
+ *  instead; %FALSE otherwise
+ */
+gboolean
+gabble_muc_channel_poll_properties (GabbleMucChannel *chan)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+  gint64 now = g_get_monotonic_time ();
+
+  if (now - priv->props_fetched < priv->poll_interval * G_TIME_SPAN_SECOND)
+    return FALSE;
+
+  if (priv->props_requests > 0 || now < priv->props_retry_at)
+    return TRUE;
+
+  DEBUG ("polling for room properties of %s", priv->jid);
+  room_properties_update (chan);
+  return FALSE;
+}
+
+static void
+start_polling (GabbleMucChannel *chan,
+    guint interval)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+  GabbleConnection *conn = GABBLE_CONNECTION (tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (chan)));
+
+  g_return_if_fail (!priv->polling);
+
+  priv->polling = TRUE;
+  priv->poll_interval = interval;
+  priv->props_fetched = g_get_monotonic_time ();
+  gabble_muc_factory_poll_room (conn->muc_factory, chan);
+}
+
+static void
+stop_polling (GabbleMucChannel *chan)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+  GabbleConnection *conn = GABBLE_CONNECTION (tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (chan)));
+
+  if (!priv->polling)
+    return;
+
+  priv->polling = FALSE;
+
+  /* The factory forgets its rooms itself when it's going away */
+  if (conn->muc_factory != NULL)
+    gabble_muc_factory_stop_polling_room (conn->muc_factory, chan);
+}
+
 static void
 room_properties_update (GabbleMucChannel *chan)
 {
@@ -742,7 +910,10 @@ room_properties_update (GabbleMucChannel *chan)
     {
       DEBUG ("disco query failed: '%s'", error->message);
       g_error_free (error);
+      return;
     }
+
+  priv->props_requests++;
 }
 
 static TpHandle
@@ -791,8 +962,116 @@ static void
 send_join_request (GabbleMucChannel *gmuc)
 {
   GabbleMucChannelPrivate *priv = gmuc->priv;
+  const gchar *id = NULL;
+
+  priv->history_since = 0;
+  tp_clear_pointer (&priv->history_since_id, g_free);
+
+  if (gabble_muc_history_get_cursor (priv->history, priv->account, priv->jid,
+          &priv->history_since, &id))
+    {
+      priv->history_since_id = g_strdup (id);
+      DEBUG ("asking %s for history since we last heard from it at %"
+          G_GINT64_FORMAT, priv->jid, priv->history_since);
+    }
 
+  priv->sending_join = TRUE;
   wocky_muc_join (priv->wmuc, NULL);
+  priv->sending_join = FALSE;
+}
+
+/* Asks for the history since the cursor, in the join request's <x/>. The
+ * cursor is by our clock and the server's may not agree, so rather than
+ * 'since' we ask for the last however many seconds, which only needs the
+ * two clocks to tick at the same rate. */
+static void
+add_history_request (GabbleMucChannel *gmuc,
+    WockyNode *x)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+  TpBaseConnection *conn = tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (gmuc));
+  WockyNode *history;
+  gboolean rejoin_history;
+
+  g_object_get (conn, "muc-rejoin-history", &rejoin_history, NULL);
+
+  history = wocky_node_add_child (x, "history");
+
+  /* We've seen everything up to the cursor, and this says we don't care
+   * about anything we missed since either */
+  if (!rejoin_history)
+    {
+      wocky_node_set_attribute (history, "maxstanzas", "0");
+    }
+  else
+    {
+      gint64 seconds = g_get_real_time () / G_USEC_PER_SEC -
+          priv->history_since;
+      gchar *tmp;
+
+      /* If our clock has gone backwards, all we can do is hope it wasn't by
+       * much */
+      tmp = g_strdup_printf ("%" G_GINT64_FORMAT,
+          MAX (seconds, 0) + HISTORY_SLACK);
+      wocky_node_set_attribute (history, "seconds", tmp);
+      g_free (tmp);
+    }
+}
+
+static void
+stop_watching_join_presence (GabbleMucChannel *gmuc)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+
+  if (priv->join_sending_id != 0)
+    {
+      g_signal_handler_disconnect (priv->join_porter, priv->join_sending_id);
+      priv->join_sending_id = 0;
+    }
+
+  tp_clear_object (&priv->join_presence);
+  tp_clear_object (&priv->join_porter);
+}
+
+static void
+join_presence_sending_cb (WockyPorter *porter,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  GabbleMucChannel *gmuc = user_data;
+  WockyNode *x;
+
+  /* NULL means whitespace keepalive */
+  if (stanza == NULL || stanza != gmuc->priv->join_presence)
+    return;
+
+  x = wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza), "x",
+      WOCKY_NS_MUC);
+
+  if (x != NULL)
+    add_history_request (gmuc, x);
+
+  stop_watching_join_presence (gmuc);
+}
+
+/* wocky_muc_join() only adds its <x/> after the presence has been filled
+ * in, so the history request is added to it when the porter comes to send
+ * the presence. */
+static void
+watch_join_presence (GabbleMucChannel *gmuc,
+    WockyStanza *stanza)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+  GabbleConnection *conn = GABBLE_CONNECTION (tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (gmuc)));
+
+  stop_watching_join_presence (gmuc);
+
+  priv->join_presence = g_object_ref (stanza);
+  priv->join_porter = gabble_connection_dup_porter (conn);
+  priv->join_sending_id = g_signal_connect (priv->join_porter, "sending",
+      G_CALLBACK (join_presence_sending_cb), gmuc);
 }
 
 static void
@@ -1278,7 +1557,6 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
 }
 
 static void clear_join_timer (GabbleMucChannel *chan);
-static void clear_poll_timer (GabbleMucChannel *chan);
 static void clear_leave_timer (GabbleMucChannel *chan);
 
 void
@@ -1295,10 +1573,20 @@ gabble_muc_channel_dispose (GObject *object)
   priv->dispose_has_run = TRUE;
 
   clear_join_timer (self);
-  clear_poll_timer (self);
+  stop_polling (self);
   clear_leave_timer (self);
 
+  if (priv->members_flush_id != 0)
+    {
+      g_source_remove (priv->members_flush_id);
+      priv->members_flush_id = 0;
+    }
+
+  clear_roster (self);
+  stop_watching_join_presence (self);
+
   tp_clear_object (&priv->wmuc);
+  tp_clear_object (&priv->history);
   tp_clear_object (&priv->requests_cancellable);
   tp_clear_object (&priv->room_config);
 
@@ -1346,6 +1634,15 @@ gabble_muc_channel_finalize (GObject *object)
   g_free (priv->subject);
   g_free (priv->subject_actor);
 
+  tp_intset_destroy (priv->pending_added);
+  g_hash_table_unref (priv->pending_owners);
+  tp_intset_destroy (priv->pending_removed);
+  g_free (priv->pending_removed_message);
+  g_queue_free (priv->roster_to_add);
+  g_queue_free (priv->roster_to_parse);
+  g_free (priv->account);
+  g_free (priv->history_since_id);
+
   tp_group_mixin_finalize (object);
   tp_message_mixin_finalize (object);
 
@@ -1364,18 +1661,6 @@ clear_join_timer (GabbleMucChannel *chan)
     }
 }
 
-static void
-clear_poll_timer (GabbleMucChannel *chan)
-{
-  GabbleMucChannelPrivate *priv = chan->priv;
-
-  if (priv->poll_timer_id != 0)
-    {
-      g_source_remove (priv->poll_timer_id);
-      priv->poll_timer_id = 0;
-    }
-}
-
 static void
 clear_leave_timer (GabbleMucChannel *chan)
 {
@@ -1457,18 +1742,6 @@ timeout_join (gpointer data)
   return FALSE;
 }
 
-static gboolean
-timeout_poll (gpointer data)
-{
-  GabbleMucChannel *chan = data;
-
-  DEBUG ("polling for room properties");
-
-  room_properties_update (chan);
-
-  return TRUE;
-}
-
 static void
 channel_state_changed (GabbleMucChannel *chan,
                        GabbleMucState prev_state,
@@ -1501,12 +1774,11 @@ channel_state_changed (GabbleMucChannel *chan,
       else
         interval = PROPS_POLL_INTERVAL_HIGH;
 
-      priv->poll_timer_id =
-          g_timeout_add_seconds (interval, timeout_poll, chan);
+      start_polling (chan, interval);
     }
   else if (new_state == MUC_STATE_ENDED)
     {
-      clear_poll_timer (chan);
+      stop_polling (chan);
     }
 
   if (new_state == MUC_STATE_JOINED || new_state == MUC_STATE_AUTH)
@@ -1592,6 +1864,9 @@ close_channel (GabbleMucChannel *chan, const gchar *reason,
     tp_base_channel_close (TP_BASE_CHANNEL (priv->calls->data));
 #endif
 
+  clear_roster (chan);
+  flush_member_changes (chan);
+
   set = tp_intset_new_containing (TP_GROUP_MIXIN (chan)->self_handle);
   tp_group_mixin_change_members ((GObject *) chan, reason,
       NULL, set, NULL, NULL, actor, reason_code);
@@ -1662,6 +1937,14 @@ gabble_muc_channel_get_autoclose (GabbleMucChannel *chan)
   return chan->priv->autoclose;
 }
 
+/* Returns when the user last sent a message to the room, in monotonic time,
+ * or 0 if they never have */
+gint64
+gabble_muc_channel_get_last_sent (GabbleMucChannel *chan)
+{
+  return chan->priv->last_sent;
+}
+
 void
 gabble_muc_channel_set_autoclose (GabbleMucChannel *chan,
                                   gboolean autoclose)
@@ -2357,6 +2640,118 @@ muc_status_codes_to_change_reason (guint codes)
     return TP_CHANNEL_GROUP_CHANGE_REASON_NONE;
 }
 
+/* Applies the joins and leaves queued by queue_member_added() and
+ * queue_member_removed() to the group mixin */
+static void
+flush_member_changes (GabbleMucChannel *self)
+{
+  GabbleMucChannelPrivate *priv = self->priv;
+
+  if (priv->members_flush_id != 0)
+    {
+      g_source_remove (priv->members_flush_id);
+      priv->members_flush_id = 0;
+    }
+
+  if (g_hash_table_size (priv->pending_owners) > 0)
+    {
+      tp_group_mixin_add_handle_owners (G_OBJECT (self), priv->pending_owners);
+      g_hash_table_remove_all (priv->pending_owners);
+    }
+
+  if (!tp_intset_is_empty (priv->pending_added))
+    {
+      DEBUG ("%u occupants joined", tp_intset_size (priv->pending_added));
+      tp_group_mixin_change_members (G_OBJECT (self), "",
+          priv->pending_added, NULL, NULL, NULL, 0, 0);
+      tp_intset_clear (priv->pending_added);
+    }
+
+  if (!tp_intset_is_empty (priv->pending_removed))
+    {
+      DEBUG ("%u occupants left", tp_intset_size (priv->pending_removed));
+      tp_group_mixin_change_members (G_OBJECT (self),
+          priv->pending_removed_message, NULL, priv->pending_removed, NULL,
+          NULL, priv->pending_removed_actor, priv->pending_removed_reason);
+      tp_intset_clear (priv->pending_removed);
+      tp_clear_pointer (&priv->pending_removed_message, g_free);
+    }
+}
+
+static gboolean
+flush_member_changes_cb (gpointer user_data)
+{
+  GabbleMucChannel *self = GABBLE_MUC_CHANNEL (user_data);
+
+  self->priv->members_flush_id = 0;
+  flush_member_changes (self);
+  return FALSE;
+}
+
+static void
+schedule_member_changes (GabbleMucChannel *self)
+{
+  GabbleMucChannelPrivate *priv = self->priv;
+  gint64 now = g_get_monotonic_time ();
+
+  if (priv->members_flush_id == 0)
+    {
+      priv->members_batch_started = now;
+      priv->members_flush_id = g_idle_add (flush_member_changes_cb, self);
+    }
+  else if (now - priv->members_batch_started >
+      MEMBERS_BATCH_LATENCY * G_TIME_SPAN_MILLISECOND)
+    {
+      flush_member_changes (self);
+    }
+}
+
+static void
+queue_member_added (GabbleMucChannel *self,
+    TpHandle handle,
+    TpHandle owner)
+{
+  GabbleMucChannelPrivate *priv = self->priv;
+
+  /* Keep the changes to each member in order */
+  if (tp_intset_is_member (priv->pending_removed, handle))
+    flush_member_changes (self);
+
+  tp_intset_add (priv->pending_added, handle);
+  g_hash_table_insert (priv->pending_owners, GUINT_TO_POINTER (handle),
+      GUINT_TO_POINTER (owner));
+  schedule_member_changes (self);
+}
+
+static void
+queue_member_removed (GabbleMucChannel *self,
+    TpHandle handle,
+    const gchar *message,
+    TpHandle actor,
+    TpChannelGroupChangeReason reason)
+{
+  GabbleMucChannelPrivate *priv = self->priv;
+
+  /* Keep the changes to each member in order, and only put together leaves
+   * which MembersChanged can describe in one go */
+  if (tp_intset_is_member (priv->pending_added, handle) ||
+      (!tp_intset_is_empty (priv->pending_removed) &&
+       (tp_strdiff (message, priv->pending_removed_message) ||
+        actor != priv->pending_removed_actor ||
+        reason != priv->pending_removed_reason)))
+    flush_member_changes (self);
+
+  if (tp_intset_is_empty (priv->pending_removed))
+    {
+      priv->pending_removed_message = g_strdup (message);
+      priv->pending_removed_actor = actor;
+      priv->pending_removed_reason = reason;
+    }
+
+  tp_intset_add (priv->pending_removed, handle);
+  schedule_member_changes (self);
+}
+
 /* connect to wocky-muc:SIG_PARTED, which we will receive when the MUC tells *
  * us that we have left the channel                                          */
 static void
@@ -2445,7 +2840,6 @@ handle_left (WockyMuc *muc,
   TpHandleRepoIface *contact_repo =
     tp_base_connection_get_handles (tp_base_channel_get_connection (base),
         TP_HANDLE_TYPE_CONTACT);
-  TpIntset *handles = NULL;
   TpHandle member = 0;
   TpHandle actor = 0;
 
@@ -2457,9 +2851,6 @@ handle_left (WockyMuc *muc,
       return;
     }
 
-  handles = tp_intset_new ();
-  tp_intset_add (handles, member);
-
   if (actor_jid != NULL)
     {
       actor = tp_handle_ensure (contact_repo, actor_jid, NULL, NULL);
@@ -2472,12 +2863,9 @@ handle_left (WockyMuc *muc,
   /* handle_tube_presence creates tubes if need be, so bypass it here: */
   tubes_presence_update (gmuc, member, wocky_stanza_get_top_node (stanza));
 
-  tp_group_mixin_change_members (data, why, NULL, handles, NULL, NULL,
-      actor, reason);
+  queue_member_removed (gmuc, member, why, actor, reason);
   tp_message_mixin_change_chat_state (data, member,
       TP_CHANNEL_CHAT_STATE_GONE);
-
-  tp_intset_destroy (handles);
 }
 
 /* connect to wocky-muc:SIG_PERM_CHANGE, which we will receive when the *
@@ -2536,6 +2924,9 @@ handle_fill_presence (WockyMuc *muc,
 
   tube_pre_presence (self, stanza);
 
+  if (priv->sending_join && priv->history_since != 0)
+    watch_join_presence (self, stanza);
+
   g_signal_emit (self, signals[PRE_PRESENCE], 0, (WockyStanza *) stanza);
 }
 
@@ -2560,6 +2951,8 @@ handle_renamed (WockyMuc *wmuc,
   TpHandle userid = tp_handle_ensure (contact_repo, me2,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
 
+  flush_member_changes (gmuc);
+
   tp_intset_add (old_self, TP_GROUP_MIXIN (gmuc)->self_handle);
   tp_group_mixin_change_self_handle (data, myself);
   tp_group_mixin_add_handle_owner (data, myself, userid);
@@ -2570,17 +2963,12 @@ handle_renamed (WockyMuc *wmuc,
   tp_intset_destroy (old_self);
 }
 
+/* Adds an occupant from the roster we got on joining to the members */
 static void
-update_roster_presence (GabbleMucChannel *gmuc,
+add_roster_member (GabbleMucChannel *gmuc,
     WockyMucMember *member,
-    TpHandleRepoIface *contact_repo,
-    TpHandleSet *members,
-    TpHandleSet *owners,
-    GHashTable *omap)
+    TpHandleRepoIface *contact_repo)
 {
-  TpBaseChannel *base = TP_BASE_CHANNEL (gmuc);
-  GabbleConnection *conn =
-      GABBLE_CONNECTION (tp_base_channel_get_connection (base));
   TpHandle owner = 0;
   TpHandle handle = tp_handle_ensure (contact_repo, member->from,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
@@ -2591,17 +2979,9 @@ update_roster_presence (GabbleMucChannel *gmuc,
           GUINT_TO_POINTER (GABBLE_JID_GLOBAL), NULL);
       if (owner == 0)
         DEBUG ("Invalid owner handle '%s', treating as no owner", member->jid);
-      else
-        tp_handle_set_add (owners, owner);
     }
 
-  gabble_presence_parse_presence_message (conn->presence_cache,
-      handle, member->from, (WockyStanza *) member->presence_stanza);
-
-  tp_handle_set_add (members, handle);
-  g_hash_table_insert (omap,
-      GUINT_TO_POINTER (handle),
-      GUINT_TO_POINTER (owner));
+  queue_member_added (gmuc, handle, owner);
 
   /* make a note of the fact that owner JIDs are visible to us    */
   /* notify whomever that an identifiable contact joined the MUC  */
@@ -2611,10 +2991,128 @@ update_roster_presence (GabbleMucChannel *gmuc,
           TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
       g_signal_emit (gmuc, signals[CONTACT_JOIN], 0, owner);
     }
+}
+
+/* Takes in the presence of an occupant from the roster we got on joining */
+static void
+parse_roster_presence (GabbleMucChannel *gmuc,
+    WockyMucMember *member,
+    TpHandleRepoIface *contact_repo)
+{
+  TpBaseChannel *base = TP_BASE_CHANNEL (gmuc);
+  GabbleConnection *conn =
+      GABBLE_CONNECTION (tp_base_channel_get_connection (base));
+  TpHandle handle = tp_handle_ensure (contact_repo, member->from,
+      GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
+
+  gabble_presence_parse_presence_message (conn->presence_cache,
+      handle, member->from, (WockyStanza *) member->presence_stanza);
 
   handle_tube_presence (gmuc, handle, member->presence_stanza);
 }
 
+/* Works through the roster we got on joining for up to ROSTER_BATCH_BUDGET,
+ * adding everyone (and then ourselves) to the members before looking at
+ * their presences, and publishes the members added so far. Returns TRUE if
+ * there's more to do. */
+static gboolean
+process_roster (GabbleMucChannel *gmuc)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+  TpBaseChannel *base = TP_BASE_CHANNEL (gmuc);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      tp_base_channel_get_connection (base), TP_HANDLE_TYPE_CONTACT);
+  GHashTable *members = wocky_muc_members (priv->wmuc);
+  gint64 deadline = g_get_monotonic_time () +
+      ROSTER_BATCH_BUDGET * G_TIME_SPAN_MILLISECOND;
+  WockyMucMember *member;
+  gchar *key;
+
+  if (members == NULL)
+    {
+      clear_roster (gmuc);
+      return FALSE;
+    }
+
+  /* Occupants who have left in the meantime are no longer in members */
+  while (g_get_monotonic_time () < deadline &&
+      (key = g_queue_pop_head (priv->roster_to_add)) != NULL)
+    {
+      member = g_hash_table_lookup (members, key);
+
+      if (member != NULL)
+        {
+          add_roster_member (gmuc, member, contact_repo);
+          g_queue_push_tail (priv->roster_to_parse, key);
+        }
+      else
+        {
+          g_free (key);
+        }
+    }
+
+  /* Once everyone else is a member, so are we: that's when the join is
+   * complete */
+  if (priv->roster_self != 0 && g_queue_is_empty (priv->roster_to_add))
+    {
+      queue_member_added (gmuc, priv->roster_self,
+          tp_base_connection_get_self_handle (
+              tp_base_channel_get_connection (base)));
+      priv->roster_self = 0;
+    }
+
+  while (g_get_monotonic_time () < deadline &&
+      (key = g_queue_pop_head (priv->roster_to_parse)) != NULL)
+    {
+      member = g_hash_table_lookup (members, key);
+
+      if (member != NULL)
+        parse_roster_presence (gmuc, member, contact_repo);
+
+      g_free (key);
+    }
+
+  flush_member_changes (gmuc);
+  g_hash_table_unref (members);
+
+  return !g_queue_is_empty (priv->roster_to_add) ||
+      !g_queue_is_empty (priv->roster_to_parse);
+}
+
+static gboolean
+process_roster_cb (gpointer user_data)
+{
+  GabbleMucChannel *gmuc = GABBLE_MUC_CHANNEL (user_data);
+
+  if (process_roster (gmuc))
+    return TRUE;
+
+  DEBUG ("finished with the room's roster");
+  gmuc->priv->roster_idle_id = 0;
+  return FALSE;
+}
+
+static void
+clear_roster (GabbleMucChannel *self)
+{
+  GabbleMucChannelPrivate *priv = self->priv;
+  gchar *key;
+
+  if (priv->roster_idle_id != 0)
+    {
+      g_source_remove (priv->roster_idle_id);
+      priv->roster_idle_id = 0;
+    }
+
+  while ((key = g_queue_pop_head (priv->roster_to_add)) != NULL)
+    g_free (key);
+
+  while ((key = g_queue_pop_head (priv->roster_to_parse)) != NULL)
+    g_free (key);
+
+  priv->roster_self = 0;
+}
+
 /* connect to wocky_muc SIG_JOINED which we should receive when we receive   *
  * the final (ie our own) presence in the roster: (note that if our nick was *
  * changed by the MUC we will already have received a SIG_NICK_CHANGE:       */
@@ -2625,34 +3123,36 @@ handle_join (WockyMuc *muc,
     gpointer data)
 {
   GabbleMucChannel *gmuc = GABBLE_MUC_CHANNEL (data);
+  GabbleMucChannelPrivate *priv = gmuc->priv;
   TpBaseChannel *base = TP_BASE_CHANNEL (gmuc);
   TpBaseConnection *base_conn = tp_base_channel_get_connection (base);
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
         TP_HANDLE_TYPE_CONTACT);
-  TpHandleSet *members = tp_handle_set_new (contact_repo);
-  TpHandleSet *owners = tp_handle_set_new (contact_repo);
-  GHashTable *omap = g_hash_table_new (g_direct_hash, g_direct_equal);
   GHashTable *member_jids = wocky_muc_members (muc);
   const gchar *me = wocky_muc_jid (muc);
   TpHandle myself = tp_handle_ensure (contact_repo, me,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
   GHashTableIter iter;
-  WockyMucMember *member;
+  gpointer key;
+
+  clear_roster (gmuc);
 
   g_hash_table_iter_init (&iter, member_jids);
 
-  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&member))
-    update_roster_presence (gmuc, member, contact_repo,
-      members, owners, omap);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_queue_push_tail (priv->roster_to_add, g_strdup (key));
 
-  g_hash_table_insert (omap,
-      GUINT_TO_POINTER (myself),
-      GUINT_TO_POINTER (tp_base_connection_get_self_handle (base_conn)));
+  priv->roster_self = myself;
 
-  tp_handle_set_add (members, myself);
-  tp_group_mixin_add_handle_owners (G_OBJECT (gmuc), omap);
-  tp_group_mixin_change_members (G_OBJECT (gmuc), "",
-      tp_handle_set_peek (members), NULL, NULL, NULL, 0, 0);
+  /* Small rooms are done with here and now; a big one's roster is taken in
+   * a batch at a time, so that joining doesn't stall everything else */
+  if (process_roster (gmuc))
+    {
+      DEBUG ("%u occupants to go; carrying on in the background",
+          g_queue_get_length (priv->roster_to_add) +
+          g_queue_get_length (priv->roster_to_parse));
+      priv->roster_idle_id = g_idle_add (process_roster_cb, gmuc);
+    }
 
   /* accept the config of the room if it was created for us: */
   if (codes & WOCKY_MUC_CODE_NEW_ROOM)
@@ -2673,9 +3173,6 @@ handle_join (WockyMuc *muc,
 
   g_object_set (gmuc, "state", MUC_STATE_JOINED, NULL);
 
-  tp_handle_set_destroy (members);
-  tp_handle_set_destroy (owners);
-  g_hash_table_unref (omap);
   g_hash_table_unref (member_jids);
 }
 
@@ -2700,7 +3197,6 @@ handle_presence (WockyMuc *muc,
   TpHandle owner = 0;
   TpHandle handle = tp_handle_ensure (contact_repo, who->from,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
-  TpHandleSet *handles = tp_handle_set_new (contact_repo);
 
   /* is the 'real' jid field of the presence set? If so, use it: */
   if (who->jid != NULL)
@@ -2721,13 +3217,8 @@ handle_presence (WockyMuc *muc,
   gabble_presence_parse_presence_message (conn->presence_cache,
     handle, who->from, (WockyStanza *) who->presence_stanza);
 
-  /* add the member in quesion */
-  tp_handle_set_add (handles, handle);
-  tp_group_mixin_change_members (data, "", tp_handle_set_peek (handles),
-      NULL, NULL, NULL, 0, 0);
-
-  /* record the owner (0 for no owner) */
-  tp_group_mixin_add_handle_owner (data, handle, owner);
+  /* add the member in question, recording its owner (0 for no owner) */
+  queue_member_added (gmuc, handle, owner);
 
   handle_tube_presence (gmuc, handle, stanza);
 
@@ -2746,13 +3237,42 @@ handle_presence (WockyMuc *muc,
         }
     }
 #endif
-
-  tp_handle_set_destroy (handles);
 }
 
 /* ************************************************************************ */
 /* message signal handlers */
 
+/* 104 is a change to anything but privacy; 170 to 174 are changes to whether
+ * the room is logged or anonymous */
+static const gchar * const config_change_codes[] = {
+    "104", "170", "171", "172", "173", "174", NULL
+};
+
+/* Whether @stanza is the room telling us its configuration has changed */
+static gboolean
+is_config_change (WockyStanza *stanza)
+{
+  WockyNode *x, *status;
+  WockyNodeIter i;
+
+  x = wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza), "x",
+      NS_MUC_USER);
+
+  if (x == NULL)
+    return FALSE;
+
+  wocky_node_iter_init (&i, x, "status", NULL);
+  while (wocky_node_iter_next (&i, &status))
+    {
+      const gchar *code = wocky_node_get_attribute (status, "code");
+
+      if (code != NULL && tp_strv_contains (config_change_codes, code))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 static void
 handle_message (WockyMuc *muc,
     WockyStanza *stanza,
@@ -2840,6 +3360,12 @@ handle_message (WockyMuc *muc,
   if (subject != NULL)
     _gabble_muc_channel_handle_subject (gmuc, handle_type, from,
         datetime, subject, stanza, NULL);
+
+  if (!from_member && is_config_change (stanza))
+    {
+      DEBUG ("room configuration changed; fetching its properties");
+      room_properties_update (gmuc);
+    }
 }
 
 static void
@@ -3063,6 +3589,16 @@ _gabble_muc_channel_receive (GabbleMucChannel *chan,
       return;
     }
 
+  /* The history we asked for starts a little before the last message we
+   * passed on last time, so it's likely to include that */
+  if (!is_echo && !is_error && timestamp != 0 && id != NULL &&
+      !tp_strdiff (id, chan->priv->history_since_id))
+    {
+      STANZA_DEBUG (msg, "ignoring history we've already passed on");
+
+      return;
+    }
+
   /* are we actually hidden? */
   if (!tp_base_channel_is_registered (base))
     {
@@ -3073,6 +3609,13 @@ _gabble_muc_channel_receive (GabbleMucChannel *chan,
   /* let's not autoclose now */
   chan->priv->autoclose = FALSE;
 
+  /* Whether this is live or history, we have now seen everything the room
+   * has sent up to now */
+  if (!is_error)
+    gabble_muc_history_update_cursor (chan->priv->history,
+        chan->priv->account, chan->priv->jid,
+        g_get_real_time () / G_USEC_PER_SEC, id);
+
   message = tp_cm_message_new (base_conn, 2);
 
   /* Header common to normal message and delivery-echo */
@@ -3279,6 +3822,7 @@ gabble_muc_channel_send (GObject *obj,
 
   base_conn = tp_base_channel_get_connection (base);
   gabble_conn = GABBLE_CONNECTION (base_conn);
+  priv->last_sent = g_get_monotonic_time ();
 
   tp_message_mixin_change_chat_state (obj,
       tp_base_channel_get_self_handle (base),
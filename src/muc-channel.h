@@ -90,10 +90,14 @@ void gabble_muc_channel_set_autoclose (GabbleMucChannel *chan,
 
 gboolean gabble_muc_channel_get_autoclose (GabbleMucChannel *chan);
 
+gint64 gabble_muc_channel_get_last_sent (GabbleMucChannel *chan);
+
 gboolean gabble_muc_channel_can_be_closed (GabbleMucChannel *chan);
 
 void gabble_muc_channel_send_presence (GabbleMucChannel *chan);
 
+gboolean gabble_muc_channel_poll_properties (GabbleMucChannel *chan);
+
 gboolean gabble_muc_channel_send_invite (GabbleMucChannel *self,
     const gchar *jid, const gchar *message, gboolean continue_, GError **error);
 
@@ -51,6 +51,13 @@
 #include "call-muc-channel.h"
 #endif
 
+/* Rooms we've sent a message to in the last this-many seconds get our new
+ * presence before the rest */
+#define PRESENCE_ACTIVE_WINDOW (60 * 10)
+/* How often, in seconds, we see whether the room whose properties are the
+ * stalest needs polling for them */
+#define PROPS_POLL_TICK 5
+
 static void channel_manager_iface_init (gpointer, gpointer);
 
 G_DEFINE_TYPE_WITH_CODE (GabbleMucFactory, gabble_muc_factory, G_TYPE_OBJECT,
@@ -90,6 +97,22 @@ struct _GabbleMucFactoryPrivate
    * Borrowed TpExportableChannel => GSList of gpointer */
   GHashTable *queued_requests;
 
+  /* Rooms which are yet to be sent our new presence, the ones we've spoken
+   * in recently first, and sent one every presence_interval ms so that going
+   * away doesn't mean a burst of hundreds of presences.
+   * Borrowed GabbleMucChannel; and the same again as a set */
+  GQueue *presence_queue;
+  GHashTable *presence_queued;
+  /* from the muc-presence-interval-ms parameter; 0 sends our presence to
+   * every room at once */
+  guint presence_interval;
+  guint presence_timer_id;
+
+  /* Joined rooms, the one whose properties were last fetched longest ago
+   * first. Borrowed GabbleMucChannel */
+  GQueue *poll_queue;
+  guint poll_tick_id;
+
   gboolean dispose_has_run;
 };
 
@@ -118,6 +141,10 @@ gabble_muc_factory_init (GabbleMucFactory *fac)
   priv->queued_requests = g_hash_table_new_full (g_direct_hash,
       g_direct_equal, NULL, NULL);
 
+  priv->presence_queue = g_queue_new ();
+  priv->presence_queued = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->poll_queue = g_queue_new ();
+
   priv->conn = NULL;
   priv->dispose_has_run = FALSE;
 }
@@ -134,6 +161,8 @@ cancel_disco_request (gpointer key, gpointer value, gpointer user_data)
 
 
 static void gabble_muc_factory_close_all (GabbleMucFactory *fac);
+static void forget_presence (GabbleMucFactory *self, GabbleMucChannel *chan);
+static void clear_poll_queue (GabbleMucFactory *self);
 
 
 static void
@@ -157,6 +186,10 @@ gabble_muc_factory_dispose (GObject *object)
       priv->conn->disco);
   g_hash_table_unref (priv->disco_requests);
 
+  g_queue_free (priv->presence_queue);
+  g_hash_table_unref (priv->presence_queued);
+  g_queue_free (priv->poll_queue);
+
   if (G_OBJECT_CLASS (gabble_muc_factory_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_muc_factory_parent_class)->dispose (object);
 }
@@ -256,6 +289,8 @@ muc_channel_closed_cb (GabbleMucChannel *chan, gpointer user_data)
 
       DEBUG ("removing MUC channel with handle %d", room_handle);
 
+      forget_presence (fac, chan);
+      gabble_muc_factory_stop_polling_room (fac, chan);
       g_hash_table_remove (priv->text_channels, GUINT_TO_POINTER (room_handle));
     }
 }
@@ -807,10 +842,56 @@ muc_factory_message_cb (
   return FALSE;
 }
 
+static void
+forget_presence (GabbleMucFactory *self,
+    GabbleMucChannel *chan)
+{
+  GabbleMucFactoryPrivate *priv = self->priv;
+
+  if (g_hash_table_remove (priv->presence_queued, chan))
+    g_queue_remove (priv->presence_queue, chan);
+}
+
+static void
+clear_presence_queue (GabbleMucFactory *self)
+{
+  GabbleMucFactoryPrivate *priv = self->priv;
+
+  if (priv->presence_timer_id != 0)
+    {
+      g_source_remove (priv->presence_timer_id);
+      priv->presence_timer_id = 0;
+    }
+
+  g_queue_clear (priv->presence_queue);
+  g_hash_table_remove_all (priv->presence_queued);
+}
+
+static gboolean
+send_queued_presence_cb (gpointer user_data)
+{
+  GabbleMucFactory *self = GABBLE_MUC_FACTORY (user_data);
+  GabbleMucFactoryPrivate *priv = self->priv;
+  GabbleMucChannel *chan = g_queue_pop_head (priv->presence_queue);
+
+  if (chan == NULL)
+    {
+      priv->presence_timer_id = 0;
+      return FALSE;
+    }
+
+  g_hash_table_remove (priv->presence_queued, chan);
+  gabble_muc_channel_send_presence (chan);
+  return TRUE;
+}
+
 void
 gabble_muc_factory_broadcast_presence (GabbleMucFactory *self)
 {
   GabbleMucFactoryPrivate *priv = self->priv;
+  gint64 active_since = g_get_monotonic_time () -
+      PRESENCE_ACTIVE_WINDOW * G_TIME_SPAN_SECOND;
+  GList *active_tail = NULL;
   GHashTableIter iter;
   gpointer channel = NULL;
 
@@ -822,7 +903,126 @@ gabble_muc_factory_broadcast_presence (GabbleMucFactory *self)
   while (g_hash_table_iter_next (&iter, NULL, &channel))
     {
       g_assert (GABBLE_IS_MUC_CHANNEL (channel));
-      gabble_muc_channel_send_presence (GABBLE_MUC_CHANNEL (channel));
+
+      if (priv->presence_interval == 0)
+        {
+          gabble_muc_channel_send_presence (GABBLE_MUC_CHANNEL (channel));
+          continue;
+        }
+
+      /* Presences are built when they're sent, so a room still waiting for
+       * the last one will get this one instead */
+      if (g_hash_table_lookup (priv->presence_queued, channel) != NULL)
+        continue;
+
+      g_hash_table_insert (priv->presence_queued, channel, channel);
+
+      if (gabble_muc_channel_get_last_sent (channel) > active_since)
+        {
+          /* after any other rooms we've spoken in recently */
+          if (active_tail == NULL)
+            {
+              g_queue_push_head (priv->presence_queue, channel);
+              active_tail = priv->presence_queue->head;
+            }
+          else
+            {
+              g_queue_insert_after (priv->presence_queue, active_tail,
+                  channel);
+              active_tail = active_tail->next;
+            }
+        }
+      else
+        {
+          g_queue_push_tail (priv->presence_queue, channel);
+        }
+    }
+
+  if (priv->presence_timer_id == 0 && !g_queue_is_empty (priv->presence_queue))
+    {
+      DEBUG ("sending presence to %u rooms, one every %u ms",
+          g_queue_get_length (priv->presence_queue), priv->presence_interval);
+
+      /* The first can go straight away */
+      send_queued_presence_cb (self);
+      priv->presence_timer_id = g_timeout_add (priv->presence_interval,
+          send_queued_presence_cb, self);
+    }
+}
+
+static void
+clear_poll_queue (GabbleMucFactory *self)
+{
+  GabbleMucFactoryPrivate *priv = self->priv;
+
+  if (priv->poll_tick_id != 0)
+    {
+      g_source_remove (priv->poll_tick_id);
+      priv->poll_tick_id = 0;
+    }
+
+  g_queue_clear (priv->poll_queue);
+}
+
+static gboolean
+poll_tick_cb (gpointer user_data)
+{
+  GabbleMucFactory *self = GABBLE_MUC_FACTORY (user_data);
+  GList *l;
+
+  /* Rooms which are due but can't be polled just now don't hold up the
+   * ones behind them */
+  for (l = self->priv->poll_queue->head; l != NULL; l = l->next)
+    {
+      if (!gabble_muc_channel_poll_properties (l->data))
+        break;
+    }
+
+  return TRUE;
+}
+
+/**
+ * gabble_muc_factory_poll_room:
+ * @self: the factory
+ * @chan: a room we've joined
+ *
+ * Puts @chan at the back of the queue of rooms polled for their properties,
+ * adding it if need be. Rooms call this when they've just got them.
+ */
+void
+gabble_muc_factory_poll_room (GabbleMucFactory *self,
+    GabbleMucChannel *chan)
+{
+  GabbleMucFactoryPrivate *priv = self->priv;
+
+  g_queue_remove (priv->poll_queue, chan);
+  g_queue_push_tail (priv->poll_queue, chan);
+
+  if (priv->poll_tick_id == 0)
+    priv->poll_tick_id = g_timeout_add_seconds (PROPS_POLL_TICK,
+        poll_tick_cb, self);
+}
+
+/**
+ * gabble_muc_factory_stop_polling_room:
+ * @self: the factory
+ * @chan: a room
+ *
+ * Takes @chan out of the queue of rooms polled for their properties, if
+ * it's there.
+ */
+void
+gabble_muc_factory_stop_polling_room (GabbleMucFactory *self,
+    GabbleMucChannel *chan)
+{
+  GabbleMucFactoryPrivate *priv = self->priv;
+
+  g_queue_remove (priv->poll_queue, chan);
+
+  if (g_queue_is_empty (priv->poll_queue) && priv->poll_tick_id != 0)
+    {
+      g_source_remove (priv->poll_tick_id);
+      priv->poll_tick_id = 0;
     }
 }
 
@@ -910,6 +1110,8 @@ gabble_muc_factory_close_all (GabbleMucFactory *self)
 
   tp_clear_pointer (&priv->queued_requests, g_hash_table_unref);
   tp_clear_pointer (&priv->text_needed_for_tube, g_hash_table_unref);
+  clear_presence_queue (self);
+  clear_poll_queue (self);
 
   /* Use a temporary variable because we don't want
    * muc_channel_closed_cb remove the channel from the hash table a
@@ -978,6 +1180,10 @@ gabble_muc_factory_constructor (GType type, guint n_props,
   GabbleMucFactory *self = GABBLE_MUC_FACTORY (obj);
   GabbleMucFactoryPrivate *priv = self->priv;
 
+  g_object_get (priv->conn,
+      "muc-presence-interval-ms", &priv->presence_interval,
+      NULL);
+
   priv->status_changed_id = g_signal_connect (priv->conn,
       "status-changed", (GCallback) connection_status_changed_cb, obj);
   tp_g_signal_connect_object (priv->conn,
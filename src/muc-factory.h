@@ -71,6 +71,11 @@ void gabble_muc_factory_handle_si_stream_request (GabbleMucFactory *self,
 
 void gabble_muc_factory_broadcast_presence (GabbleMucFactory *self);
 
+void gabble_muc_factory_poll_room (GabbleMucFactory *self,
+    GabbleMucChannel *chan);
+void gabble_muc_factory_stop_polling_room (GabbleMucFactory *self,
+    GabbleMucChannel *chan);
+
 #ifdef ENABLE_VOIP
 gboolean gabble_muc_factory_handle_jingle_session (GabbleMucFactory *self,
   WockyJingleSession *session);
@@ -0,0 +1,462 @@
+/*
+ * muc-history.c - Source for GabbleMucHistory
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Remembers, for each room each account has been in, when we last passed on
+ * a message from it to clients, by our own clock, and what that message's id
+ * was. When we rejoin the room we can then ask for only the history since
+ * then, rather than having the server replay its default history for
+ * clients to deduplicate.
+ *
+ * The cursors are shared by all connections, and are saved to a key file
+ * in the user cache directory so they survive restarts. There's one group
+ * per account and room, named "account@example.com room@conf.example.com";
+ * bare JIDs can't contain spaces. Only the MAX_CURSORS most recently used
+ * rooms are kept.
+ */
+
+#include "config.h"
+#include "muc-history.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_MUC
+#include "debug.h"
+
+/* Delay (in seconds) before writing changes to disk, so that a busy room
+ * only causes one write */
+#define SAVE_DELAY 10
+
+/* How many rooms we remember cursors for, across all accounts */
+#define MAX_CURSORS 256
+
+#define KEY_TIMESTAMP "Timestamp"
+#define KEY_ID "Id"
+
+G_DEFINE_TYPE (GabbleMucHistory, gabble_muc_history, G_TYPE_OBJECT)
+
+static gpointer shared_history = NULL;
+
+typedef struct
+{
+  /* Unix time, by our clock */
+  gint64 timestamp;
+  /* may be NULL */
+  gchar *id;
+} Cursor;
+
+struct _GabbleMucHistoryPrivate
+{
+  /* NULL if cursors are not saved */
+  gchar *path;
+  /* gchar *"account room" -> owned Cursor */
+  GHashTable *cursors;
+  guint save_id;
+};
+
+enum
+{
+  PROP_PATH = 1,
+};
+
+static void
+cursor_free (Cursor *cursor)
+{
+  g_free (cursor->id);
+  g_slice_free (Cursor, cursor);
+}
+
+static gchar *
+cursor_key (const gchar *account,
+    const gchar *room)
+{
+  return g_strdup_printf ("%s %s", account, room);
+}
+
+/* Forgets the rooms whose last message is the oldest, until there are no
+ * more than MAX_CURSORS */
+static void
+evict_cursors (GabbleMucHistory *self)
+{
+  while (g_hash_table_size (self->priv->cursors) > MAX_CURSORS)
+    {
+      GHashTableIter iter;
+      gpointer key, value;
+      const gchar *oldest_key = NULL;
+      gint64 oldest = G_MAXINT64;
+
+      g_hash_table_iter_init (&iter, self->priv->cursors);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          Cursor *cursor = value;
+
+          if (cursor->timestamp < oldest)
+            {
+              oldest = cursor->timestamp;
+              oldest_key = key;
+            }
+        }
+
+      DEBUG ("forgetting history cursor for %s", oldest_key);
+      g_hash_table_remove (self->priv->cursors, oldest_key);
+    }
+}
+
+static void
+gabble_muc_history_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  GabbleMucHistory *self = GABBLE_MUC_HISTORY (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, self->priv->path);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+gabble_muc_history_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  GabbleMucHistory *self = GABBLE_MUC_HISTORY (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_free (self->priv->path);
+      self->priv->path = g_value_dup_string (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+load (GabbleMucHistory *self)
+{
+  GKeyFile *keyfile = g_key_file_new ();
+  GError *error = NULL;
+  gchar **groups;
+  guint i, n = 0;
+
+  if (!g_key_file_load_from_file (keyfile, self->priv->path,
+          G_KEY_FILE_NONE, &error))
+    {
+      DEBUG ("couldn't load %s: %s", self->priv->path, error->message);
+      g_clear_error (&error);
+      g_key_file_free (keyfile);
+      return;
+    }
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      Cursor *cursor;
+      gint64 timestamp;
+
+      timestamp = g_key_file_get_int64 (keyfile, groups[i], KEY_TIMESTAMP,
+          &error);
+
+      /* A cursor without a time is no use */
+      if (error != NULL || timestamp <= 0)
+        {
+          g_clear_error (&error);
+          continue;
+        }
+
+      cursor = g_slice_new (Cursor);
+      cursor->timestamp = timestamp;
+      cursor->id = g_key_file_get_string (keyfile, groups[i], KEY_ID, NULL);
+      g_hash_table_insert (self->priv->cursors, g_strdup (groups[i]), cursor);
+      n++;
+    }
+
+  evict_cursors (self);
+
+  DEBUG ("loaded history cursors for %u rooms from %s", n, self->priv->path);
+
+  g_strfreev (groups);
+  g_key_file_free (keyfile);
+}
+
+static void
+gabble_muc_history_constructed (GObject *object)
+{
+  GabbleMucHistory *self = GABBLE_MUC_HISTORY (object);
+
+  if (G_OBJECT_CLASS (gabble_muc_history_parent_class)->constructed != NULL)
+    G_OBJECT_CLASS (gabble_muc_history_parent_class)->constructed (object);
+
+  if (self->priv->path != NULL)
+    load (self);
+}
+
+static void
+gabble_muc_history_finalize (GObject *object)
+{
+  GabbleMucHistory *self = GABBLE_MUC_HISTORY (object);
+
+  if (self->priv->save_id != 0)
+    gabble_muc_history_save (self);
+
+  g_hash_table_unref (self->priv->cursors);
+  g_free (self->priv->path);
+
+  G_OBJECT_CLASS (gabble_muc_history_parent_class)->finalize (object);
+}
+
+static void
+gabble_muc_history_class_init (GabbleMucHistoryClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (GabbleMucHistoryPrivate));
+
+  object_class->get_property = gabble_muc_history_get_property;
+  object_class->set_property = gabble_muc_history_set_property;
+  object_class->constructed = gabble_muc_history_constructed;
+  object_class->finalize = gabble_muc_history_finalize;
+
+  /**
+   * GabbleMucHistory:path:
+   *
+   * The key file in which the cursors are saved, or %NULL if they are only
+   * kept in memory.
+   */
+  g_object_class_install_property (object_class, PROP_PATH,
+      g_param_spec_string ("path", "Path", "The path to the cursors file",
+          NULL,
+          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE |
+          G_PARAM_STATIC_STRINGS));
+}
+
+static void
+gabble_muc_history_init (GabbleMucHistory *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, GABBLE_TYPE_MUC_HISTORY,
+      GabbleMucHistoryPrivate);
+
+  self->priv->cursors = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) cursor_free);
+}
+
+/**
+ * gabble_muc_history_dup_shared:
+ *
+ * Returns a reference to the #GabbleMucHistory shared by all connections,
+ * creating it if necessary. Setting GABBLE_MUC_HISTORY to the empty string
+ * means cursors are only kept until Gabble exits.
+ *
+ * Returns: a new, or cached, #GabbleMucHistory.
+ */
+GabbleMucHistory *
+gabble_muc_history_dup_shared (void)
+{
+  return gabble_cache_dup_shared (&shared_history, GABBLE_TYPE_MUC_HISTORY,
+      "GABBLE_MUC_HISTORY", "muc-history");
+}
+
+/**
+ * gabble_muc_history_free_shared:
+ *
+ * Drops the reference to the shared #GabbleMucHistory taken by
+ * gabble_muc_history_dup_shared(), or does nothing if it was never created.
+ * Any unsaved cursors are written out once the last reference is gone.
+ */
+void
+gabble_muc_history_free_shared (void)
+{
+  gabble_cache_free_shared (&shared_history);
+}
+
+static gboolean
+save_cb (gpointer user_data)
+{
+  GabbleMucHistory *self = user_data;
+
+  self->priv->save_id = 0;
+  gabble_muc_history_save (self);
+  return FALSE;
+}
+
+/**
+ * gabble_muc_history_get_cursor:
+ * @self: the cursors
+ * @account: the bare JID of our account
+ * @room: the bare JID of a room
+ * @timestamp: (out): when, in Unix time by our clock, we last passed on a
+ *  message from @room
+ * @id: (out) (allow-none): that message's id, which may be %NULL; only valid
+ *  until the cursor is next updated
+ *
+ * Returns: %TRUE if @account has seen a message from @room before
+ */
+gboolean
+gabble_muc_history_get_cursor (GabbleMucHistory *self,
+    const gchar *account,
+    const gchar *room,
+    gint64 *timestamp,
+    const gchar **id)
+{
+  Cursor *cursor;
+  gchar *key;
+
+  g_return_val_if_fail (GABBLE_IS_MUC_HISTORY (self), FALSE);
+  g_return_val_if_fail (account != NULL, FALSE);
+  g_return_val_if_fail (room != NULL, FALSE);
+
+  key = cursor_key (account, room);
+  cursor = g_hash_table_lookup (self->priv->cursors, key);
+  g_free (key);
+
+  if (cursor == NULL)
+    return FALSE;
+
+  if (timestamp != NULL)
+    *timestamp = cursor->timestamp;
+
+  if (id != NULL)
+    *id = cursor->id;
+
+  return TRUE;
+}
+
+/**
+ * gabble_muc_history_update_cursor:
+ * @self: the cursors
+ * @account: the bare JID of our account
+ * @room: the bare JID of a room
+ * @timestamp: when, in Unix time by our clock, we passed on a message from
+ *  @room to clients
+ * @id: (allow-none): that message's id
+ *
+ * Moves the cursor for @account in @room on to this message, unless it
+ * already points to a later one.
+ */
+void
+gabble_muc_history_update_cursor (GabbleMucHistory *self,
+    const gchar *account,
+    const gchar *room,
+    gint64 timestamp,
+    const gchar *id)
+{
+  Cursor *cursor;
+  gchar *key;
+
+  g_return_if_fail (GABBLE_IS_MUC_HISTORY (self));
+  g_return_if_fail (account != NULL);
+  g_return_if_fail (room != NULL);
+
+  key = cursor_key (account, room);
+  cursor = g_hash_table_lookup (self->priv->cursors, key);
+
+  if (cursor == NULL)
+    {
+      cursor = g_slice_new0 (Cursor);
+      g_hash_table_insert (self->priv->cursors, key, cursor);
+    }
+  else
+    {
+      g_free (key);
+
+      if (cursor->timestamp > timestamp)
+        return;
+    }
+
+  cursor->timestamp = timestamp;
+  g_free (cursor->id);
+  cursor->id = g_strdup (id);
+  evict_cursors (self);
+
+  if (self->priv->path != NULL && self->priv->save_id == 0)
+    self->priv->save_id = g_timeout_add_seconds (SAVE_DELAY, save_cb, self);
+}
+
+/**
+ * gabble_muc_history_save:
+ * @self: the cursors
+ *
+ * Writes the cursors to disk now, rather than waiting for the pending save
+ * (if any) to happen.
+ *
+ * Returns: %TRUE if the cursors were saved
+ */
+gboolean
+gabble_muc_history_save (GabbleMucHistory *self)
+{
+  GKeyFile *keyfile;
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar *data;
+  gsize len;
+  GError *error = NULL;
+  gboolean ret;
+
+  g_return_val_if_fail (GABBLE_IS_MUC_HISTORY (self), FALSE);
+
+  if (self->priv->save_id != 0)
+    {
+      g_source_remove (self->priv->save_id);
+      self->priv->save_id = 0;
+    }
+
+  if (self->priv->path == NULL)
+    return FALSE;
+
+  keyfile = g_key_file_new ();
+
+  g_hash_table_iter_init (&iter, self->priv->cursors);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      Cursor *cursor = value;
+
+      if (!gabble_key_file_group_name_is_valid (key))
+        continue;
+
+      g_key_file_set_int64 (keyfile, key, KEY_TIMESTAMP, cursor->timestamp);
+
+      if (cursor->id != NULL)
+        g_key_file_set_string (keyfile, key, KEY_ID, cursor->id);
+    }
+
+  data = g_key_file_to_data (keyfile, &len, NULL);
+  g_key_file_free (keyfile);
+
+  ret = gabble_cache_set_contents (self->priv->path, data, len, &error);
+
+  if (!ret)
+    {
+      DEBUG ("failed to save MUC history cursors to %s: %s",
+          self->priv->path, error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (data);
+  return ret;
+}
@@ -0,0 +1,79 @@
+/*
+ * muc-history.h - Header for GabbleMucHistory
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_MUC_HISTORY_H__
+#define __GABBLE_MUC_HISTORY_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleMucHistory GabbleMucHistory;
+typedef struct _GabbleMucHistoryClass GabbleMucHistoryClass;
+typedef struct _GabbleMucHistoryPrivate GabbleMucHistoryPrivate;
+
+struct _GabbleMucHistory
+{
+  GObject parent;
+  GabbleMucHistoryPrivate *priv;
+};
+
+struct _GabbleMucHistoryClass
+{
+  GObjectClass parent_class;
+};
+
+GType gabble_muc_history_get_type (void);
+
+/* TYPE MACROS */
+#define GABBLE_TYPE_MUC_HISTORY \
+  (gabble_muc_history_get_type ())
+#define GABBLE_MUC_HISTORY(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), GABBLE_TYPE_MUC_HISTORY, \
+                               GabbleMucHistory))
+#define GABBLE_MUC_HISTORY_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), GABBLE_TYPE_MUC_HISTORY, \
+                            GabbleMucHistoryClass))
+#define GABBLE_IS_MUC_HISTORY(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GABBLE_TYPE_MUC_HISTORY))
+#define GABBLE_IS_MUC_HISTORY_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), GABBLE_TYPE_MUC_HISTORY))
+#define GABBLE_MUC_HISTORY_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), GABBLE_TYPE_MUC_HISTORY, \
+                              GabbleMucHistoryClass))
+
+GabbleMucHistory *gabble_muc_history_dup_shared (void);
+void gabble_muc_history_free_shared (void);
+
+gboolean gabble_muc_history_get_cursor (GabbleMucHistory *self,
+    const gchar *account,
+    const gchar *room,
+    gint64 *timestamp,
+    const gchar **id);
+void gabble_muc_history_update_cursor (GabbleMucHistory *self,
+    const gchar *account,
+    const gchar *room,
+    gint64 timestamp,
+    const gchar *id);
+
+gboolean gabble_muc_history_save (GabbleMucHistory *self);
+
+G_END_DECLS
+
+#endif /* __GABBLE_MUC_HISTORY_H__ */
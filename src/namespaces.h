@@ -27,6 +27,7 @@
 #define NS_CSI                  "urn:xmpp:csi:0"
 #define NS_SM2                  "urn:xmpp:sm:2"
 #define NS_SM3                  "urn:xmpp:sm:3"
+#define NS_STREAM_LIMITS        "urn:xmpp:stream-limits:0"
 #define NS_AMP                  "http://jabber.org/protocol/amp"
 #define NS_AVATAR_DATA          "urn:xmpp:avatar:data"
 #define NS_AVATAR_METADATA      "urn:xmpp:avatar:metadata"
@@ -113,10 +114,13 @@
 #define NS_RECEIPTS             "urn:xmpp:receipts"
 #define NS_REGISTER             "jabber:iq:register"
 #define NS_ROSTER               "jabber:iq:roster"
+#define NS_RSM                  "http://jabber.org/protocol/rsm"
 #define NS_SEARCH               "jabber:iq:search"
 #define NS_SI                   "http://jabber.org/protocol/si"
 #define NS_SI_MULTIPLE          "http://telepathy.freedesktop.org/xmpp/si-multiple"
 #define NS_TUBES                "http://telepathy.freedesktop.org/xmpp/tubes"
+#define NS_TUBES_MUX            "http://telepathy.freedesktop.org/xmpp/tubes#mux"
+#define NS_TUBES_POOL           "http://telepathy.freedesktop.org/xmpp/tubes#pool"
 #define NS_MUJI                 "http://telepathy.freedesktop.org/xmpp/muji"
 #define NS_VCARD_TEMP           "vcard-temp"
 #define NS_VCARD_TEMP_UPDATE    "vcard-temp:x:update"
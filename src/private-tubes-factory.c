@@ -778,6 +778,41 @@ gabble_private_tubes_factory_handle_si_stream_request (
   DEBUG ("received new bytestream request for existing tube: %" G_GUINT64_FORMAT,
       tube_id);
 
+  if (!tp_strdiff (wocky_node_get_attribute (stream_node, "multiplexed"),
+        "true"))
+    {
+      if (!GABBLE_IS_TUBE_STREAM (tube))
+        {
+          GError e = { WOCKY_XMPP_ERROR, WOCKY_XMPP_ERROR_BAD_REQUEST,
+              "only stream tubes can be multiplexed" };
+
+          DEBUG ("tube %" G_GUINT64_FORMAT " is not a stream tube", tube_id);
+          gabble_bytestream_iface_close (bytestream, &e);
+          return;
+        }
+
+      gabble_tube_stream_add_mux_bytestream (GABBLE_TUBE_STREAM (tube),
+          bytestream);
+      return;
+    }
+
+  if (!tp_strdiff (wocky_node_get_attribute (stream_node, "pooled"), "true"))
+    {
+      if (!GABBLE_IS_TUBE_STREAM (tube))
+        {
+          GError e = { WOCKY_XMPP_ERROR, WOCKY_XMPP_ERROR_BAD_REQUEST,
+              "only stream tubes can have pooled bytestreams" };
+
+          DEBUG ("tube %" G_GUINT64_FORMAT " is not a stream tube", tube_id);
+          gabble_bytestream_iface_close (bytestream, &e);
+          return;
+        }
+
+      gabble_tube_stream_add_pooled_bytestream (GABBLE_TUBE_STREAM (tube),
+          bytestream);
+      return;
+    }
+
   gabble_tube_iface_add_bytestream (tube, bytestream);
 }
 
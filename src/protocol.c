@@ -200,6 +200,26 @@ static TpCMParamSpec jabber_params[] = {
     TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER(FALSE),
     0 /* unused */, NULL, NULL },
 
+  { "dbus-tube-batch-ms", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (0),
+    0 /* unused */, NULL, NULL },
+
+  { "stream-tube-pool-size", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (2),
+    0 /* unused */, NULL, NULL },
+
+  { "muc-rejoin-history", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER(TRUE),
+    0 /* unused */, NULL, NULL },
+
+  { "muc-presence-interval-ms", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (100),
+    0 /* unused */, NULL, NULL },
+
+  { "room-list-skip-info", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER(FALSE),
+    0 /* unused */, NULL, NULL },
+
   { NULL, NULL, 0, 0, NULL, 0 }
 };
 
@@ -284,6 +304,11 @@ struct ParamMapping {
   SAME ("send-chat-markers"),
   SAME ("force-chat-markers"),
   SAME ("force-receipts"),
+  SAME ("dbus-tube-batch-ms"),
+  SAME ("stream-tube-pool-size"),
+  SAME ("muc-rejoin-history"),
+  SAME ("muc-presence-interval-ms"),
+  SAME ("room-list-skip-info"),
   SAME (NULL)
 };
 #undef SAME
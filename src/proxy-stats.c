@@ -0,0 +1,532 @@
+/*
+ * proxy-stats.c - Source for GabbleProxyStats
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Remembers how well each SOCKS5 proxy has worked for us, so we can offer
+ * the best ones first. For each proxy JID we keep a moving average of the
+ * time it took to establish a TCP connection to it, and how many times
+ * using it succeeded or failed. These are combined into a cost, which is
+ * roughly the expected connection time divided by the chance of the proxy
+ * actually working.
+ *
+ * The statistics are shared by all connections, and are saved to a key file
+ * in the user cache directory so they survive restarts. Only the
+ * MAX_RECORDS most recently used proxies are kept.
+ */
+
+#include "config.h"
+#include "proxy-stats.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_BYTESTREAM
+#include "debug.h"
+
+/* Connection time (in ms) assumed for proxies we've never connected to */
+#define DEFAULT_CONNECT_TIME 1000.0
+/* Weight given to each new connection time sample */
+#define CONNECT_TIME_WEIGHT 0.25
+/* Once we have this many results for a proxy, old ones are given half their
+ * weight, so a proxy's rank can recover (or decline) reasonably quickly */
+#define MAX_RESULTS 64
+/* Delay (in seconds) before writing changes to disk, so that a burst of
+ * results only causes one write */
+#define SAVE_DELAY 10
+/* How many proxies we remember, across all accounts */
+#define MAX_RECORDS 64
+
+#define KEY_CONNECT_TIME "ConnectTime"
+#define KEY_SUCCESSES "Successes"
+#define KEY_FAILURES "Failures"
+#define KEY_LAST_USED "LastUsed"
+
+G_DEFINE_TYPE (GabbleProxyStats, gabble_proxy_stats, G_TYPE_OBJECT)
+
+static gpointer shared_stats = NULL;
+
+typedef struct
+{
+  /* in ms, or < 0 if we never managed to connect */
+  gdouble connect_time;
+  guint successes;
+  guint failures;
+  /* Unix time of the last sample, or 0 if unknown */
+  gint64 last_used;
+} ProxyRecord;
+
+struct _GabbleProxyStatsPrivate
+{
+  /* NULL if the statistics are not saved */
+  gchar *path;
+  /* gchar *jid -> owned ProxyRecord */
+  GHashTable *records;
+  guint save_id;
+};
+
+enum
+{
+  PROP_PATH = 1,
+};
+
+static ProxyRecord *
+proxy_record_new (void)
+{
+  ProxyRecord *record = g_slice_new (ProxyRecord);
+
+  record->connect_time = -1;
+  record->successes = 0;
+  record->failures = 0;
+  record->last_used = 0;
+  return record;
+}
+
+static void
+proxy_record_free (ProxyRecord *record)
+{
+  g_slice_free (ProxyRecord, record);
+}
+
+/* Forgets the proxies which were used longest ago, until there are no more
+ * than @max */
+static void
+evict_records (GabbleProxyStats *self,
+    guint max)
+{
+  while (g_hash_table_size (self->priv->records) > max)
+    {
+      GHashTableIter iter;
+      gpointer key, value;
+      const gchar *oldest_key = NULL;
+      gint64 oldest = G_MAXINT64;
+
+      g_hash_table_iter_init (&iter, self->priv->records);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          ProxyRecord *record = value;
+
+          if (record->last_used < oldest)
+            {
+              oldest = record->last_used;
+              oldest_key = key;
+            }
+        }
+
+      DEBUG ("forgetting statistics for %s", oldest_key);
+      g_hash_table_remove (self->priv->records, oldest_key);
+    }
+}
+
+static void
+gabble_proxy_stats_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  GabbleProxyStats *self = GABBLE_PROXY_STATS (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, self->priv->path);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+gabble_proxy_stats_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  GabbleProxyStats *self = GABBLE_PROXY_STATS (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_free (self->priv->path);
+      self->priv->path = g_value_dup_string (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+load (GabbleProxyStats *self)
+{
+  GKeyFile *keyfile = g_key_file_new ();
+  GError *error = NULL;
+  gchar **groups;
+  guint i;
+
+  if (!g_key_file_load_from_file (keyfile, self->priv->path,
+          G_KEY_FILE_NONE, &error))
+    {
+      DEBUG ("couldn't load %s: %s", self->priv->path, error->message);
+      g_clear_error (&error);
+      g_key_file_free (keyfile);
+      return;
+    }
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      ProxyRecord *record = proxy_record_new ();
+      gint n;
+
+      /* Missing or broken keys just leave the default in place */
+      record->connect_time = g_key_file_get_double (keyfile, groups[i],
+          KEY_CONNECT_TIME, &error);
+      if (error != NULL)
+        {
+          record->connect_time = -1;
+          g_clear_error (&error);
+        }
+
+      n = g_key_file_get_integer (keyfile, groups[i], KEY_SUCCESSES, NULL);
+      record->successes = MAX (n, 0);
+      n = g_key_file_get_integer (keyfile, groups[i], KEY_FAILURES, NULL);
+      record->failures = MAX (n, 0);
+      record->last_used = MAX (g_key_file_get_int64 (keyfile, groups[i],
+            KEY_LAST_USED, NULL), 0);
+
+      g_hash_table_insert (self->priv->records, g_strdup (groups[i]), record);
+    }
+
+  evict_records (self, MAX_RECORDS);
+
+  DEBUG ("loaded statistics for %u proxies from %s",
+      g_hash_table_size (self->priv->records), self->priv->path);
+
+  g_strfreev (groups);
+  g_key_file_free (keyfile);
+}
+
+static void
+gabble_proxy_stats_constructed (GObject *object)
+{
+  GabbleProxyStats *self = GABBLE_PROXY_STATS (object);
+
+  if (G_OBJECT_CLASS (gabble_proxy_stats_parent_class)->constructed != NULL)
+    G_OBJECT_CLASS (gabble_proxy_stats_parent_class)->constructed (object);
+
+  if (self->priv->path != NULL)
+    load (self);
+}
+
+static void
+gabble_proxy_stats_finalize (GObject *object)
+{
+  GabbleProxyStats *self = GABBLE_PROXY_STATS (object);
+
+  if (self->priv->save_id != 0)
+    gabble_proxy_stats_save (self);
+
+  g_hash_table_unref (self->priv->records);
+  g_free (self->priv->path);
+
+  G_OBJECT_CLASS (gabble_proxy_stats_parent_class)->finalize (object);
+}
+
+static void
+gabble_proxy_stats_class_init (GabbleProxyStatsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (GabbleProxyStatsPrivate));
+
+  object_class->get_property = gabble_proxy_stats_get_property;
+  object_class->set_property = gabble_proxy_stats_set_property;
+  object_class->constructed = gabble_proxy_stats_constructed;
+  object_class->finalize = gabble_proxy_stats_finalize;
+
+  /**
+   * GabbleProxyStats:path:
+   *
+   * The key file in which the statistics are saved, or %NULL if they are
+   * only kept in memory.
+   */
+  g_object_class_install_property (object_class, PROP_PATH,
+      g_param_spec_string ("path", "Path", "The path to the statistics file",
+          NULL,
+          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE |
+          G_PARAM_STATIC_STRINGS));
+}
+
+static void
+gabble_proxy_stats_init (GabbleProxyStats *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, GABBLE_TYPE_PROXY_STATS,
+      GabbleProxyStatsPrivate);
+
+  self->priv->records = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) proxy_record_free);
+}
+
+/**
+ * gabble_proxy_stats_dup_shared:
+ *
+ * Returns a reference to the #GabbleProxyStats shared by all connections,
+ * creating it if necessary. Setting GABBLE_PROXY_STATS to the empty string
+ * keeps the statistics in memory only.
+ *
+ * Returns: a new, or cached, #GabbleProxyStats.
+ */
+GabbleProxyStats *
+gabble_proxy_stats_dup_shared (void)
+{
+  return gabble_cache_dup_shared (&shared_stats, GABBLE_TYPE_PROXY_STATS,
+      "GABBLE_PROXY_STATS", "socks5-proxies");
+}
+
+/**
+ * gabble_proxy_stats_free_shared:
+ *
+ * Drops the reference to the shared #GabbleProxyStats taken by
+ * gabble_proxy_stats_dup_shared(), or does nothing if it was never created.
+ * Any unsaved statistics are written out once the last reference is gone.
+ */
+void
+gabble_proxy_stats_free_shared (void)
+{
+  gabble_cache_free_shared (&shared_stats);
+}
+
+static gboolean
+save_cb (gpointer user_data)
+{
+  GabbleProxyStats *self = user_data;
+
+  self->priv->save_id = 0;
+  gabble_proxy_stats_save (self);
+  return FALSE;
+}
+
+static ProxyRecord *
+ensure_record (GabbleProxyStats *self,
+    const gchar *jid)
+{
+  ProxyRecord *record = g_hash_table_lookup (self->priv->records, jid);
+
+  if (record == NULL)
+    {
+      /* Make room first, so the new record can't be the one to go */
+      evict_records (self, MAX_RECORDS - 1);
+      record = proxy_record_new ();
+      g_hash_table_insert (self->priv->records, g_strdup (jid), record);
+    }
+
+  record->last_used = g_get_real_time () / G_USEC_PER_SEC;
+
+  if (self->priv->path != NULL && self->priv->save_id == 0)
+    self->priv->save_id = g_timeout_add_seconds (SAVE_DELAY, save_cb, self);
+
+  return record;
+}
+
+/**
+ * gabble_proxy_stats_add_connect_time:
+ * @self: the statistics
+ * @jid: the JID of a SOCKS5 proxy
+ * @msec: how long it took to establish a TCP connection to the proxy
+ */
+void
+gabble_proxy_stats_add_connect_time (GabbleProxyStats *self,
+    const gchar *jid,
+    guint msec)
+{
+  ProxyRecord *record;
+
+  g_return_if_fail (GABBLE_IS_PROXY_STATS (self));
+  g_return_if_fail (jid != NULL);
+
+  record = ensure_record (self, jid);
+
+  if (record->connect_time < 0)
+    record->connect_time = msec;
+  else
+    record->connect_time += CONNECT_TIME_WEIGHT *
+        ((gdouble) msec - record->connect_time);
+
+  DEBUG ("%s: connected in %u ms, average now %.0f ms", jid, msec,
+      record->connect_time);
+}
+
+/**
+ * gabble_proxy_stats_add_result:
+ * @self: the statistics
+ * @jid: the JID of a SOCKS5 proxy
+ * @success: whether we managed to open a bytestream through the proxy
+ */
+void
+gabble_proxy_stats_add_result (GabbleProxyStats *self,
+    const gchar *jid,
+    gboolean success)
+{
+  ProxyRecord *record;
+
+  g_return_if_fail (GABBLE_IS_PROXY_STATS (self));
+  g_return_if_fail (jid != NULL);
+
+  record = ensure_record (self, jid);
+
+  if (success)
+    record->successes++;
+  else
+    record->failures++;
+
+  if (record->successes + record->failures > MAX_RESULTS)
+    {
+      record->successes /= 2;
+      record->failures /= 2;
+    }
+
+  DEBUG ("%s: %s; %u successes, %u failures", jid,
+      success ? "succeeded" : "failed", record->successes, record->failures);
+}
+
+/**
+ * gabble_proxy_stats_get_cost:
+ * @self: the statistics
+ * @jid: the JID of a SOCKS5 proxy
+ *
+ * Returns: how expensive it's expected to be to use @jid, in arbitrary
+ *  units. Proxies we know nothing about are ranked below ones which are known
+ *  to work well, but above ones which are known to be slow or unreliable.
+ */
+gdouble
+gabble_proxy_stats_get_cost (GabbleProxyStats *self,
+    const gchar *jid)
+{
+  ProxyRecord *record;
+  gdouble connect_time = DEFAULT_CONNECT_TIME;
+  gdouble success_rate = 0.5;
+
+  g_return_val_if_fail (GABBLE_IS_PROXY_STATS (self), DEFAULT_CONNECT_TIME);
+
+  record = g_hash_table_lookup (self->priv->records, jid);
+
+  if (record != NULL)
+    {
+      if (record->connect_time >= 0)
+        connect_time = record->connect_time;
+
+      /* Laplace's rule of succession, so that one lucky (or unlucky) result
+       * doesn't decide everything */
+      success_rate = (record->successes + 1.0) /
+          (record->successes + record->failures + 2.0);
+    }
+
+  return connect_time / success_rate;
+}
+
+/**
+ * gabble_proxy_stats_compare:
+ *
+ * A #GCompareFunc-style function which sorts cheaper proxies first.
+ */
+gint
+gabble_proxy_stats_compare (GabbleProxyStats *self,
+    const gchar *jid_a,
+    const gchar *jid_b)
+{
+  gdouble a = gabble_proxy_stats_get_cost (self, jid_a);
+  gdouble b = gabble_proxy_stats_get_cost (self, jid_b);
+
+  if (a < b)
+    return -1;
+
+  if (a > b)
+    return 1;
+
+  return 0;
+}
+
+/**
+ * gabble_proxy_stats_save:
+ * @self: the statistics
+ *
+ * Writes the statistics to disk now, rather than waiting for the pending
+ * save (if any) to happen.
+ *
+ * Returns: %TRUE if the statistics were saved
+ */
+gboolean
+gabble_proxy_stats_save (GabbleProxyStats *self)
+{
+  GKeyFile *keyfile;
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar *data;
+  gsize len;
+  GError *error = NULL;
+  gboolean ret;
+
+  g_return_val_if_fail (GABBLE_IS_PROXY_STATS (self), FALSE);
+
+  if (self->priv->save_id != 0)
+    {
+      g_source_remove (self->priv->save_id);
+      self->priv->save_id = 0;
+    }
+
+  if (self->priv->path == NULL)
+    return FALSE;
+
+  keyfile = g_key_file_new ();
+
+  g_hash_table_iter_init (&iter, self->priv->records);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const gchar *jid = key;
+      ProxyRecord *record = value;
+
+      if (!gabble_key_file_group_name_is_valid (jid))
+        continue;
+
+      if (record->connect_time >= 0)
+        g_key_file_set_double (keyfile, jid, KEY_CONNECT_TIME,
+            record->connect_time);
+
+      g_key_file_set_integer (keyfile, jid, KEY_SUCCESSES, record->successes);
+      g_key_file_set_integer (keyfile, jid, KEY_FAILURES, record->failures);
+
+      if (record->last_used > 0)
+        g_key_file_set_int64 (keyfile, jid, KEY_LAST_USED, record->last_used);
+    }
+
+  data = g_key_file_to_data (keyfile, &len, NULL);
+  g_key_file_free (keyfile);
+
+  ret = gabble_cache_set_contents (self->priv->path, data, len, &error);
+
+  if (!ret)
+    {
+      DEBUG ("failed to save proxy statistics to %s: %s", self->priv->path,
+          error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (data);
+  return ret;
+}
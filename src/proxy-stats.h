@@ -0,0 +1,81 @@
+/*
+ * proxy-stats.h - Header for GabbleProxyStats
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_PROXY_STATS_H__
+#define __GABBLE_PROXY_STATS_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleProxyStats GabbleProxyStats;
+typedef struct _GabbleProxyStatsClass GabbleProxyStatsClass;
+typedef struct _GabbleProxyStatsPrivate GabbleProxyStatsPrivate;
+
+struct _GabbleProxyStats
+{
+  GObject parent;
+  GabbleProxyStatsPrivate *priv;
+};
+
+struct _GabbleProxyStatsClass
+{
+  GObjectClass parent_class;
+};
+
+GType gabble_proxy_stats_get_type (void);
+
+/* TYPE MACROS */
+#define GABBLE_TYPE_PROXY_STATS \
+  (gabble_proxy_stats_get_type ())
+#define GABBLE_PROXY_STATS(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), GABBLE_TYPE_PROXY_STATS, \
+                               GabbleProxyStats))
+#define GABBLE_PROXY_STATS_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), GABBLE_TYPE_PROXY_STATS, \
+                            GabbleProxyStatsClass))
+#define GABBLE_IS_PROXY_STATS(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GABBLE_TYPE_PROXY_STATS))
+#define GABBLE_IS_PROXY_STATS_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), GABBLE_TYPE_PROXY_STATS))
+#define GABBLE_PROXY_STATS_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), GABBLE_TYPE_PROXY_STATS, \
+                              GabbleProxyStatsClass))
+
+GabbleProxyStats *gabble_proxy_stats_dup_shared (void);
+void gabble_proxy_stats_free_shared (void);
+
+void gabble_proxy_stats_add_connect_time (GabbleProxyStats *self,
+    const gchar *jid,
+    guint msec);
+void gabble_proxy_stats_add_result (GabbleProxyStats *self,
+    const gchar *jid,
+    gboolean success);
+
+gdouble gabble_proxy_stats_get_cost (GabbleProxyStats *self,
+    const gchar *jid);
+gint gabble_proxy_stats_compare (GabbleProxyStats *self,
+    const gchar *jid_a,
+    const gchar *jid_b);
+
+gboolean gabble_proxy_stats_save (GabbleProxyStats *self);
+
+G_END_DECLS
+
+#endif /* __GABBLE_PROXY_STATS_H__ */
@@ -326,15 +326,20 @@ room_info_cb (gpointer pipeline, GabbleDiscoItem *item, gpointer user_data)
   category = item->category;
   type = item->type;
 
-  if (0 != strcmp (category, "conference") ||
-      0 != strcmp (type, "text"))
-    return;
-
-  if (!g_hash_table_lookup_extended (item->features,
-        "http://jabber.org/protocol/muc", &k, &v))
+  /* Items listed by name alone, without asking for their info, have no
+   * identity or features; the conference server says they're rooms */
+  if (category != NULL)
     {
-      /* not muc */
-      return;
+      if (0 != strcmp (category, "conference") ||
+          0 != strcmp (type, "text"))
+        return;
+
+      if (!g_hash_table_lookup_extended (item->features,
+            "http://jabber.org/protocol/muc", &k, &v))
+        {
+          /* not muc */
+          return;
+        }
     }
 
   handle = tp_handle_ensure (room_handles, jid, NULL, NULL);
@@ -506,8 +511,18 @@ gabble_roomlist_channel_list_rooms (TpSvcChannelTypeRoomList *iface,
   tp_svc_channel_type_room_list_emit_listing_rooms (iface, TRUE);
 
   if (priv->disco_pipeline == NULL)
-    priv->disco_pipeline = gabble_disco_pipeline_init (conn->disco,
-        room_info_cb, rooms_end_cb, self);
+    {
+      gboolean skip_info;
+
+      priv->disco_pipeline = gabble_disco_pipeline_init (conn->disco,
+          room_info_cb, rooms_end_cb, self);
+
+      /* Looking up every room's details is slow on big servers; if the list
+       * of rooms names them, that's enough for some UIs */
+      g_object_get (conn, "room-list-skip-info", &skip_info, NULL);
+      gabble_disco_pipeline_set_trust_item_names (priv->disco_pipeline,
+          skip_info);
+    }
 
   gabble_disco_pipeline_run (priv->disco_pipeline, priv->conference_server);
 
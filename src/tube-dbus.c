@@ -38,6 +38,7 @@
 #include "bytestream-ibb.h"
 #include "bytestream-iface.h"
 #include "connection.h"
+#include "dbus-reassembler.h"
 #include "debug.h"
 #include "disco.h"
 #include "gabble-signals-marshal.h"
@@ -56,6 +57,16 @@
  * arbitrary limit on the queue size set to 4MB. */
 #define MAX_QUEUE_SIZE (4096*1024)
 
+/* Outgoing messages on 1-1 tubes can be batched into one bytestream write by
+ * setting the dbus-tube-batch-ms connection parameter to how long, in
+ * milliseconds, a message may wait for others to join it; it's capped at
+ * BATCH_MAX_DELAY. A batch is sent early once it reaches BATCH_MAX_SIZE,
+ * which is what an IBB stanza carries. The receiving side splits the
+ * messages apart again using their headers, so this needs nothing from the
+ * peer. */
+#define BATCH_MAX_DELAY 100
+#define BATCH_MAX_SIZE (16 * 1024)
+
 static void tube_iface_init (gpointer g_iface, gpointer iface_data);
 static void dbustube_iface_init (gpointer g_iface, gpointer iface_data);
 
@@ -145,10 +156,15 @@ struct _GabbleTubeDBusPrivate
   /* mapping of D-Bus name -> contact handle */
   GHashTable *dbus_name_to_handle;
 
-  /* Message reassembly buffer (CONTACT tubes only) */
-  GString *reassembly_buffer;
-  /* Number of bytes that will be in the next message, 0 if unknown */
-  guint32 reassembly_bytes_needed;
+  /* Message reassembly (CONTACT tubes only) */
+  GabbleDBusReassembler *reassembler;
+
+  /* Outgoing messages waiting to be sent as one batch (CONTACT tubes with
+   * batching enabled only) */
+  GString *batch_buffer;
+  /* How long, in ms, a message may wait in batch_buffer; 0 to disable */
+  guint batch_delay;
+  guint batch_timeout;
 
   gboolean dispose_has_run;
 };
@@ -169,7 +185,7 @@ gabble_tube_dbus_get_interfaces (TpBaseChannel *base)
 }
 
 static void data_received_cb (GabbleBytestreamIface *stream, TpHandle sender,
-    GString *data, gpointer user_data);
+    const GibberBuffer *data, gpointer user_data);
 
 /*
  * Characters used are permissible both in filenames and in D-Bus names. (See
@@ -190,6 +206,72 @@ generate_ascii_string (guint len,
     buf[i] = chars[g_random_int_range (0, 64)];
 }
 
+static void
+flush_batch (GabbleTubeDBus *tube)
+{
+  GabbleTubeDBusPrivate *priv = GABBLE_TUBE_DBUS_GET_PRIVATE (tube);
+
+  if (priv->batch_timeout != 0)
+    {
+      g_source_remove (priv->batch_timeout);
+      priv->batch_timeout = 0;
+    }
+
+  if (priv->batch_buffer == NULL || priv->batch_buffer->len == 0)
+    return;
+
+  if (priv->bytestream != NULL)
+    {
+      DEBUG ("sending %" G_GSIZE_FORMAT " bytes of batched messages",
+          priv->batch_buffer->len);
+      gabble_bytestream_iface_send (priv->bytestream,
+          priv->batch_buffer->len, priv->batch_buffer->str);
+    }
+
+  g_string_truncate (priv->batch_buffer, 0);
+}
+
+static gboolean
+batch_timeout_cb (gpointer user_data)
+{
+  GabbleTubeDBus *tube = GABBLE_TUBE_DBUS (user_data);
+  GabbleTubeDBusPrivate *priv = GABBLE_TUBE_DBUS_GET_PRIVATE (tube);
+
+  priv->batch_timeout = 0;
+  flush_batch (tube);
+  return FALSE;
+}
+
+static void
+send_message (GabbleTubeDBus *tube,
+    const gchar *marshalled,
+    gint len)
+{
+  GabbleTubeDBusPrivate *priv = GABBLE_TUBE_DBUS_GET_PRIVATE (tube);
+
+  if (priv->batch_delay == 0)
+    {
+      gabble_bytestream_iface_send (priv->bytestream, len, marshalled);
+      return;
+    }
+
+  if (priv->batch_buffer->len + len > BATCH_MAX_SIZE)
+    flush_batch (tube);
+
+  if (len >= BATCH_MAX_SIZE)
+    {
+      /* Nothing else would fit with it anyway */
+      gabble_bytestream_iface_send (priv->bytestream, len, marshalled);
+      return;
+    }
+
+  g_string_append_len (priv->batch_buffer, marshalled, len);
+
+  if (priv->batch_timeout == 0)
+    priv->batch_timeout = g_timeout_add (priv->batch_delay,
+        batch_timeout_cb, tube);
+}
+
 static DBusHandlerResult
 filter_cb (DBusConnection *conn,
            DBusMessage *msg,
@@ -207,6 +289,7 @@ filter_cb (DBusConnection *conn,
     {
       /* connection was disconnected */
       DEBUG ("connection was disconnected");
+      flush_batch (tube);
       dbus_connection_close (priv->dbus_conn);
       tp_clear_pointer (&priv->dbus_conn, dbus_connection_unref);
       goto out;
@@ -249,7 +332,7 @@ filter_cb (DBusConnection *conn,
         }
     }
 
-  gabble_bytestream_iface_send (priv->bytestream, len, marshalled);
+  send_message (tube, marshalled, len);
 
 out:
   if (marshalled != NULL)
@@ -328,6 +411,8 @@ gabble_tube_dbus_close (TpBaseChannel *base)
    * disappear when we finally remove the Tubes channel type.. */
   g_object_ref (base);
 
+  flush_batch (self);
+
   if (priv->bytestream != NULL)
     gabble_bytestream_iface_close (priv->bytestream, NULL);
   else
@@ -494,6 +579,8 @@ bytestream_state_changed_cb (GabbleBytestreamIface *bytestream,
   if (state == GABBLE_BYTESTREAM_STATE_CLOSED)
     {
       tp_clear_object (&priv->bytestream);
+      /* drops anything still waiting to be sent */
+      flush_batch (self);
       g_signal_emit (G_OBJECT (self), signals[CLOSED], 0);
 
       if (cls->target_handle_type == TP_HANDLE_TYPE_ROOM)
@@ -563,8 +650,16 @@ gabble_tube_dbus_dispose (GObject *object)
   tp_clear_pointer (&priv->dbus_names, g_hash_table_unref);
   tp_clear_pointer (&priv->dbus_name_to_handle, g_hash_table_unref);
 
-  if (priv->reassembly_buffer)
-    g_string_free (priv->reassembly_buffer, TRUE);
+  tp_clear_pointer (&priv->reassembler, gabble_dbus_reassembler_free);
+
+  if (priv->batch_timeout != 0)
+    {
+      g_source_remove (priv->batch_timeout);
+      priv->batch_timeout = 0;
+    }
+
+  if (priv->batch_buffer != NULL)
+    g_string_free (priv->batch_buffer, TRUE);
 
   if (G_OBJECT_CLASS (gabble_tube_dbus_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_tube_dbus_parent_class)->dispose (object);
@@ -765,8 +860,20 @@ gabble_tube_dbus_constructed (GObject *obj)
       priv->dbus_name_to_handle = NULL;
 
       /* For contact (IBB) tubes we need to be able to reassemble messages. */
-      priv->reassembly_buffer = g_string_new ("");
-      priv->reassembly_bytes_needed = 0;
+      priv->reassembler = gabble_dbus_reassembler_new ();
+
+      /* The peer reassembles messages, so they can be batched too. MUC
+       * tubes can't do this: each of their messages is demarshalled as it
+       * arrives. */
+      g_object_get (conn, "dbus-tube-batch-ms", &priv->batch_delay, NULL);
+      priv->batch_delay = MIN (priv->batch_delay, BATCH_MAX_DELAY);
+
+      if (priv->batch_delay != 0)
+        {
+          DEBUG ("batching outgoing messages for up to %u ms",
+              priv->batch_delay);
+          priv->batch_buffer = g_string_sized_new (BATCH_MAX_SIZE);
+        }
 
       g_assert (priv->muc == NULL);
 
@@ -1200,26 +1307,26 @@ unref:
   dbus_message_unref (msg);
 }
 
-static guint32
-collect_le32 (char *str)
-{
-  unsigned char *bytes = (unsigned char *) str;
-
-  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
-}
+typedef struct {
+    GabbleTubeDBus *tube;
+    TpHandle sender;
+} ReassembledContext;
 
-static guint32
-collect_be32 (char *str)
+static void
+reassembled_message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
 {
-  unsigned char *bytes = (unsigned char *) str;
+  ReassembledContext *ctx = user_data;
 
-  return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 24) | bytes[3];
+  DEBUG ("Received complete D-Bus message of size %" G_GSIZE_FORMAT, len);
+  message_received (ctx->tube, ctx->sender, data, len);
 }
 
 static void
 data_received_cb (GabbleBytestreamIface *stream,
                   TpHandle sender,
-                  GString *data,
+                  const GibberBuffer *data,
                   gpointer user_data)
 {
   GabbleTubeDBus *tube = GABBLE_TUBE_DBUS (user_data);
@@ -1229,104 +1336,30 @@ data_received_cb (GabbleBytestreamIface *stream,
 
   if (cls->target_handle_type == TP_HANDLE_TYPE_CONTACT)
     {
-      GString *buf = priv->reassembly_buffer;
-
-      g_assert (buf != NULL);
-
-      g_string_append_len (buf, data->str, data->len);
-      DEBUG ("Received %" G_GSIZE_FORMAT " bytes, so we now have %"
-          G_GSIZE_FORMAT " bytes in reassembly buffer", data->len, buf->len);
-
-      /* Each D-Bus message has a 16-byte fixed header, in which
-       *
-       * * byte 0 is 'l' (ell) or 'B' for endianness
-       * * bytes 4-7 are body length "n" in bytes in that endianness
-       * * bytes 12-15 are length "m" of param array in bytes in that
-       *   endianness
-       *
-       * followed by m + n + ((8 - (m % 8)) % 8) bytes of other content.
-       */
-
-      while (buf->len >= 16)
-        {
-          guint32 body_length, params_length, m;
+      ReassembledContext ctx = { tube, sender };
 
-          /* see if we have a whole message and have already calculated
-           * how many bytes it needs */
+      g_assert (priv->reassembler != NULL);
 
-          if (priv->reassembly_bytes_needed != 0)
-            {
-              if (buf->len >= priv->reassembly_bytes_needed)
-                {
-                  DEBUG ("Received complete D-Bus message of size %"
-                      G_GINT32_FORMAT, priv->reassembly_bytes_needed);
-                  message_received (tube, sender, buf->str,
-                      priv->reassembly_bytes_needed);
-                  g_string_erase (buf, 0, priv->reassembly_bytes_needed);
-                  priv->reassembly_bytes_needed = 0;
-                }
-              else
-                {
-                  /* we'll have to wait for more data */
-                  break;
-                }
-            }
-
-          if (buf->len < 16)
-            break;
-
-          /* work out how big the next message is going to be */
-
-          if (buf->str[0] == DBUS_BIG_ENDIAN)
-            {
-              body_length = collect_be32 (buf->str + 4);
-              m = collect_be32 (buf->str + 12);
-            }
-          else if (buf->str[0] == DBUS_LITTLE_ENDIAN)
-            {
-              body_length = collect_le32 (buf->str + 4);
-              m = collect_le32 (buf->str + 12);
-            }
-          else
-            {
-              DEBUG ("D-Bus message has unknown endianness byte 0x%x, "
-                  "closing tube", (unsigned int) buf->str[0]);
-              gabble_tube_iface_close ((GabbleTubeIface *) tube, TRUE);
-              return;
-            }
-
-          /* pad to 8-byte boundary */
-          params_length = m + ((8 - (m % 8)) % 8);
-          g_assert (params_length % 8 == 0);
-          g_assert (params_length >= m);
-          g_assert (params_length < m + 8);
-
-          priv->reassembly_bytes_needed = params_length + body_length + 16;
-
-          /* n.b.: this looks as if it could be simplified to just the third
-           * test, but that would be wrong if the addition had overflowed, so
-           * don't do that. The first and second tests are sufficient to
-           * ensure no overflow on 32-bit platforms */
-          if (body_length > DBUS_MAXIMUM_MESSAGE_LENGTH ||
-              params_length > DBUS_MAXIMUM_ARRAY_LENGTH ||
-              priv->reassembly_bytes_needed > DBUS_MAXIMUM_MESSAGE_LENGTH)
-            {
-              DEBUG ("D-Bus message is too large to be valid, closing tube");
-              gabble_tube_iface_close ((GabbleTubeIface *) tube, TRUE);
-              return;
-            }
-
-          g_assert (priv->reassembly_bytes_needed != 0);
-          DEBUG ("We need %" G_GINT32_FORMAT " bytes for the next full "
-              "message", priv->reassembly_bytes_needed);
+      if (!gabble_dbus_reassembler_feed (priv->reassembler,
+            (const gchar *) data->data, data->length, reassembled_message_cb,
+            &ctx))
+        {
+          DEBUG ("Received invalid D-Bus message, closing tube");
+          gabble_tube_iface_close ((GabbleTubeIface *) tube, TRUE);
+          return;
         }
+
+      DEBUG ("Received %" G_GSIZE_FORMAT " bytes, %" G_GSIZE_FORMAT
+          " bytes waiting for the rest of their message", data->length,
+          gabble_dbus_reassembler_get_pending (priv->reassembler));
     }
   else
     {
       /* MUC bytestreams are message-boundary preserving, which is necessary,
        * because we can't assume we started at the beginning */
       g_assert (GABBLE_IS_BYTESTREAM_MUC (priv->bytestream));
-      message_received (tube, sender, data->str, data->len);
+      message_received (tube, sender, (const gchar *) data->data,
+          data->length);
     }
 }
 
@@ -0,0 +1,876 @@
+/*
+ * tube-stream-mux.c - Source for GabbleTubeStreamMux
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Carries all the connections of a 1-1 stream tube over one bytestream, so
+ * that each new connection doesn't need a stream initiation of its own.
+ *
+ * Everything sent over the bytestream is a frame with an 8-byte header:
+ *
+ *  - byte 0 is the frame type, one of the FRAME_ values below;
+ *  - byte 1 is reserved, and is 0;
+ *  - bytes 2-3 are the length of the payload following the header;
+ *  - bytes 4-7 are the channel the frame is about;
+ *
+ * all in network byte order. The side which listens for local connections
+ * opens a channel for each one with FRAME_OPEN, and the other side connects
+ * to its local socket in response. Either side ends a channel with
+ * FRAME_CLOSE.
+ *
+ * Each side may send INITIAL_WINDOW bytes on a channel before the other has
+ * to grant it more with FRAME_WINDOW, whose payload is the number of bytes
+ * granted. Bytes are only granted back once they have been written to the
+ * local socket, so a slow application holds up its own connection and
+ * nobody else's. A peer which sends more than it has been granted breaks
+ * the protocol, and the whole bytestream is closed. So we never do: what we
+ * read from a local socket beyond the window waits on its channel, and we
+ * stop reading from that socket, until the peer grants more.
+ */
+
+#include "config.h"
+#include "tube-stream-mux.h"
+
+#include <string.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_TUBES
+#include "debug.h"
+
+#define FRAME_HEADER_SIZE 8
+#define FRAME_MAX_PAYLOAD G_MAXUINT16
+
+#define FRAME_OPEN 1
+#define FRAME_DATA 2
+#define FRAME_CLOSE 3
+#define FRAME_WINDOW 4
+
+#define INITIAL_WINDOW (256 * 1024)
+/* Bytes are granted back in batches of at least this many, unless the
+ * local socket has drained */
+#define MIN_GRANT (INITIAL_WINDOW / 4)
+
+G_DEFINE_TYPE (GabbleTubeStreamMux, gabble_tube_stream_mux, G_TYPE_OBJECT)
+
+/* signals */
+enum
+{
+  NEW_CONNECTION,
+  CONNECTION_CLOSED,
+  CLOSED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = {0};
+
+typedef struct
+{
+  guint32 id;
+  GibberTransport *transport;
+  /* bytes we may still send before the peer grants us more */
+  gint64 send_window;
+  /* bytes the peer may still send us */
+  gint64 recv_window;
+  /* bytes written to the local socket that we haven't granted back yet */
+  guint32 ungranted;
+  /* data received before the local socket was connected */
+  GString *pending;
+  /* data read from the local socket which doesn't fit in send_window */
+  GString *unsent;
+  /* the peer closed the channel; we disconnect once the data it sent
+   * before has been written out */
+  gboolean remote_closed;
+  /* the local socket was closed; we close the channel once unsent has been
+   * sent */
+  gboolean local_closed;
+} MuxChannel;
+
+struct _GabbleTubeStreamMuxPrivate
+{
+  /* NULL once the mux has been shut down */
+  GabbleBytestreamIface *bytestream;
+  gboolean open;
+  gboolean write_blocked;
+
+  /* frames waiting for the bytestream to open */
+  GString *unsent;
+  /* scratch space to build a frame in */
+  GString *frame;
+  /* received data which doesn't make up a whole frame yet */
+  GString *received;
+
+  /* guint32 id -> owned MuxChannel */
+  GHashTable *channels;
+  /* borrowed GibberTransport -> borrowed MuxChannel */
+  GHashTable *transport_to_channel;
+  guint32 last_id;
+};
+
+static void
+mux_channel_free (MuxChannel *channel)
+{
+  g_object_unref (channel->transport);
+
+  if (channel->pending != NULL)
+    g_string_free (channel->pending, TRUE);
+
+  if (channel->unsent != NULL)
+    g_string_free (channel->unsent, TRUE);
+
+  g_slice_free (MuxChannel, channel);
+}
+
+static void
+put_u32 (gchar *p,
+    guint32 value)
+{
+  value = GUINT32_TO_BE (value);
+  memcpy (p, &value, 4);
+}
+
+static guint32
+get_u32 (const gchar *p)
+{
+  guint32 value;
+
+  memcpy (&value, p, 4);
+  return GUINT32_FROM_BE (value);
+}
+
+static void
+send_frame (GabbleTubeStreamMux *self,
+    guint8 type,
+    guint32 id,
+    const gchar *payload,
+    guint16 len)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  gchar header[FRAME_HEADER_SIZE];
+  GString *frame;
+
+  if (priv->bytestream == NULL)
+    return;
+
+  header[0] = type;
+  header[1] = 0;
+  header[2] = len >> 8;
+  header[3] = len & 0xff;
+  put_u32 (header + 4, id);
+
+  /* Each frame goes out in one write, so that it only takes one stanza over
+   * IBB */
+  frame = priv->open ? priv->frame : priv->unsent;
+  g_string_append_len (frame, header, FRAME_HEADER_SIZE);
+  g_string_append_len (frame, payload, len);
+
+  if (priv->open)
+    {
+      gabble_bytestream_iface_send (priv->bytestream, frame->len, frame->str);
+      g_string_truncate (frame, 0);
+    }
+}
+
+static void
+send_window (GabbleTubeStreamMux *self,
+    MuxChannel *channel,
+    gboolean all)
+{
+  gchar payload[4];
+
+  if (channel->ungranted == 0 || (!all && channel->ungranted < MIN_GRANT))
+    return;
+
+  put_u32 (payload, channel->ungranted);
+  send_frame (self, FRAME_WINDOW, channel->id, payload, sizeof (payload));
+  channel->recv_window += channel->ungranted;
+  channel->ungranted = 0;
+}
+
+static void
+update_blocking (GabbleTubeStreamMux *self,
+    MuxChannel *channel)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+
+  gibber_transport_block_receiving (channel->transport,
+      !priv->open || priv->write_blocked || channel->remote_closed ||
+      channel->send_window <= 0 || channel->unsent != NULL);
+}
+
+static void
+update_all_blocking (GabbleTubeStreamMux *self)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, self->priv->channels);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    update_blocking (self, value);
+}
+
+static void
+remove_channel (GabbleTubeStreamMux *self,
+    MuxChannel *channel,
+    const gchar *error,
+    const gchar *debug_msg)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  GibberTransport *transport = channel->transport;
+
+  DEBUG ("removing channel %u", channel->id);
+
+  g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+  gibber_transport_set_handler (transport, NULL, NULL);
+  gibber_transport_disconnect (transport);
+
+  if (error != NULL)
+    g_signal_emit (self, signals[CONNECTION_CLOSED], 0, transport, error,
+        debug_msg);
+
+  g_hash_table_remove (priv->transport_to_channel, transport);
+  g_hash_table_remove (priv->channels, GUINT_TO_POINTER (channel->id));
+}
+
+/* Sends as much of @data on @channel as its window allows. Returns how
+ * many bytes that was. */
+static gsize
+send_data (GabbleTubeStreamMux *self,
+    MuxChannel *channel,
+    const gchar *data,
+    gsize len)
+{
+  gsize allowed = MIN (len, (gsize) channel->send_window);
+  gsize offset;
+
+  for (offset = 0; offset < allowed; offset += FRAME_MAX_PAYLOAD)
+    send_frame (self, FRAME_DATA, channel->id, data + offset,
+        MIN (allowed - offset, FRAME_MAX_PAYLOAD));
+
+  channel->send_window -= allowed;
+  return allowed;
+}
+
+/* Sends whatever @channel's window now allows of the data it kept back.
+ * Returns FALSE if that was the last of a channel whose local socket has
+ * been closed, and so @channel has gone. */
+static gboolean
+flush_unsent (GabbleTubeStreamMux *self,
+    MuxChannel *channel)
+{
+  if (channel->unsent == NULL)
+    return TRUE;
+
+  g_string_erase (channel->unsent, 0, send_data (self, channel,
+        channel->unsent->str, channel->unsent->len));
+
+  if (channel->unsent->len > 0)
+    return TRUE;
+
+  g_string_free (channel->unsent, TRUE);
+  channel->unsent = NULL;
+
+  if (!channel->local_closed)
+    return TRUE;
+
+  DEBUG ("channel %u has sent the last of its data", channel->id);
+  send_frame (self, FRAME_CLOSE, channel->id, NULL, 0);
+  remove_channel (self, channel, TP_ERROR_STR_CANCELLED,
+      "local socket has been disconnected");
+  return FALSE;
+}
+
+static void
+transport_handler (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  GabbleTubeStreamMux *self = GABBLE_TUBE_STREAM_MUX (user_data);
+  MuxChannel *channel;
+  const gchar *data = (const gchar *) buffer->data;
+  gsize sent = 0;
+
+  channel = g_hash_table_lookup (self->priv->transport_to_channel, transport);
+  g_return_if_fail (channel != NULL);
+
+  /* Anything already waiting has to go first */
+  if (channel->unsent == NULL)
+    sent = send_data (self, channel, data, buffer->length);
+
+  if (sent == buffer->length)
+    {
+      if (channel->send_window == 0)
+        {
+          DEBUG ("channel %u has used up its window", channel->id);
+          update_blocking (self, channel);
+        }
+
+      return;
+    }
+
+  if (channel->unsent == NULL)
+    {
+      DEBUG ("channel %u has used up its window; keeping %" G_GSIZE_FORMAT
+          " bytes until the peer grants more", channel->id,
+          buffer->length - sent);
+      channel->unsent = g_string_sized_new (buffer->length - sent);
+    }
+
+  g_string_append_len (channel->unsent, data + sent, buffer->length - sent);
+  update_blocking (self, channel);
+}
+
+/* Writes data received on @channel to its local socket. Returns FALSE if
+ * that made the socket disconnect, and so @channel has gone. */
+static gboolean
+deliver (GabbleTubeStreamMux *self,
+    MuxChannel *channel,
+    const gchar *data,
+    gsize len)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  guint32 id = channel->id;
+  GError *error = NULL;
+
+  if (gibber_transport_get_state (channel->transport) !=
+      GIBBER_TRANSPORT_CONNECTED)
+    {
+      if (channel->pending == NULL)
+        channel->pending = g_string_sized_new (len);
+
+      g_string_append_len (channel->pending, data, len);
+      return TRUE;
+    }
+
+  if (!gibber_transport_send (channel->transport, (const guint8 *) data, len,
+        &error))
+    {
+      DEBUG ("sending to channel %u failed: %s", id, error->message);
+      g_error_free (error);
+    }
+
+  channel = g_hash_table_lookup (priv->channels, GUINT_TO_POINTER (id));
+  if (channel == NULL)
+    return FALSE;
+
+  channel->ungranted += len;
+
+  if (!gibber_transport_buffer_is_high (channel->transport))
+    send_window (self, channel, FALSE);
+
+  return TRUE;
+}
+
+static void
+transport_connected_cb (GibberTransport *transport,
+    GabbleTubeStreamMux *self)
+{
+  MuxChannel *channel;
+  GString *pending;
+
+  channel = g_hash_table_lookup (self->priv->transport_to_channel, transport);
+  g_return_if_fail (channel != NULL);
+
+  DEBUG ("channel %u is connected", channel->id);
+
+  pending = channel->pending;
+  channel->pending = NULL;
+
+  if (pending != NULL)
+    {
+      gboolean alive = deliver (self, channel, pending->str, pending->len);
+
+      g_string_free (pending, TRUE);
+
+      if (!alive)
+        return;
+    }
+
+  if (channel->remote_closed && gibber_transport_buffer_is_empty (transport))
+    remove_channel (self, channel, NULL, NULL);
+  else
+    update_blocking (self, channel);
+}
+
+static void
+transport_disconnected_cb (GibberTransport *transport,
+    GabbleTubeStreamMux *self)
+{
+  MuxChannel *channel;
+
+  channel = g_hash_table_lookup (self->priv->transport_to_channel, transport);
+  g_return_if_fail (channel != NULL);
+
+  if (channel->remote_closed)
+    {
+      remove_channel (self, channel, NULL, NULL);
+      return;
+    }
+
+  if (channel->unsent != NULL)
+    {
+      DEBUG ("local socket of channel %u has been disconnected; closing the "
+          "channel once the peer has let us send the rest of its data",
+          channel->id);
+      channel->local_closed = TRUE;
+      return;
+    }
+
+  DEBUG ("local socket of channel %u has been disconnected", channel->id);
+  send_frame (self, FRAME_CLOSE, channel->id, NULL, 0);
+  remove_channel (self, channel, TP_ERROR_STR_CANCELLED,
+      "local socket has been disconnected");
+}
+
+static void
+transport_buffer_low_cb (GibberTransport *transport,
+    GabbleTubeStreamMux *self)
+{
+  MuxChannel *channel;
+
+  channel = g_hash_table_lookup (self->priv->transport_to_channel, transport);
+  g_return_if_fail (channel != NULL);
+
+  /* The local application has caught up, so the peer can send more */
+  send_window (self, channel, TRUE);
+}
+
+static void
+transport_buffer_empty_cb (GibberTransport *transport,
+    GabbleTubeStreamMux *self)
+{
+  MuxChannel *channel;
+
+  channel = g_hash_table_lookup (self->priv->transport_to_channel, transport);
+  g_return_if_fail (channel != NULL);
+
+  if (channel->remote_closed)
+    {
+      DEBUG ("channel %u has written out its data", channel->id);
+      remove_channel (self, channel, NULL, NULL);
+    }
+}
+
+static MuxChannel *
+add_channel (GabbleTubeStreamMux *self,
+    guint32 id,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  MuxChannel *channel = g_slice_new0 (MuxChannel);
+
+  channel->id = id;
+  channel->transport = g_object_ref (transport);
+  channel->send_window = INITIAL_WINDOW;
+  channel->recv_window = INITIAL_WINDOW;
+
+  g_hash_table_insert (priv->channels, GUINT_TO_POINTER (id), channel);
+  g_hash_table_insert (priv->transport_to_channel, transport, channel);
+
+  gibber_transport_set_handler (transport, transport_handler, self);
+
+  g_signal_connect (transport, "connected",
+      G_CALLBACK (transport_connected_cb), self);
+  g_signal_connect (transport, "disconnected",
+      G_CALLBACK (transport_disconnected_cb), self);
+  g_signal_connect (transport, "buffer-low",
+      G_CALLBACK (transport_buffer_low_cb), self);
+  g_signal_connect (transport, "buffer-empty",
+      G_CALLBACK (transport_buffer_empty_cb), self);
+
+  update_blocking (self, channel);
+
+  return channel;
+}
+
+/* Shuts down every channel and forgets the bytestream, without closing it */
+static void
+shut_down (GabbleTubeStreamMux *self,
+    const gchar *error,
+    const gchar *debug_msg)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  GList *channels, *l;
+
+  if (priv->bytestream == NULL)
+    return;
+
+  g_signal_handlers_disconnect_matched (priv->bytestream, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+  tp_clear_object (&priv->bytestream);
+
+  channels = g_hash_table_get_values (priv->channels);
+
+  for (l = channels; l != NULL; l = l->next)
+    {
+      MuxChannel *channel = l->data;
+
+      remove_channel (self, channel, channel->remote_closed ? NULL : error,
+          debug_msg);
+    }
+
+  g_list_free (channels);
+}
+
+static void
+close_on_error (GabbleTubeStreamMux *self)
+{
+  GabbleBytestreamIface *bytestream = g_object_ref (self->priv->bytestream);
+
+  shut_down (self, TP_ERROR_STR_CONNECTION_LOST,
+      "multiplexed bytestream is broken");
+  gabble_bytestream_iface_close (bytestream, NULL);
+  g_object_unref (bytestream);
+
+  g_signal_emit (self, signals[CLOSED], 0);
+}
+
+/* Returns FALSE if the frame breaks the protocol */
+static gboolean
+handle_frame (GabbleTubeStreamMux *self,
+    guint8 type,
+    guint32 id,
+    const gchar *payload,
+    guint16 len)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  MuxChannel *channel;
+
+  channel = g_hash_table_lookup (priv->channels, GUINT_TO_POINTER (id));
+
+  switch (type)
+    {
+      case FRAME_OPEN:
+        if (channel != NULL)
+          {
+            DEBUG ("channel %u is already open", id);
+            return FALSE;
+          }
+
+        DEBUG ("peer opened channel %u", id);
+        g_signal_emit (self, signals[NEW_CONNECTION], 0, id);
+
+        if (g_hash_table_lookup (priv->channels, GUINT_TO_POINTER (id))
+            == NULL)
+          {
+            DEBUG ("no connection for channel %u; closing it", id);
+            send_frame (self, FRAME_CLOSE, id, NULL, 0);
+          }
+        break;
+
+      case FRAME_DATA:
+        if (channel == NULL || channel->remote_closed)
+          {
+            DEBUG ("ignoring data for closed channel %u", id);
+            break;
+          }
+
+        if (len > channel->recv_window)
+          {
+            DEBUG ("peer sent %u bytes on channel %u, but only %"
+                G_GINT64_FORMAT " were granted", len, id,
+                channel->recv_window);
+            return FALSE;
+          }
+
+        channel->recv_window -= len;
+        deliver (self, channel, payload, len);
+        break;
+
+      case FRAME_CLOSE:
+        if (channel == NULL || channel->remote_closed)
+          break;
+
+        DEBUG ("peer closed channel %u", id);
+        channel->remote_closed = TRUE;
+        g_signal_emit (self, signals[CONNECTION_CLOSED], 0,
+            channel->transport, TP_ERROR_STR_CONNECTION_LOST,
+            "connection closed by the remote side");
+
+        if (gibber_transport_get_state (channel->transport) !=
+              GIBBER_TRANSPORT_CONNECTED ||
+            gibber_transport_buffer_is_empty (channel->transport))
+          remove_channel (self, channel, NULL, NULL);
+        else
+          update_blocking (self, channel);
+        break;
+
+      case FRAME_WINDOW:
+        if (len != 4)
+          {
+            DEBUG ("window frame has a %u-byte payload", len);
+            return FALSE;
+          }
+
+        if (channel == NULL)
+          break;
+
+        channel->send_window += get_u32 (payload);
+
+        if (flush_unsent (self, channel))
+          update_blocking (self, channel);
+        break;
+
+      default:
+        DEBUG ("ignoring frame of unknown type %u", type);
+        break;
+    }
+
+  return TRUE;
+}
+
+static void
+bytestream_data_received_cb (GabbleBytestreamIface *bytestream,
+    TpHandle sender,
+    const GibberBuffer *data,
+    gpointer user_data)
+{
+  GabbleTubeStreamMux *self = GABBLE_TUBE_STREAM_MUX (user_data);
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  GString *received = priv->received;
+  gsize offset = 0;
+
+  g_string_append_len (received, (const gchar *) data->data, data->length);
+
+  /* Signal handlers may drop the last reference to us */
+  g_object_ref (self);
+
+  while (priv->bytestream != NULL &&
+      received->len - offset >= FRAME_HEADER_SIZE)
+    {
+      const gchar *header = received->str + offset;
+      guint16 len = ((guint8) header[2] << 8) | (guint8) header[3];
+
+      if (received->len - offset - FRAME_HEADER_SIZE < len)
+        break;
+
+      if (!handle_frame (self, header[0], get_u32 (header + 4),
+            header + FRAME_HEADER_SIZE, len))
+        {
+          close_on_error (self);
+          break;
+        }
+
+      offset += FRAME_HEADER_SIZE + len;
+    }
+
+  /* Only erase once per read, however many frames it held */
+  g_string_erase (received, 0, offset);
+  g_object_unref (self);
+}
+
+static void
+bytestream_state_changed_cb (GabbleBytestreamIface *bytestream,
+    GabbleBytestreamState state,
+    gpointer user_data)
+{
+  GabbleTubeStreamMux *self = GABBLE_TUBE_STREAM_MUX (user_data);
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+
+  if (state == GABBLE_BYTESTREAM_STATE_OPEN)
+    {
+      DEBUG ("bytestream is open");
+      priv->open = TRUE;
+
+      if (priv->unsent->len > 0)
+        {
+          gabble_bytestream_iface_send (priv->bytestream, priv->unsent->len,
+              priv->unsent->str);
+          g_string_truncate (priv->unsent, 0);
+        }
+
+      update_all_blocking (self);
+    }
+  else if (state == GABBLE_BYTESTREAM_STATE_CLOSED)
+    {
+      DEBUG ("bytestream has been closed");
+      g_object_ref (self);
+      shut_down (self, TP_ERROR_STR_CONNECTION_LOST,
+          "bytestream has been broken");
+      g_signal_emit (self, signals[CLOSED], 0);
+      g_object_unref (self);
+    }
+}
+
+static void
+bytestream_write_blocked_cb (GabbleBytestreamIface *bytestream,
+    gboolean blocked,
+    gpointer user_data)
+{
+  GabbleTubeStreamMux *self = GABBLE_TUBE_STREAM_MUX (user_data);
+
+  self->priv->write_blocked = blocked;
+  update_all_blocking (self);
+}
+
+static void
+gabble_tube_stream_mux_init (GabbleTubeStreamMux *self)
+{
+  GabbleTubeStreamMuxPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      GABBLE_TYPE_TUBE_STREAM_MUX, GabbleTubeStreamMuxPrivate);
+
+  self->priv = priv;
+
+  priv->unsent = g_string_new ("");
+  priv->frame = g_string_sized_new (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+  priv->received = g_string_new ("");
+  priv->channels = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) mux_channel_free);
+  priv->transport_to_channel = g_hash_table_new (NULL, NULL);
+}
+
+static void
+gabble_tube_stream_mux_dispose (GObject *object)
+{
+  GabbleTubeStreamMux *self = GABBLE_TUBE_STREAM_MUX (object);
+
+  gabble_tube_stream_mux_close (self);
+
+  if (G_OBJECT_CLASS (gabble_tube_stream_mux_parent_class)->dispose)
+    G_OBJECT_CLASS (gabble_tube_stream_mux_parent_class)->dispose (object);
+}
+
+static void
+gabble_tube_stream_mux_finalize (GObject *object)
+{
+  GabbleTubeStreamMux *self = GABBLE_TUBE_STREAM_MUX (object);
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+
+  g_string_free (priv->unsent, TRUE);
+  g_string_free (priv->frame, TRUE);
+  g_string_free (priv->received, TRUE);
+  g_hash_table_unref (priv->transport_to_channel);
+  g_hash_table_unref (priv->channels);
+
+  G_OBJECT_CLASS (gabble_tube_stream_mux_parent_class)->finalize (object);
+}
+
+static void
+gabble_tube_stream_mux_class_init (GabbleTubeStreamMuxClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (GabbleTubeStreamMuxPrivate));
+
+  object_class->dispose = gabble_tube_stream_mux_dispose;
+  object_class->finalize = gabble_tube_stream_mux_finalize;
+
+  /* The peer opened a channel. Handlers should connect to the local socket
+   * and pass the new transport to gabble_tube_stream_mux_attach_connection();
+   * if none does, the channel is closed again. */
+  signals[NEW_CONNECTION] = g_signal_new ("new-connection",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+      0,
+      NULL, NULL,
+      g_cclosure_marshal_VOID__UINT,
+      G_TYPE_NONE, 1, G_TYPE_UINT);
+
+  /* A connection has been closed, with a D-Bus error name and a debug
+   * message saying why */
+  signals[CONNECTION_CLOSED] = g_signal_new ("connection-closed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+      0,
+      NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 3, GIBBER_TYPE_TRANSPORT, G_TYPE_STRING, G_TYPE_STRING);
+
+  /* The bytestream has gone, taking every connection with it */
+  signals[CLOSED] = g_signal_new ("closed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+      0,
+      NULL, NULL,
+      g_cclosure_marshal_VOID__VOID,
+      G_TYPE_NONE, 0);
+}
+
+GabbleTubeStreamMux *
+gabble_tube_stream_mux_new (GabbleBytestreamIface *bytestream)
+{
+  GabbleTubeStreamMux *self;
+  GabbleTubeStreamMuxPrivate *priv;
+  GabbleBytestreamState state;
+
+  g_return_val_if_fail (GABBLE_IS_BYTESTREAM_IFACE (bytestream), NULL);
+
+  self = g_object_new (GABBLE_TYPE_TUBE_STREAM_MUX, NULL);
+  priv = self->priv;
+
+  priv->bytestream = g_object_ref (bytestream);
+  g_object_get (bytestream, "state", &state, NULL);
+  priv->open = (state == GABBLE_BYTESTREAM_STATE_OPEN);
+
+  g_signal_connect (bytestream, "data-received",
+      G_CALLBACK (bytestream_data_received_cb), self);
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (bytestream_state_changed_cb), self);
+  g_signal_connect (bytestream, "write-blocked",
+      G_CALLBACK (bytestream_write_blocked_cb), self);
+
+  return self;
+}
+
+/* Opens a new channel for a connection from a local application */
+void
+gabble_tube_stream_mux_add_connection (GabbleTubeStreamMux *self,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+  MuxChannel *channel;
+
+  g_return_if_fail (priv->bytestream != NULL);
+
+  channel = add_channel (self, ++priv->last_id, transport);
+  DEBUG ("opening channel %u", channel->id);
+  send_frame (self, FRAME_OPEN, channel->id, NULL, 0);
+}
+
+/* Carries @channel, which the peer opened, over @transport. This should be
+ * called from a handler of the new-connection signal. */
+void
+gabble_tube_stream_mux_attach_connection (GabbleTubeStreamMux *self,
+    guint channel,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamMuxPrivate *priv = self->priv;
+
+  g_return_if_fail (priv->bytestream != NULL);
+  g_return_if_fail (g_hash_table_lookup (priv->channels,
+        GUINT_TO_POINTER (channel)) == NULL);
+
+  add_channel (self, channel, transport);
+}
+
+/* Closes every connection and the bytestream. Nothing is signalled but
+ * connection-closed for each connection. */
+void
+gabble_tube_stream_mux_close (GabbleTubeStreamMux *self)
+{
+  GabbleBytestreamIface *bytestream = self->priv->bytestream;
+
+  if (bytestream == NULL)
+    return;
+
+  g_object_ref (bytestream);
+  shut_down (self, TP_ERROR_STR_CANCELLED, "tube is closing");
+  gabble_bytestream_iface_close (bytestream, NULL);
+  g_object_unref (bytestream);
+}
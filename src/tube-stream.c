@@ -40,6 +40,7 @@
 
 #include <gibber/gibber-fd-transport.h>
 #include <gibber/gibber-listener.h>
+#include <gibber/gibber-splice-relay.h>
 #include <gibber/gibber-tcp-transport.h>
 #include <gibber/gibber-transport.h>
 #include <gibber/gibber-unix-transport.h>
@@ -57,6 +58,7 @@
 #include "presence-cache.h"
 #include "presence.h"
 #include "tube-iface.h"
+#include "tube-stream-mux.h"
 #include "util.h"
 
 static void tube_iface_init (gpointer g_iface, gpointer iface_data);
@@ -94,6 +96,29 @@ typedef union
   struct sockaddr_in6 ipv6;
 } SockAddr;
 
+/* The recipient of a 1-1 tube keeps stream-tube-pool-size bytestreams
+ * negotiated ahead of time, ready for new connections; 0 turns the pool off.
+ * Whatever that says, we keep no more than this many idle pooled
+ * bytestreams, on either side. */
+#define MAX_POOL_SIZE 8
+/* The first byte sent on a pooled bytestream, when it's bound to a new
+ * connection */
+#define POOL_BIND_MARKER '\x01'
+/* How long, in seconds, we use one bytestream per connection after the
+ * initiator refused a multiplexed one, before asking for one again */
+#define MUX_RETRY_DELAY (5 * 60)
+
+/* What a bytestream negotiated for the tube will carry */
+typedef enum
+{
+  /* one connection */
+  STREAM_KIND_SINGLE,
+  /* every connection, framed by GabbleTubeStreamMux */
+  STREAM_KIND_MULTIPLEXED,
+  /* nothing yet; the next connection once it's bound */
+  STREAM_KIND_POOLED
+} StreamKind;
+
 /* signals */
 enum
 {
@@ -121,6 +146,8 @@ enum
   PROP_ACCESS_CONTROL_PARAM,
   PROP_SUPPORTED_SOCKET_TYPES,
   PROP_MUC,
+  PROP_POOL_HITS,
+  PROP_POOL_MISSES,
   LAST_PROPERTY
 };
 
@@ -154,6 +181,48 @@ struct _GabbleTubeStreamPrivate
   GHashTable *transport_to_id;
   guint last_connection_id;
 
+  /* (GibberTransport *) -> owned (GibberSpliceRelay *)
+   *
+   * Connections whose data is being relayed by the kernel, rather than going
+   * through data_received_cb() and transport_handler().
+   */
+  GHashTable *transport_to_relay;
+
+  /* 1-1 tubes whose initiator supports it carry all their connections over
+   * this one bytestream, rather than negotiating one for each. */
+  GabbleTubeStreamMux *mux;
+  /* the contact at the other end of mux */
+  TpHandle mux_peer;
+  /* owned (GibberTransport *) waiting for mux's bytestream to be
+   * negotiated */
+  GSList *mux_waiting;
+  /* when the initiator last refused a multiplexed bytestream, in
+   * g_get_monotonic_time() microseconds, or 0. We don't ask again until
+   * MUX_RETRY_DELAY later. */
+  gint64 mux_refused_at;
+
+  /* On the recipient side of a 1-1 tube whose initiator supports it:
+   * owned (GabbleBytestreamIface *) already open, waiting to be bound to a
+   * new local connection */
+  GQueue *pool;
+  /* owned (GabbleBytestreamIface *) accepted, but not open yet */
+  GSList *pool_opening;
+  /* pooled bytestreams we're waiting for the initiator to accept */
+  guint pool_negotiating;
+  guint pool_size;
+  gboolean pool_refused;
+  /* local connections which found a bytestream in the pool, and those which
+   * had to negotiate one */
+  guint pool_hits;
+  guint pool_misses;
+
+  /* On the initiator side: owned (GabbleBytestreamIface *) pooled by the
+   * recipient and not bound to a connection yet */
+  GHashTable *pooled_bytestreams;
+  /* (GibberTransport *) -> owned (GBytes *) data which arrived along with a
+   * pooled bytestream's bind marker, before its local socket was connected */
+  GHashTable *transport_to_pending;
+
   gchar *service;
   GHashTable *parameters;
   TpTubeChannelState state;
@@ -190,9 +259,10 @@ typedef struct
 } transport_connected_data;
 
 static void data_received_cb (GabbleBytestreamIface *ibb, TpHandle sender,
-    GString *data, gpointer user_data);
+    const GibberBuffer *data, gpointer user_data);
 static void transport_connected_cb (GibberTransport *transport,
     transport_connected_data *data);
+static void set_mux (GabbleTubeStream *self, GabbleTubeStreamMux *mux);
 
 #ifdef GIBBER_TYPE_UNIX_TRANSPORT
 static void
@@ -293,6 +363,8 @@ remove_transport (GabbleTubeStream *self,
   g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_FUNC,
       0, 0, NULL, G_CALLBACK (transport_connected_cb), NULL);
 
+  g_hash_table_remove (priv->transport_to_relay, transport);
+  g_hash_table_remove (priv->transport_to_pending, transport);
   gibber_transport_disconnect (transport);
 
   fire_connection_closed (self, transport, TP_ERROR_STR_CONNECTION_LOST,
@@ -319,13 +391,55 @@ transport_buffer_empty_cb (GibberTransport *transport,
     {
       DEBUG ("buffer is now empty. Transport can be removed");
       remove_transport (self, bytestream, transport);
-      return;
     }
+}
+
+static void
+transport_buffer_low_cb (GibberTransport *transport,
+                         GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GabbleBytestreamIface *bytestream;
+
+  bytestream = g_hash_table_lookup (priv->transport_to_bytestream, transport);
+  g_assert (bytestream != NULL);
 
-  /* Buffer is empty so we can unblock the buffer if it was blocked */
+  /* The local client has caught up so we can unblock the bytestream if it
+   * was blocked */
   gabble_bytestream_iface_block_reading (bytestream, FALSE);
 }
 
+/* If the bytestream's data flows unframed over a socket (as it does with
+ * SOCKS5), and the local connection is a socket too, let the kernel move the
+ * data between them instead of copying it through our buffers. */
+static void
+maybe_start_relay (GabbleTubeStream *self,
+    GabbleBytestreamIface *bytestream,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GibberFdTransport *raw_transport;
+  GibberSpliceRelay *relay;
+
+  if (!gibber_splice_relay_is_available () ||
+      g_hash_table_lookup (priv->transport_to_relay, transport) != NULL ||
+      !GIBBER_IS_FD_TRANSPORT (transport) ||
+      gibber_transport_get_state (transport) != GIBBER_TRANSPORT_CONNECTED)
+    return;
+
+  raw_transport = gabble_bytestream_iface_get_raw_transport (bytestream);
+  if (raw_transport == NULL)
+    return;
+
+  relay = gibber_splice_relay_new (raw_transport,
+      GIBBER_FD_TRANSPORT (transport));
+  if (relay == NULL)
+    return;
+
+  DEBUG ("relaying the connection's data with splice()");
+  g_hash_table_insert (priv->transport_to_relay, transport, relay);
+}
+
 static void
 add_transport (GabbleTubeStream *self,
                GibberTransport *transport,
@@ -335,6 +449,8 @@ add_transport (GabbleTubeStream *self,
 
   g_signal_connect (transport, "disconnected",
       G_CALLBACK (transport_disconnected_cb), self);
+  g_signal_connect (transport, "buffer-low",
+      G_CALLBACK (transport_buffer_low_cb), self);
   g_signal_connect (transport, "buffer-empty",
       G_CALLBACK (transport_buffer_empty_cb), self);
 
@@ -357,6 +473,27 @@ bytestream_write_blocked_cb (GabbleBytestreamIface *bytestream,
   gibber_transport_block_receiving (transport, blocked);
 }
 
+/* Starts moving data between an open bytestream and its transport */
+static void
+extra_bytestream_opened (GabbleTubeStream *self,
+    GabbleBytestreamIface *bytestream)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GibberTransport *transport;
+
+  g_signal_connect (bytestream, "data-received",
+      G_CALLBACK (data_received_cb), self);
+  g_signal_connect (bytestream, "write-blocked",
+      G_CALLBACK (bytestream_write_blocked_cb), self);
+
+  transport = g_hash_table_lookup (priv->bytestream_to_transport,
+        bytestream);
+  g_assert (transport != NULL);
+
+  add_transport (self, transport, bytestream);
+  maybe_start_relay (self, bytestream, transport);
+}
+
 static void
 extra_bytestream_state_changed_cb (GabbleBytestreamIface *bytestream,
                                    GabbleBytestreamState state,
@@ -369,20 +506,8 @@ extra_bytestream_state_changed_cb (GabbleBytestreamIface *bytestream,
 
   if (state == GABBLE_BYTESTREAM_STATE_OPEN)
     {
-      GibberTransport *transport;
-
       DEBUG ("extra bytestream open");
-
-      g_signal_connect (bytestream, "data-received",
-          G_CALLBACK (data_received_cb), self);
-      g_signal_connect (bytestream, "write-blocked",
-          G_CALLBACK (bytestream_write_blocked_cb), self);
-
-      transport = g_hash_table_lookup (priv->bytestream_to_transport,
-            bytestream);
-      g_assert (transport != NULL);
-
-      add_transport (self, transport, bytestream);
+      extra_bytestream_opened (self, bytestream);
     }
   else if (state == GABBLE_BYTESTREAM_STATE_CLOSED)
     {
@@ -443,9 +568,11 @@ extra_bytestream_negotiate_cb (GabbleBytestreamIface *bytestream,
 }
 
 static gboolean
-start_stream_initiation (GabbleTubeStream *self,
-                         GibberTransport *transport,
-                         GError **error)
+send_stream_initiation (GabbleTubeStream *self,
+    StreamKind kind,
+    GabbleBytestreamFactoryNegotiateReplyFunc func,
+    gpointer user_data,
+    GError **error)
 {
   GabbleTubeStreamPrivate *priv = self->priv;
   TpBaseChannel *base = TP_BASE_CHANNEL (self);
@@ -469,6 +596,12 @@ start_stream_initiation (GabbleTubeStream *self,
       /* Private tube */
       GabblePresence *presence;
       const gchar *resource;
+      const gchar *feature = NS_TUBES;
+
+      if (kind == STREAM_KIND_MULTIPLEXED)
+        feature = NS_TUBES_MUX;
+      else if (kind == STREAM_KIND_POOLED)
+        feature = NS_TUBES_POOL;
 
       presence = gabble_presence_cache_get (conn->presence_cache,
           initiator);
@@ -481,7 +614,7 @@ start_stream_initiation (GabbleTubeStream *self,
         }
 
       resource = gabble_presence_pick_resource_by_caps (presence, 0,
-          gabble_capability_set_predicate_has, NS_TUBES);
+          gabble_capability_set_predicate_has, feature);
       if (resource == NULL)
         {
           DEBUG ("initiator doesn't have tubes capabilities");
@@ -520,12 +653,17 @@ start_stream_initiation (GabbleTubeStream *self,
 
   wocky_node_set_attribute (node, "tube", id_str);
 
+  if (kind == STREAM_KIND_MULTIPLEXED)
+    wocky_node_set_attribute (node, "multiplexed", "true");
+  else if (kind == STREAM_KIND_POOLED)
+    wocky_node_set_attribute (node, "pooled", "true");
+
   gabble_bytestream_factory_negotiate_stream (
-      conn->bytestream_factory, msg, stream_id,
-      extra_bytestream_negotiate_cb, g_object_ref (transport), G_OBJECT (self));
+      conn->bytestream_factory, msg, stream_id, func, user_data,
+      G_OBJECT (self));
 
-  /* FIXME: data and one ref on data->transport are leaked if the tube is
-   * closed before we got the SI reply. */
+  /* FIXME: user_data is leaked if the tube is closed before we got the SI
+   * reply. */
   g_object_unref (msg);
   g_free (stream_id);
   g_free (full_jid);
@@ -534,6 +672,24 @@ start_stream_initiation (GabbleTubeStream *self,
   return TRUE;
 }
 
+static gboolean
+start_stream_initiation (GabbleTubeStream *self,
+                         GibberTransport *transport,
+                         GError **error)
+{
+  /* released in extra_bytestream_negotiate_cb () */
+  g_object_ref (transport);
+
+  if (!send_stream_initiation (self, STREAM_KIND_SINGLE,
+        extra_bytestream_negotiate_cb, transport, error))
+    {
+      g_object_unref (transport);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static guint
 generate_connection_id (GabbleTubeStream *self,
                         GibberTransport *transport)
@@ -560,6 +716,346 @@ fire_new_local_connection (GabbleTubeStream *self,
       connection_id);
 }
 
+/* TRUE if we should keep bytestreams to the initiator negotiated ahead of
+ * time */
+static gboolean
+can_pool (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  GabbleConnection *conn = GABBLE_CONNECTION (
+      tp_base_channel_get_connection (base));
+  GabblePresence *presence;
+
+  if (priv->pool_size == 0 || priv->pool_refused ||
+      tp_base_channel_is_destroyed (base))
+    return FALSE;
+
+  presence = gabble_presence_cache_get (conn->presence_cache,
+      tp_base_channel_get_initiator (base));
+
+  return presence != NULL &&
+      gabble_presence_pick_resource_by_caps (presence, 0,
+          gabble_capability_set_predicate_has, NS_TUBES_POOL) != NULL;
+}
+
+static void
+pool_bytestream_state_changed_cb (GabbleBytestreamIface *bytestream,
+    GabbleBytestreamState state,
+    gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GSList *l = g_slist_find (priv->pool_opening, bytestream);
+
+  if (state == GABBLE_BYTESTREAM_STATE_OPEN && l != NULL)
+    {
+      DEBUG ("pooled bytestream is ready");
+      priv->pool_opening = g_slist_delete_link (priv->pool_opening, l);
+      g_queue_push_tail (priv->pool, bytestream);
+    }
+  else if (state == GABBLE_BYTESTREAM_STATE_CLOSED)
+    {
+      DEBUG ("pooled bytestream closed before being used");
+
+      if (l != NULL)
+        priv->pool_opening = g_slist_delete_link (priv->pool_opening, l);
+      else
+        g_queue_remove (priv->pool, bytestream);
+
+      g_signal_handlers_disconnect_by_func (bytestream,
+          pool_bytestream_state_changed_cb, self);
+      g_object_unref (bytestream);
+    }
+}
+
+static void
+pool_negotiate_cb (GabbleBytestreamIface *bytestream,
+    WockyStanza *msg,
+    GObject *object,
+    gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (object);
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GabbleBytestreamState state;
+
+  priv->pool_negotiating--;
+
+  if (tp_base_channel_is_destroyed (TP_BASE_CHANNEL (self)))
+    {
+      if (bytestream != NULL)
+        gabble_bytestream_iface_close (bytestream, NULL);
+
+      return;
+    }
+
+  if (bytestream == NULL)
+    {
+      DEBUG ("initiator refused a pooled bytestream; not pooling any more");
+      priv->pool_refused = TRUE;
+      return;
+    }
+
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (pool_bytestream_state_changed_cb), self);
+
+  g_object_get (bytestream, "state", &state, NULL);
+
+  if (state == GABBLE_BYTESTREAM_STATE_OPEN)
+    g_queue_push_tail (priv->pool, g_object_ref (bytestream));
+  else
+    priv->pool_opening = g_slist_prepend (priv->pool_opening,
+        g_object_ref (bytestream));
+}
+
+/* Asks for as many pooled bytestreams as we're missing */
+static void
+refill_pool (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+
+  while (g_queue_get_length (priv->pool) +
+      g_slist_length (priv->pool_opening) + priv->pool_negotiating <
+      priv->pool_size)
+    {
+      if (!send_stream_initiation (self, STREAM_KIND_POOLED,
+            pool_negotiate_cb, NULL, NULL))
+        return;
+
+      DEBUG ("negotiating a pooled bytestream");
+      priv->pool_negotiating++;
+    }
+}
+
+/* Carries @transport over a bytestream from the pool, if there is one */
+static gboolean
+bind_pooled_bytestream (GabbleTubeStream *self,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GabbleBytestreamIface *bytestream;
+  const gchar marker = POOL_BIND_MARKER;
+
+  while ((bytestream = g_queue_pop_head (priv->pool)) != NULL)
+    {
+      g_signal_handlers_disconnect_by_func (bytestream,
+          pool_bytestream_state_changed_cb, self);
+
+      if (gabble_bytestream_iface_send (bytestream, 1, &marker))
+        break;
+
+      DEBUG ("couldn't bind a pooled bytestream; dropping it");
+      gabble_bytestream_iface_close (bytestream, NULL);
+      g_object_unref (bytestream);
+    }
+
+  if (bytestream == NULL)
+    return FALSE;
+
+  /* The pool's reference to bytestream now belongs to the hash tables */
+  g_hash_table_insert (priv->bytestream_to_transport, bytestream,
+      g_object_ref (transport));
+  g_hash_table_insert (priv->transport_to_bytestream,
+      g_object_ref (transport), g_object_ref (bytestream));
+
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (extra_bytestream_state_changed_cb), self);
+
+  extra_bytestream_opened (self, bytestream);
+  return TRUE;
+}
+
+static void
+clear_pool (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GabbleBytestreamIface *bytestream;
+  GHashTableIter iter;
+  gpointer key;
+
+  if (priv->pool_hits + priv->pool_misses > 0)
+    DEBUG ("pooled bytestreams served %u of %u connections",
+        priv->pool_hits, priv->pool_hits + priv->pool_misses);
+
+  while ((bytestream = g_queue_pop_head (priv->pool)) != NULL)
+    priv->pool_opening = g_slist_prepend (priv->pool_opening, bytestream);
+
+  while (priv->pool_opening != NULL)
+    {
+      bytestream = priv->pool_opening->data;
+
+      g_signal_handlers_disconnect_matched (bytestream, G_SIGNAL_MATCH_DATA,
+          0, 0, NULL, NULL, self);
+      gabble_bytestream_iface_close (bytestream, NULL);
+      g_object_unref (bytestream);
+      priv->pool_opening = g_slist_delete_link (priv->pool_opening,
+          priv->pool_opening);
+    }
+
+  g_hash_table_iter_init (&iter, priv->pooled_bytestreams);
+
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      g_signal_handlers_disconnect_matched (key, G_SIGNAL_MATCH_DATA,
+          0, 0, NULL, NULL, self);
+      gabble_bytestream_iface_close (key, NULL);
+      g_hash_table_iter_remove (&iter);
+    }
+}
+
+/* Starts carrying a new connection to the initiator over its own
+ * bytestream, taking one from the pool if we can */
+static gboolean
+open_unmultiplexed_connection (GabbleTubeStream *self,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  gboolean ret;
+
+  if (!can_pool (self))
+    return start_stream_initiation (self, transport, NULL);
+
+  if (bind_pooled_bytestream (self, transport))
+    {
+      priv->pool_hits++;
+      DEBUG ("connection bound to a pooled bytestream");
+      ret = TRUE;
+    }
+  else
+    {
+      priv->pool_misses++;
+      DEBUG ("no pooled bytestream ready for the connection");
+      ret = start_stream_initiation (self, transport, NULL);
+    }
+
+  refill_pool (self);
+  return ret;
+}
+
+/* TRUE if the initiator can take all our connections over one bytestream */
+static gboolean
+can_multiplex (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  TpBaseChannelClass *cls = TP_BASE_CHANNEL_GET_CLASS (base);
+  GabbleConnection *conn = GABBLE_CONNECTION (
+      tp_base_channel_get_connection (base));
+  GabblePresence *presence;
+
+  if (cls->target_handle_type != TP_HANDLE_TYPE_CONTACT)
+    return FALSE;
+
+  if (priv->mux_refused_at != 0)
+    {
+      if (g_get_monotonic_time () - priv->mux_refused_at <
+          MUX_RETRY_DELAY * G_USEC_PER_SEC)
+        return FALSE;
+
+      DEBUG ("asking for a multiplexed bytestream again");
+      priv->mux_refused_at = 0;
+    }
+
+  presence = gabble_presence_cache_get (conn->presence_cache,
+      tp_base_channel_get_initiator (base));
+
+  return presence != NULL &&
+      gabble_presence_pick_resource_by_caps (presence, 0,
+          gabble_capability_set_predicate_has, NS_TUBES_MUX) != NULL;
+}
+
+static void
+mux_negotiate_cb (GabbleBytestreamIface *bytestream,
+    WockyStanza *msg,
+    GObject *object,
+    gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (object);
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GSList *waiting = priv->mux_waiting;
+  GSList *l;
+
+  priv->mux_waiting = NULL;
+
+  if (tp_base_channel_is_destroyed (TP_BASE_CHANNEL (self)))
+    {
+      DEBUG ("tube has been closed in the meantime");
+
+      if (bytestream != NULL)
+        gabble_bytestream_iface_close (bytestream, NULL);
+
+      return;
+    }
+
+  if (bytestream == NULL)
+    {
+      DEBUG ("initiator refused the multiplexed bytestream; using one "
+          "bytestream per connection instead");
+      priv->mux_refused_at = g_get_monotonic_time ();
+    }
+  else
+    {
+      DEBUG ("multiplexed bytestream accepted");
+      g_object_get (bytestream, "peer-handle", &priv->mux_peer, NULL);
+      set_mux (self, gabble_tube_stream_mux_new (bytestream));
+    }
+
+  for (l = waiting; l != NULL; l = l->next)
+    {
+      GibberTransport *transport = l->data;
+
+      if (gibber_transport_get_state (transport) ==
+          GIBBER_TRANSPORT_DISCONNECTED)
+        {
+          fire_connection_closed (self, transport, TP_ERROR_STR_CANCELLED,
+              "local socket has been disconnected");
+        }
+      else if (priv->mux != NULL)
+        {
+          gabble_tube_stream_mux_add_connection (priv->mux, transport);
+        }
+      else if (!open_unmultiplexed_connection (self, transport))
+        {
+          fire_connection_closed (self, transport,
+              TP_ERROR_STR_CONNECTION_REFUSED, "connection has been refused");
+          gibber_transport_disconnect (transport);
+        }
+
+      g_object_unref (transport);
+    }
+
+  g_slist_free (waiting);
+}
+
+/* Starts carrying a new connection from the local application to the
+ * initiator */
+static gboolean
+open_local_connection (GabbleTubeStream *self,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+
+  if (priv->mux != NULL)
+    {
+      gabble_tube_stream_mux_add_connection (priv->mux, transport);
+      return TRUE;
+    }
+
+  if (priv->mux_waiting == NULL)
+    {
+      if (!can_multiplex (self) ||
+          !send_stream_initiation (self, STREAM_KIND_MULTIPLEXED,
+            mux_negotiate_cb, NULL, NULL))
+        return open_unmultiplexed_connection (self, transport);
+
+      DEBUG ("negotiating a multiplexed bytestream");
+    }
+
+  priv->mux_waiting = g_slist_append (priv->mux_waiting,
+      g_object_ref (transport));
+  return TRUE;
+}
+
 #ifdef GIBBER_TYPE_UNIX_TRANSPORT
 static void
 credentials_received_cb (GibberUnixTransport *transport,
@@ -597,7 +1093,7 @@ credentials_received_cb (GibberUnixTransport *transport,
 
   DEBUG ("Connection properly authentificated");
 
-  if (!start_stream_initiation (self, GIBBER_TRANSPORT (transport), NULL))
+  if (!open_local_connection (self, GIBBER_TRANSPORT (transport)))
     {
       DEBUG ("SI failed. Closing connection");
     }
@@ -607,7 +1103,7 @@ credentials_received_cb (GibberUnixTransport *transport,
     }
 
 credentials_received_cb_out:
-  /* start_stream_initiation reffed the transport if everything went fine */
+  /* open_local_connection reffed the transport if everything went fine */
   g_object_unref (transport);
 }
 #endif
@@ -731,7 +1227,7 @@ local_new_connection_cb (GibberListener *listener,
   /* Streams in stream tubes are established with stream initiation (XEP-0095).
    * We use SalutSiBytestreamManager.
    */
-  if (!start_stream_initiation (self, transport, NULL))
+  if (!open_local_connection (self, transport))
     {
       DEBUG ("closing new client connection");
     }
@@ -880,6 +1376,30 @@ fire_new_remote_connection (GabbleTubeStream *self,
   g_value_unset (&access_control_param);
 }
 
+/* Sends whatever arrived with the bind marker of the pooled bytestream now
+ * carrying @transport */
+static void
+send_pending_data (GabbleTubeStream *self,
+    GibberTransport *transport)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GBytes *pending;
+  GError *error = NULL;
+
+  pending = g_hash_table_lookup (priv->transport_to_pending, transport);
+  if (pending == NULL)
+    return;
+
+  if (gibber_transport_get_state (transport) == GIBBER_TRANSPORT_CONNECTED &&
+      !gibber_transport_send_bytes (transport, pending, &error))
+    {
+      DEBUG ("sending failed: %s", error->message);
+      g_error_free (error);
+    }
+
+  g_hash_table_remove (priv->transport_to_pending, transport);
+}
+
 static void
 transport_connected_cb (GibberTransport *transport,
     transport_connected_data *data)
@@ -888,27 +1408,24 @@ transport_connected_cb (GibberTransport *transport,
   GabbleBytestreamIface *bytestream;
 
   fire_new_remote_connection (data->self, transport, data->contact);
+  send_pending_data (data->self, transport);
 
   bytestream = g_hash_table_lookup (priv->transport_to_bytestream, transport);
   if (bytestream == NULL)
     return;
 
   gabble_bytestream_iface_block_reading (bytestream, FALSE);
+  maybe_start_relay (data->self, bytestream, transport);
 }
 
+/* Returns a new reference to a transport connecting to the application's
+ * socket. Its receiving is blocked. */
 static GibberTransport *
-new_connection_to_socket (GabbleTubeStream *self,
-                          GabbleBytestreamIface *bytestream,
-                          TpHandle contact)
+connect_to_local_socket (GabbleTubeStream *self)
 {
   GabbleTubeStreamPrivate *priv = self->priv;
-  TpBaseChannel *base = TP_BASE_CHANNEL (self);
   GibberTransport *transport;
 
-  DEBUG ("Called.");
-
-  g_assert (tp_base_channel_is_requested (base));
-
 #ifdef GIBBER_TYPE_UNIX_TRANSPORT
   if (priv->address_type == TP_SOCKET_ADDRESS_TYPE_UNIX)
     {
@@ -948,6 +1465,23 @@ new_connection_to_socket (GabbleTubeStream *self,
    * its data. */
   gibber_transport_block_receiving (transport, TRUE);
 
+  return transport;
+}
+
+static GibberTransport *
+new_connection_to_socket (GabbleTubeStream *self,
+                          GabbleBytestreamIface *bytestream,
+                          TpHandle contact)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  GibberTransport *transport;
+
+  DEBUG ("Called.");
+
+  g_assert (tp_base_channel_is_requested (base));
+
+  transport = connect_to_local_socket (self);
   generate_connection_id (self, transport);
 
   gabble_bytestream_iface_block_reading (bytestream, TRUE);
@@ -965,6 +1499,96 @@ new_connection_to_socket (GabbleTubeStream *self,
   return transport;
 }
 
+static void
+mux_new_connection_cb (GabbleTubeStreamMux *mux,
+    guint channel,
+    GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GibberTransport *transport;
+
+  g_assert (tp_base_channel_is_requested (TP_BASE_CHANNEL (self)));
+
+  transport = connect_to_local_socket (self);
+
+  if (gibber_transport_get_state (transport) ==
+      GIBBER_TRANSPORT_DISCONNECTED)
+    {
+      /* the mux closes the channel again */
+      DEBUG ("couldn't connect to the local socket");
+      g_object_unref (transport);
+      return;
+    }
+
+  generate_connection_id (self, transport);
+
+  g_signal_emit (G_OBJECT (self), signals[NEW_CONNECTION], 0,
+      priv->mux_peer);
+
+  /* Connected before the mux gets to write anything to the transport, so
+   * that NewRemoteConnection comes first */
+  if (gibber_transport_get_state (transport) != GIBBER_TRANSPORT_CONNECTED)
+    g_signal_connect_data (transport, "connected",
+        G_CALLBACK (transport_connected_cb),
+        transport_connected_data_new (self, priv->mux_peer),
+        (GClosureNotify) transport_connected_data_free, 0);
+
+  gabble_tube_stream_mux_attach_connection (mux, channel, transport);
+
+  if (gibber_transport_get_state (transport) == GIBBER_TRANSPORT_CONNECTED)
+    fire_new_remote_connection (self, transport, priv->mux_peer);
+
+  g_object_unref (transport);
+}
+
+static void
+mux_connection_closed_cb (GabbleTubeStreamMux *mux,
+    GibberTransport *transport,
+    const gchar *error,
+    const gchar *debug_msg,
+    GabbleTubeStream *self)
+{
+  fire_connection_closed (self, transport, error, debug_msg);
+}
+
+static void
+clear_mux (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+
+  if (priv->mux == NULL)
+    return;
+
+  g_signal_handlers_disconnect_matched (priv->mux, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+  gabble_tube_stream_mux_close (priv->mux);
+  tp_clear_object (&priv->mux);
+}
+
+static void
+mux_closed_cb (GabbleTubeStreamMux *mux,
+    GabbleTubeStream *self)
+{
+  DEBUG ("multiplexed bytestream closed");
+  clear_mux (self);
+}
+
+static void
+set_mux (GabbleTubeStream *self,
+    GabbleTubeStreamMux *mux)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+
+  g_assert (priv->mux == NULL);
+  priv->mux = mux;
+
+  g_signal_connect (mux, "new-connection",
+      G_CALLBACK (mux_new_connection_cb), self);
+  g_signal_connect (mux, "connection-closed",
+      G_CALLBACK (mux_connection_closed_cb), self);
+  g_signal_connect (mux, "closed", G_CALLBACK (mux_closed_cb), self);
+}
+
 static gboolean
 tube_stream_open (GabbleTubeStream *self,
                   GError **error)
@@ -1103,8 +1727,16 @@ gabble_tube_stream_init (GabbleTubeStream *self)
 
   priv->transport_to_id = g_hash_table_new_full (g_direct_hash,
       g_direct_equal, NULL, NULL);
+  priv->transport_to_relay = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) g_object_unref);
+  priv->transport_to_pending = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) g_bytes_unref);
   priv->last_connection_id = 0;
 
+  priv->pool = g_queue_new ();
+  priv->pooled_bytestreams = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, (GDestroyNotify) g_object_unref, NULL);
+
   priv->address_type = TP_SOCKET_ADDRESS_TYPE_UNIX;
   priv->address = NULL;
   priv->access_control = TP_SOCKET_ACCESS_CONTROL_LOCALHOST;
@@ -1136,6 +1768,8 @@ close_each_extra_bytestream (gpointer key,
   g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_FUNC,
       0, 0, NULL, G_CALLBACK (transport_connected_cb), NULL);
 
+  g_hash_table_remove (priv->transport_to_relay, transport);
+  g_hash_table_remove (priv->transport_to_pending, transport);
   gabble_bytestream_iface_close (bytestream, NULL);
   gibber_transport_disconnect (transport);
   fire_connection_closed (self, transport, TP_ERROR_STR_CANCELLED,
@@ -1180,6 +1814,10 @@ gabble_tube_stream_dispose (GObject *object)
   tp_clear_pointer (&priv->transport_to_bytestream, g_hash_table_unref);
   tp_clear_pointer (&priv->bytestream_to_transport, g_hash_table_unref);
   tp_clear_pointer (&priv->transport_to_id, g_hash_table_unref);
+  tp_clear_pointer (&priv->transport_to_relay, g_hash_table_unref);
+  tp_clear_pointer (&priv->transport_to_pending, g_hash_table_unref);
+  tp_clear_pointer (&priv->pooled_bytestreams, g_hash_table_unref);
+  tp_clear_pointer (&priv->pool, g_queue_free);
 
   tp_clear_object (&priv->local_listener);
 
@@ -1266,6 +1904,12 @@ gabble_tube_stream_get_property (GObject *object,
       case PROP_MUC:
         g_value_set_object (value, priv->muc);
         break;
+      case PROP_POOL_HITS:
+        g_value_set_uint (value, priv->pool_hits);
+        break;
+      case PROP_POOL_MISSES:
+        g_value_set_uint (value, priv->pool_misses);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1362,6 +2006,13 @@ gabble_tube_stream_constructed (GObject *obj)
   if (cls->target_handle_type == TP_HANDLE_TYPE_CONTACT)
     {
       g_assert (priv->muc == NULL);
+
+      if (!tp_base_channel_is_requested (base))
+        {
+          g_object_get (conn, "stream-tube-pool-size", &priv->pool_size,
+              NULL);
+          priv->pool_size = MIN (priv->pool_size, MAX_POOL_SIZE);
+        }
     }
   else
     {
@@ -1528,6 +2179,25 @@ gabble_tube_stream_class_init (GabbleTubeStreamClass *gabble_tube_stream_class)
       G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_MUC, param_spec);
 
+  param_spec = g_param_spec_uint (
+      "pool-hits",
+      "Pool hits",
+      "The number of local connections which were carried over a bytestream "
+      "negotiated ahead of time",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_POOL_HITS, param_spec);
+
+  param_spec = g_param_spec_uint (
+      "pool-misses",
+      "Pool misses",
+      "The number of local connections which had to wait for a bytestream "
+      "to be negotiated, although the tube keeps a pool of them",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_POOL_MISSES,
+      param_spec);
+
   signals[OPENED] =
     g_signal_new ("tube-opened",
                   G_OBJECT_CLASS_TYPE (gabble_tube_stream_class),
@@ -1574,7 +2244,7 @@ gabble_tube_stream_class_init (GabbleTubeStreamClass *gabble_tube_stream_class)
 static void
 data_received_cb (GabbleBytestreamIface *bytestream,
                   TpHandle sender,
-                  GString *data,
+                  const GibberBuffer *data,
                   gpointer user_data)
 {
   GabbleTubeStream *tube = GABBLE_TUBE_STREAM (user_data);
@@ -1588,12 +2258,11 @@ data_received_cb (GabbleBytestreamIface *bytestream,
   /* If something goes wrong when trying to write the data on the transport,
    * it could be disconnected, causing its removal from the hash tables.
    * When removed, the transport would be destroyed as the hash tables keep a
-   * ref on it and so we'll call _buffer_is_empty on a destroyed transport.
+   * ref on it and so we'll call _buffer_is_high on a destroyed transport.
    * We avoid that by reffing the transport between the 2 calls so we keep it
    * artificially alive if needed. */
   g_object_ref (transport);
-  if (!gibber_transport_send (transport, (const guint8 *) data->str, data->len,
-      &error))
+  if (!gibber_transport_send (transport, data->data, data->length, &error))
   {
     DEBUG ("sending failed: %s", error->message);
     g_error_free (error);
@@ -1601,10 +2270,10 @@ data_received_cb (GabbleBytestreamIface *bytestream,
     return;
   }
 
-  if (!gibber_transport_buffer_is_empty (transport))
+  if (gibber_transport_buffer_is_high (transport))
     {
-      /* We don't want to send more data while the buffer isn't empty */
-      DEBUG ("tube buffer isn't empty. Block the bytestream");
+      /* We don't want to send more data until the local client catches up */
+      DEBUG ("tube buffer is above its high watermark. Block the bytestream");
       gabble_bytestream_iface_block_reading (bytestream, TRUE);
     }
   g_object_unref (transport);
@@ -1713,6 +2382,24 @@ gabble_tube_iface_stream_close (GabbleTubeIface *tube,
   g_hash_table_foreach_remove (priv->bytestream_to_transport,
       close_each_extra_bytestream, self);
 
+  if (priv->mux != NULL)
+    gabble_tube_stream_mux_close (priv->mux);
+
+  clear_mux (self);
+  clear_pool (self);
+
+  while (priv->mux_waiting != NULL)
+    {
+      GibberTransport *transport = priv->mux_waiting->data;
+
+      gibber_transport_disconnect (transport);
+      fire_connection_closed (self, transport, TP_ERROR_STR_CANCELLED,
+          "tube is closing");
+      g_object_unref (transport);
+      priv->mux_waiting = g_slist_delete_link (priv->mux_waiting,
+          priv->mux_waiting);
+    }
+
   if (!closed_remotely && cls->target_handle_type == TP_HANDLE_TYPE_CONTACT)
     {
       WockyStanza *msg;
@@ -1771,6 +2458,54 @@ augment_si_accept_iq (WockyNode *si,
  * Implements gabble_tube_iface_add_bytestream on GabbleTubeIface
  */
 
+static void
+remote_connection_opened (GabbleTubeStream *self)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+
+  if (priv->state == TP_TUBE_CHANNEL_STATE_REMOTE_PENDING)
+    {
+      DEBUG ("Received first connection. Tube is now open");
+      priv->state = TP_TUBE_CHANNEL_STATE_OPEN;
+
+      tp_svc_channel_interface_tube_emit_tube_channel_state_changed (
+          self, TP_TUBE_CHANNEL_STATE_OPEN);
+
+      g_signal_emit (G_OBJECT (self), signals[OPENED], 0);
+    }
+}
+
+/* Announces a connection from @contact, carried by @transport to the local
+ * socket, once the transport is connected */
+static void
+start_remote_connection (GabbleTubeStream *self,
+    GabbleBytestreamIface *bytestream,
+    GibberTransport *transport,
+    TpHandle contact)
+{
+  g_signal_emit (G_OBJECT (self), signals[NEW_CONNECTION], 0, contact);
+
+  if (gibber_transport_get_state (transport) == GIBBER_TRANSPORT_CONNECTED)
+    {
+      send_pending_data (self, transport);
+      gabble_bytestream_iface_block_reading (bytestream, FALSE);
+      fire_new_remote_connection (self, transport, contact);
+    }
+  else
+    {
+      /* NewConnection will be fired once the transport is connected.
+       * We can't get access_control_param (as the source port for example)
+       * until it's connected. */
+      transport_connected_data *data;
+
+      data = transport_connected_data_new (self, contact);
+
+      g_signal_connect_data (transport, "connected",
+          G_CALLBACK (transport_connected_cb), data,
+          (GClosureNotify) transport_connected_data_free, 0);
+    }
+}
+
 static void
 gabble_tube_stream_add_bytestream (GabbleTubeIface *tube,
                                    GabbleBytestreamIface *bytestream)
@@ -1796,46 +2531,149 @@ gabble_tube_stream_add_bytestream (GabbleTubeIface *tube,
   transport = new_connection_to_socket (self, bytestream, contact);
   if (transport != NULL)
     {
-      if (priv->state == TP_TUBE_CHANNEL_STATE_REMOTE_PENDING)
-        {
-          DEBUG ("Received first connection. Tube is now open");
-          priv->state = TP_TUBE_CHANNEL_STATE_OPEN;
-
-          tp_svc_channel_interface_tube_emit_tube_channel_state_changed (
-              self, TP_TUBE_CHANNEL_STATE_OPEN);
-
-          g_signal_emit (G_OBJECT (self), signals[OPENED], 0);
-        }
+      remote_connection_opened (self);
 
       DEBUG ("accept the extra bytestream");
 
       gabble_bytestream_iface_accept (bytestream, augment_si_accept_iq, self);
 
-      g_signal_emit (G_OBJECT (self), signals[NEW_CONNECTION], 0, contact);
+      start_remote_connection (self, bytestream, transport, contact);
+    }
+  else
+    {
+      gabble_bytestream_iface_close (bytestream, NULL);
+    }
+}
 
-      if (gibber_transport_get_state (transport) == GIBBER_TRANSPORT_CONNECTED)
-        {
-          gabble_bytestream_iface_block_reading (bytestream, FALSE);
-          fire_new_remote_connection (self, transport, contact);
-        }
-      else
-        {
-          /* NewConnection will be fired once the transport is connected.
-           * We can't get access_control_param (as the source port for example)
-           * until it's connected. */
-          transport_connected_data *data;
+/*
+ * gabble_tube_stream_add_mux_bytestream:
+ *
+ * Accepts @bytestream, over which the recipient of the tube will carry all
+ * its connections to it.
+ */
+void
+gabble_tube_stream_add_mux_bytestream (GabbleTubeStream *self,
+    GabbleBytestreamIface *bytestream)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  TpBaseChannelClass *cls = TP_BASE_CHANNEL_GET_CLASS (base);
 
-          data = transport_connected_data_new (self, contact);
+  if (!tp_base_channel_is_requested (base) ||
+      cls->target_handle_type != TP_HANDLE_TYPE_CONTACT ||
+      priv->mux != NULL)
+    {
+      DEBUG ("can't accept a multiplexed bytestream for this tube");
+      gabble_bytestream_iface_close (bytestream, NULL);
+      return;
+    }
 
-          g_signal_connect_data (transport, "connected",
-              G_CALLBACK (transport_connected_cb), data,
-              (GClosureNotify) transport_connected_data_free, 0);
-        }
+  g_object_get (bytestream, "peer-handle", &priv->mux_peer, NULL);
+  set_mux (self, gabble_tube_stream_mux_new (bytestream));
+
+  remote_connection_opened (self);
+
+  DEBUG ("accept the multiplexed bytestream");
+  gabble_bytestream_iface_accept (bytestream, augment_si_accept_iq, self);
+}
+
+static void
+pooled_bytestream_state_changed_cb (GabbleBytestreamIface *bytestream,
+    GabbleBytestreamState state,
+    gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+
+  if (state != GABBLE_BYTESTREAM_STATE_CLOSED)
+    return;
+
+  DEBUG ("pooled bytestream closed before being used");
+  g_signal_handlers_disconnect_matched (bytestream, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+  g_hash_table_remove (self->priv->pooled_bytestreams, bytestream);
+}
+
+static void
+pooled_bytestream_data_received_cb (GabbleBytestreamIface *bytestream,
+    TpHandle sender,
+    const GibberBuffer *data,
+    gpointer user_data)
+{
+  GabbleTubeStream *self = GABBLE_TUBE_STREAM (user_data);
+  GabbleTubeStreamPrivate *priv = self->priv;
+  GibberTransport *transport;
+  TpHandle contact;
+
+  if (data->length == 0)
+    return;
+
+  g_object_ref (bytestream);
+  g_signal_handlers_disconnect_matched (bytestream, G_SIGNAL_MATCH_DATA,
+      0, 0, NULL, NULL, self);
+  g_hash_table_remove (priv->pooled_bytestreams, bytestream);
+
+  if (data->data[0] != POOL_BIND_MARKER)
+    {
+      DEBUG ("pooled bytestream wasn't bound before use; closing it");
+      gabble_bytestream_iface_close (bytestream, NULL);
+      g_object_unref (bytestream);
+      return;
     }
-  else
+
+  DEBUG ("pooled bytestream bound to a new connection");
+
+  g_object_get (bytestream, "peer-handle", &contact, NULL);
+  transport = new_connection_to_socket (self, bytestream, contact);
+
+  if (data->length > 1)
+    g_hash_table_insert (priv->transport_to_pending, transport,
+        g_bytes_new (data->data + 1, data->length - 1));
+
+  /* The rest of data has to reach the local socket before the relay can
+   * start moving the bytestream's data there. If the socket isn't connected
+   * yet, it waits for that instead. */
+  if (gibber_transport_get_state (transport) == GIBBER_TRANSPORT_CONNECTED)
+    send_pending_data (self, transport);
+
+  extra_bytestream_opened (self, bytestream);
+  remote_connection_opened (self);
+  start_remote_connection (self, bytestream, transport, contact);
+
+  g_object_unref (bytestream);
+}
+
+/*
+ * gabble_tube_stream_add_pooled_bytestream:
+ *
+ * Accepts @bytestream, which the recipient of the tube is keeping ready for
+ * a future connection. It will start with POOL_BIND_MARKER once it's used.
+ */
+void
+gabble_tube_stream_add_pooled_bytestream (GabbleTubeStream *self,
+    GabbleBytestreamIface *bytestream)
+{
+  GabbleTubeStreamPrivate *priv = self->priv;
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  TpBaseChannelClass *cls = TP_BASE_CHANNEL_GET_CLASS (base);
+
+  if (!tp_base_channel_is_requested (base) ||
+      cls->target_handle_type != TP_HANDLE_TYPE_CONTACT ||
+      g_hash_table_size (priv->pooled_bytestreams) >= MAX_POOL_SIZE)
     {
+      DEBUG ("can't accept a pooled bytestream for this tube");
       gabble_bytestream_iface_close (bytestream, NULL);
+      return;
     }
+
+  g_hash_table_add (priv->pooled_bytestreams, g_object_ref (bytestream));
+
+  g_signal_connect (bytestream, "data-received",
+      G_CALLBACK (pooled_bytestream_data_received_cb), self);
+  g_signal_connect (bytestream, "state-changed",
+      G_CALLBACK (pooled_bytestream_state_changed_cb), self);
+
+  DEBUG ("accept the pooled bytestream");
+  gabble_bytestream_iface_accept (bytestream, augment_si_accept_iq, self);
 }
 
 #ifdef GIBBER_TYPE_UNIX_TRANSPORT
@@ -1218,3 +1218,112 @@ gabble_simple_async_countdown_dec (GSimpleAsyncResult *simple)
       g_object_unref (simple);
     }
 }
+
+/**
+ * gabble_cache_path:
+ * @env_var: an environment variable which overrides the location
+ * @name: the name of a file or directory in Gabble's cache directory
+ *
+ * Returns: (transfer full): where to keep @name: the value of @env_var if
+ *  it's set, otherwise @name in $WOCKY_CACHE_DIR or the user cache
+ *  directory. %NULL if @env_var is set to the empty string, which means the
+ *  caller shouldn't keep anything on disk.
+ */
+gchar *
+gabble_cache_path (const gchar *env_var,
+    const gchar *name)
+{
+  const gchar *dir = g_getenv (env_var);
+
+  if (dir != NULL)
+    return (*dir == '\0') ? NULL : g_strdup (dir);
+
+  dir = g_getenv ("WOCKY_CACHE_DIR");
+
+  if (dir != NULL)
+    return g_build_path (G_DIR_SEPARATOR_S, dir, name, NULL);
+
+  return g_build_path (G_DIR_SEPARATOR_S,
+      g_get_user_cache_dir (), "telepathy", "gabble", name, NULL);
+}
+
+/**
+ * gabble_cache_dup_shared:
+ * @shared: the static variable holding the shared instance
+ * @type: a #GObject type with a construct-only "path" property
+ * @env_var: as for gabble_cache_path()
+ * @name: as for gabble_cache_path()
+ *
+ * Returns: (transfer full): the instance of @type shared by all connections,
+ *  which is created with its path set by gabble_cache_path() if need be
+ */
+gpointer
+gabble_cache_dup_shared (gpointer *shared,
+    GType type,
+    const gchar *env_var,
+    const gchar *name)
+{
+  if (*shared == NULL)
+    {
+      gchar *path = gabble_cache_path (env_var, name);
+
+      DEBUG ("%s at %s", g_type_name (type),
+          path != NULL ? path : "(nowhere)");
+      *shared = g_object_new (type, "path", path, NULL);
+      g_free (path);
+    }
+
+  return g_object_ref (*shared);
+}
+
+/**
+ * gabble_cache_free_shared:
+ * @shared: the static variable holding the shared instance
+ *
+ * Drops the reference taken by gabble_cache_dup_shared(), if any.
+ */
+void
+gabble_cache_free_shared (gpointer *shared)
+{
+  tp_clear_object (shared);
+}
+
+/**
+ * gabble_cache_set_contents:
+ *
+ * As g_file_set_contents(), but creates the directories leading to @path
+ * first.
+ */
+gboolean
+gabble_cache_set_contents (const gchar *path,
+    const gchar *contents,
+    gsize len,
+    GError **error)
+{
+  gchar *dir = g_path_get_dirname (path);
+
+  /* If this fails, so will g_file_set_contents(), with a better error */
+  g_mkdir_with_parents (dir, 0700);
+  g_free (dir);
+
+  return g_file_set_contents (path, contents, len, error);
+}
+
+/* Key file group names can't be empty, or contain brackets or control
+ * characters */
+gboolean
+gabble_key_file_group_name_is_valid (const gchar *name)
+{
+  const gchar *p;
+
+  if (*name == '\0')
+    return FALSE;
+
+  for (p = name; *p != '\0'; p++)
+    {
+      if (*p == '[' || *p == ']' || g_ascii_iscntrl (*p))
+        return FALSE;
+    }
+
+  return TRUE;
+}
@@ -97,6 +97,14 @@ gboolean
 gabble_flag_from_nick (GType flag_type, const gchar *nick,
     guint *value);
 
+gchar *gabble_cache_path (const gchar *env_var, const gchar *name);
+gpointer gabble_cache_dup_shared (gpointer *shared, GType type,
+    const gchar *env_var, const gchar *name);
+void gabble_cache_free_shared (gpointer *shared);
+gboolean gabble_cache_set_contents (const gchar *path, const gchar *contents,
+    gsize len, GError **error);
+gboolean gabble_key_file_group_name_is_valid (const gchar *name);
+
 void gabble_simple_async_succeed_or_fail_in_idle (gpointer self,
     GAsyncReadyCallback callback,
     gpointer user_data,
@@ -0,0 +1,366 @@
+/* Measures how fast data can be pushed through the transports underneath
+ * stream tubes and file transfers, without needing a real peer.
+ *
+ * A source writes into one end of a socketpair, standing in for the local
+ * application. Gabble's side of it is relayed to a TCP loopback connection,
+ * standing in for the SOCKS5 bytestream, whose far end is the sink. The
+ * relay is done in one of three ways:
+ *
+ *  - copy: the data is read and sent on, as tube-stream.c and ft-channel.c
+ *    do, blocking on the outgoing transport's watermarks;
+ *  - base64: the data is also encoded in IBB-sized blocks and decoded again
+ *    by the sink, which is the bulk of the cost of an IBB bytestream;
+ *  - splice: GibberSpliceRelay moves the data inside the kernel.
+ *
+ * For each, it prints the throughput, the CPU time used and how many reads
+ * Gabble made per MB. Pass the amount of data to send, in MB, as the only
+ * argument; the default is 1024. For exact syscall counts, run it under
+ * strace -c -f.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <time.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <gibber/gibber-listener.h>
+#include <gibber/gibber-sockets.h>
+#include <gibber/gibber-splice-relay.h>
+#include <gibber/gibber-tcp-transport.h>
+#include <gibber/gibber-unix-transport.h>
+
+#include "src/base64.h"
+
+#define CHUNK_SIZE (64 * 1024)
+#define IBB_BLOCK_SIZE 4096
+#define IBB_ENCODED_SIZE GABBLE_BASE64_ENCODED_LEN (IBB_BLOCK_SIZE)
+#define MB (1024.0 * 1024.0)
+
+typedef enum {
+    PATH_COPY,
+    PATH_BASE64,
+    PATH_SPLICE
+} RelayPath;
+
+typedef struct {
+    GMainLoop *loop;
+    RelayPath path;
+
+    guint64 total;
+    guint64 sent;
+    guint64 received;
+    guint reads;
+
+    GBytes *chunk;
+
+    GibberTransport *source;
+    GibberTransport *relay_in;
+    GibberTransport *relay_out;
+    GibberTransport *sink;
+    GibberSpliceRelay *splice;
+
+    /* base64 path: plain data waiting to make up a whole block on the way
+     * in, and encoded data waiting to make up a whole block on the way out */
+    GString *plain;
+    GString *encoded;
+} Bench;
+
+static void
+feed_source (Bench *bench)
+{
+  while (bench->sent < bench->total &&
+      !gibber_transport_buffer_is_high (bench->source))
+    {
+      if (!gibber_transport_send_bytes (bench->source, bench->chunk, NULL))
+        g_error ("writing to the source failed");
+
+      bench->sent += g_bytes_get_size (bench->chunk);
+    }
+}
+
+static void
+source_buffer_low_cb (GibberTransport *transport,
+    Bench *bench)
+{
+  feed_source (bench);
+}
+
+static void
+relay_out_buffer_low_cb (GibberTransport *transport,
+    Bench *bench)
+{
+  gibber_transport_block_receiving (bench->relay_in, FALSE);
+}
+
+static void
+relay_send (Bench *bench,
+    const guint8 *data,
+    gsize len)
+{
+  if (!gibber_transport_send (bench->relay_out, data, len, NULL))
+    g_error ("relaying failed");
+}
+
+static void
+relay_base64 (Bench *bench,
+    const guint8 *data,
+    gsize len)
+{
+  gchar encoded[IBB_ENCODED_SIZE];
+  gsize offset = 0;
+
+  if (bench->plain->len > 0)
+    {
+      gsize missing = MIN (IBB_BLOCK_SIZE - bench->plain->len, len);
+
+      g_string_append_len (bench->plain, (const gchar *) data, missing);
+      offset = missing;
+
+      if (bench->plain->len < IBB_BLOCK_SIZE)
+        return;
+
+      gabble_base64_encode_to ((const guchar *) bench->plain->str,
+          IBB_BLOCK_SIZE, encoded);
+      relay_send (bench, (const guint8 *) encoded, IBB_ENCODED_SIZE);
+      g_string_truncate (bench->plain, 0);
+    }
+
+  for (; len - offset >= IBB_BLOCK_SIZE; offset += IBB_BLOCK_SIZE)
+    {
+      gabble_base64_encode_to (data + offset, IBB_BLOCK_SIZE, encoded);
+      relay_send (bench, (const guint8 *) encoded, IBB_ENCODED_SIZE);
+    }
+
+  g_string_append_len (bench->plain, (const gchar *) data + offset,
+      len - offset);
+}
+
+static void
+relay_handler (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  Bench *bench = user_data;
+
+  bench->reads++;
+
+  if (bench->path == PATH_BASE64)
+    relay_base64 (bench, buffer->data, buffer->length);
+  else
+    relay_send (bench, buffer->data, buffer->length);
+
+  if (gibber_transport_buffer_is_high (bench->relay_out))
+    gibber_transport_block_receiving (bench->relay_in, TRUE);
+}
+
+static void
+sink_handler (GibberTransport *transport,
+    GibberBuffer *buffer,
+    gpointer user_data)
+{
+  Bench *bench = user_data;
+
+  if (bench->path == PATH_BASE64)
+    {
+      guchar decoded[IBB_BLOCK_SIZE + 3];
+      gsize offset;
+
+      g_string_append_len (bench->encoded, (const gchar *) buffer->data,
+          buffer->length);
+
+      for (offset = 0; bench->encoded->len - offset >= IBB_ENCODED_SIZE;
+          offset += IBB_ENCODED_SIZE)
+        bench->received += gabble_base64_decode_to (
+            bench->encoded->str + offset, IBB_ENCODED_SIZE, decoded);
+
+      g_string_erase (bench->encoded, 0, offset);
+    }
+  else
+    {
+      bench->received += buffer->length;
+    }
+
+  if (bench->received >= bench->total)
+    g_main_loop_quit (bench->loop);
+}
+
+static void
+new_connection_cb (GibberListener *listener,
+    GibberTransport *transport,
+    struct sockaddr_storage *addr,
+    guint size,
+    gpointer user_data)
+{
+  Bench *bench = user_data;
+
+  g_assert (bench->sink == NULL);
+  bench->sink = g_object_ref (transport);
+}
+
+static void
+setup_transports (Bench *bench)
+{
+  GibberListener *listener;
+  GError *error = NULL;
+  int fds[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    g_error ("socketpair() failed: %s", g_strerror (errno));
+
+  bench->source = GIBBER_TRANSPORT (gibber_unix_transport_new_from_fd (
+        fds[0]));
+  bench->relay_in = GIBBER_TRANSPORT (gibber_unix_transport_new_from_fd (
+        fds[1]));
+
+  listener = gibber_listener_new ();
+  g_signal_connect (listener, "new-connection",
+      G_CALLBACK (new_connection_cb), bench);
+
+  if (!gibber_listener_listen_tcp_loopback (listener, 0, &error))
+    g_error ("listening failed: %s", error->message);
+
+  bench->relay_out = GIBBER_TRANSPORT (gibber_tcp_transport_new ());
+  gibber_tcp_transport_connect (GIBBER_TCP_TRANSPORT (bench->relay_out),
+      "127.0.0.1", gibber_listener_get_port (listener));
+
+  while (bench->sink == NULL ||
+      gibber_transport_get_state (bench->relay_out) ==
+      GIBBER_TRANSPORT_CONNECTING)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (gibber_transport_get_state (bench->relay_out) !=
+      GIBBER_TRANSPORT_CONNECTED)
+    g_error ("couldn't connect over TCP loopback");
+
+  g_object_unref (listener);
+
+  gibber_transport_set_handler (bench->sink, sink_handler, bench);
+  gibber_transport_block_receiving (bench->sink, FALSE);
+}
+
+static void
+teardown_transports (Bench *bench)
+{
+  GibberTransport **transports[] = { &bench->source, &bench->relay_in,
+      &bench->relay_out, &bench->sink };
+  guint i;
+
+  if (bench->splice != NULL)
+    {
+      gibber_splice_relay_stop (bench->splice);
+      g_object_unref (bench->splice);
+      bench->splice = NULL;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (transports); i++)
+    {
+      GibberTransport *transport = *transports[i];
+
+      g_signal_handlers_disconnect_matched (transport, G_SIGNAL_MATCH_DATA,
+          0, 0, NULL, NULL, bench);
+      gibber_transport_set_handler (transport, NULL, NULL);
+      gibber_transport_disconnect (transport);
+      g_object_unref (transport);
+      *transports[i] = NULL;
+    }
+}
+
+static void
+run (Bench *bench,
+    RelayPath path,
+    const gchar *name)
+{
+  GTimer *timer;
+  clock_t cpu_start;
+  gdouble elapsed, cpu;
+
+  bench->path = path;
+  bench->sent = 0;
+  bench->received = 0;
+  bench->reads = 0;
+
+  setup_transports (bench);
+
+  if (path == PATH_SPLICE)
+    {
+      bench->splice = gibber_splice_relay_new (
+          GIBBER_FD_TRANSPORT (bench->relay_in),
+          GIBBER_FD_TRANSPORT (bench->relay_out));
+
+      if (bench->splice == NULL)
+        {
+          g_print ("%-8s unavailable\n", name);
+          teardown_transports (bench);
+          return;
+        }
+    }
+  else
+    {
+      gibber_transport_set_handler (bench->relay_in, relay_handler, bench);
+      gibber_transport_block_receiving (bench->relay_in, FALSE);
+      g_signal_connect (bench->relay_out, "buffer-low",
+          G_CALLBACK (relay_out_buffer_low_cb), bench);
+    }
+
+  g_signal_connect (bench->source, "buffer-low",
+      G_CALLBACK (source_buffer_low_cb), bench);
+
+  timer = g_timer_new ();
+  cpu_start = clock ();
+
+  feed_source (bench);
+  g_main_loop_run (bench->loop);
+
+  cpu = (gdouble) (clock () - cpu_start) / CLOCKS_PER_SEC;
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_assert_cmpuint (bench->received, ==, bench->total);
+
+  g_print ("%-8s %8.1f MB/s %8.2f s CPU %8.1f reads/MB\n", name,
+      bench->total / MB / elapsed, cpu, bench->reads / (bench->total / MB));
+
+  teardown_transports (bench);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  Bench bench = { NULL, };
+  guint8 *data;
+  guint64 size_mb = 1024;
+  guint i;
+
+  g_type_init ();
+
+  if (argc > 1)
+    size_mb = g_ascii_strtoull (argv[1], NULL, 10);
+
+  if (size_mb == 0)
+    g_error ("usage: %s [MB to send]", argv[0]);
+
+  data = g_malloc (CHUNK_SIZE);
+  for (i = 0; i < CHUNK_SIZE; i++)
+    data[i] = g_random_int_range (0, 256);
+
+  bench.loop = g_main_loop_new (NULL, FALSE);
+  bench.total = size_mb * 1024 * 1024;
+  bench.chunk = g_bytes_new_take (data, CHUNK_SIZE);
+  bench.plain = g_string_sized_new (IBB_BLOCK_SIZE);
+  bench.encoded = g_string_sized_new (2 * IBB_ENCODED_SIZE);
+
+  run (&bench, PATH_COPY, "copy");
+  run (&bench, PATH_BASE64, "base64");
+  run (&bench, PATH_SPLICE, "splice");
+
+  g_string_free (bench.encoded, TRUE);
+  g_string_free (bench.plain, TRUE);
+  g_bytes_unref (bench.chunk);
+  g_main_loop_unref (bench.loop);
+
+  return 0;
+}
@@ -0,0 +1,55 @@
+/* Helpers for the tests of the caches Gabble keeps on disk */
+
+#ifndef __GABBLE_CACHE_TEST_UTIL_H__
+#define __GABBLE_CACHE_TEST_UTIL_H__
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* Makes a temporary directory, and points @env_var at @name inside it.
+ * Returns the directory, and the path @env_var now holds in @path. */
+static gchar *
+cache_test_dir_new (const gchar *env_var,
+    const gchar *name,
+    gchar **path)
+{
+  gchar *dir = g_dir_make_tmp ("gabble-cache-test-XXXXXX", NULL);
+
+  g_assert (dir != NULL);
+  *path = g_build_filename (dir, name, NULL);
+  g_setenv (env_var, *path, TRUE);
+  return dir;
+}
+
+/* Removes @path and everything below it */
+static void
+cache_test_remove (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *child = g_build_filename (path, name, NULL);
+
+      cache_test_remove (child);
+      g_free (child);
+    }
+
+  if (dir != NULL)
+    g_dir_close (dir);
+
+  g_remove (path);
+}
+
+static void
+cache_test_dir_free (gchar *dir,
+    gchar *path)
+{
+  cache_test_remove (dir);
+  g_assert (!g_file_test (dir, G_FILE_TEST_EXISTS));
+  g_free (path);
+  g_free (dir);
+}
+
+#endif /* __GABBLE_CACHE_TEST_UTIL_H__ */
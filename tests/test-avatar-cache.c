@@ -0,0 +1,163 @@
+#include "config.h"
+
+#include <string.h>
+#include <utime.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+
+#include "src/avatar-cache.h"
+#include "src/util.h"
+
+#include "cache-test-util.h"
+
+#define AVATAR_SIZE 1000
+
+static void
+test_round_trip (GabbleAvatarCache *cache)
+{
+  const gchar data[] = "\x89PNG\r\n\x1a\n\0not really a png";
+  gchar *sha1 = sha1_hex (data, sizeof (data));
+  gchar *mime_type = NULL;
+  GArray *arr;
+
+  arr = gabble_avatar_cache_lookup (cache, sha1, &mime_type);
+  g_assert (arr == NULL);
+  g_assert (mime_type == NULL);
+
+  g_assert (gabble_avatar_cache_store (cache, sha1, data, sizeof (data),
+          "image/png"));
+  /* Storing the same content twice is a no-op */
+  g_assert (gabble_avatar_cache_store (cache, sha1, data, sizeof (data),
+          "image/png"));
+
+  arr = gabble_avatar_cache_lookup (cache, sha1, &mime_type);
+  g_assert (arr != NULL);
+  g_assert_cmpstr (mime_type, ==, "image/png");
+  g_assert_cmpuint (arr->len, ==, sizeof (data));
+  g_assert (memcmp (arr->data, data, sizeof (data)) == 0);
+
+  g_array_unref (arr);
+  g_free (mime_type);
+  g_free (sha1);
+}
+
+static void
+test_bad_tokens (GabbleAvatarCache *cache)
+{
+  gchar *mime_type = NULL;
+
+  g_assert (!gabble_avatar_cache_store (cache, "../../etc/passwd", "x", 1,
+          NULL));
+  g_assert (!gabble_avatar_cache_store (cache,
+          "DA39A3EE5E6B4B0D3255BFEF95601890AFD80709", "x", 1, NULL));
+  g_assert (!gabble_avatar_cache_store (cache, "da39", "x", 1, NULL));
+  g_assert (gabble_avatar_cache_lookup (cache, "", &mime_type) == NULL);
+  g_assert (gabble_avatar_cache_lookup (cache, NULL, &mime_type) == NULL);
+}
+
+static gchar *
+store_avatar (GabbleAvatarCache *cache,
+    const gchar *path,
+    gchar fill,
+    time_t mtime)
+{
+  gchar data[AVATAR_SIZE];
+  gchar *sha1, *entry;
+  struct utimbuf times = { mtime, mtime };
+
+  memset (data, fill, sizeof (data));
+  sha1 = sha1_hex (data, sizeof (data));
+  g_assert (gabble_avatar_cache_store (cache, sha1, data, sizeof (data),
+          "image/png"));
+
+  if (mtime != 0)
+    {
+      gchar prefix[3] = { sha1[0], sha1[1], '\0' };
+
+      entry = g_build_filename (path, prefix, sha1 + 2, NULL);
+      g_assert_cmpint (g_utime (entry, &times), ==, 0);
+      g_free (entry);
+    }
+
+  return sha1;
+}
+
+static gboolean
+has_avatar (GabbleAvatarCache *cache,
+    const gchar *sha1)
+{
+  gchar *mime_type = NULL;
+  GArray *arr = gabble_avatar_cache_lookup (cache, sha1, &mime_type);
+
+  if (arr == NULL)
+    return FALSE;
+
+  g_array_unref (arr);
+  g_free (mime_type);
+  return TRUE;
+}
+
+static void
+test_eviction (const gchar *path)
+{
+  /* room for three avatars, with their MIME types, but not four */
+  GabbleAvatarCache *cache = g_object_new (GABBLE_TYPE_AVATAR_CACHE,
+      "path", path,
+      "max-size", 7 * AVATAR_SIZE / 2,
+      NULL);
+  gchar *a, *b, *c, *d;
+
+  a = store_avatar (cache, path, 'a', 100);
+  b = store_avatar (cache, path, 'b', 200);
+  c = store_avatar (cache, path, 'c', 300);
+
+  /* Using the oldest avatar makes it the most recently used */
+  g_assert (has_avatar (cache, a));
+
+  /* so the next two are the ones which make way for a fourth */
+  d = store_avatar (cache, path, 'd', 0);
+  g_assert (has_avatar (cache, d));
+  g_assert (has_avatar (cache, a));
+  g_assert (!has_avatar (cache, b));
+  g_assert (!has_avatar (cache, c));
+
+  g_object_unref (cache);
+  g_free (a);
+  g_free (b);
+  g_free (c);
+  g_free (d);
+}
+
+int
+main (void)
+{
+  GabbleAvatarCache *cache;
+  gchar *dir, *path;
+
+  g_type_init ();
+
+  dir = cache_test_dir_new ("GABBLE_AVATAR_CACHE_DIR", "avatars", &path);
+
+  cache = gabble_avatar_cache_dup_shared ();
+  test_round_trip (cache);
+  test_bad_tokens (cache);
+  g_object_unref (cache);
+  gabble_avatar_cache_free_shared ();
+
+  g_free (path);
+  path = g_build_filename (dir, "small", NULL);
+  test_eviction (path);
+
+  /* An empty path disables the cache */
+  g_setenv ("GABBLE_AVATAR_CACHE_DIR", "", TRUE);
+  cache = gabble_avatar_cache_dup_shared ();
+  g_assert (!gabble_avatar_cache_store (cache,
+          "da39a3ee5e6b4b0d3255bfef95601890afd80709", "", 0, NULL));
+  g_object_unref (cache);
+  gabble_avatar_cache_free_shared ();
+
+  cache_test_dir_free (dir, path);
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "src/base64.h"
+
+static void
+test_round_trip (gsize len)
+{
+  guchar *data = g_malloc (len + 1);
+  gchar *expected, *encoded;
+  GString *wrapped, *decoded;
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    data[i] = g_random_int_range (0, 256);
+
+  expected = g_base64_encode (data, len);
+  encoded = gabble_base64_encode (data, len);
+  g_assert_cmpstr (encoded, ==, expected);
+
+  decoded = gabble_base64_decode_to_string (encoded);
+  g_assert_cmpuint (decoded->len, ==, len);
+  g_assert (memcmp (decoded->str, data, len) == 0);
+  g_string_free (decoded, TRUE);
+
+  /* Line breaks (as in vCard BINVALs) and other junk are skipped */
+  wrapped = g_string_new (NULL);
+
+  for (i = 0; encoded[i] != '\0'; i++)
+    {
+      if (g_random_int_range (0, 30) == 0)
+        g_string_append_c (wrapped, (i % 2) ? '\n' : '\xc3');
+
+      g_string_append_c (wrapped, encoded[i]);
+    }
+
+  decoded = gabble_base64_decode_to_string (wrapped->str);
+  g_assert_cmpuint (decoded->len, ==, len);
+  g_assert (memcmp (decoded->str, data, len) == 0);
+  g_string_free (decoded, TRUE);
+
+  g_string_free (wrapped, TRUE);
+  g_free (encoded);
+  g_free (expected);
+  g_free (data);
+}
+
+static void
+test_all_lengths (void)
+{
+  gsize len;
+
+  for (len = 0; len < 200; len++)
+    test_round_trip (len);
+
+  test_round_trip (4096);
+  test_round_trip (45 * 1024 + 1);
+}
+
+int
+main (void)
+{
+  /* Whichever kernel the CPU supports... */
+  test_all_lengths ();
+
+  /* ...and the portable one */
+  gabble_base64_force_scalar (TRUE);
+  test_all_lengths ();
+
+  return 0;
+}
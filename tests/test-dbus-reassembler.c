@@ -0,0 +1,209 @@
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "src/dbus-reassembler.h"
+
+#define N_MESSAGES 100000
+#define MAX_CHUNK_SIZE 8192
+
+typedef struct {
+    const gchar *stream;
+    /* offset of each message in stream, plus the end of the stream */
+    GArray *offsets;
+    guint next;
+} Expected;
+
+static void
+put_32 (gchar *p,
+    gboolean big_endian,
+    guint32 value)
+{
+  if (big_endian)
+    value = GUINT32_TO_BE (value);
+  else
+    value = GUINT32_TO_LE (value);
+
+  memcpy (p, &value, 4);
+}
+
+/* Appends something that looks like a D-Bus message as far as its fixed
+ * header goes, with random contents and a random size */
+static void
+append_message (GString *stream,
+    GRand *rand)
+{
+  gboolean big_endian = g_rand_boolean (rand);
+  guint32 body_length = g_rand_int_range (rand, 0, 256);
+  guint32 m = g_rand_int_range (rand, 0, 64);
+  gsize size = 16 + m + ((8 - (m % 8)) % 8) + body_length;
+  gsize start = stream->len;
+  gsize i;
+
+  g_string_set_size (stream, start + size);
+
+  for (i = start; i < stream->len; i++)
+    stream->str[i] = g_rand_int_range (rand, 0, 256);
+
+  stream->str[start] = big_endian ? DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+  put_32 (stream->str + start + 4, big_endian, body_length);
+  put_32 (stream->str + start + 12, big_endian, m);
+}
+
+static void
+message_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  Expected *expected = user_data;
+  gsize start, end;
+
+  g_assert_cmpuint (expected->next + 1, <, expected->offsets->len);
+
+  start = g_array_index (expected->offsets, gsize, expected->next);
+  end = g_array_index (expected->offsets, gsize, expected->next + 1);
+
+  g_assert_cmpuint (len, ==, end - start);
+  g_assert (memcmp (data, expected->stream + start, len) == 0);
+
+  expected->next++;
+}
+
+static void
+test_random_chunks (void)
+{
+  GRand *rand = g_rand_new_with_seed (42);
+  GString *stream = g_string_new ("");
+  Expected expected = { NULL, NULL, 0 };
+  GabbleDBusReassembler *reassembler;
+  gsize offset = 0;
+  guint i;
+
+  expected.offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+  for (i = 0; i < N_MESSAGES; i++)
+    {
+      g_array_append_val (expected.offsets, stream->len);
+      append_message (stream, rand);
+    }
+
+  g_array_append_val (expected.offsets, stream->len);
+  expected.stream = stream->str;
+
+  reassembler = gabble_dbus_reassembler_new ();
+
+  while (offset < stream->len)
+    {
+      gsize len = MIN ((gsize) g_rand_int_range (rand, 1, MAX_CHUNK_SIZE),
+          stream->len - offset);
+
+      g_assert (gabble_dbus_reassembler_feed (reassembler,
+            stream->str + offset, len, message_cb, &expected));
+      offset += len;
+    }
+
+  g_assert_cmpuint (expected.next, ==, N_MESSAGES);
+  g_assert_cmpuint (gabble_dbus_reassembler_get_pending (reassembler), ==, 0);
+
+  gabble_dbus_reassembler_free (reassembler);
+  g_array_unref (expected.offsets);
+  g_string_free (stream, TRUE);
+  g_rand_free (rand);
+}
+
+static void
+demarshal_cb (const gchar *data,
+    gsize len,
+    gpointer user_data)
+{
+  guint *received = user_data;
+  DBusMessage *msg;
+
+  msg = dbus_message_demarshal (data, len, NULL);
+  g_assert (msg != NULL);
+  g_assert_cmpstr (dbus_message_get_member (msg), ==, "Ping");
+  dbus_message_unref (msg);
+
+  (*received)++;
+}
+
+static void
+test_real_messages (void)
+{
+  GabbleDBusReassembler *reassembler;
+  DBusMessage *msg;
+  GString *stream = g_string_new ("");
+  gchar *marshalled;
+  gint len;
+  guint received = 0;
+  gsize i;
+
+  msg = dbus_message_new_signal ("/", "org.freedesktop.Telepathy.Test",
+      "Ping");
+  g_assert (dbus_message_marshal (msg, &marshalled, &len));
+  dbus_message_unref (msg);
+
+  for (i = 0; i < 3; i++)
+    g_string_append_len (stream, marshalled, len);
+
+  reassembler = gabble_dbus_reassembler_new ();
+
+  /* one byte at a time */
+  for (i = 0; i < stream->len; i++)
+    g_assert (gabble_dbus_reassembler_feed (reassembler, stream->str + i, 1,
+          demarshal_cb, &received));
+
+  g_assert_cmpuint (received, ==, 3);
+
+  /* all at once */
+  g_assert (gabble_dbus_reassembler_feed (reassembler, stream->str,
+        stream->len, demarshal_cb, &received));
+  g_assert_cmpuint (received, ==, 6);
+
+  gabble_dbus_reassembler_free (reassembler);
+  g_string_free (stream, TRUE);
+  dbus_free (marshalled);
+}
+
+static void
+test_invalid (void)
+{
+  GabbleDBusReassembler *reassembler;
+  gchar header[16] = { 0, };
+  guint received = 0;
+
+  /* unknown endianness */
+  reassembler = gabble_dbus_reassembler_new ();
+  header[0] = 'x';
+  g_assert (!gabble_dbus_reassembler_feed (reassembler, header,
+        sizeof (header), demarshal_cb, &received));
+  gabble_dbus_reassembler_free (reassembler);
+
+  /* too large, split across two calls */
+  reassembler = gabble_dbus_reassembler_new ();
+  header[0] = DBUS_LITTLE_ENDIAN;
+  put_32 (header + 4, FALSE, DBUS_MAXIMUM_MESSAGE_LENGTH);
+  g_assert (gabble_dbus_reassembler_feed (reassembler, header, 10,
+        demarshal_cb, &received));
+  g_assert (!gabble_dbus_reassembler_feed (reassembler, header + 10,
+        sizeof (header) - 10, demarshal_cb, &received));
+  gabble_dbus_reassembler_free (reassembler);
+
+  g_assert_cmpuint (received, ==, 0);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/dbus-reassembler/random-chunks", test_random_chunks);
+  g_test_add_func ("/dbus-reassembler/real-messages", test_real_messages);
+  g_test_add_func ("/dbus-reassembler/invalid", test_invalid);
+
+  return g_test_run ();
+}
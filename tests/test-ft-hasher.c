@@ -0,0 +1,139 @@
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "src/ft-hasher.h"
+
+/* "The quick brown fox jumps over the lazy dog" */
+#define MD5_FOX "9e107d9d372bb6826bd81d3542a419d6"
+#define SHA256_FOX \
+  "d7a8fbb307d7809469ca9abcb0082e4f8d5651e46d3cdb762d02d0bf37c9e592"
+
+static void
+done_cb (GabbleFtHasher *hasher,
+    const gchar *digest,
+    gpointer user_data)
+{
+  gchar **result = user_data;
+
+  g_assert (*result == NULL);
+  *result = g_strdup (digest);
+}
+
+static void
+test_hash (TpFileHashType hash_type,
+    const gchar *expected)
+{
+  const gchar *words[] = { "The quick ", "brown fox ", "jumps over ",
+      "the lazy dog", NULL };
+  GabbleFtHasher *hasher;
+  gchar *digest = NULL;
+  guint i;
+
+  hasher = gabble_ft_hasher_new (hash_type);
+
+  for (i = 0; words[i] != NULL; i++)
+    gabble_ft_hasher_update (hasher, (const guint8 *) words[i],
+        strlen (words[i]));
+
+  gabble_ft_hasher_finish (hasher, done_cb, &digest);
+  g_assert (gabble_ft_hasher_is_finishing (hasher));
+
+  while (digest == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (digest, ==, expected);
+  g_free (digest);
+  gabble_ft_hasher_free (hasher);
+}
+
+static void
+test_cancel (void)
+{
+  GabbleFtHasher *hasher;
+  gchar *digest = NULL;
+
+  hasher = gabble_ft_hasher_new (TP_FILE_HASH_TYPE_MD5);
+  gabble_ft_hasher_update (hasher, (const guint8 *) "abc", 3);
+  gabble_ft_hasher_finish (hasher, done_cb, &digest);
+  gabble_ft_hasher_free (hasher);
+
+  /* The callback must not be called once the hasher has been freed */
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  g_assert (digest == NULL);
+}
+
+static void
+caught_up_cb (GabbleFtHasher *hasher,
+    gpointer user_data)
+{
+  gboolean *caught_up = user_data;
+
+  g_assert (!*caught_up);
+  *caught_up = TRUE;
+}
+
+static void
+test_wait (void)
+{
+  GabbleFtHasher *hasher;
+  GChecksum *checksum;
+  guint8 chunk[65536];
+  gchar *digest = NULL;
+  gboolean caught_up = FALSE;
+  guint i;
+
+  for (i = 0; i < sizeof (chunk); i++)
+    chunk[i] = i % 251;
+
+  hasher = gabble_ft_hasher_new (TP_FILE_HASH_TYPE_SHA256);
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  /* Far more than the thread is allowed to fall behind by; whether it
+   * actually does depends on how fast it is, so we can't insist on it */
+  for (i = 0; i < 256; i++)
+    {
+      g_checksum_update (checksum, chunk, sizeof (chunk));
+
+      if (!gabble_ft_hasher_update (hasher, chunk, sizeof (chunk)))
+        break;
+    }
+
+  /* Either way, we're told once it has caught up */
+  gabble_ft_hasher_wait (hasher, caught_up_cb, &caught_up);
+
+  while (!caught_up)
+    g_main_context_iteration (NULL, TRUE);
+
+  gabble_ft_hasher_finish (hasher, done_cb, &digest);
+
+  while (digest == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (digest, ==, g_checksum_get_string (checksum));
+  g_free (digest);
+  g_checksum_free (checksum);
+  gabble_ft_hasher_free (hasher);
+}
+
+int
+main (void)
+{
+  g_type_init ();
+
+  g_assert (gabble_ft_hasher_supports (TP_FILE_HASH_TYPE_MD5));
+  g_assert (gabble_ft_hasher_supports (TP_FILE_HASH_TYPE_SHA256));
+  g_assert (!gabble_ft_hasher_supports (TP_FILE_HASH_TYPE_NONE));
+
+  test_hash (TP_FILE_HASH_TYPE_MD5, MD5_FOX);
+  test_hash (TP_FILE_HASH_TYPE_SHA256, SHA256_FOX);
+  test_cancel ();
+  test_wait ();
+
+  return 0;
+}
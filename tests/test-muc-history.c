@@ -0,0 +1,111 @@
+#include "config.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+
+#include "src/muc-history.h"
+
+#include "cache-test-util.h"
+
+#define ACCOUNT "test@example.com"
+#define ROOM "chat@conf.example.com"
+
+int
+main (void)
+{
+  GabbleMucHistory *history;
+  gchar *dir, *path;
+  gint64 timestamp;
+  const gchar *id;
+  guint i;
+
+  g_type_init ();
+
+  dir = cache_test_dir_new ("GABBLE_MUC_HISTORY", "muc-history", &path);
+
+  history = gabble_muc_history_dup_shared ();
+  g_assert (!gabble_muc_history_get_cursor (history, ACCOUNT, ROOM,
+        &timestamp, &id));
+
+  gabble_muc_history_update_cursor (history, ACCOUNT, ROOM, 1000, "a");
+  gabble_muc_history_update_cursor (history, ACCOUNT, ROOM, 2000, "b");
+  /* an older message doesn't move the cursor back */
+  gabble_muc_history_update_cursor (history, ACCOUNT, ROOM, 1500, "c");
+  /* nor does anything in another room, or from another account */
+  gabble_muc_history_update_cursor (history, ACCOUNT, "other@conf.example.com",
+      3000, NULL);
+  gabble_muc_history_update_cursor (history, "other@example.com", ROOM,
+      4000, "d");
+
+  g_assert (gabble_muc_history_get_cursor (history, ACCOUNT, ROOM,
+        &timestamp, &id));
+  g_assert_cmpint (timestamp, ==, 2000);
+  g_assert_cmpstr (id, ==, "b");
+  g_object_unref (history);
+  /* This saves the cursors */
+  gabble_muc_history_free_shared ();
+
+  /* The cursors survive a restart */
+  history = gabble_muc_history_dup_shared ();
+  g_assert (gabble_muc_history_get_cursor (history, ACCOUNT, ROOM,
+        &timestamp, &id));
+  g_assert_cmpint (timestamp, ==, 2000);
+  g_assert_cmpstr (id, ==, "b");
+  g_assert (gabble_muc_history_get_cursor (history, ACCOUNT,
+        "other@conf.example.com", &timestamp, &id));
+  g_assert_cmpint (timestamp, ==, 3000);
+  g_assert_cmpstr (id, ==, NULL);
+
+  /* Only so many rooms are remembered, the ones we've heard from most
+   * recently winning */
+  for (i = 0; i < 1000; i++)
+    {
+      gchar *room = g_strdup_printf ("room%u@conf.example.com", i);
+
+      gabble_muc_history_update_cursor (history, ACCOUNT, room, 5000 + i,
+          NULL);
+      g_free (room);
+    }
+
+  g_assert (!gabble_muc_history_get_cursor (history, ACCOUNT, ROOM,
+        &timestamp, &id));
+  g_assert (!gabble_muc_history_get_cursor (history, ACCOUNT,
+        "room0@conf.example.com", &timestamp, &id));
+  g_assert (gabble_muc_history_get_cursor (history, ACCOUNT,
+        "room999@conf.example.com", &timestamp, &id));
+  g_assert_cmpint (timestamp, ==, 5999);
+  g_object_unref (history);
+  gabble_muc_history_free_shared ();
+
+  /* and that still holds after a restart */
+  history = gabble_muc_history_dup_shared ();
+  g_assert (!gabble_muc_history_get_cursor (history, ACCOUNT,
+        "room0@conf.example.com", &timestamp, &id));
+  g_assert (gabble_muc_history_get_cursor (history, ACCOUNT,
+        "room999@conf.example.com", &timestamp, &id));
+  g_object_unref (history);
+  gabble_muc_history_free_shared ();
+
+  /* An empty path means cursors are only kept in memory */
+  g_unlink (path);
+  g_setenv ("GABBLE_MUC_HISTORY", "", TRUE);
+  history = gabble_muc_history_dup_shared ();
+  gabble_muc_history_update_cursor (history, ACCOUNT, ROOM, 1000, "a");
+  g_assert (gabble_muc_history_get_cursor (history, ACCOUNT, ROOM,
+        &timestamp, &id));
+  g_assert_cmpint (timestamp, ==, 1000);
+  g_assert (!gabble_muc_history_save (history));
+  g_object_unref (history);
+  gabble_muc_history_free_shared ();
+  g_assert (!g_file_test (path, G_FILE_TEST_EXISTS));
+
+  history = gabble_muc_history_dup_shared ();
+  g_assert (!gabble_muc_history_get_cursor (history, ACCOUNT, ROOM,
+        &timestamp, &id));
+  g_object_unref (history);
+  gabble_muc_history_free_shared ();
+
+  cache_test_dir_free (dir, path);
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include "config.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+
+#include "src/proxy-stats.h"
+
+#include "cache-test-util.h"
+
+static void
+test_ranking (GabbleProxyStats *stats)
+{
+  guint i;
+
+  /* fast and reliable */
+  for (i = 0; i < 5; i++)
+    {
+      gabble_proxy_stats_add_connect_time (stats, "fast.example.com", 50);
+      gabble_proxy_stats_add_result (stats, "fast.example.com", TRUE);
+    }
+
+  /* slow but reliable */
+  for (i = 0; i < 5; i++)
+    {
+      gabble_proxy_stats_add_connect_time (stats, "slow.example.com", 800);
+      gabble_proxy_stats_add_result (stats, "slow.example.com", TRUE);
+    }
+
+  /* fast but usually broken */
+  for (i = 0; i < 5; i++)
+    {
+      gabble_proxy_stats_add_connect_time (stats, "flaky.example.com", 50);
+      gabble_proxy_stats_add_result (stats, "flaky.example.com", i == 0);
+    }
+
+  /* never reachable */
+  for (i = 0; i < 5; i++)
+    gabble_proxy_stats_add_result (stats, "dead.example.com", FALSE);
+
+  g_assert_cmpint (gabble_proxy_stats_compare (stats, "fast.example.com",
+        "slow.example.com"), <, 0);
+  g_assert_cmpint (gabble_proxy_stats_compare (stats, "slow.example.com",
+        "unknown.example.com"), <, 0);
+  g_assert_cmpint (gabble_proxy_stats_compare (stats, "fast.example.com",
+        "flaky.example.com"), <, 0);
+  g_assert_cmpint (gabble_proxy_stats_compare (stats, "unknown.example.com",
+        "dead.example.com"), <, 0);
+  g_assert_cmpint (gabble_proxy_stats_compare (stats, "unknown.example.com",
+        "other.example.com"), ==, 0);
+}
+
+/* Far more proxies than are ever kept */
+#define MANY_PROXIES 200
+
+static void
+test_eviction (const gchar *path)
+{
+  GabbleProxyStats *stats;
+  GString *contents = g_string_new ("");
+  gdouble unknown;
+  guint i;
+
+  g_string_append (contents,
+      "[old.example.com]\nConnectTime=50\nSuccesses=5\nFailures=0\n"
+      "LastUsed=1\n");
+
+  for (i = 0; i < MANY_PROXIES; i++)
+    g_string_append_printf (contents,
+        "[proxy%u.example.com]\nConnectTime=50\nSuccesses=5\nFailures=0\n"
+        "LastUsed=%u\n", i, 1000 + i);
+
+  g_string_append (contents,
+      "[new.example.com]\nConnectTime=50\nSuccesses=5\nFailures=0\n"
+      "LastUsed=1000000000\n");
+
+  g_assert (g_file_set_contents (path, contents->str, contents->len, NULL));
+  g_string_free (contents, TRUE);
+
+  /* The proxies used longest ago are forgotten */
+  stats = gabble_proxy_stats_dup_shared ();
+  unknown = gabble_proxy_stats_get_cost (stats, "unknown.example.com");
+  g_assert_cmpfloat (gabble_proxy_stats_get_cost (stats, "old.example.com"),
+      ==, unknown);
+  g_assert_cmpfloat (gabble_proxy_stats_get_cost (stats, "new.example.com"),
+      <, unknown);
+
+  /* and so are they when new ones are used */
+  for (i = 0; i < MANY_PROXIES; i++)
+    {
+      gchar *jid = g_strdup_printf ("other%u.example.com", i);
+
+      gabble_proxy_stats_add_result (stats, jid, TRUE);
+      g_free (jid);
+    }
+
+  g_assert_cmpfloat (gabble_proxy_stats_get_cost (stats, "new.example.com"),
+      ==, unknown);
+  g_assert_cmpfloat (gabble_proxy_stats_get_cost (stats,
+        "other199.example.com"), <, unknown);
+
+  g_assert (gabble_proxy_stats_save (stats));
+  g_object_unref (stats);
+  gabble_proxy_stats_free_shared ();
+}
+
+int
+main (void)
+{
+  GabbleProxyStats *stats;
+  gchar *dir, *path;
+  gdouble fast, dead;
+
+  g_type_init ();
+
+  dir = cache_test_dir_new ("GABBLE_PROXY_STATS", "socks5-proxies", &path);
+
+  stats = gabble_proxy_stats_dup_shared ();
+  test_ranking (stats);
+  fast = gabble_proxy_stats_get_cost (stats, "fast.example.com");
+  dead = gabble_proxy_stats_get_cost (stats, "dead.example.com");
+  g_object_unref (stats);
+  /* This saves the statistics */
+  gabble_proxy_stats_free_shared ();
+
+  /* The ranking survives a restart */
+  stats = gabble_proxy_stats_dup_shared ();
+  g_assert_cmpfloat (gabble_proxy_stats_get_cost (stats, "fast.example.com"),
+      ==, fast);
+  g_assert_cmpfloat (gabble_proxy_stats_get_cost (stats, "dead.example.com"),
+      ==, dead);
+  g_object_unref (stats);
+  gabble_proxy_stats_free_shared ();
+
+  test_eviction (path);
+
+  /* An empty path keeps the statistics in memory */
+  g_unlink (path);
+  g_setenv ("GABBLE_PROXY_STATS", "", TRUE);
+  stats = gabble_proxy_stats_dup_shared ();
+  test_ranking (stats);
+  g_assert (!gabble_proxy_stats_save (stats));
+  g_object_unref (stats);
+  gabble_proxy_stats_free_shared ();
+  g_assert (!g_file_test (path, G_FILE_TEST_EXISTS));
+
+  cache_test_dir_free (dir, path);
+  return 0;
+}
@@ -0,0 +1,234 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <gibber/gibber-sockets.h>
+#include <gibber/gibber-splice-relay.h>
+#include <gibber/gibber-unix-transport.h>
+
+/* The application's socket is relayed to the network's. The test plays both
+ * peers, through the far end of each socketpair. */
+typedef struct {
+    int app;
+    int net;
+    GibberTransport *app_transport;
+    GibberTransport *net_transport;
+    GibberSpliceRelay *relay;
+} Fixture;
+
+static gboolean
+setup (Fixture *f)
+{
+  int app[2], net[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, app) != 0 ||
+      socketpair (AF_UNIX, SOCK_STREAM, 0, net) != 0)
+    g_error ("socketpair() failed: %s", g_strerror (errno));
+
+  f->app = app[0];
+  f->net = net[1];
+  fcntl (f->app, F_SETFL, O_NONBLOCK);
+  fcntl (f->net, F_SETFL, O_NONBLOCK);
+
+  f->app_transport = GIBBER_TRANSPORT (gibber_unix_transport_new_from_fd (
+        app[1]));
+  f->net_transport = GIBBER_TRANSPORT (gibber_unix_transport_new_from_fd (
+        net[0]));
+
+  f->relay = gibber_splice_relay_new (
+      GIBBER_FD_TRANSPORT (f->app_transport),
+      GIBBER_FD_TRANSPORT (f->net_transport));
+
+  return f->relay != NULL;
+}
+
+static void
+teardown (Fixture *f)
+{
+  if (f->relay != NULL)
+    g_object_unref (f->relay);
+
+  g_object_unref (f->app_transport);
+  g_object_unref (f->net_transport);
+  close (f->app);
+  close (f->net);
+}
+
+/* Reads exactly @len bytes from @fd, letting the relay run meanwhile */
+static void
+receive (int fd,
+    gchar *buf,
+    gsize len)
+{
+  gsize received = 0;
+
+  while (received < len)
+    {
+      ssize_t n = read (fd, buf + received, len - received);
+
+      if (n > 0)
+        received += n;
+      else if (n < 0 && errno == EAGAIN)
+        g_main_context_iteration (NULL, TRUE);
+      else
+        g_error ("read %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes: %s",
+            received, len, n == 0 ? "EOF" : g_strerror (errno));
+    }
+}
+
+static void
+expect_eof (int fd)
+{
+  gchar c;
+  ssize_t n;
+
+  while ((n = read (fd, &c, 1)) < 0 && errno == EAGAIN)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (n, ==, 0);
+}
+
+static void
+send_all (int fd,
+    const gchar *buf,
+    gsize len)
+{
+  g_assert_cmpint (write (fd, buf, len), ==, len);
+}
+
+static void
+wait_for_disconnection (Fixture *f)
+{
+  while (gibber_transport_get_state (f->app_transport) !=
+      GIBBER_TRANSPORT_DISCONNECTED ||
+      gibber_transport_get_state (f->net_transport) !=
+      GIBBER_TRANSPORT_DISCONNECTED)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_relay (void)
+{
+  Fixture f;
+  gchar buf[5];
+
+  if (!setup (&f))
+    {
+      g_test_message ("splice() isn't available");
+      teardown (&f);
+      return;
+    }
+
+  send_all (f.app, "hello", 5);
+  receive (f.net, buf, 5);
+  g_assert (memcmp (buf, "hello", 5) == 0);
+
+  send_all (f.net, "world", 5);
+  receive (f.app, buf, 5);
+  g_assert (memcmp (buf, "world", 5) == 0);
+
+  /* Each side's EOF is passed on, and once both sides are done the relay
+   * disconnects both transports */
+  shutdown (f.app, SHUT_WR);
+  expect_eof (f.net);
+  g_assert_cmpuint (gibber_transport_get_state (f.app_transport), ==,
+      GIBBER_TRANSPORT_CONNECTED);
+
+  shutdown (f.net, SHUT_WR);
+  expect_eof (f.app);
+  wait_for_disconnection (&f);
+
+  teardown (&f);
+}
+
+/* Sends to @fd until neither it nor the relay can take any more. Returns
+ * how much was sent. */
+static gsize
+fill (int fd,
+    gchar byte)
+{
+  gchar buf[4096];
+  gsize sent = 0;
+
+  memset (buf, byte, sizeof (buf));
+
+  while (TRUE)
+    {
+      ssize_t n = write (fd, buf, sizeof (buf));
+
+      if (n > 0)
+        {
+          sent += n;
+          continue;
+        }
+
+      g_assert_cmpint (errno, ==, EAGAIN);
+
+      if (!g_main_context_iteration (NULL, FALSE))
+        return sent;
+    }
+}
+
+static void
+test_eof_with_data_pending (void)
+{
+  Fixture f;
+  gchar *buf;
+  gsize len, i;
+
+  if (!setup (&f))
+    {
+      g_test_message ("splice() isn't available");
+      teardown (&f);
+      return;
+    }
+
+  /* The application isn't reading, so some of this is stuck in the relay */
+  len = fill (f.net, 'x');
+
+  /* The application stops sending while the relay still has data for it */
+  shutdown (f.app, SHUT_WR);
+  expect_eof (f.net);
+
+  /* which it still gets in full */
+  buf = g_malloc (len);
+  receive (f.app, buf, len);
+
+  for (i = 0; i < len; i++)
+    g_assert_cmpint (buf[i], ==, 'x');
+
+  g_free (buf);
+
+  /* and the other direction still works */
+  send_all (f.net, "more", 4);
+  buf = g_malloc (4);
+  receive (f.app, buf, 4);
+  g_assert (memcmp (buf, "more", 4) == 0);
+  g_free (buf);
+
+  shutdown (f.net, SHUT_WR);
+  expect_eof (f.app);
+  wait_for_disconnection (&f);
+
+  teardown (&f);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/splice-relay/relay", test_relay);
+  g_test_add_func ("/splice-relay/eof-with-data-pending",
+      test_eof_with_data_pending);
+
+  return g_test_run ();
+}
@@ -0,0 +1,140 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <gibber/gibber-sockets.h>
+#include <gibber/gibber-unix-transport.h>
+
+#define LOW_WATERMARK 1024
+#define HIGH_WATERMARK 4096
+
+typedef struct {
+    GibberTransport *transport;
+    /* the far end of the transport's socket */
+    int peer;
+    guint highs;
+    guint lows;
+} Fixture;
+
+static void
+buffer_high_cb (GibberTransport *transport,
+    Fixture *f)
+{
+  f->highs++;
+}
+
+static void
+buffer_low_cb (GibberTransport *transport,
+    Fixture *f)
+{
+  f->lows++;
+}
+
+/* Connects the transport to a new socketpair */
+static void
+connect_transport (Fixture *f)
+{
+  int fds[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    g_error ("socketpair() failed: %s", g_strerror (errno));
+
+  f->peer = fds[1];
+  fcntl (f->peer, F_SETFL, O_NONBLOCK);
+
+  gibber_fd_transport_set_fd (GIBBER_FD_TRANSPORT (f->transport), fds[0],
+      TRUE);
+}
+
+/* Sends until the transport has more than the high watermark queued */
+static void
+fill (Fixture *f)
+{
+  guint8 buf[1024];
+
+  memset (buf, 'x', sizeof (buf));
+
+  while (!gibber_transport_buffer_is_high (f->transport))
+    g_assert (gibber_transport_send (f->transport, buf, sizeof (buf), NULL));
+}
+
+/* Reads from the peer until the transport is back to the low watermark */
+static void
+drain (Fixture *f)
+{
+  gchar buf[4096];
+
+  while (gibber_transport_buffer_is_high (f->transport))
+    {
+      ssize_t n = read (f->peer, buf, sizeof (buf));
+
+      if (n < 0 && errno != EAGAIN)
+        g_error ("read() failed: %s", g_strerror (errno));
+
+      g_main_context_iteration (NULL, n < 0);
+    }
+}
+
+static void
+test_watermarks (void)
+{
+  Fixture f = { NULL, -1, 0, 0 };
+  guint8 byte = 'x';
+
+  f.transport = GIBBER_TRANSPORT (gibber_unix_transport_new ());
+  gibber_transport_set_watermarks (f.transport, LOW_WATERMARK,
+      HIGH_WATERMARK);
+  g_signal_connect (f.transport, "buffer-high", G_CALLBACK (buffer_high_cb),
+      &f);
+  g_signal_connect (f.transport, "buffer-low", G_CALLBACK (buffer_low_cb),
+      &f);
+  connect_transport (&f);
+
+  fill (&f);
+  g_assert_cmpuint (f.highs, ==, 1);
+  g_assert_cmpuint (f.lows, ==, 0);
+
+  /* Sending more while we're above the high watermark doesn't signal again */
+  g_assert (gibber_transport_send (f.transport, &byte, 1, NULL));
+  g_assert_cmpuint (f.highs, ==, 1);
+
+  drain (&f);
+  g_assert_cmpuint (f.highs, ==, 1);
+  g_assert_cmpuint (f.lows, ==, 1);
+
+  /* Disconnecting while above the high watermark throws the buffer away */
+  fill (&f);
+  g_assert_cmpuint (f.highs, ==, 2);
+  gibber_transport_disconnect (f.transport);
+  close (f.peer);
+  g_assert (!gibber_transport_buffer_is_high (f.transport));
+
+  /* so the next connection starts afresh */
+  connect_transport (&f);
+  fill (&f);
+  g_assert_cmpuint (f.highs, ==, 3);
+  drain (&f);
+  g_assert_cmpuint (f.lows, ==, 2);
+
+  gibber_transport_disconnect (f.transport);
+  close (f.peer);
+  g_object_unref (f.transport);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/transport/watermarks", test_watermarks);
+
+  return g_test_run ();
+}
@@ -192,8 +192,8 @@ class BytestreamS5B(Bytestream):
             ('invalid.invalid', 'invalid.invalid'),
             # Working streamhost
             (self.initiator, '127.0.0.1'),
-            # This works too but should not be tried as Gabble should just
-            # connect to the previous one
+            # This works too but should not be used as Gabble should have
+            # completed the handshake with the previous one by then
             ('Not me', '127.0.0.1')]
 
     def get_ns(self):
@@ -471,6 +471,88 @@ class BytestreamS5BWrongHash(BytestreamS5B):
 
         return events_before, []
 
+class BytestreamS5BRacing(BytestreamS5B):
+    """Two connections to the initiator's streamhost race each other. When
+    we're the target, we only send the CONNECT command on the second,
+    although the first was authenticated too; when we're the initiator,
+    the target has to close the loser before sending it on the winner."""
+    def __init__(self, stream, q, sid, initiator, target, initiated):
+        BytestreamS5B.__init__(self, stream, q, sid, initiator, target, initiated)
+
+        # two routes to the same working streamhost
+        self.hosts = [
+            (self.initiator, '127.0.0.1'),
+            (self.initiator, '127.0.0.1')]
+
+    def wait_bytestream_open(self):
+        id, mode, sid, hosts = self._expect_socks5_init()
+
+        assert mode == 'tcp'
+        assert sid == self.stream_id
+
+        own = [(host, port) for jid, host, port in hosts
+            if jid == self.initiator and is_ipv4(host)]
+        assert own
+
+        host, port = own[0]
+        transports = []
+
+        for i in range(2):
+            reactor.connectTCP(host, port, S5BFactory(self.q.append))
+            self.transport = self.q.expect('s5b-connected').transport
+            self._send_auth_cmd()
+            self._wait_auth_reply()
+            transports.append(self.transport)
+
+        # The initiator mustn't give up on the bytestream when we drop the
+        # connection we're not going to use
+        transports[0].loseConnection()
+        self.q.expect('s5b-connection-lost')
+
+        self._send_connect_cmd()
+        self._wait_connect_reply()
+        self._send_socks5_reply(id, self.initiator)
+
+    def _socks5_expect_connection(self, expected_before, expected_after):
+        # As the target, we only get this far on the first connection to be
+        # authenticated; the other has to be closed without a CONNECT command
+        events = self.q.expect_many(*(expected_before + [
+            EventPattern('s5b-connected'),
+            EventPattern('s5b-connected'),
+            EventPattern('s5b-data-received'),
+            EventPattern('s5b-data-received')]))
+        events_before = events[:len(expected_before)]
+        requests = events[-2:]
+
+        for e in requests:
+            assert e.data == b'\x05\x01\x00' # version 5, 1 auth method, no auth
+            e.transport.write(b'\x05\x00') # version 5, no auth
+
+        connect, closed = self.q.expect_many(
+            EventPattern('s5b-data-received'),
+            EventPattern('s5b-disconnected'))
+
+        self.transport = connect.transport
+        transports = [e.transport for e in requests]
+        assert self.transport in transports
+        assert closed.transport in transports
+        assert closed.transport is not self.transport
+
+        expected_connect = b'\x05\x01\x00\x03'
+        expected_connect += bytes([40]) # len (SHA-1)
+        expected_connect += self._compute_hash_domain()
+        expected_connect += b'\x00\x00' # port
+        assert connect.data == expected_connect, connect.data
+
+        self._send_connect_reply()
+
+        events_after, e = wait_events(self.q, expected_after,
+            EventPattern('stream-iq', iq_type='result', to=self.initiator))
+
+        self._check_s5b_reply(e.stanza)
+
+        return events_before, events_after
+
 class BytestreamS5BRelay(BytestreamS5B):
     """Direct connection doesn't work so we use a relay"""
     def __init__(self, stream, q, sid, initiator, target, initiated):
@@ -563,6 +645,10 @@ class S5BProtocol(Protocol):
         self.factory.event_func(Event('s5b-data-received', data=data,
             transport=self.transport))
 
+    def connectionLost(self, reason):
+        self.factory.event_func(Event('s5b-disconnected',
+            transport=self.transport))
+
 class S5BFactory(Factory):
     protocol = S5BProtocol
 
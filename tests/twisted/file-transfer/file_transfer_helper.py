@@ -507,10 +507,13 @@ class SendFileTest(FileTransferTest):
 
         self.bytestream.wait_bytestream_open()
 
+    def write_file(self, s):
+        s.send(self.file.data[self.file.offset:])
+
     def send_file(self):
         s = self.create_socket()
         s.connect(self.address)
-        s.send(self.file.data[self.file.offset:])
+        self.write_file(s)
 
         to_receive = self.file.size - self.file.offset
         self.count = 0
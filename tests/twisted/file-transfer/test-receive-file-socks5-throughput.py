@@ -0,0 +1,66 @@
+"""
+Push a few megabytes through a SOCKS5 bytestream to Gabble, check they all
+come out of its socket intact, and report how fast that went.
+"""
+
+import os
+import time
+
+from twisted.internet import reactor
+
+import constants as cs
+import bytestream
+from gabbletest import exec_test
+from file_transfer_helper import File, ReceiveFileTest
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print("NOTE: built with --disable-file-transfer")
+    raise SystemExit(77)
+
+SIZE = 8 * 1024 * 1024
+
+class ReceiveLargeFileTest(ReceiveFileTest):
+    def receive_file(self):
+        s = self.create_socket()
+        s.connect(self.address)
+        # Gabble's socket and the bytestream both have to keep moving, so
+        # read without blocking and let the reactor run in between
+        s.setblocking(False)
+
+        start = time.time()
+        self.bytestream.send_data(self.file.data[2:])
+
+        chunks = []
+        count = 0
+        while count < self.file.size:
+            try:
+                chunk = s.recv(65536)
+            except BlockingIOError:
+                reactor.iterate(0.001)
+                continue
+
+            assert len(chunk) > 0, count
+            chunks.append(chunk)
+            count += len(chunk)
+
+        elapsed = time.time() - start
+        assert b''.join(chunks) == self.file.data
+
+        print("received %d bytes through SOCKS5 in %.2f s (%.1f MiB/s)" %
+            (count, elapsed, count / (1024 * 1024 * max(elapsed, 0.001))))
+
+        self.q.expect('dbus-signal', signal='FileTransferStateChanged',
+            args=[cs.FT_STATE_COMPLETED, cs.FT_STATE_CHANGE_REASON_NONE])
+        s.close()
+
+if __name__ == '__main__':
+    file = File()
+    file.data = os.urandom(SIZE)
+    file.size = SIZE
+    file.compute_hash(cs.FILE_HASH_TYPE_MD5)
+
+    test = ReceiveLargeFileTest(bytestream.BytestreamS5B, file,
+        cs.SOCKET_ADDRESS_TYPE_IPV4, cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+    exec_test(test.test)
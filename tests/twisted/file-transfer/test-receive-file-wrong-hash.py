@@ -0,0 +1,48 @@
+"""
+Test that a received file which doesn't match the hash given in the offer
+is cancelled; and that when the transfer is resumed, so we never see the
+start of the file, it isn't checked at all.
+"""
+
+import hashlib
+
+import constants as cs
+from file_transfer_helper import exec_file_transfer_test, ReceiveFileTest
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print("NOTE: built with --disable-file-transfer")
+    raise SystemExit(77)
+
+class ReceiveFileWrongHashTest(ReceiveFileTest):
+    def __init__(self, bytestream_cls, file, address_type, access_control, access_control_param):
+        # The sender claims to be sending something else entirely
+        file.hash = hashlib.md5(b'Something else').hexdigest()
+
+        ReceiveFileTest.__init__(self, bytestream_cls, file, address_type,
+            access_control, access_control_param)
+
+    def receive_file(self):
+        s = self.create_socket()
+        s.connect(self.address)
+
+        # send the rest of the file
+        i = self.file.offset + 2
+        self.bytestream.send_data(self.file.data[i:])
+
+        if self.file.offset != 0:
+            # There's nothing to check the end of the file against
+            self._read_file_from_socket(s)
+            return
+
+        self.q.expect('dbus-signal', signal='FileTransferStateChanged',
+            args=[cs.FT_STATE_CANCELLED,
+                cs.FT_STATE_CHANGE_REASON_REMOTE_ERROR])
+
+        self.channel.Close()
+        self.q.expect('dbus-signal', signal='Closed')
+        return True
+
+if __name__ == '__main__':
+    exec_file_transfer_test(ReceiveFileWrongHashTest)
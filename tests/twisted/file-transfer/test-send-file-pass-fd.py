@@ -0,0 +1,31 @@
+import array
+import socket
+import tempfile
+
+import constants as cs
+from file_transfer_helper import SendFileTest, exec_file_transfer_test
+
+from config import FILE_TRANSFER_ENABLED
+
+if not FILE_TRANSFER_ENABLED:
+    print("NOTE: built with --disable-file-transfer")
+    raise SystemExit(77)
+
+class SendFileTransferPassFd(SendFileTest):
+    def write_file(self, s):
+        if self.address_type != cs.SOCKET_ADDRESS_TYPE_UNIX:
+            # Only Unix sockets can carry file descriptors
+            SendFileTest.write_file(self, s)
+            return
+
+        # Gabble reads the file itself, starting at the offset the
+        # receiver asked for; the byte sent along with the fd is ignored
+        self.tmp = tempfile.TemporaryFile()
+        self.tmp.write(self.file.data)
+        self.tmp.flush()
+
+        s.sendmsg([b'\0'], [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+            array.array('i', [self.tmp.fileno()]))])
+
+if __name__ == '__main__':
+    exec_file_transfer_test(SendFileTransferPassFd)
@@ -0,0 +1,63 @@
+"""
+Test that joining a room with more occupants than Gabble takes in one go
+still makes every one of them a member, and that we only count as having
+joined once all of them have been added.
+"""
+
+from servicetest import EventPattern, assertEquals, assertSameSets
+from gabbletest import exec_test, make_muc_presence, sync_stream
+from mucutil import try_to_join_muc
+import constants as cs
+
+MUC = 'chat@conf.localhost'
+
+# Comfortably more than Gabble gets through in one batch
+N_OCCUPANTS = 2000
+
+def test(q, bus, conn, stream):
+    try_to_join_muc(q, bus, conn, stream, MUC)
+
+    nicks = ['occupant%d' % i for i in range(N_OCCUPANTS)]
+
+    for nick in nicks:
+        stream.send(make_muc_presence('none', 'participant', MUC, nick))
+
+    stream.send(make_muc_presence('none', 'participant', MUC, 'test'))
+
+    # The occupants are added a batch at a time (the channel is announced
+    # along the way, which we don't need to wait for)
+    batches = []
+    seen = []
+
+    while len(seen) < N_OCCUPANTS + 1:
+        e = q.expect('dbus-signal', signal='MembersChangedDetailed',
+            predicate=lambda e: e.args[0] != [])
+        assertEquals([], e.args[1])
+        batches.append(e.args[0])
+        seen += e.args[0]
+
+    path = e.path
+    chan = bus.get_object(conn.bus_name, path)
+
+    occupants = conn.get_contact_handles_sync(
+        ['%s/%s' % (MUC, nick) for nick in nicks])
+    test_handle = conn.get_contact_handle_sync('%s/test' % MUC)
+
+    assert len(batches) > 1, batches
+    assertEquals(len(seen), len(set(seen)))
+    assertSameSets(occupants + [test_handle], seen)
+
+    # and we're only added along with the last of them
+    assert test_handle in batches[-1]
+
+    # after which the roster is complete, and nobody else turns up
+    q.forbid_events([EventPattern('dbus-signal',
+        signal='MembersChangedDetailed', path=path)])
+    sync_stream(q, stream)
+
+    members = chan.Get(cs.CHANNEL_IFACE_GROUP, 'Members',
+        dbus_interface=cs.PROPERTIES_IFACE)
+    assertSameSets(occupants + [test_handle], members)
+
+if __name__ == '__main__':
+    exec_test(test)
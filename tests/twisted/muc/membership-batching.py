@@ -0,0 +1,70 @@
+"""
+Test that other occupants' joins and leaves, which Gabble may announce
+together, leave the room's membership in the right state.
+"""
+
+from servicetest import assertEquals, assertSameSets
+from gabbletest import exec_test, make_muc_presence, elem
+from mucutil import join_muc_and_check
+import constants as cs
+import ns
+
+MUC = 'chat@conf.localhost'
+
+def leave_presence(nick):
+    return elem('presence', from_='%s/%s' % (MUC, nick), type='unavailable')(
+        elem(ns.MUC_USER, 'x')(
+          elem('item', affiliation='none', role='none')
+        ))
+
+def expect_changes(q, added, removed):
+    """Waits for MembersChangedDetailed signals until exactly added and
+    removed have been announced, in any grouping."""
+    seen_added = []
+    seen_removed = []
+
+    while (sorted(seen_added) != sorted(added) or
+            sorted(seen_removed) != sorted(removed)):
+        e = q.expect('dbus-signal', signal='MembersChangedDetailed')
+        seen_added += e.args[0]
+        seen_removed += e.args[1]
+        assertEquals([[], []], e.args[2:4])
+
+def test(q, bus, conn, stream):
+    chan, test_handle, bob_handle = join_muc_and_check(q, bus, conn, stream,
+        MUC)
+
+    alice, carol, dave, carol_owner = conn.get_contact_handles_sync(
+        ['%s/alice' % MUC, '%s/carol' % MUC, '%s/dave' % MUC,
+         'carol@example.com'])
+
+    # A crowd turns up at once
+    stream.send(make_muc_presence('none', 'participant', MUC, 'alice'))
+    stream.send(make_muc_presence('none', 'participant', MUC, 'carol',
+        jid='carol@example.com'))
+    stream.send(make_muc_presence('none', 'participant', MUC, 'dave'))
+    expect_changes(q, [alice, carol, dave], [])
+
+    owners = chan.Properties.Get(cs.CHANNEL_IFACE_GROUP, 'HandleOwners')
+    assertEquals(carol_owner, owners[carol])
+    assertEquals(0, owners[alice])
+
+    # and most of it leaves at once
+    stream.send(leave_presence('alice'))
+    stream.send(leave_presence('carol'))
+    expect_changes(q, [], [alice, carol])
+
+    # Leaving and coming straight back is announced in that order
+    stream.send(leave_presence('dave'))
+    stream.send(make_muc_presence('none', 'participant', MUC, 'dave'))
+    expect_changes(q, [], [dave])
+    expect_changes(q, [dave], [])
+
+    members = chan.Properties.Get(cs.CHANNEL_IFACE_GROUP, 'Members')
+    assertSameSets([test_handle, bob_handle, dave], members)
+
+    owners = chan.Properties.Get(cs.CHANNEL_IFACE_GROUP, 'HandleOwners')
+    assert carol not in owners, owners
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,73 @@
+"""
+Test that a change to our presence reaches every room we're in, starting with
+the ones we've been talking in, one room at a time; and that rooms still
+waiting for it when it changes again just get the newer one.
+"""
+
+import time
+
+import dbus
+
+from servicetest import assertEquals
+from gabbletest import exec_test
+from mucutil import join_muc
+
+from twisted.words.xish import xpath
+
+ROOMS = ['quiet%d@conf.localhost' % i for i in range(4)]
+CHATTY = 'chatty@conf.localhost'
+
+# Long enough that changing our presence again is sure to happen while most
+# rooms are still waiting for the first change
+INTERVAL_MS = 500
+
+def expect_muc_presence(q):
+    e = q.expect('stream-presence', predicate=lambda e:
+        e.to is not None and e.to.endswith('/test'))
+    status = xpath.queryForString('/presence/status', e.stanza)
+    return e.to.split('/')[0], status, time.time()
+
+def test(q, bus, conn, stream):
+    for room in ROOMS:
+        join_muc(q, bus, conn, stream, room)
+
+    chan, _, _ = join_muc(q, bus, conn, stream, CHATTY)
+
+    chan.Messages.SendMessage([
+        dbus.Dictionary({}, signature='sv'),
+        { 'content-type': 'text/plain',
+          'content': 'hello?',
+        }], 0)
+    q.expect('stream-message', to=CHATTY)
+
+    conn.SimplePresence.SetPresence('away', 'lunch')
+
+    # The room we've been talking in gets it straight away
+    room, status, _ = expect_muc_presence(q)
+    assertEquals(CHATTY, room)
+    assertEquals('lunch', status)
+
+    conn.SimplePresence.SetPresence('dnd', 'meeting')
+
+    # It gets the newer one first too, and then everyone else gets just
+    # that, each of them once, and never the one they'd been waiting for
+    sent = [expect_muc_presence(q)]
+    assertEquals((CHATTY, 'meeting'), sent[0][:2])
+
+    while len(sent) < len(ROOMS) + 1:
+        sent.append(expect_muc_presence(q))
+
+    rooms = [room for room, _, _ in sent[1:]]
+    assertEquals(sorted(ROOMS), sorted(rooms))
+
+    for _, status, _ in sent:
+        assertEquals('meeting', status)
+
+    # They go out one at a time, well spaced
+    for (_, _, before), (_, _, after) in zip(sent, sent[1:]):
+        assert after - before >= INTERVAL_MS / 2000.0, (before, after)
+
+if __name__ == '__main__':
+    exec_test(test, params={
+        'muc-presence-interval-ms': dbus.UInt32(INTERVAL_MS),
+        })
@@ -0,0 +1,100 @@
+"""
+Test that rejoining a room asks only for the history since we last passed on
+a message from it, even if every message we had was live and so unstamped,
+and that the message we'd already passed on isn't passed on again.
+"""
+
+import time
+
+from servicetest import assertEquals, assertLength
+from gabbletest import exec_test, elem, make_muc_presence
+from twisted.words.xish import xpath
+
+import constants as cs
+import ns
+
+from mucutil import echo_muc_presence, try_to_join_muc
+
+ROOM = 'chat@conf.localhost'
+
+# As in muc-channel.c
+HISTORY_SLACK = 5
+
+# How long we stay out of the room
+AWAY = 3
+
+def get_history(join_event):
+    return xpath.queryForNodes('/presence/x[@xmlns="%s"]/history' % ns.MUC,
+        join_event.stanza)
+
+def send_message(stream, id, body, stamp=None):
+    message = elem('message', from_=ROOM + '/bob', type='groupchat', id=id)(
+        elem('body')(body))
+
+    if stamp is not None:
+        message.addChild(elem(ns.X_DELAY, 'x', from_=ROOM, stamp=stamp)())
+
+    stream.send(message)
+
+def get_body(event):
+    return event.args[0][1]['content']
+
+def test(q, bus, conn, stream):
+    # We've never been in the room, so we get the server's default history
+    join_event = try_to_join_muc(q, bus, conn, stream, ROOM)
+    assertEquals(None, get_history(join_event))
+
+    stream.send(make_muc_presence('owner', 'moderator', ROOM, 'bob'))
+    stream.send(make_muc_presence('none', 'participant', ROOM, 'test'))
+    e = q.expect('dbus-return', method='CreateChannel')
+    chan = bus.get_object(conn.bus_name, e.value[0])
+
+    # Two live messages, which the server doesn't stamp
+    send_message(stream, 'one', 'hello')
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    assertEquals('hello', get_body(e))
+
+    send_message(stream, 'two', 'anyone there?')
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    assertEquals('anyone there?', get_body(e))
+    last = time.time()
+
+    chan.Close(dbus_interface=cs.CHANNEL)
+    e = q.expect('stream-presence', to=ROOM + '/test',
+        presence_type='unavailable')
+    echo_muc_presence(q, stream, e.stanza, 'none', 'participant')
+    q.expect('dbus-signal', signal='ChannelClosed')
+
+    time.sleep(AWAY)
+
+    # Rejoining asks for the last however many seconds, by the server's
+    # clock, rather than for everything since some time by ours
+    before = time.time()
+    join_event = try_to_join_muc(q, bus, conn, stream, ROOM)
+    after = time.time()
+
+    history = get_history(join_event)
+    assertLength(1, history)
+    assert not history[0].hasAttribute('since'), history[0].toXml()
+    assert not history[0].hasAttribute('maxstanzas'), history[0].toXml()
+
+    seconds = int(history[0]['seconds'])
+    assert int(before - last) + HISTORY_SLACK - 1 <= seconds, \
+        (seconds, before - last)
+    assert seconds <= int(after - last) + HISTORY_SLACK + 2, \
+        (seconds, after - last)
+
+    stream.send(make_muc_presence('owner', 'moderator', ROOM, 'bob'))
+    stream.send(make_muc_presence('none', 'participant', ROOM, 'test'))
+    q.expect('dbus-return', method='CreateChannel')
+
+    # The server replays the last message we passed on, which has been
+    # passed on already; and then the one we missed
+    send_message(stream, 'two', 'anyone there?', stamp='20260101T12:00:00')
+    send_message(stream, 'three', 'guess not', stamp='20260101T12:00:01')
+
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    assertEquals('guess not', get_body(e))
+
+if __name__ == '__main__':
+    exec_test(test)
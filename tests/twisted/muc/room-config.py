@@ -8,7 +8,7 @@ from twisted.words.xish import xpath
 
 from gabbletest import (
     exec_test, make_result_iq, acknowledge_iq, make_muc_presence,
-    disconnect_conn)
+    disconnect_conn, elem)
 from servicetest import (
     call_async, EventPattern, assertEquals, assertSameSets,
     assertContains,
@@ -329,6 +329,52 @@ def test_role_changes(q, bus, conn, stream):
     call_async(q, chan.RoomConfig1, 'UpdateConfiguration', {})
     q.expect('dbus-error', name=cs.PERMISSION_DENIED)
 
+def test_config_change_notification(q, bus, conn, stream):
+    MUC = 'changing@conf.localhost'
+    chan, _, _, disco = join_muc(q, bus, conn, stream, MUC,
+        also_capture=[
+            EventPattern('stream-iq', to=MUC, iq_type='get',
+                query_ns=ns.DISCO_INFO),
+        ])
+    handle_disco_info_iq(stream, disco.stanza)
+    q.expect('dbus-signal', signal='PropertiesChanged',
+        args=[cs.CHANNEL_IFACE_ROOM_CONFIG,
+              {'ConfigurationRetrieved': True},
+              []
+             ])
+
+    # An ordinary message doesn't make Gabble look again
+    disco_pattern = [EventPattern('stream-iq', to=MUC, iq_type='get',
+        query_ns=ns.DISCO_INFO)]
+    q.forbid_events(disco_pattern)
+
+    message = elem('message', from_='%s/bob' % MUC, type='groupchat')(
+        elem('body')('Welcome!'))
+    stream.send(message)
+    q.expect('dbus-signal', signal='MessageReceived')
+
+    q.unforbid_events(disco_pattern)
+
+    # but the room saying its configuration has changed does
+    message = elem('message', from_=MUC, type='groupchat')(
+        elem(ns.MUC_USER, 'x')(
+            elem('status', code='104')
+        ))
+    stream.send(message)
+
+    disco = q.expect('stream-iq', to=MUC, iq_type='get',
+        query_ns=ns.DISCO_INFO)
+    iq = make_result_iq(stream, disco.stanza)
+    identity = iq.firstChildElement().addElement('identity')
+    identity['category'] = 'conference'
+    identity['type'] = 'text'
+    identity['name'] = 'A new name'
+    stream.send(iq)
+
+    q.expect('dbus-signal', signal='PropertiesChanged',
+        predicate=lambda e: e.args[0] == cs.CHANNEL_IFACE_ROOM_CONFIG and
+            e.args[1].get('Title') == 'A new name')
+
 def test_broken_server(q, bus, conn, stream):
     MUC = 'bro@ken'
     chan, _ , _ = join_muc(q, bus, conn, stream, MUC, affiliation='owner')
@@ -381,6 +427,7 @@ def test_disconnect_during_update_configuration(q, bus, conn, stream):
 def test(q, bus, conn, stream):
     test_some_stuff(q, bus, conn, stream)
     test_role_changes(q, bus, conn, stream)
+    test_config_change_notification(q, bus, conn, stream)
     test_broken_server(q, bus, conn, stream)
     test_disconnect_during_update_configuration(q, bus, conn, stream)
 
@@ -0,0 +1,126 @@
+"""
+Test that a room list the conference server pages with XEP-0059 is fetched a
+page at a time, and that rooms are announced as each page is looked at; and
+that with room-list-skip-info set, rooms named in the list aren't asked for
+their details.
+"""
+
+import dbus
+
+from gabbletest import make_result_iq, exec_test, elem
+from servicetest import call_async, EventPattern, assertEquals
+import constants as cs
+import ns
+
+SERVER = 'conference.example.net'
+
+def rsm_set(iq):
+    return iq.firstChildElement().elements(uri=ns.RSM, name='set')
+
+page_pattern = EventPattern('stream-iq', to=SERVER, query_ns=ns.DISCO_ITEMS)
+
+def check_page(event, after):
+    sets = list(rsm_set(event.stanza))
+    assertEquals(1, len(sets))
+
+    maxes = list(sets[0].elements(name='max'))
+    assertEquals(1, len(maxes))
+    assert int(str(maxes[0])) > 0, maxes[0]
+
+    afters = [str(a) for a in sets[0].elements(name='after')]
+    assertEquals(after, afters)
+
+info_pattern = EventPattern('stream-iq', query_ns=ns.DISCO_INFO,
+    predicate=lambda e: (e.to or '').endswith('@' + SERVER))
+
+def reply_to_info(stream, event):
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addChild(elem('identity', category='conference', type='text',
+        name=event.to.split('@')[0]))
+    query.addChild(elem('feature', var=ns.MUC))
+    stream.send(result)
+
+def send_page(stream, event, jid, index):
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addChild(elem('item', jid=jid))
+    query.addChild(elem(ns.RSM, 'set')(
+        elem('first', index=str(index))(jid),
+        elem('last')(jid),
+        elem('count')(u'2')))
+    stream.send(result)
+
+def expect_rooms(q, jids):
+    e = q.expect('dbus-signal', signal='GotRooms')
+    assertEquals(jids, [room[2]['handle-name'] for room in e.args[0]])
+
+def start_listing(q, bus, conn, stream):
+    event = q.expect('stream-iq', to='localhost', query_ns=ns.DISCO_ITEMS)
+    stream.send(make_result_iq(stream, event.stanza))
+
+    call_async(q, conn.Requests, 'CreateChannel',
+            { cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST,
+              cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+              cs.CHANNEL_TYPE_ROOM_LIST + '.Server': SERVER,
+              })
+    ret = q.expect('dbus-return', method='CreateChannel')
+    chan = bus.get_object(conn.bus_name, ret.value[0])
+
+    call_async(q, chan, 'ListRooms', dbus_interface=cs.CHANNEL_TYPE_ROOM_LIST)
+    q.expect('dbus-signal', signal='ListingRooms', args=[True])
+
+def test(q, bus, conn, stream):
+    start_listing(q, bus, conn, stream)
+
+    # The first page says there's more to come
+    event = q.expect('stream-iq', to=SERVER, query_ns=ns.DISCO_ITEMS)
+    check_page(event, [])
+    send_page(stream, event, 'alpha@%s' % SERVER, 0)
+
+    # Once its room is being looked at, the next page is fetched
+    info, event = q.expect_many(info_pattern, page_pattern)
+    assertEquals('alpha@%s' % SERVER, info.to)
+    check_page(event, ['alpha@%s' % SERVER])
+
+    # and the room is announced without waiting for the rest of the list
+    reply_to_info(stream, info)
+    expect_rooms(q, ['alpha@%s' % SERVER])
+
+    send_page(stream, event, 'beta@%s' % SERVER, 1)
+    info, event = q.expect_many(info_pattern, page_pattern)
+    assertEquals('beta@%s' % SERVER, info.to)
+    check_page(event, ['beta@%s' % SERVER])
+
+    reply_to_info(stream, info)
+    expect_rooms(q, ['beta@%s' % SERVER])
+
+    # The last page is empty, which ends the listing
+    stream.send(make_result_iq(stream, event.stanza))
+    q.expect('dbus-signal', signal='ListingRooms', args=[False])
+
+def test_skip_info(q, bus, conn, stream):
+    start_listing(q, bus, conn, stream)
+
+    q.forbid_events([info_pattern])
+
+    # The server lists every room at once, with names
+    event = q.expect('stream-iq', to=SERVER, query_ns=ns.DISCO_ITEMS)
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addChild(elem('item', jid='alpha@%s' % SERVER, name='Alpha'))
+    query.addChild(elem('item', jid='beta@%s' % SERVER, name='Beta'))
+    stream.send(result)
+
+    # and that's all we hear about them
+    e, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='GotRooms'),
+        EventPattern('dbus-signal', signal='ListingRooms', args=[False]))
+    assertEquals(['alpha@%s' % SERVER, 'beta@%s' % SERVER],
+        [room[2]['handle-name'] for room in e.args[0]])
+    assertEquals(['Alpha', 'Beta'], [room[2]['name'] for room in e.args[0]])
+
+if __name__ == '__main__':
+    exec_test(test)
+    exec_test(test_skip_info,
+        params={ 'room-list-skip-info': dbus.Boolean(True) })
@@ -60,13 +60,17 @@ PUBSUB_EVENT = "%s#event" % PUBSUB
 RECEIPTS = "urn:xmpp:receipts"
 REGISTER = "jabber:iq:register"
 ROSTER = "jabber:iq:roster"
+RSM = "http://jabber.org/protocol/rsm"
 SEARCH = 'jabber:iq:search'
 SI = 'http://jabber.org/protocol/si'
 SI_MULTIPLE = 'http://telepathy.freedesktop.org/xmpp/si-multiple'
 STANZA = "urn:ietf:params:xml:ns:xmpp-stanzas"
 STREAMS = "urn:ietf:params:xml:ns:xmpp-streams"
+STREAM_LIMITS = "urn:xmpp:stream-limits:0"
 TEMPPRES = "urn:xmpp:temppres:0"
 TUBES = 'http://telepathy.freedesktop.org/xmpp/tubes'
+TUBES_MUX = 'http://telepathy.freedesktop.org/xmpp/tubes#mux'
+TUBES_POOL = 'http://telepathy.freedesktop.org/xmpp/tubes#pool'
 MUJI = 'http://telepathy.freedesktop.org/xmpp/muji'
 VCARD_TEMP = 'vcard-temp'
 VCARD_TEMP_UPDATE = 'vcard-temp:x:update'
@@ -0,0 +1,168 @@
+"""
+Test that when the initiator of a 1-1 stream tube supports it, all the
+connections to the tube are carried over one multiplexed bytestream.
+"""
+
+import struct
+
+import dbus
+
+from servicetest import call_async, EventPattern, sync_dbus, assertEquals
+from gabbletest import acknowledge_iq, make_result_iq
+
+from twisted.words.xish import domish, xpath
+import ns
+import constants as cs
+from bytestream import create_from_si_offer, announce_socks5_proxy
+import tubetestutil as t
+
+bob_jid = 'bob@localhost/Bob'
+stream_tube_id = 49
+
+FRAME_OPEN = 1
+FRAME_DATA = 2
+FRAME_CLOSE = 3
+
+def frame(type, channel, payload=b''):
+    return struct.pack('!BBHI', type, 0, len(payload), channel) + payload
+
+def test(q, bus, conn, stream, bytestream_cls,
+        address_type, access_control, access_control_param):
+    vcard_event, roster_event, disco_event = q.expect_many(
+        EventPattern('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard'),
+        EventPattern('stream-iq', query_ns=ns.ROSTER),
+        EventPattern('stream-iq', to='localhost', query_ns=ns.DISCO_ITEMS))
+
+    acknowledge_iq(stream, vcard_event.stanza)
+
+    announce_socks5_proxy(q, stream, disco_event.stanza)
+
+    roster = roster_event.stanza
+    roster['type'] = 'result'
+    item = roster_event.query.addElement('item')
+    item['jid'] = 'bob@localhost'
+    item['subscription'] = 'both'
+    stream.send(roster)
+
+    # Bob can multiplex tube connections
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = bob_jid
+    presence['to'] = 'test@localhost/Resource'
+    c = presence.addElement('c')
+    c['xmlns'] = 'http://jabber.org/protocol/caps'
+    c['node'] = 'http://example.com/ICantBelieveItsNotTelepathy'
+    c['ver'] = '1.2.4'
+    stream.send(presence)
+
+    event = q.expect('stream-iq', iq_type='get',
+        query_ns='http://jabber.org/protocol/disco#info', to=bob_jid)
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addElement('feature')['var'] = ns.TUBES
+    query.addElement('feature')['var'] = ns.TUBES_MUX
+    stream.send(result)
+
+    sync_dbus(bus, q, conn)
+
+    # Bob offers a tube
+    message = domish.Element(('jabber:client', 'message'))
+    message['to'] = 'test@localhost/Resource'
+    message['from'] = bob_jid
+    tube_node = message.addElement((ns.TUBES, 'tube'))
+    tube_node['type'] = 'stream'
+    tube_node['service'] = 'http'
+    tube_node['id'] = str(stream_tube_id)
+    stream.send(message)
+
+    new_sig = q.expect('dbus-signal', signal='NewChannels')
+    path, props = new_sig.args[0][0]
+    assertEquals(cs.CHANNEL_TYPE_STREAM_TUBE, props[cs.CHANNEL_TYPE])
+    tube_chan = bus.get_object(conn.bus_name, path)
+    tube_iface = dbus.Interface(tube_chan, cs.CHANNEL_TYPE_STREAM_TUBE)
+
+    call_async(q, tube_iface, 'Accept', address_type, access_control,
+        access_control_param, byte_arrays=True)
+    accept_return_event, _ = q.expect_many(
+        EventPattern('dbus-return', method='Accept'),
+        EventPattern('dbus-signal', signal='TubeChannelStateChanged',
+            args=[2]))
+    address = accept_return_event.value[0]
+
+    # The first connection asks for a multiplexed bytestream
+    socket_event, si_event, conn_id = t.connect_to_cm_socket(q, bob_jid,
+        address_type, address, access_control, access_control_param)
+    protocol = socket_event.protocol
+    protocol.sendData(b'hello from 1')
+
+    stream_node = xpath.queryForNodes('/iq/si/stream[@xmlns="%s"]' %
+        ns.TUBES, si_event.stanza)[0]
+    assertEquals(str(stream_tube_id), stream_node['tube'])
+    assertEquals('true', stream_node['multiplexed'])
+
+    # and the second one waits for it rather than asking for its own
+    si_pattern = [EventPattern('stream-iq', to=bob_jid, query_ns=ns.SI,
+        query_name='si')]
+    q.forbid_events(si_pattern)
+
+    t.connect_socket(q, address_type, address, access_control,
+        access_control_param)
+    socket_event2, sig = q.expect_many(
+        EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewLocalConnection'))
+    protocol2 = socket_event2.protocol
+    conn_id2 = sig.args[0]
+
+    bytestream, profile = create_from_si_offer(stream, q, bytestream_cls,
+        si_event.stanza, 'test@localhost/Resource')
+    assertEquals(ns.TUBES, profile)
+
+    result, si = bytestream.create_si_reply(si_event.stanza)
+    si.addElement((ns.TUBES, 'tube'))
+    stream.send(result)
+
+    bytestream.wait_bytestream_open()
+
+    expected = (frame(FRAME_OPEN, 1) + frame(FRAME_OPEN, 2) +
+        frame(FRAME_DATA, 1, b'hello from 1'))
+    assertEquals(expected, bytestream.get_data(len(expected)))
+
+    # Data for each channel goes to its own socket
+    bytestream.send_data(frame(FRAME_DATA, 2, b'hello 2'))
+    e = q.expect('socket-data', protocol=protocol2)
+    assertEquals(b'hello 2', e.data)
+
+    bytestream.send_data(frame(FRAME_DATA, 1, b'hello 1'))
+    e = q.expect('socket-data', protocol=protocol)
+    assertEquals(b'hello 1', e.data)
+
+    # Bob closes the first connection; the second one carries on
+    bytestream.send_data(frame(FRAME_CLOSE, 1))
+    e = q.expect('dbus-signal', signal='ConnectionClosed')
+    assertEquals(conn_id, e.args[0])
+    assertEquals(cs.CONNECTION_LOST, e.args[1])
+
+    protocol2.sendData(b'still here')
+    expected = frame(FRAME_DATA, 2, b'still here')
+    assertEquals(expected, bytestream.get_data(len(expected)))
+
+    # A third connection goes over the same bytestream
+    t.connect_socket(q, address_type, address, access_control,
+        access_control_param)
+    q.expect_many(
+        EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewLocalConnection'))
+    assertEquals(frame(FRAME_OPEN, 3), bytestream.get_data(8))
+
+    q.unforbid_events(si_pattern)
+
+    tube_chan.Close()
+    e, _, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='ConnectionClosed',
+            args=[conn_id2, cs.CANCELLED, 'tube is closing']),
+        EventPattern('dbus-signal', signal='Closed'),
+        EventPattern('dbus-signal', signal='ChannelClosed'))
+
+if __name__ == '__main__':
+    t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_IPV4,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
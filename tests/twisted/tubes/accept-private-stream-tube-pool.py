@@ -0,0 +1,188 @@
+"""
+Test that when the initiator of a 1-1 stream tube supports it, the recipient
+keeps bytestreams negotiated ahead of time, and binds new connections to them
+rather than waiting for a new one; and that setting the stream-tube-pool-size
+parameter to 0 turns that off.
+"""
+
+import dbus
+
+from servicetest import call_async, EventPattern, sync_dbus, assertEquals
+from gabbletest import acknowledge_iq, make_result_iq, exec_test, sync_stream
+
+from twisted.words.xish import domish, xpath
+import ns
+import constants as cs
+from bytestream import create_from_si_offer, announce_socks5_proxy
+import tubetestutil as t
+
+bob_jid = 'bob@localhost/Bob'
+stream_tube_id = 49
+
+POOL_BIND_MARKER = b'\x01'
+
+def stream_node(si_event):
+    return xpath.queryForNodes('/iq/si/stream[@xmlns="%s"]' % ns.TUBES,
+        si_event.stanza)[0]
+
+def is_pooled(si_event):
+    return stream_node(si_event).getAttribute('pooled') == 'true'
+
+def accept_bytestream(q, stream, bytestream_cls, si_event):
+    bytestream, profile = create_from_si_offer(stream, q, bytestream_cls,
+        si_event.stanza, 'test@localhost/Resource')
+    assertEquals(ns.TUBES, profile)
+    assertEquals(str(stream_tube_id), stream_node(si_event)['tube'])
+
+    result, si = bytestream.create_si_reply(si_event.stanza)
+    si.addElement((ns.TUBES, 'tube'))
+    stream.send(result)
+
+    bytestream.wait_bytestream_open()
+    return bytestream
+
+def accept_tube(q, bus, conn, stream, address_type, access_control,
+        access_control_param):
+    vcard_event, roster_event, disco_event = q.expect_many(
+        EventPattern('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard'),
+        EventPattern('stream-iq', query_ns=ns.ROSTER),
+        EventPattern('stream-iq', to='localhost', query_ns=ns.DISCO_ITEMS))
+
+    acknowledge_iq(stream, vcard_event.stanza)
+
+    announce_socks5_proxy(q, stream, disco_event.stanza)
+
+    roster = roster_event.stanza
+    roster['type'] = 'result'
+    item = roster_event.query.addElement('item')
+    item['jid'] = 'bob@localhost'
+    item['subscription'] = 'both'
+    stream.send(roster)
+
+    # Bob can hold pooled bytestreams, but not multiplex them
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = bob_jid
+    presence['to'] = 'test@localhost/Resource'
+    c = presence.addElement('c')
+    c['xmlns'] = 'http://jabber.org/protocol/caps'
+    c['node'] = 'http://example.com/ICantBelieveItsNotTelepathy'
+    c['ver'] = '1.2.5'
+    stream.send(presence)
+
+    event = q.expect('stream-iq', iq_type='get',
+        query_ns='http://jabber.org/protocol/disco#info', to=bob_jid)
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addElement('feature')['var'] = ns.TUBES
+    query.addElement('feature')['var'] = ns.TUBES_POOL
+    stream.send(result)
+
+    sync_dbus(bus, q, conn)
+
+    # Bob offers a tube
+    message = domish.Element(('jabber:client', 'message'))
+    message['to'] = 'test@localhost/Resource'
+    message['from'] = bob_jid
+    tube_node = message.addElement((ns.TUBES, 'tube'))
+    tube_node['type'] = 'stream'
+    tube_node['service'] = 'http'
+    tube_node['id'] = str(stream_tube_id)
+    stream.send(message)
+
+    new_sig = q.expect('dbus-signal', signal='NewChannels')
+    path, props = new_sig.args[0][0]
+    assertEquals(cs.CHANNEL_TYPE_STREAM_TUBE, props[cs.CHANNEL_TYPE])
+    tube_chan = bus.get_object(conn.bus_name, path)
+    tube_iface = dbus.Interface(tube_chan, cs.CHANNEL_TYPE_STREAM_TUBE)
+
+    call_async(q, tube_iface, 'Accept', address_type, access_control,
+        access_control_param, byte_arrays=True)
+    accept_return_event, _ = q.expect_many(
+        EventPattern('dbus-return', method='Accept'),
+        EventPattern('dbus-signal', signal='TubeChannelStateChanged',
+            args=[2]))
+    return tube_chan, accept_return_event.value[0]
+
+def test(q, bus, conn, stream, bytestream_cls,
+        address_type, access_control, access_control_param):
+    tube_chan, address = accept_tube(q, bus, conn, stream, address_type,
+        access_control, access_control_param)
+
+    # The first connection has to wait for its own bytestream, and fills the
+    # pool while it's at it
+    socket_event, si_event, conn_id = t.connect_to_cm_socket(q, bob_jid,
+        address_type, address, access_control, access_control_param)
+    protocol = socket_event.protocol
+    assert not is_pooled(si_event)
+
+    pooled_pattern = EventPattern('stream-iq', to=bob_jid, query_ns=ns.SI,
+        query_name='si', predicate=is_pooled)
+    pool_events = q.expect_many(pooled_pattern, pooled_pattern)
+
+    bytestream = accept_bytestream(q, stream, bytestream_cls, si_event)
+    protocol.sendData(b'hello from 1')
+    assertEquals(b'hello from 1', bytestream.get_data(len(b'hello from 1')))
+
+    pooled = [accept_bytestream(q, stream, bytestream_cls, e)
+        for e in pool_events]
+
+    # The second connection goes straight over a pooled bytestream, which
+    # is then replaced
+    unpooled_pattern = [EventPattern('stream-iq', to=bob_jid, query_ns=ns.SI,
+        query_name='si', predicate=lambda e: not is_pooled(e))]
+    q.forbid_events(unpooled_pattern)
+
+    t.connect_socket(q, address_type, address, access_control,
+        access_control_param)
+    socket_event2, sig, _ = q.expect_many(
+        EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewLocalConnection'),
+        pooled_pattern)
+    protocol2 = socket_event2.protocol
+    conn_id2 = sig.args[0]
+
+    protocol2.sendData(b'hello from 2')
+    expected = POOL_BIND_MARKER + b'hello from 2'
+    assertEquals(expected, pooled[0].get_data(len(expected)))
+
+    pooled[0].send_data(b'hello 2')
+    e = q.expect('socket-data', protocol=protocol2)
+    assertEquals(b'hello 2', e.data)
+
+    q.unforbid_events(unpooled_pattern)
+
+    tube_chan.Close()
+    q.expect_many(
+        EventPattern('dbus-signal', signal='ConnectionClosed',
+            args=[conn_id, cs.CANCELLED, 'tube is closing']),
+        EventPattern('dbus-signal', signal='ConnectionClosed',
+            args=[conn_id2, cs.CANCELLED, 'tube is closing']),
+        EventPattern('dbus-signal', signal='Closed'),
+        EventPattern('dbus-signal', signal='ChannelClosed'))
+
+def test_no_pool(q, bus, conn, stream):
+    address_type = cs.SOCKET_ADDRESS_TYPE_IPV4
+    access_control = cs.SOCKET_ACCESS_CONTROL_LOCALHOST
+    _, address = accept_tube(q, bus, conn, stream, address_type,
+        access_control, "")
+
+    # With stream-tube-pool-size set to 0, each connection asks for its own
+    # bytestream and nothing more
+    q.forbid_events([EventPattern('stream-iq', to=bob_jid, query_ns=ns.SI,
+        query_name='si', predicate=is_pooled)])
+
+    _, si_event, _ = t.connect_to_cm_socket(q, bob_jid, address_type,
+        address, access_control, "")
+    assert not is_pooled(si_event)
+
+    _, si_event, _ = t.connect_to_cm_socket(q, bob_jid, address_type,
+        address, access_control, "")
+    assert not is_pooled(si_event)
+
+    sync_stream(q, stream)
+
+if __name__ == '__main__':
+    t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_IPV4,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+    exec_test(test_no_pool, params={ 'stream-tube-pool-size': dbus.UInt32(0) })
@@ -0,0 +1,123 @@
+"""
+Test that with the dbus-tube-batch-ms parameter set, messages sent on a 1-1
+D-Bus tube in quick succession go out together, in order, in one bytestream
+write; and that without it, each is sent on its own.
+"""
+
+import base64
+import struct
+
+import dbus
+from dbus.connection import Connection
+from dbus.lowlevel import SignalMessage
+
+from servicetest import call_async, EventPattern, assertEquals
+from gabbletest import exec_test, make_result_iq, make_presence, sync_stream
+from bytestream import create_from_si_offer, BytestreamIBBIQ
+from caps_helper import send_disco_reply
+import constants as cs
+import ns
+
+from twisted.words.xish import xpath
+
+# How many signals the test sends in one go
+N_SIGNALS = 3
+
+data_pattern = EventPattern('stream-iq', iq_type='set', query_ns=ns.IBB,
+    query_name='data')
+
+def open_tube(q, bus, conn, stream):
+    disco_event = q.expect('stream-iq', to='localhost',
+        query_ns=ns.DISCO_ITEMS)
+    stream.send(make_result_iq(stream, disco_event.stanza))
+
+    alice_handle = conn.get_contact_handle_sync('alice@localhost')
+    presence = make_presence('alice@localhost/Test', caps={ 'ext': '',
+        'ver': '0.0.0', 'node': 'http://example.com/fake-client0' })
+    stream.send(presence)
+
+    _, disco_event = q.expect_many(
+        EventPattern('dbus-signal', signal='PresencesChanged',
+            args = [{alice_handle: (2, u'available', u'')}]),
+        EventPattern('stream-iq', to='alice@localhost/Test',
+            query_ns=ns.DISCO_INFO))
+    send_disco_reply(stream, disco_event.stanza, [], [ns.TUBES])
+    sync_stream(q, stream)
+
+    call_async(q, conn.Requests, 'CreateChannel',
+            {cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_DBUS_TUBE,
+             cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+             cs.TARGET_ID: 'alice@localhost',
+             cs.DBUS_TUBE_SERVICE_NAME: 'com.example.TestCase'
+            })
+    path, _ = q.expect('dbus-return', method='CreateChannel').value
+    tube_iface = dbus.Interface(bus.get_object(conn.bus_name, path),
+        cs.CHANNEL_TYPE_DBUS_TUBE)
+
+    call_async(q, tube_iface, 'Offer', dbus.Dictionary({}, signature='sv'),
+        cs.SOCKET_ACCESS_CONTROL_CREDENTIALS)
+    return_event, si_event = q.expect_many(
+        EventPattern('dbus-return', method='Offer'),
+        EventPattern('stream-iq', to='alice@localhost/Test',
+            query_ns=ns.SI, query_name='si'))
+
+    # Alice accepts the tube
+    bytestream, _ = create_from_si_offer(stream, q, BytestreamIBBIQ,
+        si_event.stanza, 'test@localhost/Resource')
+    result, si = bytestream.create_si_reply(si_event.stanza)
+    si.addElement((ns.TUBES, 'tube'))
+    stream.send(result)
+    bytestream.wait_bytestream_open()
+
+    q.expect('dbus-signal', signal='TubeChannelStateChanged',
+        args=[cs.TUBE_STATE_OPEN])
+
+    return Connection(return_event.value[0])
+
+def split_messages(binary):
+    """Splits a stream of D-Bus messages, returning the UInt32 each one
+    carries"""
+    values = []
+
+    while binary:
+        endian = '<' if binary[0:1] == b'l' else '>'
+        body_len, = struct.unpack(endian + 'I', binary[4:8])
+        fields_len, = struct.unpack(endian + 'I', binary[12:16])
+        header_len = 16 + fields_len + (-fields_len % 8)
+
+        body = binary[header_len:header_len + body_len]
+        values.append(struct.unpack(endian + 'I', body)[0])
+        binary = binary[header_len + body_len:]
+
+    return values
+
+def test(q, bus, conn, stream, batched):
+    tube = open_tube(q, bus, conn, stream)
+
+    for i in range(N_SIGNALS):
+        signal = SignalMessage('/', 'foo.bar', 'baz')
+        signal.append(i, signature='u')
+        tube.send_message(signal)
+
+    # With batching, all the signals arrive in one IBB stanza; without it,
+    # each has one to itself
+    n_stanzas = 1 if batched else N_SIGNALS
+    binary = b''
+
+    for i in range(n_stanzas):
+        event = q.expect('stream-iq', iq_type='set', query_ns=ns.IBB,
+            query_name='data')
+        data = xpath.queryForNodes('/iq/data', event.stanza)[0]
+        binary += base64.b64decode(str(data))
+        stream.send(make_result_iq(stream, event.stanza))
+
+    q.forbid_events([data_pattern])
+    sync_stream(q, stream)
+    q.unforbid_events([data_pattern])
+
+    assertEquals(list(range(N_SIGNALS)), split_messages(binary))
+
+if __name__ == '__main__':
+    exec_test(lambda q, bus, conn, stream: test(q, bus, conn, stream, True),
+        params={ 'dbus-tube-batch-ms': dbus.UInt32(100) })
+    exec_test(lambda q, bus, conn, stream: test(q, bus, conn, stream, False))
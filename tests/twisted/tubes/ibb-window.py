@@ -0,0 +1,126 @@
+"""
+Test that the number of unacknowledged IBB data stanzas Gabble allows grows
+while acks come back promptly, and shrinks when they start taking longer.
+"""
+
+from twisted.internet import reactor
+from twisted.words.xish import domish
+
+from servicetest import call_async, EventPattern
+from gabbletest import exec_test, acknowledge_iq, make_result_iq, sync_stream
+from bytestream import create_from_si_offer, BytestreamIBBIQ
+import constants as cs
+import ns
+import tubetestutil as t
+
+import dbus
+
+bob_jid = 'bob@localhost/Bob'
+stream_tube_id = 49
+
+# The window Gabble starts with
+INITIAL_WINDOW = 10
+# How long we take to ack stanzas, in seconds. Round-trips over the real
+# stream are too short to be steady, so we set the pace ourselves.
+PROMPT = 0.5
+SLOW = 4 * PROMPT
+
+data_pattern = EventPattern('stream-iq', iq_type='set', query_ns=ns.IBB,
+    query_name='data')
+
+def expect_in_flight(q, stream, n):
+    """Waits for Gabble to have n data stanzas waiting for acks, and checks
+    it doesn't send any more."""
+    events = [q.expect('stream-iq', iq_type='set', query_ns=ns.IBB,
+        query_name='data') for i in range(n)]
+
+    q.forbid_events([data_pattern])
+    sync_stream(q, stream)
+    q.unforbid_events([data_pattern])
+
+    return events
+
+def ack(stream, events):
+    for e in events:
+        stream.send(make_result_iq(stream, e.stanza))
+
+def test(q, bus, conn, stream):
+    vcard_event, roster_event, disco_event = q.expect_many(
+        EventPattern('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard'),
+        EventPattern('stream-iq', query_ns=ns.ROSTER),
+        EventPattern('stream-iq', to='localhost', query_ns=ns.DISCO_ITEMS))
+
+    acknowledge_iq(stream, vcard_event.stanza)
+    stream.send(make_result_iq(stream, disco_event.stanza))
+
+    roster = roster_event.stanza
+    roster['type'] = 'result'
+    item = roster_event.query.addElement('item')
+    item['jid'] = 'bob@localhost'
+    item['subscription'] = 'both'
+    stream.send(roster)
+
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = bob_jid
+    presence['to'] = 'test@localhost/Resource'
+    c = presence.addElement('c')
+    c['xmlns'] = 'http://jabber.org/protocol/caps'
+    c['node'] = 'http://example.com/ICantBelieveItsNotTelepathy'
+    c['ver'] = '1.2.3'
+    stream.send(presence)
+
+    event = q.expect('stream-iq', iq_type='get', query_ns=ns.DISCO_INFO,
+        to=bob_jid)
+    result = make_result_iq(stream, event.stanza)
+    result.firstChildElement().addElement('feature')['var'] = ns.TUBES
+    stream.send(result)
+
+    # Bob offers a tube, which we accept
+    message = domish.Element(('jabber:client', 'message'))
+    message['to'] = 'test@localhost/Resource'
+    message['from'] = bob_jid
+    tube_node = message.addElement((ns.TUBES, 'tube'))
+    tube_node['type'] = 'stream'
+    tube_node['service'] = 'http'
+    tube_node['id'] = str(stream_tube_id)
+    stream.send(message)
+
+    new_sig = q.expect('dbus-signal', signal='NewChannels')
+    path, props = new_sig.args[0][0]
+    tube_chan = bus.get_object(conn.bus_name, path)
+    tube_iface = dbus.Interface(tube_chan, cs.CHANNEL_TYPE_STREAM_TUBE)
+
+    call_async(q, tube_iface, 'Accept', cs.SOCKET_ADDRESS_TYPE_IPV4,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, '', byte_arrays=True)
+    address = q.expect('dbus-return', method='Accept').value[0]
+
+    socket_event, si_event, conn_id = t.connect_to_cm_socket(q, bob_jid,
+        cs.SOCKET_ADDRESS_TYPE_IPV4, address,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, '')
+
+    bytestream, profile = create_from_si_offer(stream, q, BytestreamIBBIQ,
+        si_event.stanza, 'test@localhost/Resource')
+    result, si = bytestream.create_si_reply(si_event.stanza)
+    si.addElement((ns.TUBES, 'tube'))
+    stream.send(result)
+    bytestream.wait_bytestream_open()
+
+    # Plenty of data for every stage of the test
+    socket_event.protocol.sendData(b'x' * 4096 * 256)
+
+    # Gabble starts off with a modest window
+    events = expect_in_flight(q, stream, INITIAL_WINDOW)
+
+    # Every ack which comes back as quickly as the fastest so far lets it
+    # have one more stanza in flight
+    reactor.callLater(PROMPT, ack, stream, events)
+    events = expect_in_flight(q, stream, 2 * INITIAL_WINDOW)
+
+    # When acks take much longer than that, Gabble halves its window, but
+    # only once for the whole round-trip's worth of late acks
+    reactor.callLater(SLOW, ack, stream, events)
+    expect_in_flight(q, stream, INITIAL_WINDOW)
+
+if __name__ == '__main__':
+    exec_test(test)
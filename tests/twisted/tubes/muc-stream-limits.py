@@ -0,0 +1,138 @@
+"""
+Test that MUC bytestream fragments are made smaller to fit the maximum stanza
+size the server advertises with XEP-0478 stream limits, but never larger than
+the default, even if the server would accept that.
+"""
+
+import base64
+
+import dbus
+from dbus.connection import Connection
+from dbus.lowlevel import SignalMessage
+
+from servicetest import call_async, EventPattern, assertEquals, wrap_channel
+from gabbletest import exec_test, acknowledge_iq, elem, XmppAuthenticator
+import ns
+import constants as cs
+import tubetestutil as t
+
+from twisted.words.protocols.jabber import xmlstream
+from twisted.words.xish import xpath
+
+from mucutil import join_muc
+
+MUC = 'chat@conf.localhost'
+
+# The block size Gabble uses when the server doesn't say otherwise
+DEFAULT_BLOCK_SIZE = 45 * 1024
+# Room left in each stanza for everything but the base64-encoded data
+STANZA_HEADER_SIZE = 4 * 1024
+
+class LimitsAuthenticator(XmppAuthenticator):
+    def __init__(self, max_bytes):
+        XmppAuthenticator.__init__(self, 'test', 'pass')
+        self.max_bytes = max_bytes
+
+    def streamIQ(self):
+        features = elem(xmlstream.NS_STREAMS, 'features')(
+            elem(ns.NS_XMPP_BIND, 'bind'),
+            elem(ns.NS_XMPP_SESSION, 'session'),
+            elem(ns.STREAM_LIMITS, 'limits')(
+                elem('max-bytes')(str(self.max_bytes))),
+        )
+        self.xmlstream.send(features)
+
+        self.xmlstream.addOnetimeObserver(
+            "/iq/bind[@xmlns='%s']" % ns.NS_XMPP_BIND, self.bindIq)
+        self.xmlstream.addOnetimeObserver(
+            "/iq/session[@xmlns='%s']" % ns.NS_XMPP_SESSION, self.sessionIq)
+
+def offer_tube(q, bus, conn, stream):
+    join_muc(q, bus, conn, stream, MUC, request={
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_DBUS_TUBE,
+        cs.TARGET_HANDLE_TYPE: cs.HT_ROOM,
+        cs.TARGET_ID: MUC,
+        cs.DBUS_TUBE_SERVICE_NAME: 'com.example.TestCase',
+        })
+    path, _ = q.expect('dbus-signal', signal='NewChannels').args[0][0]
+    tube_chan = wrap_channel(bus.get_object(conn.bus_name, path), 'DBusTube')
+
+    call_async(q, tube_chan.DBusTube, 'Offer',
+        dbus.Dictionary({}, signature='sv'),
+        cs.SOCKET_ACCESS_CONTROL_CREDENTIALS)
+    presence_event, return_event = q.expect_many(
+        EventPattern('stream-presence', to='%s/test' % MUC,
+            predicate=t.presence_contains_tube),
+        EventPattern('dbus-return', method='Offer'))
+
+    tube_node = xpath.queryForNodes('/presence/tubes/tube',
+        presence_event.stanza)[0]
+
+    # Bob joins the tube, so there's someone to send to
+    presence = elem('presence', from_='%s/bob' % MUC, to=MUC)(
+        elem('x', xmlns=ns.MUC_USER),
+        elem('tubes', xmlns=ns.TUBES)(
+            elem('tube', type='dbus', initiator='%s/test' % MUC,
+                service='com.example.TestCase', id=tube_node['id'])))
+    bob_tube = xpath.queryForNodes('/presence/tubes/tube', presence)[0]
+    bob_tube['stream-id'] = tube_node['stream-id']
+    bob_tube['dbus-name'] = ':2.Ym9i'
+    stream.send(presence)
+
+    q.expect('dbus-signal', signal='DBusNamesChanged',
+        interface=cs.CHANNEL_TYPE_DBUS_TUBE)
+
+    return Connection(return_event.value[0])
+
+def send_big_signal(q, tube, size):
+    """Sends a D-Bus signal of more than size bytes through the tube, and
+    returns the sizes of the fragments it was sent in."""
+    signal = SignalMessage('/', 'foo.bar', 'baz')
+    signal.append('a' * size, signature='s')
+    tube.send_message(signal)
+
+    sizes = []
+    frag = None
+
+    while frag in (None, 'first', 'middle'):
+        event = q.expect('stream-message', to=MUC, message_type='groupchat')
+        data = xpath.queryForNodes('/message/data[@xmlns="%s"]'
+            % ns.MUC_BYTESTREAM, event.stanza)[0]
+        frag = data['frag']
+        sizes.append(len(base64.b64decode(str(data))))
+
+    return sizes
+
+def check_fragments(sizes, block_size):
+    assert len(sizes) > 1, sizes
+
+    for size in sizes[:-1]:
+        assertEquals(block_size, size)
+
+    assert sizes[-1] <= block_size, sizes
+
+def test_low_limit(q, bus, conn, stream):
+    iq_event = q.expect('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard')
+    acknowledge_iq(stream, iq_event.stanza)
+
+    tube = offer_tube(q, bus, conn, stream)
+
+    # The server accepts stanzas of up to 16k, so fragments are cut to fit
+    block_size = (16 * 1024 - STANZA_HEADER_SIZE) // 4 * 3
+    check_fragments(send_big_signal(q, tube, 20000), block_size)
+
+def test_high_limit(q, bus, conn, stream):
+    iq_event = q.expect('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard')
+    acknowledge_iq(stream, iq_event.stanza)
+
+    tube = offer_tube(q, bus, conn, stream)
+
+    # Our server would take a megabyte, but the other occupants' might not,
+    # so fragments stay at the default size
+    check_fragments(send_big_signal(q, tube, 100000), DEFAULT_BLOCK_SIZE)
+
+if __name__ == '__main__':
+    exec_test(test_low_limit, authenticator=LimitsAuthenticator(16 * 1024))
+    exec_test(test_high_limit, authenticator=LimitsAuthenticator(1024 * 1024))
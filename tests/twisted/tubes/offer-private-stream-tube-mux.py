@@ -0,0 +1,246 @@
+"""
+Test the initiator side of a multiplexed 1-1 stream tube: each channel the
+recipient opens gets its own connection to the local socket, data is granted
+back as the application takes it, Gabble never sends more than it has been
+granted however much the application writes, and a recipient which sends
+more than it has been granted loses the whole bytestream.
+"""
+
+import struct
+
+import dbus
+
+from servicetest import call_async, EventPattern, sync_dbus, assertEquals
+from gabbletest import acknowledge_iq, sync_stream, make_result_iq
+import constants as cs
+import ns
+import tubetestutil as t
+
+from twisted.words.xish import domish, xpath
+
+bob_full_jid = 'bob@localhost/Bob'
+self_full_jid = 'test@localhost/Resource'
+
+FRAME_OPEN = 1
+FRAME_DATA = 2
+FRAME_CLOSE = 3
+FRAME_WINDOW = 4
+
+FRAME_HEADER_SIZE = 8
+FRAME_MAX_PAYLOAD = 65535
+INITIAL_WINDOW = 256 * 1024
+MIN_GRANT = INITIAL_WINDOW // 4
+
+def frame(type, channel, payload=b''):
+    return struct.pack('!BBHI', type, 0, len(payload), channel) + payload
+
+def window(channel, granted):
+    return frame(FRAME_WINDOW, channel, struct.pack('!I', granted))
+
+class FrameReader(object):
+    """Reads whole frames from a bytestream, whatever size the pieces it
+    arrives in"""
+    def __init__(self, bytestream):
+        self.bytestream = bytestream
+        self.buffer = b''
+
+    def read(self, size):
+        while len(self.buffer) < size:
+            self.buffer += self.bytestream.get_data(size - len(self.buffer))
+
+        data = self.buffer[:size]
+        self.buffer = self.buffer[size:]
+        return data
+
+    def next_frame(self):
+        header = self.read(FRAME_HEADER_SIZE)
+        _, _, length, _ = struct.unpack('!BBHI', header)
+        return header + self.read(length)
+
+def read_data(reader, channel, size):
+    """Reads DATA frames for channel until exactly size bytes have come"""
+    data = b''
+
+    while len(data) < size:
+        f = reader.next_frame()
+        type, _, _, id = struct.unpack('!BBHI', f[:FRAME_HEADER_SIZE])
+        assertEquals((FRAME_DATA, channel), (type, id))
+        data += f[FRAME_HEADER_SIZE:]
+
+    assertEquals(size, len(data))
+    return data
+
+def receive(q, protocol, size):
+    data = b''
+
+    while len(data) < size:
+        e = q.expect('socket-data', protocol=protocol)
+        data += e.data
+
+    return data
+
+def test(q, bus, conn, stream, bytestream_cls,
+        address_type, access_control, access_control_param):
+    # The application doesn't read from a connection until the test says so
+    address = t.create_server(q, address_type, block_reading=True)
+
+    vcard_event, roster_event = q.expect_many(
+        EventPattern('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard'),
+        EventPattern('stream-iq', query_ns=ns.ROSTER))
+
+    acknowledge_iq(stream, vcard_event.stanza)
+
+    roster = roster_event.stanza
+    roster['type'] = 'result'
+    item = roster_event.query.addElement('item')
+    item['jid'] = 'bob@localhost'
+    item['subscription'] = 'both'
+    stream.send(roster)
+
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = bob_full_jid
+    presence['to'] = self_full_jid
+    c = presence.addElement('c')
+    c['xmlns'] = 'http://jabber.org/protocol/caps'
+    c['node'] = 'http://example.com/ICantBelieveItsNotTelepathy'
+    c['ver'] = '1.2.4'
+    stream.send(presence)
+
+    event = q.expect('stream-iq', iq_type='get',
+        query_ns='http://jabber.org/protocol/disco#info', to=bob_full_jid)
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addElement('feature')['var'] = ns.TUBES
+    query.addElement('feature')['var'] = ns.TUBES_MUX
+    stream.send(result)
+
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+
+    bob_handle = conn.get_contact_handle_sync('bob@localhost')
+
+    call_async(q, conn.Requests, 'CreateChannel',
+            {cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_STREAM_TUBE,
+             cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+             cs.TARGET_HANDLE: bob_handle,
+             cs.STREAM_TUBE_SERVICE: 'echo',
+            })
+    path, _ = q.expect('dbus-return', method='CreateChannel').value
+    tube_chan = bus.get_object(conn.bus_name, path)
+    tube_iface = dbus.Interface(tube_chan, cs.CHANNEL_TYPE_STREAM_TUBE)
+
+    call_async(q, tube_iface, 'Offer', address_type, address, access_control,
+        dbus.Dictionary({}, signature='sv'))
+    msg_event, _ = q.expect_many(
+        EventPattern('stream-message', to=bob_full_jid),
+        EventPattern('dbus-return', method='Offer'))
+    tube_node = xpath.queryForNodes('/message/tube[@xmlns="%s"]' % ns.TUBES,
+        msg_event.stanza)[0]
+
+    # Bob asks for one bytestream to carry all his connections
+    bytestream = bytestream_cls(stream, q, 'alpha', bob_full_jid,
+        self_full_jid, True)
+    iq, si = bytestream.create_si_offer(ns.TUBES)
+    stream_node = si.addElement((ns.TUBES, 'stream'))
+    stream_node['tube'] = tube_node['id']
+    stream_node['multiplexed'] = 'true'
+    stream.send(iq)
+
+    si_reply_event, _ = q.expect_many(
+        EventPattern('stream-iq', iq_type='result'),
+        EventPattern('dbus-signal', signal='TubeChannelStateChanged',
+            args=[cs.TUBE_STATE_OPEN]))
+    bytestream.check_si_reply(si_reply_event.stanza)
+
+    bytestream.open_bytestream()
+    reader = FrameReader(bytestream)
+
+    # Bob opens a channel and sends on it straight away
+    bytestream.send_data(frame(FRAME_OPEN, 1) +
+        frame(FRAME_DATA, 1, b'hello'))
+
+    socket_event, new_conn_event = q.expect_many(
+        EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewRemoteConnection'))
+    handle, _, conn_id = new_conn_event.args
+    assertEquals(bob_handle, handle)
+    protocol = socket_event.protocol
+
+    protocol.transport.startReading()
+    assertEquals(b'hello', receive(q, protocol, 5))
+
+    # The application's reply is framed for channel 1
+    protocol.sendData(b'hi')
+    assertEquals(frame(FRAME_DATA, 1, b'hi'), reader.next_frame())
+
+    # Once enough has been written to the socket, it's granted back
+    data = b'x' * (MIN_GRANT - 5)
+    bytestream.send_data(frame(FRAME_DATA, 1, data))
+    assertEquals(data, receive(q, protocol, len(data)))
+    assertEquals(window(1, MIN_GRANT), reader.next_frame())
+
+    # The application writes far more than Bob has granted. Gabble sends
+    # exactly what's left of the window, and keeps the rest.
+    left = INITIAL_WINDOW - len(b'hi')
+    big = bytes(i % 251 for i in range(left + 100000))
+    protocol.sendData(big)
+    assertEquals(big[:left], read_data(reader, 1, left))
+
+    # Nothing else came after it: the next frame is the grant for what Bob
+    # sends now
+    data = b'z' * MIN_GRANT
+    bytestream.send_data(frame(FRAME_DATA, 1, data))
+    assertEquals(data, receive(q, protocol, len(data)))
+    assertEquals(window(1, MIN_GRANT), reader.next_frame())
+
+    # Each grant lets exactly that much more through
+    bytestream.send_data(window(1, 60000))
+    assertEquals(big[left:left + 60000], read_data(reader, 1, 60000))
+
+    bytestream.send_data(frame(FRAME_DATA, 1, data))
+    assertEquals(data, receive(q, protocol, len(data)))
+    assertEquals(window(1, MIN_GRANT), reader.next_frame())
+
+    bytestream.send_data(window(1, INITIAL_WINDOW))
+    assertEquals(big[left + 60000:], read_data(reader, 1, 40000))
+
+    # Bob closes the channel
+    bytestream.send_data(frame(FRAME_CLOSE, 1))
+    q.expect_many(
+        EventPattern('dbus-signal', signal='ConnectionClosed',
+            args=[conn_id, cs.CONNECTION_LOST,
+                'connection closed by the remote side']),
+        EventPattern('socket-disconnected', protocol=protocol))
+
+    # A second channel's application doesn't read, so once its socket is
+    # full nothing more is granted. Bob carries on sending regardless, far
+    # past anything Gabble could have granted him.
+    bytestream.send_data(frame(FRAME_OPEN, 2))
+    socket_event, new_conn_event = q.expect_many(
+        EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewRemoteConnection'))
+    _, _, conn_id2 = new_conn_event.args
+    protocol2 = socket_event.protocol
+
+    data = b'y' * FRAME_MAX_PAYLOAD
+    for i in range(64):
+        bytestream.send_data(frame(FRAME_DATA, 2, data))
+
+    # That breaks the protocol, so the whole bytestream goes
+    q.expect_many(
+        EventPattern('dbus-signal', signal='ConnectionClosed',
+            args=[conn_id2, cs.CONNECTION_LOST,
+                'multiplexed bytestream is broken']),
+        EventPattern('socket-disconnected', protocol=protocol2))
+
+    # but the tube itself is still usable
+    state = tube_chan.Get(cs.CHANNEL_IFACE_TUBE, 'State',
+        dbus_interface=cs.PROPERTIES_IFACE)
+    assertEquals(cs.TUBE_STATE_OPEN, state)
+
+    t.cleanup()
+
+if __name__ == '__main__':
+    t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_UNIX,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
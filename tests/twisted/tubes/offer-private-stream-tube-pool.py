@@ -0,0 +1,154 @@
+"""
+Test the initiator side of pooled bytestreams on a 1-1 stream tube: one sits
+idle until the recipient binds it to a connection, and then carries that
+connection's data, starting with whatever came in with the bind marker.
+"""
+
+import dbus
+
+from servicetest import call_async, EventPattern, sync_dbus, assertEquals
+from gabbletest import acknowledge_iq, sync_stream, make_result_iq
+import constants as cs
+import ns
+import tubetestutil as t
+
+from twisted.words.xish import domish, xpath
+
+bob_full_jid = 'bob@localhost/Bob'
+self_full_jid = 'test@localhost/Resource'
+
+POOL_BIND_MARKER = b'\x01'
+
+def receive(q, protocol, size):
+    data = b''
+
+    while len(data) < size:
+        e = q.expect('socket-data', protocol=protocol)
+        data += e.data
+
+    return data
+
+def offer_pooled_bytestream(q, stream, bytestream_cls, sid, tube_id):
+    bytestream = bytestream_cls(stream, q, sid, bob_full_jid, self_full_jid,
+        True)
+    iq, si = bytestream.create_si_offer(ns.TUBES)
+    stream_node = si.addElement((ns.TUBES, 'stream'))
+    stream_node['tube'] = tube_id
+    stream_node['pooled'] = 'true'
+    stream.send(iq)
+
+    e = q.expect('stream-iq', iq_type='result', iq_id=iq['id'])
+    bytestream.check_si_reply(e.stanza)
+    bytestream.open_bytestream()
+
+    return bytestream
+
+def test(q, bus, conn, stream, bytestream_cls,
+        address_type, access_control, access_control_param):
+    address = t.create_server(q, address_type)
+
+    vcard_event, roster_event = q.expect_many(
+        EventPattern('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard'),
+        EventPattern('stream-iq', query_ns=ns.ROSTER))
+
+    acknowledge_iq(stream, vcard_event.stanza)
+
+    roster = roster_event.stanza
+    roster['type'] = 'result'
+    item = roster_event.query.addElement('item')
+    item['jid'] = 'bob@localhost'
+    item['subscription'] = 'both'
+    stream.send(roster)
+
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = bob_full_jid
+    presence['to'] = self_full_jid
+    c = presence.addElement('c')
+    c['xmlns'] = 'http://jabber.org/protocol/caps'
+    c['node'] = 'http://example.com/ICantBelieveItsNotTelepathy'
+    c['ver'] = '1.2.5'
+    stream.send(presence)
+
+    event = q.expect('stream-iq', iq_type='get',
+        query_ns='http://jabber.org/protocol/disco#info', to=bob_full_jid)
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addElement('feature')['var'] = ns.TUBES
+    query.addElement('feature')['var'] = ns.TUBES_POOL
+    stream.send(result)
+
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+
+    bob_handle = conn.get_contact_handle_sync('bob@localhost')
+
+    call_async(q, conn.Requests, 'CreateChannel',
+            {cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_STREAM_TUBE,
+             cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+             cs.TARGET_HANDLE: bob_handle,
+             cs.STREAM_TUBE_SERVICE: 'echo',
+            })
+    path, _ = q.expect('dbus-return', method='CreateChannel').value
+    tube_chan = bus.get_object(conn.bus_name, path)
+    tube_iface = dbus.Interface(tube_chan, cs.CHANNEL_TYPE_STREAM_TUBE)
+
+    call_async(q, tube_iface, 'Offer', address_type, address, access_control,
+        dbus.Dictionary({}, signature='sv'))
+    msg_event, _ = q.expect_many(
+        EventPattern('stream-message', to=bob_full_jid),
+        EventPattern('dbus-return', method='Offer'))
+    tube_id = xpath.queryForNodes('/message/tube[@xmlns="%s"]' % ns.TUBES,
+        msg_event.stanza)[0]['id']
+
+    # Bob keeps two bytestreams ready. Nothing connects to the local socket
+    # until one of them is used.
+    connected_pattern = [EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewRemoteConnection')]
+    q.forbid_events(connected_pattern)
+
+    pooled = [offer_pooled_bytestream(q, stream, bytestream_cls, sid, tube_id)
+        for sid in ['alpha', 'beta']]
+
+    sync_stream(q, stream)
+    q.unforbid_events(connected_pattern)
+
+    # Bob binds the first one to a new connection, with some data straight
+    # after the marker, and more soon after
+    pooled[0].send_data(POOL_BIND_MARKER + b'hello, ')
+    socket_event, new_conn_event = q.expect_many(
+        EventPattern('socket-connected'),
+        EventPattern('dbus-signal', signal='NewRemoteConnection'))
+    handle, _, conn_id = new_conn_event.args
+    assertEquals(bob_handle, handle)
+    protocol = socket_event.protocol
+
+    pooled[0].send_data(b'world')
+
+    # The application gets it all, in order
+    assertEquals(b'hello, world', receive(q, protocol, 12))
+
+    # and its replies go back over the same bytestream
+    protocol.sendData(b'hi')
+    assertEquals(b'hi', pooled[0].get_data(2))
+
+    # Data on a pooled bytestream which hasn't been bound to a connection
+    # breaks the protocol
+    pooled[1].send_data(b'oops')
+    pooled[1].wait_bytestream_closed()
+
+    # Bob closes the bound bytestream
+    pooled[0].close()
+    e, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='ConnectionClosed'),
+        EventPattern('socket-disconnected', protocol=protocol))
+    assertEquals(conn_id, e.args[0])
+    assertEquals(cs.CONNECTION_LOST, e.args[1])
+
+    t.cleanup()
+
+if __name__ == '__main__':
+    t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_UNIX,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
+    t.exec_tube_test(test, cs.SOCKET_ADDRESS_TYPE_IPV4,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, "")
@@ -355,6 +355,7 @@ def exec_tube_test(test, *args):
             bytestream.BytestreamIBBMsg,
             bytestream.BytestreamIBBIQ,
             bytestream.BytestreamS5B,
+            bytestream.BytestreamS5BRacing,
             bytestream.BytestreamSIFallbackS5CannotConnect,
             bytestream.BytestreamSIFallbackS5WrongHash,
             bytestream.BytestreamS5BRelay,